@@ -131,3 +131,10 @@ void DumpAllTracksAttr(MIDIMultiTrack* mlt, bool v) {
         }
     }
 }
+
+
+// prints the result of a check of the automatic tests (OK or FAILED followed by descr) and returns it
+bool Check(bool result, const char* descr) {
+    cout << (result ? "OK       " : "FAILED   ") << descr << endl;
+    return result;
+}
@@ -40,6 +40,8 @@ void DumpMIDIMultiTrackWithPauses(MIDIMultiTrack *mlt);
 void DumpMIDITrackWithPauses(MIDITrack* trk, int trk_num);
 // shows the attributes of all the tracks of a multitrack, pausing every 80 lines
 void DumpAllTracksAttr(MIDIMultiTrack* mlt, bool v);
+// prints the result of a check of the automatic tests (OK or FAILED followed by descr) and returns it
+bool Check(bool result, const char* descr);
 
 
 static const int PAUSE_LINES = 80;
@@ -0,0 +1,182 @@
+/*
+ *   Example file for NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with NiCMidi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+  A test of the MIDI file cache. It copies a MIDI file into test_cache.mid,
+  loads the copy with AdvancedSequencer::LoadCached() (which writes the
+  cache test_cache.nmc) and then again from the cache, checking that the
+  sequencer has the same events, measures and times, and renders the same
+  messages of a sequencer which loaded the MIDI file. Then it changes a
+  note of the file (leaving its size unchanged) and checks that the cache
+  is detected as stale. The files are deleted at the end.
+  Give the name of a MIDI file as argument (the default is twinkle.mid in
+  the current directory).
+*/
+
+
+#include <string>
+#include <cstdio>                               // for remove()
+
+#include "../include/advancedsequencer.h"
+#include "../include/filecache.h"
+#include "../include/filewritemultitrack.h"     // for WriteMIDIFile() function
+#include "../include/render.h"
+#include "functions.h"                  // for Check()
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////
+//                        G L O B A L S                         //
+//////////////////////////////////////////////////////////////////
+
+const char copy_name[] = "test_cache.mid";      // The copy of the MIDI file
+const char cache_name[] = "test_cache.nmc";     // The cache file
+
+
+//////////////////////////////////////////////////////////////////
+//                      F U N C T I O N S                       //
+//////////////////////////////////////////////////////////////////
+
+// Returns true if the two multitracks contain the same events
+bool SameTracks(const MIDIMultiTrack* a, const MIDIMultiTrack* b) {
+    if (a->GetNumTracks() != b->GetNumTracks() || a->GetClksPerBeat() != b->GetClksPerBeat())
+        return false;
+    for (unsigned int i = 0; i < a->GetNumTracks(); i++) {
+        const MIDITrack* trk_a = a->GetTrack(i);
+        const MIDITrack* trk_b = b->GetTrack(i);
+        if (trk_a->GetNumEvents() != trk_b->GetNumEvents())
+            return false;
+        for (unsigned int j = 0; j < trk_a->GetNumEvents(); j++)
+            if (!(trk_a->GetEvent(j) == trk_b->GetEvent(j)))
+                return false;
+    }
+    return true;
+}
+
+
+// Returns true if the two sequencers render the same messages at the same times
+bool SameRender(AdvancedSequencer& a, AdvancedSequencer& b) {
+    MIDIRenderVectorSink sink_a, sink_b;
+    if (!a.Render(&sink_a) || !b.Render(&sink_b) || sink_a.events.size() != sink_b.events.size())
+        return false;
+    for (unsigned int i = 0; i < sink_a.events.size(); i++) {
+        const MIDIRenderedEvent& ev_a = sink_a.events[i];
+        const MIDIRenderedEvent& ev_b = sink_b.events[i];
+        if (ev_a.time_us != ev_b.time_us || ev_a.track != ev_b.track || !(ev_a.msg == ev_b.msg))
+            return false;
+    }
+    return true;
+}
+
+
+// Returns true if the two sequencers have the same times at the beginning of every measure
+bool SameTimes(AdvancedSequencer& a, AdvancedSequencer& b) {
+    if (a.GetNumMeasures() != b.GetNumMeasures())
+        return false;
+    for (int i = 0; i < a.GetNumMeasures(); i++) {
+        a.GoToMeasure(i);
+        b.GoToMeasure(i);
+        if (a.GetCurrentMIDIClockTime() != b.GetCurrentMIDIClockTime() ||
+            a.GetCurrentTimeMs() != b.GetCurrentTimeMs())
+            return false;
+    }
+    a.GoToZero();
+    b.GoToZero();
+    return true;
+}
+
+
+// Changes the velocity of the first note of the multitrack
+bool ChangeNote(MIDIMultiTrack* tracks) {
+    for (unsigned int i = 0; i < tracks->GetNumTracks(); i++) {
+        MIDITrack* trk = tracks->GetTrack(i);
+        for (unsigned int j = 0; j < trk->GetNumEvents(); j++) {
+            MIDITimedMessage* msg = trk->GetEventAddress(j);
+            if (msg->IsNoteOn()) {
+                msg->SetVelocity(msg->GetVelocity() == 64 ? 65 : 64);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+//////////////////////////////////////////////////////////////////
+//                            M A I N                           //
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    const char* file_name = (argc > 1 ? argv[1] : "twinkle.mid");
+    bool ok = true;
+
+    // the sequencers need an out port, so we add a loopback if the system has no MIDI ports
+    if (MIDIManager::GetNumMIDIOuts() == 0)
+        MIDIManager::AddLoopbackPort();
+    AdvancedSequencer seq_file, seq_cache;
+
+    // makes a copy of the file, so we can change it
+    if (!seq_file.Load(file_name)) {
+        cout << "Cannot load " << file_name << endl;
+        return EXIT_FAILURE;
+    }
+    remove(cache_name);
+    ok &= Check(WriteMIDIFile(copy_name, 1, seq_file.GetMultiTrack()), "The copy of the file was written");
+    ok &= Check(seq_file.Load(copy_name), "The copy was loaded");
+
+    // the first LoadCached() loads the file and writes the cache
+    MIDIFileCache cache;
+    ok &= Check(!cache.Load(cache_name, copy_name), "There is no cache before LoadCached()");
+    ok &= Check(seq_cache.LoadCached(copy_name, cache_name), "LoadCached() loaded the file");
+    ok &= Check(cache.Load(cache_name, copy_name), "LoadCached() wrote a valid cache");
+    ok &= Check(cache.GetNumMeasures() == (unsigned int)seq_file.GetNumMeasures(),
+                "The cache has the right number of measures");
+    MIDIMultiTrack tracks;
+    ok &= Check(cache.GetMultiTrack(&tracks) && SameTracks(&tracks, seq_file.GetMultiTrack()),
+                "The cache has the same events of the file");
+    cache.Clear();
+
+    // the second LoadCached() loads the cache
+    ok &= Check(seq_cache.LoadCached(copy_name, cache_name), "LoadCached() loaded the cache");
+    ok &= Check(SameTracks(seq_cache.GetMultiTrack(), seq_file.GetMultiTrack()),
+                "The sequencers have the same events");
+    ok &= Check(SameTimes(seq_cache, seq_file), "The sequencers have the same measures and times");
+    ok &= Check(SameRender(seq_cache, seq_file), "The sequencers render the same messages");
+
+    // changes the file: the cache is now stale
+    ok &= Check(ChangeNote(seq_file.GetMultiTrack()) &&
+                WriteMIDIFile(copy_name, 1, seq_file.GetMultiTrack()) && seq_file.Load(copy_name),
+                "The file was changed");
+    ok &= Check(!cache.Load(cache_name, copy_name), "The cache is stale after the change");
+    ok &= Check(seq_cache.LoadCached(copy_name, cache_name) &&
+                SameTracks(seq_cache.GetMultiTrack(), seq_file.GetMultiTrack()),
+                "LoadCached() loaded the changed file");
+    ok &= Check(cache.Load(cache_name, copy_name), "LoadCached() rewrote the cache");
+
+    cache.Clear();
+    remove(copy_name);
+    remove(cache_name);
+    cout << (ok ? "\nAll tests passed" : "\nSome tests FAILED") << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,219 @@
+/*
+ *   Example file for NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with NiCMidi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+  A test of the parameter changes posted to the AdvancedSequencer while it
+  is playing. The setters (mute, solo, transpose, etc.) don't lock the
+  sequencer during playback: they post a command which is executed by the
+  next tick, or immediately if the command ring is full. The test posts
+  many more commands than the ring size, then checks that:
+  - the final values are the last ones set (the commands were executed in
+    the order they were posted)
+  - the messages arrived to a loopback port reflect these values
+  - the commands still pending when the sequencer is stopped are executed
+    by Stop().
+  This is done in the normal and in the render mode. It doesn't need MIDI
+  ports.
+*/
+
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "../include/advancedsequencer.h"
+#include "../include/loopback.h"
+#include "functions.h"                  // for Check()
+
+using namespace std;
+
+
+// A MIDIProcessor which collects the note on messages arrived to an in port
+class NoteCollector : public MIDIProcessor {
+    public:
+        virtual void            Reset() {
+                                    lock_guard<mutex> lock(notes_mutex);
+                                    notes.clear();
+                                }
+        virtual bool            Process(MIDITimedMessage* msg) {
+                                    if (msg->IsNoteOn()) {
+                                        lock_guard<mutex> lock(notes_mutex);
+                                        notes.push_back(*msg);
+                                    }
+                                    return true;
+                                }
+        vector<MIDIMessage>     GetNotes() {
+                                    lock_guard<mutex> lock(notes_mutex);
+                                    return notes;
+                                }
+    protected:
+        vector<MIDIMessage>     notes;
+        mutex                   notes_mutex;
+};
+
+
+//////////////////////////////////////////////////////////////////
+//                        G L O B A L S                         //
+//////////////////////////////////////////////////////////////////
+
+const int NUM_MEASURES = 8;                     // The length of the song
+const int TRACK_NOTES[3] = { 60, 50, 70 };      // The note played by tracks 1, 2, 3 (channels 1, 2, 3)
+const int NUM_CHANGES = 200;                    // The number of changes posted (more than the ring size)
+const tMsecs SETTLE_TIME = 100;                 // The time we wait for the tick to execute the commands
+const tMsecs PLAY_TIME = 1000;                  // The time we collect the notes
+NoteCollector collector;
+
+
+//////////////////////////////////////////////////////////////////
+//                      F U N C T I O N S                       //
+//////////////////////////////////////////////////////////////////
+
+// Creates the song: NUM_MEASURES measures of 4/4 (a measure lasts 1 sec), where tracks 1, 2 and 3 play
+// a note every beat on channels 1, 2 and 3
+void MakeSong(AdvancedSequencer& seq) {
+    MIDIMultiTrack* tracks = seq.GetMultiTrack();
+    MIDIClockTime beat = tracks->GetClksPerBeat();
+    MIDITrack* trk = tracks->GetTrack(0);
+    MIDITimedMessage msg;
+
+    msg.SetTimeSig(4, 4);
+    trk->InsertEvent(msg);
+    msg.SetTempo(240.0);
+    trk->InsertEvent(msg);
+    for (int i = 0; i < 3; i++) {
+        trk = tracks->GetTrack(i + 1);
+        for (int j = 0; j < 4 * NUM_MEASURES; j++) {
+            msg.SetNoteOn(i, TRACK_NOTES[i], 100);
+            msg.SetTime(j * beat);
+            trk->InsertNote(msg, beat / 2);
+        }
+    }
+    seq.UpdateStatus();
+}
+
+
+// Posts NUM_CHANGES changes of the transpose of track 1, of the mute of track 2 and of the solo of track 3.
+// The last ones leave track 1 transposed by 7 semitones, track 2 muted and no track soloed
+void PostChanges(AdvancedSequencer& seq) {
+    for (int i = 0; i < NUM_CHANGES; i++) {
+        seq.SetTrackTranspose(1, i % 12);
+        seq.SetTrackMute(2, i % 2 == 1);
+        if (i % 10 == 0)
+            seq.SetTrackSolo(3);
+        else if (i % 10 == 5)
+            seq.UnSoloTrack();
+    }
+}
+
+
+// Checks that the track parameters are the last ones set by PostChanges()
+bool CheckValues(AdvancedSequencer& seq) {
+    return seq.GetTrackTranspose(1) == (NUM_CHANGES - 1) % 12 &&
+           seq.GetTrackMute(2) &&
+           !seq.GetSoloMode();
+}
+
+
+// Restores the default parameters of the tracks
+void ResetValues(AdvancedSequencer& seq) {
+    seq.UnSoloTrack();
+    seq.UnmuteAllTracks();
+    seq.SetTrackTranspose(1, 0);
+}
+
+
+// Posts the changes while playing and checks the results
+bool TestCommands(AdvancedSequencer& seq) {
+    bool ok = true;
+
+    // the changes executed by the tick
+    ResetValues(seq);
+    seq.GoToZero();
+    seq.Play();
+    MIDITimer::Wait(SETTLE_TIME);
+    PostChanges(seq);
+    MIDITimer::Wait(SETTLE_TIME);
+    ok &= Check(CheckValues(seq), "The last values set are in effect while playing");
+    collector.Reset();
+    MIDITimer::Wait(PLAY_TIME);
+    vector<MIDIMessage> notes = collector.GetNotes();
+    seq.Stop();
+    int counts[3] = { 0, 0, 0 };
+    bool notes_ok = true;
+    for (unsigned int i = 0; i < notes.size(); i++) {
+        int chan = notes[i].GetChannel();
+        if (chan > 2)
+            notes_ok = false;
+        else {
+            counts[chan]++;
+            // track 1 is transposed
+            if (notes[i].GetNote() != TRACK_NOTES[chan] + (chan == 0 ? (NUM_CHANGES - 1) % 12 : 0))
+                notes_ok = false;
+        }
+    }
+    cout << "Received " << counts[0] << ", " << counts[1] << ", " << counts[2] << " notes on channels 1, 2, 3"
+         << endl;
+    ok &= Check(notes_ok, "The notes were transposed as requested");
+    ok &= Check(counts[0] > 0 && counts[2] > 0, "The unmuted tracks were played");
+    ok &= Check(counts[1] == 0, "The muted track was not played");
+
+    // the changes still pending when the sequencer is stopped
+    ResetValues(seq);
+    seq.Play();
+    MIDITimer::Wait(SETTLE_TIME);
+    PostChanges(seq);
+    seq.Stop();
+    ok &= Check(CheckValues(seq), "The last values set are in effect after Stop()");
+    return ok;
+}
+
+
+//////////////////////////////////////////////////////////////////
+//                            M A I N                           //
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    // all the tracks play on a loopback port, whose in port collects the notes
+    unsigned int port = MIDIManager::AddLoopbackPort("LOOP");
+    MIDIInDriver* in_driver = static_cast<MIDILoopbackOutDriver*>(MIDIManager::GetOutDriver(port))->GetInDriver();
+    in_driver->SetProcessor(&collector);
+    in_driver->OpenPort();
+    AdvancedSequencer seq;
+    MakeSong(seq);
+    for (unsigned int i = 0; i < seq.GetNumTracks(); i++)
+        seq.SetTrackOutPort(i, port);
+
+    cout << "Normal mode" << endl;
+    ok &= TestCommands(seq);
+    cout << "Render mode" << endl;
+    seq.SetRenderMode(true);
+    ok &= TestCommands(seq);
+
+    in_driver->ClosePort();
+    in_driver->SetProcessor(0);
+    cout << (ok ? "\nAll tests passed" : "\nSome tests FAILED") << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,243 @@
+/*
+ *   Example file for NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with NiCMidi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+  A test of the loop play of the AdvancedSequencer. It creates a song of
+  four measures, where the program and the volume of channel 1 change at
+  the third measure, and loops the second and the third measures, playing
+  through a loopback port. At every loop start it checks that:
+  - the notes of the loop are played again in the same order
+  - no note is left sounding
+  - the program and the volume of channel 1 are restored to their values
+    at the loop start, while the unchanged controls (the pan of channel 1
+    and all the channel 2 values) are not sent again.
+  This is done in the normal and in the render mode. It doesn't need MIDI
+  ports.
+*/
+
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "../include/advancedsequencer.h"
+#include "../include/loopback.h"
+#include "functions.h"                  // for Check()
+
+using namespace std;
+
+
+// A MIDIProcessor which collects the channel messages arrived to an in port
+class MsgCollector : public MIDIProcessor {
+    public:
+        virtual void            Reset() {
+                                    lock_guard<mutex> lock(msgs_mutex);
+                                    msgs.clear();
+                                }
+        virtual bool            Process(MIDITimedMessage* msg) {
+                                    if (msg->IsChannelMsg()) {
+                                        lock_guard<mutex> lock(msgs_mutex);
+                                        msgs.push_back(*msg);
+                                    }
+                                    return true;
+                                }
+        vector<MIDIMessage>     GetMessages() {
+                                    lock_guard<mutex> lock(msgs_mutex);
+                                    return msgs;
+                                }
+    protected:
+        vector<MIDIMessage>     msgs;
+        mutex                   msgs_mutex;
+};
+
+
+//////////////////////////////////////////////////////////////////
+//                        G L O B A L S                         //
+//////////////////////////////////////////////////////////////////
+
+const int LOOP_START = 1;                       // The first measure of the loop
+const int LOOP_END = 3;                         // The measure after the loop
+const int FIRST_NOTE = 60;                      // The note of the first beat of the song (channel 1)
+const int NUM_LAPS = 3;                         // The number of complete laps we want to check
+const unsigned int TEMPO_SCALE = 400;           // We play the song faster (a lap lasts 0.5 sec)
+const tMsecs PLAY_TIME = 2500;                  // The time we play the loop
+MsgCollector collector;
+
+
+//////////////////////////////////////////////////////////////////
+//                      F U N C T I O N S                       //
+//////////////////////////////////////////////////////////////////
+
+// Creates the song: four measures of 4/4 (a measure lasts 1 sec) with a note every beat on channel 1 (notes
+// FIRST_NOTE ... FIRST_NOTE + 15) and a note every measure on channel 2. At the third measure the program and
+// the volume of channel 1 change.
+void MakeSong(AdvancedSequencer& seq) {
+    MIDIMultiTrack* tracks = seq.GetMultiTrack();
+    MIDIClockTime beat = tracks->GetClksPerBeat();
+    MIDITrack* trk = tracks->GetTrack(0);
+    MIDITimedMessage msg;
+
+    msg.SetTimeSig(4, 4);
+    trk->InsertEvent(msg);
+    msg.SetTempo(240.0);
+    trk->InsertEvent(msg);
+
+    trk = tracks->GetTrack(1);
+    msg.SetProgramChange(0, 10);
+    trk->InsertEvent(msg);
+    msg.SetVolumeChange(0, 100);
+    trk->InsertEvent(msg);
+    msg.SetControlChange(0, C_PAN, 64);
+    trk->InsertEvent(msg);
+    for (int i = 0; i < 16; i++) {
+        msg.SetNoteOn(0, FIRST_NOTE + i, 100);
+        msg.SetTime(i * beat);
+        trk->InsertNote(msg, beat / 2);
+    }
+    msg.SetProgramChange(0, 20);
+    msg.SetTime(8 * beat);
+    trk->InsertEvent(msg);
+    msg.SetVolumeChange(0, 50);
+    msg.SetTime(8 * beat);
+    trk->InsertEvent(msg);
+
+    trk = tracks->GetTrack(2);
+    msg.SetProgramChange(1, 30);
+    msg.SetTime(0);
+    trk->InsertEvent(msg);
+    for (int i = 0; i < 4; i++) {
+        msg.SetNoteOn(1, 40 + i, 100);
+        msg.SetTime(i * 4 * beat);
+        trk->InsertNote(msg, 3 * beat);
+    }
+    seq.UpdateStatus();
+}
+
+
+// Plays the loop and checks the messages arrived to the loopback port
+bool TestLoop(AdvancedSequencer& seq) {
+    const int lap_first = FIRST_NOTE + 4 * LOOP_START;
+    const int lap_last = FIRST_NOTE + 4 * LOOP_END - 1;
+    bool ok = true;
+
+    seq.GoToMeasure(LOOP_START);
+    collector.Reset();
+    seq.Play();
+    MIDITimer::Wait(PLAY_TIME);
+    seq.Stop();
+    vector<MIDIMessage> msgs = collector.GetMessages();
+
+    // the last values and the sounding notes of the channels, as seen by the in port
+    int program[2] = { -1, -1 }, volume[2] = { -1, -1 };
+    // a note of each channel ends before the next one starts, so there can't be two sounding notes
+    int notes_on[2] = { 0, 0 };
+    // the messages sent between the last note of a lap and the first of the next one
+    int wrap_programs = 0, wrap_controls = 0;
+    int laps = 0, expected_note = lap_first;
+    bool notes_ok = true, chase_ok = true, wrap_ok = true, off_ok = true;
+    for (unsigned int i = 0; i < msgs.size(); i++) {
+        const MIDIMessage& msg = msgs[i];
+        int chan = msg.GetChannel();
+        if (chan > 1)                           // the All Notes Off sent by Stop()
+            continue;
+        if (msg.IsNoteOn()) {
+            if (++notes_on[chan] > 1)
+                off_ok = false;
+            if (chan != 0)
+                continue;
+            if (msg.GetNote() == lap_first) {
+                if (laps > 0) {
+                    // we are at a loop start: the last lap must be complete
+                    if (expected_note != lap_last + 1)
+                        notes_ok = false;
+                    // only the program and the volume of channel 1 must be sent
+                    if (wrap_programs != 1 || wrap_controls != 1)
+                        wrap_ok = false;
+                }
+                expected_note = lap_first;
+                laps++;
+            }
+            if (msg.GetNote() != expected_note)
+                notes_ok = false;
+            expected_note++;
+            // the values of channel 1 before and after the change at the third measure
+            bool after_change = (msg.GetNote() >= FIRST_NOTE + 8);
+            if (program[0] != (after_change ? 20 : 10) || volume[0] != (after_change ? 50 : 100) ||
+                program[1] != 30)
+                chase_ok = false;
+            wrap_programs = wrap_controls = 0;
+        }
+        else if (msg.IsNoteOff()) {
+            if (--notes_on[chan] < 0)
+                off_ok = false;
+        }
+        else if (msg.IsProgramChange()) {
+            program[chan] = msg.GetProgramValue();
+            wrap_programs++;
+        }
+        else if (msg.IsControlChange()) {
+            if (msg.IsVolumeChange())
+                volume[chan] = msg.GetControllerValue();
+            wrap_controls++;
+        }
+    }
+    cout << "Received " << msgs.size() << " messages, " << laps << " laps started" << endl;
+    ok &= Check(laps > NUM_LAPS, "The loop was played enough times");
+    ok &= Check(notes_ok, "Every lap played the notes of the loop in order");
+    ok &= Check(off_ok, "No note was left sounding");
+    ok &= Check(chase_ok, "The program and the volume were right for every note");
+    ok &= Check(wrap_ok, "Only the changed values were sent at the loop start");
+    return ok;
+}
+
+
+//////////////////////////////////////////////////////////////////
+//                            M A I N                           //
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    // all the tracks play on a loopback port, whose in port collects the messages
+    unsigned int port = MIDIManager::AddLoopbackPort("LOOP");
+    MIDIInDriver* in_driver = static_cast<MIDILoopbackOutDriver*>(MIDIManager::GetOutDriver(port))->GetInDriver();
+    in_driver->SetProcessor(&collector);
+    in_driver->OpenPort();
+    AdvancedSequencer seq;
+    MakeSong(seq);
+    for (unsigned int i = 0; i < seq.GetNumTracks(); i++)
+        seq.SetTrackOutPort(i, port);
+    seq.SetRepeatPlay(true, LOOP_START, LOOP_END);
+    seq.SetTempoScale(TEMPO_SCALE);
+
+    cout << "Normal mode" << endl;
+    ok &= TestLoop(seq);
+    cout << "Render mode" << endl;
+    seq.SetRenderMode(true);
+    ok &= TestLoop(seq);
+
+    in_driver->ClosePort();
+    in_driver->SetProcessor(0);
+    cout << (ok ? "\nAll tests passed" : "\nSome tests FAILED") << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,228 @@
+/*
+ *   Example file for NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with NiCMidi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+  A test of the MIDIOutDriver::AllNotesOff(), which is called by the
+  sequencer at every stop, locate and loop wrap. It must send a Note Off
+  only for the sounding notes and a pedal off only for the pedals which
+  are down, while the All Notes Off (CC 123) must be sent only to the
+  channels whose state is unknown, i.e. only by the first AllNotesOff()
+  after the port was open. The test counts the bytes arrived to a
+  loopback port in a panic and at the loop wraps of a MIDISequencer.
+  It doesn't need MIDI ports.
+*/
+
+
+#include <vector>
+#include <mutex>
+
+#include "../include/sequencer.h"
+#include "../include/loopback.h"
+#include "functions.h"                  // for Check()
+
+using namespace std;
+
+
+// A MIDIProcessor which collects the channel messages arrived to an in port
+class MsgCollector : public MIDIProcessor {
+    public:
+        virtual void            Reset() {
+                                    lock_guard<mutex> lock(msgs_mutex);
+                                    msgs.clear();
+                                }
+        virtual bool            Process(MIDITimedMessage* msg) {
+                                    if (msg->IsChannelMsg()) {
+                                        lock_guard<mutex> lock(msgs_mutex);
+                                        msgs.push_back(*msg);
+                                    }
+                                    return true;
+                                }
+        vector<MIDIMessage>     GetMessages() {
+                                    lock_guard<mutex> lock(msgs_mutex);
+                                    return msgs;
+                                }
+    protected:
+        vector<MIDIMessage>     msgs;
+        mutex                   msgs_mutex;
+};
+
+
+//////////////////////////////////////////////////////////////////
+//                        G L O B A L S                         //
+//////////////////////////////////////////////////////////////////
+
+const int LOOP_START = 0;                       // The first measure of the loop
+const int LOOP_END = 2;                         // The measure after the loop
+const int FIRST_NOTE = 60;                      // The note of the first beat of the song
+const int NUM_LAPS = 3;                         // The number of complete laps we want to check
+const float TEMPO = 960.0;                      // We play the song fast (a lap lasts 0.5 sec)
+const tMsecs PLAY_TIME = 2500;                  // The time we play the loop
+MsgCollector collector;
+
+
+//////////////////////////////////////////////////////////////////
+//                      F U N C T I O N S                       //
+//////////////////////////////////////////////////////////////////
+
+// Returns the number of bytes of the collected messages
+unsigned int CountBytes(const vector<MIDIMessage>& msgs) {
+    unsigned int bytes = 0;
+    for (unsigned int i = 0; i < msgs.size(); i++)
+        bytes += msgs[i].GetLength();
+    return bytes;
+}
+
+
+// Creates the song: three measures of 4/4 with a note every beat on channel 1 (notes FIRST_NOTE ...
+// FIRST_NOTE + 11). The last note of the loop lasts two beats and the damper pedal is pressed in the first
+// beat and released after the loop end, so at every wrap the driver must shut off a note and a pedal.
+void MakeSong(MIDIMultiTrack& tracks) {
+    MIDIClockTime beat = tracks.GetClksPerBeat();
+    MIDITrack* trk = tracks.GetTrack(0);
+    MIDITimedMessage msg;
+
+    msg.SetTimeSig(4, 4);
+    trk->InsertEvent(msg);
+    msg.SetTempo(TEMPO);
+    trk->InsertEvent(msg);
+
+    trk = tracks.GetTrack(1);
+    for (int i = 0; i < 12; i++) {
+        msg.SetNoteOn(0, FIRST_NOTE + i, 100);
+        msg.SetTime(i * beat);
+        trk->InsertNote(msg, i == 4 * LOOP_END - 1 ? 2 * beat : beat / 2);
+    }
+    msg.SetControlChange(0, C_DAMPER, 127);
+    msg.SetTime(beat / 4);
+    trk->InsertEvent(msg);
+    msg.SetControlChange(0, C_DAMPER, 0);
+    msg.SetTime(4 * LOOP_END * beat + beat);
+    trk->InsertEvent(msg);
+}
+
+
+// Sends two panics to the port, checking that only the first one sends the All Notes Off
+bool TestPanic(MIDIOutDriver* driver) {
+    bool ok = true;
+
+    collector.Reset();
+    driver->AllNotesOff();
+    unsigned int bytes = CountBytes(collector.GetMessages());
+    cout << "First panic: received " << bytes << " bytes" << endl;
+    ok &= Check(bytes == 16 * 3, "The first panic sent an All Notes Off to every channel");
+    collector.Reset();
+    driver->AllNotesOff();
+    bytes = CountBytes(collector.GetMessages());
+    cout << "Second panic: received " << bytes << " bytes" << endl;
+    ok &= Check(bytes == 0, "The second panic sent nothing");
+    return ok;
+}
+
+
+// Plays the loop and counts the bytes sent between the last note of a lap and the first of the next one
+bool TestWrap(MIDISequencer& seq) {
+    const int lap_first = FIRST_NOTE + 4 * LOOP_START;
+    const int lap_last = FIRST_NOTE + 4 * LOOP_END - 1;
+    bool ok = true;
+
+    seq.GoToMeasure(LOOP_START);
+    collector.Reset();
+    seq.Play();
+    MIDITimer::Wait(PLAY_TIME);
+    seq.Stop();
+    vector<MIDIMessage> msgs = collector.GetMessages();
+
+    vector<MIDIMessage> wrap_msgs;              // the messages sent at the current wrap
+    int laps = 0;
+    bool in_wrap = false, bytes_ok = true, offs_ok = true, mode_ok = true;
+    for (unsigned int i = 0; i < msgs.size(); i++) {
+        const MIDIMessage& msg = msgs[i];
+        if (msg.IsNoteOn() && msg.GetNote() == lap_last)
+            in_wrap = true;                     // the following messages are the wrap
+        else if (msg.IsNoteOn() && msg.GetNote() == lap_first) {
+            if (laps > 0) {
+                // only the Note Off of the last note and the damper off must be sent
+                bool note_off = false, damper_off = false;
+                for (unsigned int j = 0; j < wrap_msgs.size(); j++) {
+                    if (wrap_msgs[j].IsNoteOff() && wrap_msgs[j].GetNote() == lap_last)
+                        note_off = true;
+                    else if (wrap_msgs[j].IsControlChange() && wrap_msgs[j].GetController() == C_DAMPER &&
+                             wrap_msgs[j].GetControllerValue() == 0)
+                        damper_off = true;
+                    else if (wrap_msgs[j].IsChannelMode())
+                        mode_ok = false;
+                }
+                if (!note_off || !damper_off)
+                    offs_ok = false;
+                if (CountBytes(wrap_msgs) != 2 * 3)
+                    bytes_ok = false;
+                cout << "Wrap " << laps << ": received " << CountBytes(wrap_msgs) << " bytes" << endl;
+            }
+            wrap_msgs.clear();
+            in_wrap = false;
+            laps++;
+        }
+        else if (in_wrap)
+            wrap_msgs.push_back(msg);
+    }
+    ok &= Check(laps > NUM_LAPS, "The loop was played enough times");
+    ok &= Check(offs_ok, "Every wrap shut off the sounding note and the damper");
+    ok &= Check(mode_ok, "No All Notes Off was sent at the wraps");
+    ok &= Check(bytes_ok, "Every wrap sent only 6 bytes");
+    return ok;
+}
+
+
+//////////////////////////////////////////////////////////////////
+//                            M A I N                           //
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    // the track plays on a loopback port, whose in port collects the messages
+    unsigned int port = MIDIManager::AddLoopbackPort("LOOP");
+    MIDIOutDriver* out_driver = MIDIManager::GetOutDriver(port);
+    MIDIInDriver* in_driver = static_cast<MIDILoopbackOutDriver*>(out_driver)->GetInDriver();
+    in_driver->SetProcessor(&collector);
+    in_driver->OpenPort();
+    // we keep the out port open, otherwise the sequencer would reopen it at every start (and its state would be
+    // unknown again)
+    out_driver->OpenPort();
+
+    MIDIMultiTrack tracks(2);
+    MakeSong(tracks);
+    MIDISequencer seq(&tracks);
+    seq.SetTrackOutPort(1, port);
+    seq.SetRepeatPlay(true, LOOP_START, LOOP_END);
+
+    ok &= TestPanic(out_driver);
+    ok &= TestWrap(seq);
+
+    out_driver->ClosePort();
+    in_driver->ClosePort();
+    in_driver->SetProcessor(0);
+    cout << (ok ? "\nAll tests passed" : "\nSome tests FAILED") << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
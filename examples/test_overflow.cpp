@@ -0,0 +1,167 @@
+/*
+ *   Example file for NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with NiCMidi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+  A test of the bounded queues used in the real time paths: the MIDILog
+  buffer and the queue of the threaded output mode of MIDIOutDriver.
+  They must never block or overwrite an unread message: when they are
+  full the new messages are discarded and counted.
+  The output test uses a loopback port made slow (every message takes
+  2 msecs to be sent, as with a slow USB interface), so the queue fills
+  up. It doesn't need MIDI ports.
+*/
+
+
+#include <sstream>
+#include <string>
+
+#include "../include/manager.h"
+#include "../include/loopback.h"
+#include "../include/log.h"
+#include "functions.h"                  // for Check()
+
+using namespace std;
+
+
+// A loopback out port which takes some time for sending a message
+class SlowOutDriver : public MIDILoopbackOutDriver {
+    public:
+                                SlowOutDriver(MIDILoopbackInDriver* in) :
+                                    MIDILoopbackOutDriver(0, "SLOW", in) {}
+                                ~SlowOutDriver()        { SetThreadedOutput(false); }
+    protected:
+        virtual void            HardwareMsgOut(const MIDIMessage &msg) {
+                                    MIDITimer::Wait(SEND_TIME);
+                                    MIDILoopbackOutDriver::HardwareMsgOut(msg);
+                                }
+
+        static const unsigned int SEND_TIME = 2;        // msecs
+};
+
+
+//////////////////////////////////////////////////////////////////
+//                        G L O B A L S                         //
+//////////////////////////////////////////////////////////////////
+
+const unsigned int NUM_MESSAGES = 100;          // The messages sent in the output test (less than 128)
+const unsigned int NUM_EXTRA_LOG = 20;          // The log messages beyond the buffer size
+
+
+//////////////////////////////////////////////////////////////////
+//                      F U N C T I O N S                       //
+//////////////////////////////////////////////////////////////////
+
+// Fills the log buffer with the drain thread stopped, and then drains it into a string
+bool TestLog() {
+    bool ok = true;
+    ostringstream log_str;
+
+    MIDILog::Stop();                            // writes the pending messages
+    MIDILog::SetStream(log_str);
+    unsigned long dropped = MIDILog::GetNumDropped();
+    for (unsigned int i = 0; i < MIDILog::RING_SIZE + NUM_EXTRA_LOG; i++)
+        NICMIDI_LOG_WARNING("Test message %u", i);
+    ok &= Check(MIDILog::GetNumDropped() - dropped == NUM_EXTRA_LOG,
+                "The log discarded the messages beyond its size");
+    MIDILog::Flush();
+    MIDILog::SetStream(cout);
+    MIDILog::Start();
+
+    // the log must contain the first RING_SIZE messages, in order
+    istringstream lines(log_str.str());
+    string line;
+    unsigned int n = 0;
+    bool in_order = true;
+    while (getline(lines, line)) {
+        ostringstream expected;
+        expected << "Test message " << n;
+        if (line.size() < expected.str().size() ||
+            line.compare(line.size() - expected.str().size(), string::npos, expected.str()) != 0)
+            in_order = false;
+        n++;
+    }
+    ok &= Check(n == MIDILog::RING_SIZE && in_order, "The log kept the first messages in order");
+    return ok;
+}
+
+
+// Sends NUM_MESSAGES note on (with increasing note numbers) to the slow port in threaded mode and
+// checks the messages which arrived
+bool TestOutQueue(unsigned int queue_size, bool must_drop) {
+    bool ok = true;
+    MIDILoopbackInDriver in_driver(0, "SLOW", 2 * NUM_MESSAGES);
+    SlowOutDriver out_driver(&in_driver);
+    MIDITimedMessage msg;
+    MIDIRawMessage raw_msg;
+
+    in_driver.OpenPort();
+    out_driver.OpenPort();
+    out_driver.SetThreadedOutput(true, queue_size);
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        msg.SetNoteOn(0, i, 100);
+        out_driver.OutputMessage(msg);
+    }
+    out_driver.SetThreadedOutput(false);        // sends the messages still in the queue
+
+    unsigned int received = 0;
+    int last_note = -1;
+    bool in_order = true;
+    while (in_driver.InputMessage(raw_msg)) {
+        if (raw_msg.msg.GetNote() <= last_note)
+            in_order = false;
+        last_note = raw_msg.msg.GetNote();
+        received++;
+    }
+    unsigned long dropped = out_driver.GetOutDropped();
+    cout << "Queue size " << queue_size << ": received " << received << ", dropped " << dropped
+         << ", queue peak " << out_driver.GetOutQueuePeak() << endl;
+    ok &= Check(received + dropped == NUM_MESSAGES, "Every message was sent or counted as dropped");
+    ok &= Check(in_order, "No message was duplicated or overwritten");
+    ok &= Check((dropped > 0) == must_drop, must_drop ? "The full queue discarded messages" :
+                                                        "The queue discarded no message");
+    unsigned int real_size = MIDIOutDriver::MIN_OUT_QUEUE_SIZE;
+    if (queue_size > real_size)
+        real_size = queue_size;
+    ok &= Check(out_driver.GetOutQueuePeak() <= real_size, "The queue never exceeded its size");
+    out_driver.ClosePort();
+    in_driver.ClosePort();
+    return ok;
+}
+
+
+//////////////////////////////////////////////////////////////////
+//                            M A I N                           //
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    MIDIManager::GetNumMIDIOuts();              // initializes the MIDIManager, which starts the log
+    ok &= TestLog();
+    ok &= TestOutQueue(MIDIOutDriver::DEFAULT_OUT_QUEUE_SIZE, false);
+    ok &= TestOutQueue(16, true);
+    ok &= TestOutQueue(1, true);                // it is rounded up to MIN_OUT_QUEUE_SIZE
+
+    cout << (ok ? "\nAll tests passed" : "\nSome tests FAILED") << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,196 @@
+/*
+ *   Example file for NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with NiCMidi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+  A test of the render list and of the offline rendering of the
+  AdvancedSequencer. With some tracks transposed, muted and scaled, it
+  collects the events returned by MIDISequencer::GetNextEvent() and checks
+  that MIDISequencer::Render() and AdvancedSequencer::Render() (with one
+  and more threads, also during playback) give the same messages. Then it
+  plays the file in the normal and in the render mode through a loopback
+  port, checking that the same notes arrive in the same order.
+  Give the name of a MIDI file as argument (the default is twinkle.mid in
+  the current directory).
+*/
+
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "../include/advancedsequencer.h"
+#include "../include/loopback.h"
+#include "../include/render.h"
+#include "functions.h"                  // for Check()
+
+using namespace std;
+
+
+// A MIDIProcessor which collects the notes arrived to an in port
+class NoteCollector : public MIDIProcessor {
+    public:
+        virtual void            Reset() {
+                                    lock_guard<mutex> lock(notes_mutex);
+                                    notes.clear();
+                                }
+        virtual bool            Process(MIDITimedMessage* msg) {
+                                    if (msg->IsNote()) {
+                                        lock_guard<mutex> lock(notes_mutex);
+                                        notes.push_back(*msg);
+                                    }
+                                    return true;
+                                }
+        vector<MIDIMessage>     GetNotes() {
+                                    lock_guard<mutex> lock(notes_mutex);
+                                    return notes;
+                                }
+    protected:
+        vector<MIDIMessage>     notes;
+        mutex                   notes_mutex;
+};
+
+
+//////////////////////////////////////////////////////////////////
+//                        G L O B A L S                         //
+//////////////////////////////////////////////////////////////////
+
+const unsigned int TEMPO_SCALE = 400;           // We play the file faster
+NoteCollector collector;
+
+
+//////////////////////////////////////////////////////////////////
+//                      F U N C T I O N S                       //
+//////////////////////////////////////////////////////////////////
+
+// Returns true if the two vectors contain the same messages from the same tracks
+bool SameEvents(const vector<MIDIRenderedEvent>& a, const vector<MIDIRenderedEvent>& b) {
+    if (a.size() != b.size())
+        return false;
+    for (unsigned int i = 0; i < a.size(); i++)
+        if (a[i].track != b[i].track || a[i].port != b[i].port || !(a[i].msg == b[i].msg))
+            return false;
+    return true;
+}
+
+
+// Returns true if the two vectors contain the same notes
+bool SameNotes(const vector<MIDIMessage>& a, const vector<MIDIMessage>& b) {
+    if (a.size() != b.size())
+        return false;
+    for (unsigned int i = 0; i < a.size(); i++)
+        if (a[i].GetStatus() != b[i].GetStatus() || a[i].GetByte1() != b[i].GetByte1() ||
+            a[i].GetByte2() != b[i].GetByte2())
+            return false;
+    return true;
+}
+
+
+// Plays the whole file and returns the notes arrived to the loopback port
+vector<MIDIMessage> PlayFile(AdvancedSequencer& seq) {
+    seq.GoToZero();
+    collector.Reset();
+    seq.Play();
+    while (seq.IsPlaying())
+        MIDITimer::Wait(20);
+    return collector.GetNotes();
+}
+
+
+//////////////////////////////////////////////////////////////////
+//                            M A I N                           //
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    const char* file_name = (argc > 1 ? argv[1] : "twinkle.mid");
+    bool ok = true;
+
+    // all the tracks play on a loopback port, whose in port collects the notes
+    unsigned int port = MIDIManager::AddLoopbackPort("RENDER");
+    MIDIInDriver* in_driver = static_cast<MIDILoopbackOutDriver*>(MIDIManager::GetOutDriver(port))->GetInDriver();
+    in_driver->SetProcessor(&collector);
+    in_driver->OpenPort();
+    AdvancedSequencer seq;
+    if (!seq.Load(file_name)) {
+        cout << "Cannot load " << file_name << endl;
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < seq.GetNumTracks(); i++)
+        seq.SetTrackOutPort(i, port);
+    // the track processors change the messages
+    if (seq.GetNumTracks() > 1)
+        seq.SetTrackTranspose(1, 2);
+    if (seq.GetNumTracks() > 2)
+        seq.SetTrackMute(2, true);
+    if (seq.GetNumTracks() > 3)
+        seq.SetTrackVelocityScale(3, 50);
+    seq.SetTempoScale(TEMPO_SCALE);
+
+    // the reference: the events returned by GetNextEvent()
+    vector<MIDIRenderedEvent> ref_events;
+    vector<MIDIMessage> ref_notes;
+    MIDIRenderedEvent ev;
+    seq.GoToZero();
+    while (seq.GetNextEvent(&ev.track, &ev.msg)) {
+        if (ev.msg.IsMetaEvent() || ev.msg.IsBeatMarker() || ev.msg.IsNoOp())
+            continue;
+        ev.port = port;
+        ref_events.push_back(ev);
+        if (ev.msg.IsNote())
+            ref_notes.push_back(ev.msg);
+    }
+    seq.GoToZero();
+    cout << "The file has " << ref_events.size() << " messages to send (" << ref_notes.size() << " notes)" << endl;
+
+    // offline rendering
+    MIDIRenderVectorSink sink;
+    ok &= Check(seq.MIDISequencer::Render(&sink) && SameEvents(sink.events, ref_events),
+                "MIDISequencer::Render() gives the same messages of GetNextEvent()");
+    sink.Clear();
+    ok &= Check(seq.Render(&sink) && SameEvents(sink.events, ref_events),
+                "AdvancedSequencer::Render() gives the same messages of GetNextEvent()");
+    sink.Clear();
+    ok &= Check(seq.Render(&sink, 0, 0, 4) && SameEvents(sink.events, ref_events),
+                "AdvancedSequencer::Render() with 4 threads gives the same messages");
+    sink.Clear();
+    seq.Play();
+    MIDIClockTime play_time = seq.GetCurrentMIDIClockTime();
+    bool rendered = seq.Render(&sink, 0, 0, 4);
+    MIDITimer::Wait(100);
+    ok &= Check(rendered && SameEvents(sink.events, ref_events),
+                "AdvancedSequencer::Render() during playback gives the same messages");
+    ok &= Check(seq.GetCurrentMIDIClockTime() > play_time, "The sequencer kept playing during the rendering");
+    seq.Stop();
+
+    // playback through the loopback port
+    vector<MIDIMessage> notes = PlayFile(seq);
+    ok &= Check(SameNotes(notes, ref_notes), "The normal mode plays the notes of GetNextEvent()");
+    ok &= Check(seq.SetRenderMode(true), "The render mode was set");
+    notes = PlayFile(seq);
+    cout << "The render list has " << seq.GetRenderListSize() << " messages" << endl;
+    ok &= Check(SameNotes(notes, ref_notes), "The render mode plays the notes of GetNextEvent()");
+
+    in_driver->ClosePort();
+    in_driver->SetProcessor(0);
+    cout << (ok ? "\nAll tests passed" : "\nSome tests FAILED") << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
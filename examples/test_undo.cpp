@@ -0,0 +1,206 @@
+/*
+ *   Example file for NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with NiCMidi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+  A test of the undo and redo of the MIDIRecorder. It creates a song and
+  records two takes in different measures, sending the notes through a
+  loopback port, then checks that:
+  - UndoRec() and RedoRec() bring the sequencer tracks back and forth to
+    their exact content before and after each take
+  - the history is cleared if a recorded track is edited after the take,
+    or if the sequencer tracks are replaced.
+  This is done in the REC_MERGE and in the REC_OVER modes. It doesn't need
+  MIDI ports.
+*/
+
+
+#include <string>
+#include <vector>
+
+#include "../include/advancedsequencer.h"
+#include "../include/recorder.h"
+#include "../include/loopback.h"
+#include "functions.h"                  // for Check()
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////
+//                        G L O B A L S                         //
+//////////////////////////////////////////////////////////////////
+
+const int REC_TRACK = 2;                        // The track we record into
+const int REC_CHANNEL = 1;                      // The channel of the recorded track
+const int NUM_NOTES = 8;                        // The number of notes of a take
+const tMsecs LEAD_IN_TIME = 2200;               // The time from Start() to the first note of a take (the lead
+                                                // in measure, the measure before the recording and a beat)
+const tMsecs NOTE_TIME = 100;                   // The length of the recorded notes and of the pauses
+unsigned int play_port;                         // The port where the sequencer plays
+MIDILoopbackOutDriver* rec_driver;              // The driver which sends the notes to the recorder
+unsigned int rec_port;                          // The in port of the recorder
+
+
+//////////////////////////////////////////////////////////////////
+//                      F U N C T I O N S                       //
+//////////////////////////////////////////////////////////////////
+
+// Creates the song: eight measures of 4/4 (a measure lasts 1 sec) with a note every beat on channel 1 (track 1)
+// and a note every measure on channel 2 (track 2)
+void MakeSong(AdvancedSequencer& seq) {
+    MIDIMultiTrack* tracks = seq.GetMultiTrack();
+    MIDIClockTime beat = tracks->GetClksPerBeat();
+    MIDITrack* trk = tracks->GetTrack(0);
+    MIDITimedMessage msg;
+
+    msg.SetTimeSig(4, 4);
+    trk->InsertEvent(msg);
+    msg.SetTempo(240.0);
+    trk->InsertEvent(msg);
+    trk = tracks->GetTrack(1);
+    for (int i = 0; i < 32; i++) {
+        msg.SetNoteOn(0, 60 + i % 12, 100);
+        msg.SetTime(i * beat);
+        trk->InsertNote(msg, beat / 2);
+    }
+    trk = tracks->GetTrack(REC_TRACK);
+    for (int i = 0; i < 8; i++) {
+        msg.SetNoteOn(REC_CHANNEL, 40 + i, 100);
+        msg.SetTime(i * 4 * beat);
+        trk->InsertNote(msg, 3 * beat);
+    }
+    seq.UpdateStatus();
+}
+
+
+// Returns true if the two multitracks have the same events
+bool SameTracks(const MIDIMultiTrack& m1, const MIDIMultiTrack& m2) {
+    if (m1.GetNumTracks() != m2.GetNumTracks())
+        return false;
+    for (unsigned int i = 0; i < m1.GetNumTracks(); i++) {
+        const MIDITrack* t1 = m1.GetTrack(i);
+        const MIDITrack* t2 = m2.GetTrack(i);
+        if (t1->GetNumEvents() != t2->GetNumEvents())
+            return false;
+        for (unsigned int j = 0; j < t1->GetNumEvents(); j++)
+            if (!(t1->GetEvent(j) == t2->GetEvent(j)))
+                return false;
+    }
+    return true;
+}
+
+
+// Records a take in the two measures after the given one: the recorder starts the sequencer from meas after a
+// lead in measure, then NUM_NOTES notes (from first_note) are sent to the recorder in port
+void RecordTake(AdvancedSequencer& seq, MIDIRecorder& rec, unsigned int meas, int first_note) {
+    rec.SetStartRecTime(meas + 1);
+    rec.SetEndRecTime(meas + 3);
+    seq.GoToMeasure(meas);
+    rec.Start();
+    MIDITimer::Wait(LEAD_IN_TIME);
+    MIDITimedMessage msg;
+    for (int i = 0; i < NUM_NOTES; i++) {
+        msg.SetNoteOn(REC_CHANNEL, first_note + i, 100);
+        rec_driver->OutputMessage(msg);
+        MIDITimer::Wait(NOTE_TIME);
+        msg.SetNoteOff(REC_CHANNEL, first_note + i, 0);
+        rec_driver->OutputMessage(msg);
+        MIDITimer::Wait(NOTE_TIME);
+    }
+    rec.Stop();
+}
+
+
+// Records two takes with the given mode and checks the undo and redo
+bool TestUndo(int mode) {
+    bool ok = true;
+    AdvancedSequencer seq;
+    MakeSong(seq);
+    for (unsigned int i = 0; i < seq.GetNumTracks(); i++)
+        seq.SetTrackOutPort(i, play_port);
+    MIDIRecorder rec(&seq);
+    rec.EnableTrack(REC_TRACK);
+    rec.SetTrackInPort(REC_TRACK, rec_port);
+    rec.SetTrackRecChannel(REC_TRACK, REC_CHANNEL);
+    rec.SetRecMode(mode);
+
+    // the sequencer tracks before and after the takes
+    MIDIMultiTrack before(*seq.GetMultiTrack());
+    RecordTake(seq, rec, 0, 70);
+    MIDIMultiTrack take1(*seq.GetMultiTrack());
+    RecordTake(seq, rec, 3, 80);
+    MIDIMultiTrack take2(*seq.GetMultiTrack());
+    ok &= Check(!SameTracks(before, take1) && !SameTracks(take1, take2), "The takes changed the tracks");
+    ok &= Check(rec.GetNumUndo() == 2 && rec.GetNumRedo() == 0, "Two takes can be undone");
+    cout << "The undo history takes " << rec.GetUndoSize() << " bytes" << endl;
+
+    ok &= Check(rec.UndoRec() && SameTracks(*seq.GetMultiTrack(), take1), "The second take was undone");
+    ok &= Check(rec.UndoRec() && SameTracks(*seq.GetMultiTrack(), before), "The first take was undone");
+    ok &= Check(!rec.UndoRec(), "There is nothing more to undo");
+    ok &= Check(rec.RedoRec() && SameTracks(*seq.GetMultiTrack(), take1), "The first take was redone");
+    ok &= Check(rec.RedoRec() && SameTracks(*seq.GetMultiTrack(), take2), "The second take was redone");
+    ok &= Check(!rec.RedoRec(), "There is nothing more to redo");
+
+    // an edit of the recorded track after the take forbids the undo
+    MIDITimedMessage msg;
+    msg.SetNoteOn(REC_CHANNEL, 30, 100);
+    msg.SetTime(seq.MeasToMIDI(2, 1));
+    seq.GetMultiTrack()->GetTrack(REC_TRACK)->InsertNote(msg, seq.GetMultiTrack()->GetClksPerBeat());
+    MIDIMultiTrack edited(*seq.GetMultiTrack());
+    ok &= Check(!rec.UndoRec() && SameTracks(*seq.GetMultiTrack(), edited),
+                "The undo is refused after an edit of the track");
+    ok &= Check(rec.GetNumUndo() == 0 && rec.GetNumRedo() == 0 && rec.GetUndoSize() == 0,
+                "The history was cleared after the edit");
+
+    // replacing the tracks clears the history
+    RecordTake(seq, rec, 0, 90);
+    ok &= Check(rec.GetNumUndo() == 1, "A new take can be undone");
+    *seq.GetMultiTrack() = before;
+    seq.UpdateStatus();
+    ok &= Check(rec.GetNumUndo() == 0 && !rec.UndoRec() && rec.GetUndoSize() == 0,
+                "The history was cleared when the tracks were replaced");
+    return ok;
+}
+
+
+//////////////////////////////////////////////////////////////////
+//                            M A I N                           //
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    // the sequencer plays on a loopback port, while the notes are sent to the recorder through another one
+    play_port = MIDIManager::AddLoopbackPort("PLAY");
+    unsigned int port = MIDIManager::AddLoopbackPort("REC");
+    rec_driver = static_cast<MIDILoopbackOutDriver*>(MIDIManager::GetOutDriver(port));
+    rec_port = MIDIManager::GetNumMIDIIns() - 1;
+
+    cout << "Merge mode" << endl;
+    ok &= TestUndo(MIDIRecorder::REC_MERGE);
+    cout << "Over mode" << endl;
+    ok &= TestUndo(MIDIRecorder::REC_OVER);
+
+    cout << (ok ? "\nAll tests passed" : "\nSome tests FAILED") << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -32,6 +32,7 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
 
 #include "thru.h"
 #include "multitrack.h"
@@ -90,6 +91,12 @@ class MIDISequencerTrackProcessor : public MIDIProcessor {
 /// + Has improved methods for jumping from a time to another: if you start the sequencer from the middle of a
 ///   song it automatically sets appropriate MIDI controls, programs and sysex
 ///
+/// While the sequencer is playing, the methods which change the track processors (solo, mute, velocity scale,
+/// rechannelize, transpose) and the tempo scale don't lock the sequencer: they post the change into a lock free
+/// queue and the change is applied at the beginning of the next tick (so a get method called immediately after
+/// could still return the old value). In this way a GUI or a remote control thread never has to wait for the
+/// tick, and the tick is never stalled by them.
+///
 class AdvancedSequencer : public MIDISequencer {
     public:
         /// Creates an AdvancedSequencer with 17 tracks (one for each channel plus the master track). Adds the
@@ -133,6 +140,20 @@ class AdvancedSequencer : public MIDISequencer {
         /// \param tracks the MIDIMultiTrack to be copied.
         /// \return always returns **true**.
         virtual bool        Load(const MIDIMultiTrack* tracks);
+        /// Loads a MIDI file using a cache file written by SaveCache() (see MIDIFileCache). If the cache
+        /// exists and is up to date the multitrack, the warp positions and the number of measures are read
+        /// from it, avoiding the parsing of the file and the computation of the warp positions; otherwise the
+        /// file is loaded with Load() and the cache is (re)written.
+        /// \param fname the MIDI file name
+        /// \param cache_name the cache file name; if you leave 0 it is _fname_ followed by ".nmc"
+        /// \return **true** if the file has been loaded (see Load())
+        bool                LoadCached(const char* fname, const char* cache_name = 0);
+        /// Writes a cache file for the loaded MIDI file, which can then be loaded with LoadCached(). Call this
+        /// only if you didn't edit the multitrack after loading it.
+        /// \param cache_name the cache file name; if you leave 0 it is the name of the loaded file followed
+        /// by ".nmc"
+        /// \return **true** if the cache has been written
+        bool                SaveCache(const char* cache_name = 0);
         /// Clears the contents of the internal MIDIMultiTrack. Moreover it resets its MIDIMultiTrack::clks_per_beat
         /// parameter to \ref DEFAULT_CLKS_PER_BEAT.
         virtual void        UnLoad();
@@ -208,6 +229,10 @@ class AdvancedSequencer : public MIDISequencer {
         int                 GetTrackTranspose(unsigned int trk_num) const;
         /// Returns the time offset (in MIDI ticks) assigned to the given track.
         int                 GetTrackTimeShift(unsigned int trk_num) const;
+        /// Returns **true** if the render mode is on (see SetRenderMode()).
+        bool                GetRenderMode() const               { return render_mode; }
+        /// Returns the number of events in the render list (0 if it was never built).
+        unsigned int        GetRenderListSize() const           { return render_list.size(); }
         /// Returns a pointer to the MIDISequencerTrackProcessor for the given track.
         MIDISequencerTrackProcessor*    GetTrackProcessor(unsigned int trk_num)
                                                 { return (MIDISequencerTrackProcessor *)track_processors[trk_num]; }
@@ -250,6 +275,27 @@ class AdvancedSequencer : public MIDISequencer {
         /// See MIDIProcessorTransposer.
         /// \return **true** if _trk_num is a valid track number, **false** otherwise.
         bool                SetTrackTranspose(unsigned int trk_num, int amt);
+        /// Sets the render mode on or off. In render mode the sequencer, before playing, compiles the whole
+        /// multitrack into a render list: a flat vector of the messages to be sent, already processed by the
+        /// track processors (mute, solo, transpose, etc\.), with their out port and their time in usecs. During
+        /// playback the TickProc() only walks this vector, without iterating the tracks and processing the
+        /// messages, so it is much lighter with big files. The list is rebuilt immediately when you change a
+        /// track processor parameter (also during playback), while a change of the out port or of the time shift
+        /// of a track, or an edit of the tracks, is detected when the sequencer starts.
+        /// \note In render mode the sequencer always plays in the PLAY_BOUNDED mode, the GUI is only notified
+        /// of beats and measures and GetTrackNoteCount() is not updated. The extra processors of the tracks are
+        /// called when the list is built, not during playback.
+        /// \return **false** if the sequencer is playing (you cannot change the mode during playback),
+        /// **true** otherwise.
+        bool                SetRenderMode(bool on);
+        /// Same as MIDISequencer::SetTempoScale(), but it keeps the correct time in render mode.
+        virtual bool        SetTempoScale(unsigned int scale);
+        /// Same as MIDISequencer::Render(), but the range is split at the warp positions (one every
+        /// \ref MEASURES_PER_WARP measures) and the pieces are rendered in parallel by _n_threads_ threads, each
+        /// starting from the sequencer state saved at its warp position. The messages are collected and sent to
+        /// the sink in time order by the calling thread.
+        virtual bool        Render(MIDIRenderSink* sink, MIDIClockTime start = 0, MIDIClockTime end = 0,
+                                   unsigned int n_threads = 1);
         /// Sets the current time to the beginning of the song. This method is thread-safe and can be
         /// called during playback. Notifies the GUI a GROUP_ALL event to signify a full GUI reset.
         virtual void        GoToZero()                          { GoToTime(0); }
@@ -287,19 +333,143 @@ class AdvancedSequencer : public MIDISequencer {
 
     protected:
 
+        /// Internal use. Synchronizes the sequencer with the multitrack, creates new track processors and goes to
+        /// time 0, without computing the warp positions. It is the common part of Reset() and LoadCached().
+        void                ResetTracks();
         /// Internal use. It registers the state of the sequencer every MEASURES_PER_WARP measures, and creates a
         /// std::vector of MIDISequencerState for a quicker jump from a time to another.
         void                ExtractWarpPositions();
-        /// Internal use. When jumping from a time to another while the sequencer is playing, it examines all events
-        /// between old and new time (or between start and new time, if lesser then old), sending to the ports the
-        /// appropriate control, program, pitch bend and sysex messages in order to exactly reproduce the sequencer
-        /// setting at the new time.
+        /// Internal use. When jumping from a time to another while the sequencer is playing, it sends to the ports
+        /// the appropriate control, program, pitch bend and sysex messages in order to exactly reproduce the sequencer
+        /// setting at the new time. Controls, program and pitch bend are taken from the sequencer state, sysex
+        /// from the chase index of the tracks, and the messages are sent in a single batch for every port.
         void                CatchEventsBefore();
         /// Internal use. As above, but only on the given track (this is useful when a formerly muted track is unmuted,
         /// and needs to be set with appropriate controls, program etc.
         void                CatchEventsBefore(int trk_num);
+        /// Implements the TickProc: in render mode it walks the render list, otherwise it calls
+        /// MIDISequencer::TickProc().
+        virtual void        TickProc(tMsecs sys_time);
 
         /// \cond EXCLUDED
+        // The chase index of a track (see GetChaseIndex())
+        struct ChaseIndex {
+                                        ChaseIndex() : edit_id(0) {}
+            unsigned long               edit_id;        // The edit id of the track when the index was built
+            std::vector<unsigned int>   events;         // The event indexes
+        };
+        // An entry of the render list: a channel message (with its bytes), a sysex (stored in render_sysex)
+        // or a beat marker (with its measure and beat)
+        struct RenderEvent {
+            tUsecs          time_us;        // The time from the start, without tempo scale
+            MIDIClockTime   clock;          // The MIDI time
+            unsigned short  port;           // The out port, or RENDER_BEAT
+            unsigned short  track;          // The track (for the latency compensation)
+            unsigned char   len;            // The length of a channel message, 0 for sysex and beats
+            unsigned char   bytes[3];       // The bytes of a channel message, or the beat
+            unsigned int    data;           // The index of a sysex in render_sysex, or the measure
+        };
+        // The snapshot of the track parameters which are baked into the render list
+        struct RenderTrackId {
+            unsigned long   edit_id;
+            unsigned int    port;
+        };
+        // The jobs of the worker added by the AdvancedSequencer (see MIDISequencer::RequestJob())
+        enum { JOB_RENDER_LIST = 2, JOB_CHASE = 4 };
+        // Internal use: returns a copy of the MIDISequencerTrackProcessor of a track, used by Render()
+        virtual MIDIProcessor*              CopyTrackProcessor(unsigned int trk_num) const;
+        // Internal use: compiles the multitrack into the render list. The events are compiled without proc_lock,
+        // from copies of the state and of the track processors, and the new list is swapped in only if no
+        // processor was changed meanwhile (returns false otherwise). It is called by Start() and by the worker
+        bool                                BuildRenderList();
+        // Internal use: compiles the events into events and sysex, playing the state st with the processors
+        // of ctx (it doesn't use the sequencer state, so it can run without proc_lock)
+        void                                CompileRenderList(MIDISequencerState* st, const RenderContext& ctx,
+                                                              std::vector<RenderEvent>& events,
+                                                              std::vector<MIDITimedMessage>& sysex) const;
+        // Internal use: returns true if the render list reflects the current tracks and processors
+        bool                                IsRenderListValid() const;
+        // Internal use: called when a track processor parameter is changed; if the sequencer is playing
+        // in render mode the worker rebuilds the list, while the tick doesn't send the note ons of the changed
+        // track (or of all tracks if trk_num is -1) with the old one
+        void                                InvalidateRenderList(int trk_num = -1);
+        // Internal use: sets render_pos to the first event at or after the given time
+        void                                SyncRenderPos(MIDIClockTime clk);
+        // Internal use: brings the sequencer state to the current time while playing in render mode
+        void                                SyncRenderState();
+        // Internal use: loads the given warp position, keeping the current tempo scale
+        void                                SetWarpState(unsigned int warp_to_item);
+        // Internal use: converts the state times from its tempo scale to the given one
+        void                                RescaleState(unsigned int scale);
+        // Internal use: starts the loop search from the nearest warp position, and saves the chase indexes
+        // for ComputeLoop()
+        virtual void                        GetLoopStartState(MIDISequencerState* st);
+        // Internal use: computes the loop start state and the chase messages to send at the loop start
+        virtual bool                        ComputeLoop(LoopData* ld, const RenderContext& ctx);
+        // Internal use: copies into st the nearest warp position, or the state at time 0 if the warp positions
+        // can't be used
+        void                                GetWarpState(MIDISequencerState* st, unsigned int warp_to_item);
+        // Internal use: copies the loop start state and sends the chase messages
+        virtual void                        LoadLoopState(double sys_ms);
+        // Internal use: moves to the loop start when the loop is not ready, keeping the render position
+        virtual void                        SkipToLoopStart(double sys_ms);
+        // Internal use: puts into events the sysex of all tracks (or of the track trk_num) and the program, pitch
+        // bend and controllers of the unmuted tracks which set the given state at the time t. If from is not 0
+        // only the values which differ from the ones of from (i.e. already sent) are put. If procs and indexes
+        // are not 0 the track parameters and the chase indexes are taken from them instead of the sequencer
+        // (so it can be called without proc_lock)
+        void                                CollectEventsBefore(const MIDISequencerState* st, MIDIClockTime t,
+                                                                std::vector<TrackMessage>& events, int trk_num = -1,
+                                                                const MIDISequencerState* from = 0,
+                                                                const std::vector<MIDIProcessor*>* procs = 0,
+                                                                const std::vector<ChaseIndex>* indexes = 0);
+        // Internal use: sends the chase messages, queuing them and flushing the port queues once
+        void                                OutputChase(const std::vector<TrackMessage>& events);
+        // Internal use: queues the chase messages which are not redundant (the caller flushes the queues)
+        void                                QueueChase(const std::vector<TrackMessage>& events);
+        // Internal use: asks the worker for the chase of a track (-1 for all tracks) at the current time; it is
+        // used by the commands which unmute tracks, and the tick sends the messages when they are ready
+        void                                RequestChase(int trk_num);
+        // Internal use: the worker job which computes the requested chase: it replays the events from the
+        // nearest warp position without proc_lock, and puts the messages into chase_ready
+        void                                ComputeChase();
+        // Internal use: does the jobs of the worker
+        virtual void                        DoJobs(unsigned int jobs);
+        // Internal use: puts into chase_sent the indexes of the events which must be sent, skipping the
+        // controllers, programs and pitch bends which the ports already have (see MIDIOutDriver::IsRedundant())
+        void                                FilterChase(const std::vector<TrackMessage>& events);
+        // Internal use: returns the indexes of the events of the track which the chase sends as they are
+        // (sysex, and program, pitch bend and controllers of tracks with mixed channels); the index is rebuilt
+        // if the track was edited
+        const std::vector<unsigned int>&    GetChaseIndex(unsigned int trk_num);
+        // Internal use: posts a parameter change to the tick if the sequencer is playing, otherwise executes it
+        void                                PostCommand(int type, unsigned int trk_num, int value);
+        // Internal use: puts a command into the command ring; returns false if the ring is full
+        bool                                PushCommand(int type, unsigned int trk_num, int value);
+        // Internal use: executes all the posted commands (must be called with proc_lock held)
+        void                                ExecCommands();
+        // Internal use: executes a parameter change (must be called with proc_lock held); returns true if a
+        // track processor was changed, so the render list and the loop state must be rebuilt. It only changes
+        // the processors and sends the note offs: the heavier work is requested to the worker
+        bool                                ExecCommand(int type, unsigned int trk_num, int value);
+        // Internal use: returns the track whose processor is changed by a command, or -1 if it can change all
+        static int                          CommandTrack(int type, unsigned int trk_num)
+                                                { return (type == CMD_SOLO || type == CMD_UNSOLO ||
+                                                          type == CMD_UNMUTE_ALL) ? -1 : (int)trk_num; }
+
+        static const unsigned short         RENDER_BEAT = 0xffff;
+        // A slot of the command ring. seq tells the slot state, as in the MIDILog ring (see log.cpp)
+        struct CommandSlot {
+            std::atomic<unsigned long>  seq;
+            int                         type;
+            unsigned int                track;
+            int                         value;
+        };
+        // The commands posted by the parameter setters
+        enum { CMD_SOLO, CMD_UNSOLO, CMD_MUTE, CMD_UNMUTE_ALL, CMD_VELOCITY_SCALE, CMD_RECHANNELIZE,
+               CMD_TRANSPOSE, CMD_TEMPO_SCALE };
+        static const unsigned int           CMD_RING_SIZE = 64;
+
         // The interval between measures in ExtractWarpPositions()
         static const int                    MEASURES_PER_WARP = 4;
         MIDIThru*                           thru;               // The embedded MIDI thru
@@ -309,6 +479,28 @@ class AdvancedSequencer : public MIDISequencer {
         int                                 file_loaded;        // True if the multitrack is not empty
 
         std::vector<MIDISequencerState>     warp_positions;     // Vector of MIDISequencerState objects for fast time moving
+
+        bool                                render_mode;        // True if playing from the render list
+        bool                                render_valid;       // False if a track processor was changed
+        unsigned long                       render_gen;         // Incremented when a track processor is changed
+        std::vector<char>                   render_changed;     // The tracks changed after the list was built
+        std::vector<RenderEvent>            render_list;        // The compiled events
+        std::vector<MIDITimedMessage>       render_sysex;       // The sysex messages of the render list
+        std::vector<RenderTrackId>          render_ids;         // The track parameters when the list was built
+        unsigned int                        render_pos;         // The next event to send
+        bool                                render_state_stale; // True if the state is behind the render list
+
+        std::vector<TrackMessage>           chase_events;       // The messages sent by CatchEventsBefore()
+        std::vector<unsigned int>           chase_sent;         // The chase messages not redundant
+        std::vector<ChaseIndex>             chase_index;        // The chase index of every track
+        std::vector<ChaseIndex>             loop_index;         // The chase indexes used by ComputeLoop()
+        int                                 chase_trk;          // The track to chase (-1 all, -2 none)
+        std::vector<TrackMessage>           chase_ready;        // The chase computed by the worker, sent by the tick
+        std::vector<ChaseIndex>             worker_index;       // The chase indexes used by ComputeChase()
+
+        CommandSlot                         cmd_ring[CMD_RING_SIZE];// The parameter changes posted while playing
+        std::atomic<unsigned long>          cmd_in_pos;         // The next slot to write
+        unsigned long                       cmd_out_pos;        // The next slot to read (protected by proc_lock)
         /// \endcond
 
     private:
@@ -40,8 +40,13 @@
 
 #include <vector>
 #include <string>
+#include <queue>
 #include <mutex>
-//#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <atomic>
+#include <cstdint>
 
 
 // TODO: implements RtMidi functions (error callback, selection of input, etc.)
@@ -50,15 +55,6 @@
 /// \addtogroup GLOBALS
 ///@{
 
-/// This item only affects AllNotesOff() function. All modern MIDI devices should respond to all notes off
-/// messages so usually there is no need to stop notes sending Note off messages.
-/// If you set this to 1 the driver will keep track of all sounding notes and, if the AllNotesOff() method is
-/// called, will send a Note Off message for each one, plus a damper off message for every channel. This is
-/// quite expensive, so turn this on only if you experience notes sounding when you stop a sequencer.
-#define DRIVER_USES_MIDIMATRIX 0
-#if DRIVER_USES_MIDIMATRIX
-   #include "matrix.h"
-#endif // DRIVER_USES_MIDIMATRIX
 ///@}
 
 
@@ -68,12 +64,14 @@
 /// The MIDIInDriver keeps an internal queue of MIDIRawMessage arrived from its hardware MIDI in port, and
 /// you can get them by its methods.
 struct MIDIRawMessage {
-                                        MIDIRawMessage() : timestamp(0), port(0) {}
-                                        /// The constructor.
-                                        MIDIRawMessage(const MIDIMessage& m, tMsecs t, int p) :
-                                                        msg(m), timestamp(t), port(p) {}
+                                        MIDIRawMessage() : timestamp(0), timestamp_us(0), port(0) {}
+                                        /// The constructor. If _t_us_ is 0 the time in usecs is given by _t_.
+                                        MIDIRawMessage(const MIDIMessage& m, tMsecs t, int p, tUsecs t_us = 0) :
+                                                        msg(m), timestamp(t), timestamp_us(t_us ? t_us : t * 1000),
+                                                        port(p) {}
         MIDIMessage                     msg;        ///< The MIDI Message received from the port
         tMsecs                          timestamp;  ///< The absolute time in msecs
+        tUsecs                          timestamp_us;   ///< The absolute time in usecs (see MIDIInDriver::HardwareMsgIn())
         int                             port;       ///< The id of the MIDI in port which received the message
 };
 
@@ -145,12 +143,37 @@ class MIDIOutDriver {
         ///   doesn't own its processor).
         virtual void            Reset();
 
-        /// Returns the id number of the hardware out port
+        /// Returns the id number of the out port (its index in the MIDIManager out ports, which never changes).
         int                     GetPortId() const               { return port_id; }
         /// Returns the name of the hardware out port.
-        std::string             GetPortName()                   { return port->getPortName(port_id); }
+        virtual std::string     GetPortName()                   { return port_name; }
         /// Returns **true** is the hardware port is open.
-        bool                    IsPortOpen() const              { return port->isPortOpen(); }
+        virtual bool            IsPortOpen() const              { return port->isPortOpen(); }
+        /// Returns **false** if the hardware port was removed from the system (see MIDIManager::RescanPorts()).
+        bool                    IsPortPresent() const           { return present; }
+        /// Returns **true** if the driver sent a Note On for the given note and channel, and not yet its
+        /// Note Off. See also \ref NUMBERING.
+        bool                    IsNoteOn(int chan, int note) const
+                                    { return (note_bits[chan][note >> 5] >> (note & 31)) & 1; }
+        /// Returns the number of the sounding notes on the port (or on the given channel).
+        unsigned int            GetNumNotesOn(int chan = -1) const;
+        /// Returns the value of the given controller last sent to the port on the given channel, or -1 if it
+        /// is unknown (it was not sent since the port was open, or a SysEx or a Reset All Controllers was sent
+        /// after it). See also \ref NUMBERING.
+        int                     GetLastControl(int chan, int num) const { return last_control[chan][num]; }
+        /// Returns the program last sent to the port on the given channel, or -1 if it is unknown.
+        int                     GetLastProgram(int chan) const  { return last_program[chan]; }
+        /// Returns the pitch bend value (0 ... 16383, 8192 is the center) last sent to the port on the given
+        /// channel, or -1 if it is unknown.
+        int                     GetLastPitchBend(int chan) const{ return last_bender[chan]; }
+        /// Returns **true** if the message is a control change, a program change or a pitch bend which doesn't
+        /// change the value last sent to the port on its channel, so sending it is useless. The sequencer uses
+        /// this for not sending again the values the port already has when it chases controllers. It always
+        /// returns **false** if the port has an out processor, or if there are messages queued, waiting for
+        /// a SysEx or waiting in the queue of the threaded mode, as their values are not yet sent, and if
+        /// another thread is sending to the port (the check never waits for it). The data entry, increment and
+        /// decrement controllers are never redundant, as their effect depends on the selected (N)RPN.
+        bool                    IsRedundant(const MIDIMessage& msg);
         /// Returns a pointer to the out processor.
         MIDIProcessor*          GetOutProcessor()               { return processor; }
         /// Returns a pointer to the out processor.
@@ -170,9 +193,16 @@ class MIDIOutDriver {
         /// (leaving it open), while it does nothing if the port is already close. If you want to force
         /// the closure call Reset().
         virtual void            ClosePort();
-        /// Turns off all the sounding notes on the port (or on the given MIDI channel). This is normally
-        /// done by sending an All Notes Off message, but you can change this behaviour (see \ref DRIVER_USES_MIDIMATRIX).
-        /// See also \ref NUMBERING.
+        /// If the port is open, closes and reopens it, looking for it by name (its id could be changed). This is
+        /// called by the MIDIManager when a removed port comes back (for example when a cable was replugged).
+        /// \return **true** if the port is closed or was successfully reopened
+        virtual bool            Reconnect();
+        /// Turns off all the sounding notes on the port (or on the given MIDI channel). The driver keeps track
+        /// of the notes and of the pedals (damper and sostenuto) it sent, so this sends a Note Off for the
+        /// notes which are actually sounding and a pedal off for the pedals which are down, all in a single batch.
+        /// An All Notes Off is added only for the channels whose state is unknown, i.e. the port was open or
+        /// reconnected and no All Notes Off was sent since (the device could have notes sent before or by
+        /// another program). The messages queued with QueueMessage() are sent before. See also \ref NUMBERING.
         /// \param chan if you left the default silences all channels, otherwise you can give an unique channel
         /// to turn off
         virtual void            AllNotesOff(int chan = -1);
@@ -181,30 +211,198 @@ class MIDIOutDriver {
         /// is reached.
             // TODO: actually it writes to cerr, Should we raise an exception?
         virtual void            OutputMessage(const MIDITimedMessage& msg);
+        /// Makes a copy of the message, processes it with the out processor and appends its bytes to the
+        /// output batch, without sending it. The batch is sent by FlushQueue(), which acquires the port only once
+        /// for all the messages: this is used by the MIDISequencer, which queues all the messages of a tick and
+        /// then flushes the queues of all ports.
+        virtual void            QueueMessage(const MIDITimedMessage& msg);
+        /// Sends all the queued messages to the hardware port, in the order they were queued. If the port is busy
+        /// waits 1 msec and retries as OutputMessage() does.
+        virtual void            FlushQueue();
+        /// Returns **true** if there are queued messages waiting for FlushQueue().
+        bool                    HasQueuedMessages() const       { return !batch_ends.empty(); }
+        /// Makes a copy of the message, processes it with the out processor and schedules it for sending at the
+        /// given time. Scheduled messages are kept in a time ordered queue and sent by a dedicated high priority
+        /// thread (started at the first call) exactly at their time, regardless of the timer resolution. Messages
+        /// with the same time are sent in the order they were scheduled, and messages with a past time are sent
+        /// immediately.
+        /// \param msg the message
+        /// \param t the sending time in microseconds, in the MIDITimer::GetSysTimeUs() scale
+        virtual void            ScheduleMessage(const MIDITimedMessage& msg, tUsecs t);
+        /// Sends the scheduled messages whose time is already passed and discards the others. This is called
+        /// by AllNotesOff().
+        void                    ClearSchedule();
+        /// Returns the number of scheduled messages not yet sent.
+        unsigned int            GetNumScheduled();
+        /// Returns the transmission rate of SysEx messages, in bytes per second.
+        unsigned int            GetSysExRate() const            { return sysex_rate; }
+        /// Sets the transmission rate of SysEx messages. SysEx messages are not sent by the calling thread, but
+        /// queued and sent by the sender thread (the same of ScheduleMessage()), which waits after every SysEx
+        /// the time needed to transmit it at the given rate, so that a slow hardware interface is not flooded.
+        /// Channel voice messages, channel mode messages and real time messages are sent immediately, also while
+        /// SysEx are waiting, so a big dump doesn't delay the notes; this holds also for the pedal controllers
+        /// (damper, sostenuto and soft pedal), which must follow the notes. Other messages (control changes,
+        /// program changes, system common messages) are queued after the pending SysEx, keeping their order.
+        /// \param bytes_per_sec the rate: the default \ref DEFAULT_SYSEX_RATE is the speed of a MIDI 1.0 cable,
+        /// while 0 waits \ref DRIVER_WAIT_AFTER_SYSEX msecs after every SysEx, regardless of its length
+        void                    SetSysExRate(unsigned int bytes_per_sec);
+        /// Returns the number of SysEx (and other messages queued after them) not yet sent.
+        unsigned int            GetNumDeferred() const          { return num_deferred; }
+        /// Returns the latency in msecs of the device connected to the port (see SetDeviceLatency()).
+        unsigned int            GetDeviceLatency() const        { return device_latency; }
+        /// Sets the latency in msecs of the device connected to the port, i.e. the time between the arrival of
+        /// a message and the sound. The driver doesn't use it: a MIDISequencer in look ahead mode schedules the
+        /// messages for the port earlier by this amount, so they sound in time with the other ports at any tempo
+        /// (see MIDISequencer::SetTrackLatency()).
+        void                    SetDeviceLatency(unsigned int msecs)
+                                                                { device_latency = msecs; }
+
+        /// Returns **true** if the driver is in threaded mode (see SetThreadedOutput()).
+        bool                    GetThreadedOutput() const       { return threaded; }
+        /// Sets the threaded mode. In this mode OutputMessage(), QueueMessage() and FlushQueue() don't send
+        /// the messages, but put them into a lock free queue, from which a dedicated thread (the same of
+        /// ScheduleMessage()) takes and sends them to the hardware port. So a port which blocks when sending (for
+        /// example a slow USB interface) doesn't delay the timer thread and the other ports. If the queue is full
+        /// the messages are discarded (see GetOutDropped()). You should not call this while sending messages.
+        /// \param on **true** for the threaded mode, **false** for sending from the calling thread (the default);
+        /// in this case the messages still in the queue are sent before returning
+        /// \param queue_size the size of the queue (it is ignored if _on_ is **false**): 0 is the default size,
+        /// while sizes lesser than \ref MIN_OUT_QUEUE_SIZE are rounded up to it
+        void                    SetThreadedOutput(bool on, unsigned int queue_size = DEFAULT_OUT_QUEUE_SIZE);
+        /// Returns the number of messages waiting in the queue of the threaded mode.
+        unsigned int            GetOutQueueLength() const       { return ring_in - ring_out; }
+        /// Returns the maximum number of messages which were waiting in the queue of the threaded mode.
+        unsigned int            GetOutQueuePeak() const         { return ring_peak; }
+        /// Returns the number of messages discarded because the queue of the threaded mode was full.
+        unsigned long           GetOutDropped() const           { return ring_dropped; }
+        /// Returns the maximum time (in usecs) the sender thread took for sending a message in the threaded mode.
+        /// A high value means that the hardware port is blocking.
+        tUsecs                  GetMaxSendTime() const          { return max_send_time; }
+        /// Resets the statistics of the threaded mode (GetOutQueuePeak(), GetOutDropped() and GetMaxSendTime()).
+        void                    ResetOutStats();
+
+        /// The default SysEx rate: 31250 baud with 10 bits per byte.
+        static const unsigned int   DEFAULT_SYSEX_RATE = 3125;
+        /// The default size of the queue of the threaded mode.
+        static const unsigned int   DEFAULT_OUT_QUEUE_SIZE = 1024;
+        /// The minimum size of the queue of the threaded mode.
+        static const unsigned int   MIN_OUT_QUEUE_SIZE = 2;
 
     protected:
+        /// This constructor is used by subclasses which don't send messages to an RtMidi port (see
+        /// MIDILoopbackOutDriver). The driver owns _p_, which can be 0: in this case the subclass must
+        /// redefine all the methods which use the port.
+                                MIDIOutDriver(int id, RtMidiOut* p);
         /// The maximum number of retries the method OutputMessage() will try before hanging (and skipping a message).
         static const int        DRIVER_MAX_RETRIES = 100;
-        /// The number of milliseconds the driver waits after sending a MIDI system exclusive message.
+        /// The number of milliseconds the driver waits after sending a MIDI system exclusive message when
+        /// the SysEx rate is 0 (see SetSysExRate()).
         static const int        DRIVER_WAIT_AFTER_SYSEX = 20;
         /// Sends the message to the hardware MIDI port using the RtMidi library functions.
         virtual void            HardwareMsgOut(const MIDIMessage &msg);
+        /// Updates the note and pedal state with a message which is being sent to the port. Every override of
+        /// HardwareMsgOut() and HardwareBatchOut() must call this for the channel messages it sends.
+        void                    TrackMessage(unsigned char status, unsigned char byte1, unsigned char byte2);
+        /// Clears the note and pedal state and the last sent values (when the port is open or reset) and marks
+        /// all the channels as unknown, so the next AllNotesOff() sends them an All Notes Off. The caller must
+        /// hold the port lock.
+        void                    ResetNoteState();
+        /// Forgets the last sent controller, program and pitch bend values (for example when a SysEx, which
+        /// could change them, is sent). The caller must hold the port lock.
+        void                    ResetLastValues();
+        /// Sends a batch of messages to the hardware MIDI port. _bytes_ contains the raw bytes of all the
+        /// messages, and _ends_ the end of every message in _bytes_.
+        virtual void            HardwareBatchOut(const std::vector<unsigned char>& bytes,
+                                                 const std::vector<unsigned int>& ends);
+
+        /// If the message is a SysEx, or it must wait for the pending SysEx, queues it for the sender thread
+        /// and returns **true**; otherwise returns **false** and the caller must send it.
+        bool                    DeferMessage(const MIDIMessage& msg);
+        /// Returns **true** if a message with the given status and first data byte must never wait for a SysEx.
+        static bool             IsTimingCritical(unsigned char status, unsigned char byte1);
+        /// The procedure of the thread which sends scheduled messages and SysEx.
+        void                    SenderProc();
+        /// Starts the sender thread, if it is not running. The caller must hold the schedule lock.
+        void                    StartSender();
+        /// Stops the sender thread, if it is running.
+        void                    StopSender();
+        /// Puts a message into the queue of the threaded mode, returning **false** if the queue is full.
+        bool                    RingPush(const MIDIMessage& msg);
+        /// Gets the first message of the queue of the threaded mode, returning **false** if the queue is empty.
+        bool                    RingPop(MIDIMessage& msg);
+        /// Sends all the messages in the queue of the threaded mode. The caller must hold the port lock.
+        void                    SendRing();
+        /// Wakes up the sender thread if it is waiting.
+        void                    WakeSender();
 
        /// \cond EXCLUDED
+        // A scheduled message. The operator < is reversed, so the std::priority_queue gives the first message
+        struct SchedMessage {
+            SchedMessage(const MIDIMessage& m, tUsecs t, unsigned long n) : msg(m), time(t), seq(n) {}
+            bool operator< (const SchedMessage& m) const
+                            { return time > m.time || (time == m.time && seq > m.seq); }
+            MIDIMessage     msg;
+            tUsecs          time;
+            unsigned long   seq;            // keeps the order of messages with the same time
+        };
+
+        friend class MIDIManager;
+
         MIDIProcessor*          processor;  // The out processor
         RtMidiOut*              port;       // The hardware port
         const int               port_id;    // The id of the port
+        int                     rtmidi_index;   // The RtMidi number of the port (it can change if ports are
+                                                // added or removed, -1 if unknown)
+        std::string             port_name;  // The name of the port
+        std::atomic<bool>       present;    // False if the port was removed from the system
         int                     num_open;   // Counts the number of OpenPort() calls
         std::recursive_mutex    out_mutex;  // Used internally for thread safe operating
-
-#if DRIVER_USES_MIDIMATRIX
-        MIDIMatrix              out_matrix; // To keep track of notes on going to MIDI out
-#endif // DRIVER_USES_MIDIMATRIX
+        std::vector<unsigned char>  batch_bytes;    // The bytes of the queued messages
+        std::vector<unsigned int>   batch_ends;     // The end of every queued message in batch_bytes
+        std::mutex              batch_mutex;    // Protects the batch
+        std::priority_queue<SchedMessage> sched_queue;  // The scheduled messages
+        unsigned long           sched_count;    // Counts the scheduled messages
+        std::mutex              sched_mutex;    // Protects the schedule
+        std::condition_variable sched_cond;     // Wakes up the sender thread
+        std::thread             sender_thread;  // The thread which sends scheduled messages
+        bool                    sender_exit;    // Tells the sender thread to exit
+        std::vector<MIDIMessage>    sender_due; // The messages the sender thread is sending
+        std::deque<MIDIMessage> sysex_queue;    // The SysEx (and the messages waiting for them)
+        std::atomic<unsigned int>   num_deferred;   // The size of sysex_queue, for a lock free check
+        std::vector<MIDIMessage>    sender_deferred;// The deferred messages the sender thread is sending
+        unsigned int            sysex_rate;     // The SysEx rate in bytes per second
+        std::atomic<unsigned int>   device_latency; // The latency of the device in msecs
+        tUsecs                  sysex_next_time;// The time the next SysEx can be sent
+
+        // A slot of the queue of the threaded mode. seq tells the slot state as in MIDILog
+        struct RingSlot {
+            std::atomic<unsigned long>  seq;
+            MIDIMessage                 msg;
+        };
+        std::atomic<bool>       threaded;       // True in threaded mode
+        RingSlot*               ring;           // The queue of the threaded mode
+        unsigned int            ring_size;      // The size of the queue
+        std::atomic<unsigned long>  ring_in;    // The next slot to write
+        std::atomic<unsigned long>  ring_out;   // The next slot to read
+        std::atomic<unsigned int>   ring_peak;  // The maximum number of queued messages
+        std::atomic<unsigned long>  ring_dropped;   // The number of discarded messages
+        std::atomic<tUsecs>     max_send_time;  // The maximum time for sending a message
+        std::atomic<bool>       sender_waiting; // True if the sender thread is waiting
+
+        uint32_t                note_bits[16][4];   // The sounding notes (a bit for every note)
+        uint16_t                damper_bits;    // The channels with the damper pedal down
+        uint16_t                sostenuto_bits; // The channels with the sostenuto pedal down
+        uint16_t                unknown_bits;   // The channels which had no All Notes Off since the port was open
+        signed char             last_control[16][128];  // The last sent controller values (-1 = unknown)
+        signed char             last_program[16];   // The last sent programs (-1 = unknown)
+        short                   last_bender[16];    // The last sent pitch bend values (-1 = unknown)
+        std::vector<unsigned char>  panic_bytes;    // The batch built by AllNotesOff()
+        std::vector<unsigned int>   panic_ends;
         /// \endcond
 
     private:
-        // this vector is used by HardwareMsgOut to feed the port
-        std::vector<unsigned char>      msg_bytes;
+        // appends the raw bytes of the message to the vector (nothing for meta events)
+        static void             PutMsgBytes(const MIDIMessage& msg, std::vector<unsigned char>& bytes);
 };
 
 
@@ -214,7 +412,7 @@ class MIDIOutDriver {
 /// Receives MIDI messages from an hardware MIDI in port.
 /// Every MIDI in port is denoted by a specific id number, enumerated by the RtMidi class, and by a
 /// name, given by the OS; this class communicates between the hardware ports and the other library
-/// classes. The incoming MIDI messages are stamped with the system time in milliseconds and the
+/// classes. The incoming MIDI messages are stamped with their arrival time (in milliseconds and microseconds) and the
 /// port number (see the MIDIRawMessage struct and HardwareMsgIn() for details) and put in an internal
 /// queue; you can get them with the InputMessage() and ReadMessage() methods. Moreover you can set a
 /// MIDIProcessor for processing them as they arrive.
@@ -241,12 +439,14 @@ class MIDIInDriver {
         ///   doesn't own its processor).
         virtual void            Reset();
 
-        /// Returns the id number of the hardware in port.
+        /// Returns the id number of the in port (its index in the MIDIManager in ports, which never changes).
         int                     GetPortId() const               { return port_id; }
         /// Returns the name of the hardware in port.
-        std::string             GetPortName()                   { return port->getPortName(port_id); }
+        virtual std::string     GetPortName()                   { return port_name; }
         /// Returns **true** is the hardware port is open.
-        bool                    IsPortOpen() const              { return port->isPortOpen(); }
+        virtual bool            IsPortOpen() const              { return port->isPortOpen(); }
+        /// Returns **false** if the hardware port was removed from the system (see MIDIManager::RescanPorts()).
+        bool                    IsPortPresent() const           { return present; }
         /// Returns **true** if the queue is non-empty.
         bool                    CanGet() const                  { return in_queue.GetLength() > 0; }
         /// Returns the queue size.
@@ -273,6 +473,10 @@ class MIDIInDriver {
         /// (leaving it open), while it does nothing if the port is already close. If you want to force
         /// the closure call Reset().
         virtual void            ClosePort();
+        /// If the port is open, closes and reopens it, looking for it by name (its id could be changed). This is
+        /// called by the MIDIManager when a removed port comes back (for example when a cable was replugged).
+        /// \return **true** if the port is closed or was successfully reopened
+        virtual bool            Reconnect();
         /// Locks the queue so it cannot be written by other threads (such as the RtMidi callback). You
         /// can then safely inspect and get its data, unlocking it when you have finished and want to get
         /// new messages.
@@ -299,21 +503,46 @@ protected:
         /// This is the callback function executed by RtMidi when a message arrives to the hardware port.
         /// It converts raw data taken from the port into a MIDIRawMessage (eventually processing it with
         /// the processor) and pushes it on the internal queue. You must not call it directly.
+        ///
+        /// The message is not stamped with the time the callback runs, but with its arrival time rebuilt
+        /// from the delta times given by RtMidi (which come from the OS MIDI layer), so messages coming in a
+        /// burst keep their real distance. The rebuilt time is anchored to the system time at the first
+        /// message after OpenPort(), and again whenever it goes ahead of the system time or behind it by more
+        /// than \ref DRIVER_MAX_IN_DRIFT usecs.
         static void             HardwareMsgIn(double time,
                                               std::vector<unsigned char>* msg_bytes,
                                               void* p);
+        /// Processes the message with the in processor and puts it into the queue, stamped with the given time
+        /// (in the MIDITimer::GetSysTimeUs() scale). The caller must have locked the queue.
+        void                    PutInQueue(MIDITimedMessage& msg, tUsecs t);
+        /// This constructor is used by subclasses which don't receive messages from an RtMidi port (see
+        /// MIDILoopbackInDriver). The driver owns _p_, which can be 0: in this case the subclass must
+        /// redefine all the methods which use the port.
+                                MIDIInDriver(int id, RtMidiIn* p, unsigned int queue_size);
+
+        /// The maximum difference (in usecs) between the rebuilt arrival time of a message and the system
+        /// time before the driver anchors the timestamps again to the system time.
+        static const tUsecs     DRIVER_MAX_IN_DRIFT = 20000;
 
         /// \cond EXCLUDED
         // This is the default queue size.
         static const unsigned int       DEFAULT_QUEUE_SIZE = 256;
 
+        friend class MIDIManager;
+
         MIDIProcessor*          processor;      // The in processor
         RtMidiIn*               port;           // The hardware port
         const int               port_id;        // The id of the port
+        int                     rtmidi_index;   // The RtMidi number of the port (it can change if ports are
+                                                // added or removed, -1 if unknown)
+        std::string             port_name;      // The name of the port
+        std::atomic<bool>       present;        // False if the port was removed from the system
         int                     num_open;       // Counts the number of OpenPort() calls
 
         MIDIRawMessageQueue     in_queue;       // The incoming message queue (see MIDIRawMessage)
         std::recursive_mutex    in_mutex;       // Locks/unlocks the queue
+        tUsecs                  in_last_time;   // The rebuilt time of the last incoming message
+        bool                    in_time_valid;  // False if in_last_time must be anchored again
         /// \endcond
 };
 
@@ -0,0 +1,144 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/// \file
+/// Contains the definition of the class MIDIFileCache, used for saving and loading pre-parsed MIDI files.
+
+
+#ifndef _NICMIDI_FILECACHE_H
+#define _NICMIDI_FILECACHE_H
+
+#include "multitrack.h"
+#include "fileread.h"           // for MIDIFileHeader
+#include "sequencer.h"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+
+///
+/// A tempo change in the tempo map of a MIDIFileCache. The values are computed as the MIDISequencer does for its
+/// own tempo map, so AdvancedSequencer::LoadCached() can use them directly.
+///
+struct MIDICacheTempo {
+    MIDIClockTime   clock;          ///< The time of the tempo change in MIDI ticks
+    double          time_ms;        ///< The time of the tempo change in msecs (with no tempo scaling)
+    double          ms_per_clock;   ///< The msecs per MIDI tick from this tempo change (with no tempo scaling)
+};
+
+
+///
+/// Saves and loads a MIDIMultiTrack, together with the data an AdvancedSequencer computes when it loads a file,
+/// in a compact binary format. The cache file contains:
+/// - the header of the original MIDI file, its size and modification time (used to detect a stale cache)
+/// - the track table and all the events, as fixed size records
+/// - a payload pool with the data of SysEx and meta events
+/// - the tempo map
+/// - the warp snapshots (the sequencer states the AdvancedSequencer uses for jumping from a time to another)
+///
+/// All the sections are aligned and made of fixed size records in the machine byte order, so the file can be
+/// mapped into memory as is: on Linux and macOS Load() maps the file with mmap(), elsewhere it reads it in a single
+/// call. Loading only requires the validation of the header and the section bounds and a single pass which copies
+/// the records into the multitrack (the SysEx and meta data are copied as blocks), with no MIDI parsing or sorting.
+/// The AdvancedSequencer::LoadCached() method uses this class and falls back to the MIDI file when the cache is
+/// missing or stale.
+///
+class MIDIFileCache {
+    public:
+        /// The constructor creates an empty object.
+                                MIDIFileCache();
+        /// The destructor unmaps the file, if it was loaded.
+        virtual                 ~MIDIFileCache();
+        /// Frees the loaded file and empties the object.
+        void                    Clear();
+
+        /// Loads a cache file, checking its version and its consistency.
+        /// \param cache_name the name of the cache file
+        /// \param src_name the name of the original MIDI file: if it is given the method fails if the MIDI
+        /// file was modified after the cache was written
+        /// \return **true** if the cache is valid
+        bool                    Load(const char* cache_name, const char* src_name = 0);
+        /// Returns **true** if a cache file was successfully loaded.
+        bool                    IsLoaded() const                    { return data != 0; }
+        /// Returns the header of the original MIDI file.
+        const MIDIFileHeader&   GetHeader() const                   { return header; }
+        /// Returns the number of measures stored in the cache.
+        unsigned int            GetNumMeasures() const              { return num_measures; }
+        /// Returns the tempo map (all the tempo changes in temporal order). The first element is always at
+        /// time 0.
+        const std::vector<MIDICacheTempo>& GetTempoMap() const      { return tempo_map; }
+        /// Copies the events of the loaded cache into the given multitrack, which is resized accordingly.
+        bool                    GetMultiTrack(MIDIMultiTrack* tracks) const;
+        /// Rebuilds the warp snapshots stored in the cache.
+        /// \param warps the vector which will hold the snapshots (its old content is erased)
+        /// \param model a state of the sequencer the snapshots are for. Its multitrack must already
+        /// contain the events of the cache (see GetMultiTrack()) and its notifier will be copied into the snapshots
+        /// \return **false** if the cache has no snapshots, or they don't fit the multitrack or the tempo scale of
+        /// the model
+        bool                    GetWarpPositions(std::vector<MIDISequencerState>* warps,
+                                                 const MIDISequencerState& model) const;
+
+        /// Writes a cache file.
+        /// \param cache_name the name of the cache file
+        /// \param tracks the multitrack to be saved
+        /// \param head the header of the MIDI file the multitrack was loaded from; the file named by its
+        /// _filename_ field is examined for its size and modification time
+        /// \param warps the warp snapshots (can be 0)
+        /// \param num_meas the number of measures (as returned by AdvancedSequencer::GetNumMeasures())
+        /// \return **true** if the file was successfully written
+        static bool             Save(const char* cache_name, const MIDIMultiTrack* tracks, const MIDIFileHeader& head,
+                                     const std::vector<MIDISequencerState>* warps = 0, unsigned int num_meas = 0);
+
+        /// The version of the cache format. Cache files with a different version are considered stale, as are
+        /// those written by a build where the classes saved in the snapshots have a different layout.
+        static const uint32_t   CACHE_VERSION = 2;
+
+    protected:
+        /// \cond EXCLUDED
+        struct FileHeader;
+        struct TrackRecord;
+        struct EventRecord;
+        struct TempoRecord;
+
+        static bool             GetFileStat(const char* fname, uint64_t* size, int64_t* mtime);
+        static uint32_t         GetLayoutHash();
+        static void             MakeTempoMap(const MIDIMultiTrack* tracks, std::vector<MIDICacheTempo>* tmap);
+        static void             PutState(std::vector<unsigned char>& buf, const MIDISequencerState& s);
+        static bool             GetState(const unsigned char*& p, const unsigned char* end, MIDISequencerState& s);
+        bool                    Validate();
+
+        const unsigned char*    data;           // the loaded (or mapped) file
+        uint64_t                data_size;      // the size of the file
+        bool                    mapped;         // true if data was mapped with mmap()
+        std::vector<unsigned char>  buffer;     // the file content, if it was not mapped
+        MIDIFileHeader          header;         // the original MIDI file header
+        unsigned int            num_measures;   // the number of measures
+        std::vector<MIDICacheTempo> tempo_map;  // the tempo map
+        /// \endcond
+};
+
+
+#endif
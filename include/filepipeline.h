@@ -0,0 +1,204 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/// \file
+/// Contains the definition of the class MIDIFilePipeline, which converts many MIDI files at once using
+/// a pool of threads, and of the struct MIDIPipelineStats.
+
+
+#ifndef _NICMIDI_FILEPIPELINE_H
+#define _NICMIDI_FILEPIPELINE_H
+
+#include "filereadmultitrack.h"
+#include "filewritemultitrack.h"
+#include "processor.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+
+///
+/// A structure holding the statistics of a MIDIFilePipeline run. You can get it with
+/// MIDIFilePipeline::GetStats() after MIDIFilePipeline::Run() returned.
+///
+struct MIDIPipelineStats {
+    MIDIPipelineStats() : files_ok(0), files_failed(0), bytes_read(0), bytes_written(0), bytes_saved(0),
+                          events(0), steals(0), budget_waits(0), elapsed_ms(0) {}
+    /// Returns the number of converted files per second.
+    double                  GetFilesPerSec() const;
+    /// Returns the number of read bytes per second.
+    double                  GetBytesPerSec() const;
+    unsigned int            files_ok;       ///< The number of files successfully converted
+    unsigned int            files_failed;   ///< The number of files which could not be read or written
+    unsigned long long      bytes_read;     ///< The total size of the source files
+    unsigned long long      bytes_written;  ///< The total size of the converted files
+    long long               bytes_saved;    ///< The total bytes saved by the size optimizing mode (see
+                                            ///< MIDIFilePipeline::SetOptimizeSize())
+    unsigned long long      events;         ///< The total number of events written
+    unsigned int            steals;         ///< How many times a thread took a file from the queue of another thread
+    unsigned int            budget_waits;   ///< How many times a thread waited for memory to be released
+    unsigned long           elapsed_ms;     ///< The wall clock duration of the run, in msecs
+};
+
+
+///
+/// Converts a list of MIDI files, running the read, process and write stages concurrently on a pool of
+/// threads. Every file is loaded into a MIDIMultiTrack (SMF 0 files are split into 17 tracks as in
+/// LoadMIDIFile()), all its channel events are passed through an optional MIDIProcessor and an optional
+/// quantizer, and then the result is saved with WriteMIDIFile() in the given format (normalizing to format 1
+/// by default).
+///
+/// Files are initially dealt to the threads in a round robin fashion; when a thread empties its queue it
+/// steals files from the others, so that a bunch of big files doesn't leave the other threads idle. Before
+/// loading a file a thread reserves an estimate of the memory it will need: if the total reserved memory would
+/// exceed the memory budget the thread waits until other files are done (a file bigger than the whole budget
+/// is converted when no other file is in memory).
+///
+/// Example:
+/// \code
+/// MIDIProcessorTransposer trans;
+/// trans.SetAllTranspose(2);
+/// MIDIFilePipeline pipe;
+/// pipe.SetProcessor(&trans);
+/// pipe.SetQuantize(4);                // quantize to 1/16
+/// pipe.AddFile("song1.mid", "out/song1.mid");
+/// pipe.AddFile("song2.mid", "out/song2.mid");
+/// pipe.Run();
+/// pipe.PrintStats();
+/// \endcode
+///
+class MIDIFilePipeline {
+    public:
+        /// The constructor.
+        /// \param num_threads the number of worker threads; if you leave 0 it is given by
+        /// std::thread::hardware_concurrency()
+        /// \param mem_budget the maximum amount of memory (in bytes) which can be used at the same time
+        /// by the loaded files
+                                MIDIFilePipeline(unsigned int num_threads = 0,
+                                                 unsigned long mem_budget = DEFAULT_MEM_BUDGET);
+        /// The destructor. The processor is not owned by the class.
+        virtual                 ~MIDIFilePipeline() {}
+        /// Empties the file list and resets the statistics. It doesn't change the other parameters.
+        void                    Reset();
+        /// Returns the number of files in the list.
+        unsigned int            GetNumFiles() const                 { return jobs.size(); }
+        /// Returns the number of worker threads.
+        unsigned int            GetNumThreads() const               { return num_threads; }
+        /// Returns the memory budget in bytes.
+        unsigned long           GetMemBudget() const                { return mem_budget; }
+        /// Returns the format of the converted files.
+        int                     GetFormat() const                   { return format; }
+        /// Returns **true** if empty tracks are stripped from the converted files.
+        bool                    GetStripEmpty() const               { return strip; }
+        /// Returns **true** if the converted files are written in the size optimizing mode.
+        bool                    GetOptimizeSize() const             { return optimize; }
+        /// Returns the quantize subdivision of the beat (0 means no quantize).
+        unsigned int            GetQuantize() const                 { return quantize; }
+        /// Returns a reference to the statistics of the last run.
+        const MIDIPipelineStats& GetStats() const                   { return stats; }
+        /// Returns **true** if the conversion of the given file was successful. The value is meaningful only
+        /// after Run() returned.
+        bool                    GetFileResult(unsigned int n) const { return jobs[n].ok; }
+        /// Appends a file to the conversion list.
+        /// \param in_name the name of the source MIDI file
+        /// \param out_name the name of the converted file (it can be the same of _in_name_)
+        void                    AddFile(const std::string& in_name, const std::string& out_name);
+        /// Sets the number of worker threads (0 means std::thread::hardware_concurrency()). You cannot call
+        /// this while Run() is executing.
+        void                    SetNumThreads(unsigned int n);
+        /// Sets the memory budget in bytes. You cannot call this while Run() is executing.
+        void                    SetMemBudget(unsigned long bytes)   { mem_budget = bytes; }
+        /// Sets the format of the converted files (0 or 1, default 1). See WriteMIDIFile().
+        bool                    SetFormat(int f);
+        /// If this is **true** (the default) empty tracks are stripped from files written in format 1.
+        void                    SetStripEmpty(bool f)               { strip = f; }
+        /// If this is **true** the converted files are written in the size optimizing mode (see
+        /// WriteMIDIFile()). The default is **false**.
+        void                    SetOptimizeSize(bool f)             { optimize = f; }
+        /// Sets a MIDIProcessor which will process every channel event (for example a MIDIProcessorTransposer,
+        /// or a MIDIMultiProcessor for more complex jobs); if the processor returns **false** the event is
+        /// discarded. Its Process() method is called concurrently by all the threads, so it must not change
+        /// its internal state. The processor is not owned by the class; give 0 to remove it.
+        void                    SetProcessor(MIDIProcessor* proc)   { processor = proc; }
+        /// Sets the quantize grid, as a subdivision of the beat (for example 4 means a sixteenth). Note on
+        /// messages are moved to the nearest point of the grid, and their note off messages are moved by the
+        /// same amount, so that the note length is preserved. Give 0 (the default) to disable quantizing.
+        void                    SetQuantize(unsigned int subd)      { quantize = subd; }
+        /// Converts all the files in the list, returning when all the threads have finished.
+        /// \return **true** if all the files were successfully converted.
+        bool                    Run();
+        /// Prints the statistics of the last run to the given stream.
+        void                    PrintStats(std::ostream& os = std::cout) const;
+
+        /// The default memory budget (64 MB).
+        static const unsigned long  DEFAULT_MEM_BUDGET = 64 * 1024 * 1024;
+
+    protected:
+        /// \cond EXCLUDED
+        struct Job {
+            Job(const std::string& in, const std::string& out) :
+                in_name(in), out_name(out), ok(false) {}
+            std::string             in_name;
+            std::string             out_name;
+            bool                    ok;
+        };
+
+        struct WorkerQueue {
+            std::deque<unsigned int>    queue;
+            std::mutex                  lock;
+        };
+
+        void                    WorkerProc(unsigned int n);
+        bool                    GetNextJob(unsigned int n, unsigned int* job);
+        bool                    ConvertFile(Job& job);
+        void                    ProcessTrack(const MIDITrack* src, MIDITrack* dest,
+                                             MIDIClockTime grid, unsigned long long* ev_count);
+        void                    ReserveMem(unsigned long bytes);
+        void                    ReleaseMem(unsigned long bytes);
+
+        std::vector<Job>        jobs;               // the file list
+        unsigned int            num_threads;        // the number of worker threads
+        unsigned long           mem_budget;         // the memory budget
+        int                     format;             // the format of converted files
+        bool                    strip;              // strip empty tracks
+        bool                    optimize;           // write in size optimizing mode
+        unsigned int            quantize;           // the quantize subdivision
+        MIDIProcessor*          processor;          // the processor for channel messages
+
+        std::vector<WorkerQueue*>   worker_queues;  // one queue for every thread
+        unsigned long           mem_used;           // the reserved memory
+        std::mutex              mem_lock;           // protects mem_used
+        std::condition_variable mem_released;       // notifies that memory has been released
+        std::mutex              stats_lock;         // protects stats
+        MIDIPipelineStats       stats;              // the statistics
+        /// \endcond
+};
+
+
+#endif // _NICMIDI_FILEPIPELINE_H
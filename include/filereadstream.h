@@ -0,0 +1,395 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/// \file
+/// Contains the definition and the implementation of the template class MIDIFileStreamReader and of the
+/// ScanMIDIFile() global function, used for reading MIDI files event by event without storing them.
+
+
+#ifndef _NICMIDI_FILEREADSTREAM_H
+#define _NICMIDI_FILEREADSTREAM_H
+
+#include "fileread.h"           // includes "msg.h" and the MIDIFileHeader struct
+
+#include <fstream>
+#include <vector>
+#include <type_traits>
+
+
+///
+/// Reads a MIDI file from a std::istream and calls a user supplied function object for every decoded event,
+/// without building a MIDIMultiTrack. The template parameter _F_ is the type of the function object, which
+/// must be callable as
+/// \code
+/// func(int track, const MIDITimedMessage& msg);
+/// \endcode
+/// where _track_ is the number of the track in the file (SMF 0 files are **not** split into channel tracks, as
+/// LoadMIDIFile() does) and _msg_ is the event, with its time in MIDI ticks from the start of the track. The events
+/// are the same which LoadMIDIFile() would put into the multitrack (channel messages, SysEx, tempo, time and key
+/// signature, text and other known meta events); at the end of every track an end of track event (see
+/// MIDIMessage::IsDataEnd()) is sent with the track end time. The message is only valid during the call.
+///
+/// Since the call is resolved at compile time and the reader only keeps a fixed size buffer for SysEx and meta
+/// data, scanning a file is fast and the memory usage doesn't depend on the file size.
+/// You probably will use the ScanMIDIFile() global function, which creates and uses this class.
+///
+template <class F>
+class MIDIFileStreamReader {
+    public:
+        /// The constructor. Neither the stream nor the function object are owned by the class.
+        /// \param ist the input stream, which must be already open
+        /// \param f the function object which is called for every event
+        /// \param max_msg_len the maximum length of a SysEx or meta event (longer events are truncated)
+                                        MIDIFileStreamReader(std::istream* ist, F& f, unsigned int max_msg_len = 8192) :
+                                            in_buf(ist->rdbuf()), func(f), the_msg(max_msg_len + 1),
+                                            msg_index(0), to_be_read(0), cur_time(0), abort_parse(false) {}
+        /// Reads the file header, returning **false** if it is not a valid MIDI file. Parse() calls this,
+        /// so you need it only if you want to inspect the header before parsing.
+        bool                            ReadHeader();
+        /// Reads the whole file, calling the function object for every event.
+        /// \return **true** if the parsing was successful, **false** if an error occurred (the function
+        /// object could have already been called for some events).
+        bool                            Parse();
+        /// Returns the file header. It is valid only after ReadHeader() or Parse() were called.
+        const MIDIFileHeader&           GetHeader() const       { return header; }
+        /// Returns **true** if an error occurred while reading.
+        bool                            ErrorOccurred() const   { return abort_parse; }
+
+    protected:
+        /// \cond EXCLUDED
+        bool                            ReadMT(unsigned long type, bool skip);
+        void                            ReadTrack(int trk);
+        void                            MetaEvent(int trk, int type);
+        unsigned long                   ReadVariableNum();
+        unsigned long                   Read32Bit();
+        int                             Read16Bit();
+        int                             EGetC();
+        void                            MsgAdd(int c)           { if (msg_index < the_msg.size() - 1)
+                                                                    the_msg[msg_index++] = (unsigned char)c; }
+
+        std::streambuf*                 in_buf;         // the stream buffer we read from
+        F&                              func;           // the function object
+        MIDIFileHeader                  header;         // the file header
+        std::vector<unsigned char>      the_msg;        // buffer for SysEx and meta events
+        unsigned int                    msg_index;      // the buffer length
+        unsigned long                   to_be_read;     // remaining bytes in the chunk
+        MIDIClockTime                   cur_time;       // current time in the track
+        MIDITimedMessage                msg;            // the message sent to func
+        bool                            abort_parse;    // error flag
+
+        static const unsigned long      _MThd = ('M')*0x1000000 + ('T')*0x10000 + ('h')*0x100 + ('d');
+        static const unsigned long      _MTrk = ('M')*0x1000000 + ('T')*0x10000 + ('r')*0x100 + ('k');
+        /// \endcond
+};
+
+
+/// \addtogroup GLOBALS
+///@{
+
+/// \name Functions for Loading MIDI files
+///@{
+
+/// Reads a MIDI file and calls the given function object for every event, without loading the file into memory.
+/// This is the fastest way to analyze a file. Example:
+/// \code
+/// unsigned int notes = 0;
+/// ScanMIDIFile("song.mid", [&notes](int trk, const MIDITimedMessage& msg) { if (msg.IsNoteOn()) notes++; });
+/// \endcode
+/// \param[in] filename the name of the file
+/// \param[in] func a function object callable as `func(int track, const MIDITimedMessage& msg)`. See MIDIFileStreamReader.
+/// \param[out] head if you give the address of a MIDIFileHeader object this will be filled with the file parameters
+/// \return **true** if the file was successfully read, otherwise **false**.
+template <class F>
+bool                                    ScanMIDIFile(const char* filename, F&& func, MIDIFileHeader* const head = 0) {
+    std::ifstream read_stream (filename, std::ios::in | std::ios::binary);
+    if (read_stream.fail())
+        return false;
+    MIDIFileStreamReader<typename std::remove_reference<F>::type> reader(&read_stream, func);
+    bool ret = reader.Parse();
+    if (ret && head) {
+        *head = reader.GetHeader();
+        head->filename = filename;
+    }
+    return ret;
+}
+
+/// Reads a MIDI file and calls the given function object for every event.
+/// \see ScanMIDIFile(const char*, F&&, MIDIFileHeader* const).
+template <class F>
+bool                                    ScanMIDIFile(const std::string& filename, F&& func, MIDIFileHeader* const head = 0) {
+    return ScanMIDIFile(filename.c_str(), std::forward<F>(func), head);
+}
+///@}
+///@}
+
+
+/// \cond EXCLUDED
+
+template <class F>
+bool MIDIFileStreamReader<F>::ReadHeader() {
+    if (!ReadMT(_MThd, true))
+        return false;
+    to_be_read = Read32Bit();
+    header.format = Read16Bit();
+    header.ntrks = Read16Bit();
+    header.division = Read16Bit();
+    while (to_be_read > 0 && !abort_parse)
+        EGetC();
+    return !abort_parse;
+}
+
+
+template <class F>
+bool MIDIFileStreamReader<F>::Parse() {
+    if (!ReadHeader() || header.ntrks <= 0)
+        return false;
+    for (int trk = 0; trk < header.ntrks; trk++) {
+        ReadTrack(trk);
+        if (abort_parse)
+            return false;
+    }
+    return true;
+}
+
+
+template <class F>
+bool MIDIFileStreamReader<F>::ReadMT(unsigned long type, bool skip) {
+    unsigned long read = Read32Bit();
+    if (read == type)
+        return true;
+    if (skip) {
+        while (!abort_parse) {
+            read = (read << 8) | EGetC();
+            if ((read & 0xffffffff) == type)
+                return true;
+        }
+    }
+    abort_parse = true;
+    return false;
+}
+
+
+// This follows MIDIFileReader::ReadTrack(), sending the messages directly to the function object.
+// As in MIDIFileReader, SysEx packets are never merged and 0xf7 (arbitrary) events are ignored
+template <class F>
+void MIDIFileStreamReader<F>::ReadTrack(int trk) {
+    static const char chantype[] = {
+        0, 0, 0, 0, 0, 0, 0, 0,         // 0x00 through 0x70
+        2, 2, 2, 2, 1, 1, 2, 0          // 0x80 through 0xf0
+    };
+
+    unsigned long lookfor, lng;
+    int c, c1, type;
+    bool running;                       // true when running status used
+    int status = 0;                     // (possible running) status byte
+    int needed;
+
+    if (!ReadMT(_MTrk, false))
+        return;
+
+    to_be_read = Read32Bit();
+    cur_time = 0;
+
+    while (to_be_read > 0 && !abort_parse) {
+        cur_time += ReadVariableNum();
+        c = EGetC();
+        if (abort_parse)
+            break;
+        if ((c & 0x80) == 0) {
+            if (status == 0) {
+                abort_parse = true;     // unexpected running status
+                break;
+            }
+            running = true;
+            needed = chantype[(status >> 4) & 0xf];
+        }
+        else {
+            status = c;
+            running = false;
+            needed = chantype[(status >> 4) & 0xf];
+        }
+
+        if (needed) {                   // ie. is it a channel message?
+            c1 = running ? c : EGetC();
+            msg.Clear();
+            msg.SetStatus((unsigned char)status);
+            msg.SetByte1((unsigned char)c1);
+            msg.SetByte2((unsigned char)(needed > 1 ? EGetC() : 0));
+            msg.SetTime(cur_time);
+            func(trk, static_cast<const MIDITimedMessage&>(msg));
+            continue;
+        }
+
+        switch (c) {
+            case 0xff:                  // meta-event
+                type = EGetC();
+                lng = ReadVariableNum();
+                lookfor = to_be_read - lng;
+                msg_index = 0;
+                while (to_be_read > lookfor && !abort_parse)
+                    MsgAdd(EGetC());
+                MetaEvent(trk, type);
+                break;
+            case 0xf0:                  // start of sys-ex
+                lng = ReadVariableNum();
+                lookfor = to_be_read - lng;
+                msg_index = 0;
+                MsgAdd(0xf0);
+                while (to_be_read > lookfor && !abort_parse)
+                    MsgAdd(EGetC());
+                {
+                    // make a sysex object out of the raw sysex data
+                    MIDISystemExclusive ex(the_msg.data(), msg_index);
+                    msg.SetSysEx(&ex);
+                    msg.SetTime(cur_time);
+                    func(trk, static_cast<const MIDITimedMessage&>(msg));
+                }
+                break;
+            case 0xf7:                  // sysex continuation or arbitrary stuff: ignored
+                lng = ReadVariableNum();
+                lookfor = to_be_read - lng;
+                while (to_be_read > lookfor && !abort_parse)
+                    EGetC();
+                break;
+            default:
+                abort_parse = true;     // unexpected byte
+                break;
+        }
+    }
+}
+
+
+// This converts meta events as MIDIFileReadMultiTrack does
+template <class F>
+void MIDIFileStreamReader<F>::MetaEvent(int trk, int type) {
+    unsigned char* m = the_msg.data();
+    msg.Clear();
+    switch (type) {
+        case META_SEQUENCE_NUMBER:
+            if (msg_index < 2) return;
+            msg.SetMetaEvent(type, m[0], m[1]);
+            break;
+        case META_GENERIC_TEXT:
+        case META_COPYRIGHT:
+        case META_TRACK_NAME:
+        case META_INSTRUMENT_NAME:
+        case META_LYRIC_TEXT:
+        case META_MARKER_TEXT:
+        case META_CUE_TEXT:
+        case META_PROGRAM_NAME:
+        case META_DEVICE_NAME:
+        case META_GENERIC_TEXT_A:
+        case META_GENERIC_TEXT_B:
+        case META_GENERIC_TEXT_C:
+        case META_GENERIC_TEXT_D:
+        case META_GENERIC_TEXT_E:
+        case META_GENERIC_TEXT_F:
+            msg.SetStatus(META_EVENT);
+            msg.SetMetaType((unsigned char)type);
+            msg.AllocateSysEx(msg_index);
+            for (unsigned int i = 0; i < msg_index; i++)
+                msg.GetSysEx()->PutSysByte(m[i]);
+            break;
+        case META_CHANNEL_PREFIX:
+        case META_OUTPUT_CABLE:
+            if (msg_index < 1) return;
+            msg.SetMetaEvent(type, m[0], 0);
+            break;
+        case META_END_OF_TRACK:
+            msg.SetDataEnd();
+            break;
+        case META_TEMPO:
+            if (msg_index < 3) return;
+            msg.SetMetaEvent(META_TEMPO, 0);
+            msg.AllocateSysEx(3);
+            for (unsigned int i = 0; i < 3; i++)
+                msg.GetSysEx()->PutSysByte(m[i]);
+            break;
+        case META_SMPTE:
+            if (msg_index < 5) return;
+            msg.SetSMPTEOffset(m[0], m[1], m[2], m[3], m[4]);
+            break;
+        case META_TIMESIG:
+            if (msg_index < 4) return;
+            msg.SetTimeSig(m[0], (unsigned char)(1 << m[1]), m[2], m[3]);
+            break;
+        case META_KEYSIG:
+            if (msg_index < 2) return;
+            msg.SetKeySig((signed char)m[0], m[1]);
+            break;
+        default:                        // ignore sequencer specific and unknown meta events
+            return;
+    }
+    msg.SetTime(cur_time);
+    func(trk, static_cast<const MIDITimedMessage&>(msg));
+}
+
+
+template <class F>
+unsigned long MIDIFileStreamReader<F>::ReadVariableNum() {
+    unsigned long value = 0;
+    int c;
+    do {
+        c = EGetC();
+        if (abort_parse)
+            return 0;
+        value = (value << 7) + (c & 0x7f);
+    } while (c & 0x80);
+    return value;
+}
+
+
+template <class F>
+unsigned long MIDIFileStreamReader<F>::Read32Bit() {
+    unsigned long value = 0;
+    for (int i = 0; i < 4; i++)
+        value = (value << 8) + EGetC();
+    return value;
+}
+
+
+template <class F>
+int MIDIFileStreamReader<F>::Read16Bit() {
+    int c1 = EGetC();
+    int c2 = EGetC();
+    return (c1 << 8) + c2;
+}
+
+
+template <class F>
+int MIDIFileStreamReader<F>::EGetC() {
+    int c = in_buf->sbumpc();
+    if (c == std::char_traits<char>::eof()) {
+        abort_parse = true;             // unexpected end of stream
+        return 0;
+    }
+    --to_be_read;
+    return c;
+}
+
+/// \endcond
+
+
+#endif
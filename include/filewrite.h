@@ -52,6 +52,15 @@ class MIDIFileWriter {
         unsigned long   GetTrackLength()        { return track_length; }
         void            ResetTrackLength()      { track_length = 0; }
         void            ResetTrackTime()        { track_time = 0; }
+        // In size optimizing mode note off messages are written either as note off or as note on with
+        // velocity 0, choosing the one which continues the running status. If keep_vel is true only
+        // note off with velocity 64 (the same of a note on with velocity 0) are changed into note on.
+        void            SetOptimizeSize(bool f, bool keep_vel = true)
+                                                { optimize = f; keep_off_vel = keep_vel; }
+        bool            GetOptimizeSize() const { return optimize; }
+        // The bytes saved by the size optimizing mode since the last WriteFileHeader(), compared with the plain
+        // running status
+        long            GetBytesSaved() const   { return bytes_saved; }
 
         void            WriteFileHeader(int format, int ntrks, int division);
         void            WriteTrackHeader(unsigned long length);
@@ -83,6 +92,10 @@ class MIDIFileWriter {
         unsigned long   track_time;
         unsigned long   track_position;
         unsigned char   running_status;
+        unsigned char   plain_status;           // the running status without optimization
+        bool            optimize;
+        bool            keep_off_vel;
+        long            bytes_saved;
 
         std::ostream*   out_stream;
 };
@@ -52,6 +52,16 @@ class MIDIFileWriteMultiTrack {
         virtual                 ~MIDIFileWriteMultiTrack()      {}
         /// Writes the multitrack events to the std::ostream in the standard MIDI file format
         bool                    Write(int num_tracks, int division);
+        /// Enables or disables the size optimizing mode. In this mode note off messages are written as note off
+        /// or as note on with velocity 0, choosing the encoding which extends the running status.
+        /// \param f **true** for enabling the mode
+        /// \param keep_vel if **true** (the default) only note off with velocity 64 (which are equivalent to
+        /// note on with velocity 0) are turned into note on, so the file is not altered; if **false** the note
+        /// off velocity can be lost
+        void                    SetOptimizeSize(bool f, bool keep_vel = true)
+                                                                { writer.SetOptimizeSize(f, keep_vel); }
+        /// Returns the number of bytes saved by the size optimizing mode in the last Write().
+        long                    GetBytesSaved() const           { return writer.GetBytesSaved(); }
 
     private:
 
@@ -75,11 +85,16 @@ class MIDIFileWriteMultiTrack {
 /// \param format the MIDI file format (only 0 and 1 are supported)
 /// \param tracks the MIDIMultiTrack to be written
 /// \param strip if the format is 1 (many tracks) and this is *true*, empty tracks are skipped
+/// \param optimize if this is **true** the file is written in the size optimizing mode (with lossless
+/// choice of note off encodings, see MIDIFileWriteMultiTrack::SetOptimizeSize())
+/// \param bytes_saved if it is not 0 it gets the number of bytes saved by the size optimizing mode
 /// \return **true** if the writing was successful.
-bool WriteMIDIFile(const char* filename, int format, const MIDIMultiTrack* tracks, bool strip = false);
+bool WriteMIDIFile(const char* filename, int format, const MIDIMultiTrack* tracks, bool strip = false,
+                   bool optimize = false, long* bytes_saved = 0);
 /// Writes the given MIDIMultiTrack object into a MIDI file.
-/// \see WriteMIDIFile(const char*, int, const MIDIMultiTrack*, bool)
-bool WriteMIDIFile(const std::string& filename, int format, const MIDIMultiTrack* tracks, bool strip = false);
+/// \see WriteMIDIFile(const char*, int, const MIDIMultiTrack*, bool, bool, long*)
+bool WriteMIDIFile(const std::string& filename, int format, const MIDIMultiTrack* tracks, bool strip = false,
+                   bool optimize = false, long* bytes_saved = 0);
 ///@}
 ///@}
 
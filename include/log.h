@@ -0,0 +1,167 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/// \file
+/// Contains the definition of the static class MIDILog and of the logging macros.
+
+
+#ifndef _NICMIDI_LOG_H
+#define _NICMIDI_LOG_H
+
+#include "timer.h"
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+
+/// \addtogroup GLOBALS
+///@{
+
+/// The minimum level of the log messages which are compiled: the macros for lower levels expand to nothing,
+/// so they have no cost at all. 0 = debug, 1 = info, 2 = warning, 3 = error, 4 = no log. You can define it in
+/// your compiler options; the default is 1 (debug messages are not compiled).
+#ifndef NICMIDI_LOG_LEVEL
+#define NICMIDI_LOG_LEVEL 1
+#endif
+
+#if NICMIDI_LOG_LEVEL <= 0
+/// Writes a debug message to the log (the arguments are the same of printf()).
+#define NICMIDI_LOG_DEBUG(...)      MIDILog::Write(MIDILog::LOG_DEBUG, __VA_ARGS__)
+#else
+#define NICMIDI_LOG_DEBUG(...)      ((void)0)
+#endif
+
+#if NICMIDI_LOG_LEVEL <= 1
+/// Writes an info message to the log (the arguments are the same of printf()).
+#define NICMIDI_LOG_INFO(...)       MIDILog::Write(MIDILog::LOG_INFO, __VA_ARGS__)
+#else
+#define NICMIDI_LOG_INFO(...)       ((void)0)
+#endif
+
+#if NICMIDI_LOG_LEVEL <= 2
+/// Writes a warning message to the log (the arguments are the same of printf()).
+#define NICMIDI_LOG_WARNING(...)    MIDILog::Write(MIDILog::LOG_WARNING, __VA_ARGS__)
+#else
+#define NICMIDI_LOG_WARNING(...)    ((void)0)
+#endif
+
+#if NICMIDI_LOG_LEVEL <= 3
+/// Writes an error message to the log (the arguments are the same of printf()).
+#define NICMIDI_LOG_ERROR(...)      MIDILog::Write(MIDILog::LOG_ERROR, __VA_ARGS__)
+#else
+#define NICMIDI_LOG_ERROR(...)      ((void)0)
+#endif
+///@}
+
+
+///
+/// A static class which collects log messages from the library. It is designed for being used in the
+/// real time threads (the timer callback, the RtMidi callbacks, the driver sender thread), where writing
+/// to a std::ostream could block for an unpredictable time: Write() formats the message into a slot of
+/// a fixed size ring buffer, without locks and memory allocations, and a background thread with normal
+/// priority drains the buffer every \ref DRAIN_INTERVAL msecs, writing the messages to the output stream.
+/// If the buffer is full the message is discarded (and counted, see GetNumDropped()), so Write() never waits.
+///
+/// You usually don't call Write() directly but the NICMIDI_LOG_DEBUG(), NICMIDI_LOG_INFO(),
+/// NICMIDI_LOG_WARNING() and NICMIDI_LOG_ERROR() macros, which are removed at compile time if their level
+/// is lower than NICMIDI_LOG_LEVEL; moreover you can set a minimum level at run time with SetLevel().
+/// The MIDIManager starts the drain thread when it is initialized and stops it at exit.
+///
+class MIDILog {
+    public:
+        /// The log levels.
+        enum {
+            LOG_DEBUG,              ///< Debug messages
+            LOG_INFO,               ///< Information on the library activity
+            LOG_WARNING,            ///< Something went wrong, but the library can go on
+            LOG_ERROR,              ///< An operation failed
+            LOG_NONE                ///< Used in SetLevel() for disabling the log
+        };
+
+        /// The constructor is deleted.
+                                    MIDILog() = delete;
+        /// Returns the minimum level of the messages which are written.
+        static int                  GetLevel()                      { return level.load(); }
+        /// Returns the number of messages discarded because the buffer was full.
+        static unsigned long        GetNumDropped()                 { return dropped.load(); }
+        /// Returns **true** if the drain thread is running.
+        static bool                 IsRunning()                     { return running.load(); }
+
+        /// Sets the minimum level of the messages which are written (messages with a lower level are discarded
+        /// by Write() before formatting them). The default is LOG_INFO.
+        static void                 SetLevel(int lev)               { level.store(lev); }
+        /// Sets the stream the messages are written to (the default is std::cout). This must not be called while
+        /// the drain thread is running.
+        static void                 SetStream(std::ostream& os)     { out_stream = &os; }
+
+        /// Formats a message with the printf() syntax and appends it to the log. The message is truncated to
+        /// \ref MAX_TEXT_LENGTH characters. This is safe to call from any thread and never blocks.
+        static void                 Write(int lev, const char* fmt, ...)
+#ifdef __GNUC__
+                                        __attribute__ ((format (printf, 2, 3)))
+#endif
+                                        ;
+        /// Writes all the pending messages to the output stream, in the calling thread.
+        static void                 Flush();
+        /// Starts the drain thread (if it is not running).
+        static void                 Start();
+        /// Stops the drain thread, writing all the pending messages.
+        static void                 Stop();
+
+        /// The maximum length of a message.
+        static const unsigned int   MAX_TEXT_LENGTH = 127;
+        /// The number of messages the ring buffer can hold.
+        static const unsigned int   RING_SIZE = 256;
+        /// The interval (in msecs) between two drains of the buffer.
+        static const unsigned int   DRAIN_INTERVAL = 20;
+
+    protected:
+        /// \cond EXCLUDED
+        // A slot of the ring buffer. seq tells the slot state (see log.cpp)
+        struct Slot {
+            std::atomic<unsigned long>  seq;
+            int                         lev;
+            tUsecs                      time;
+            char                        text[MAX_TEXT_LENGTH + 1];
+        };
+
+        static void                 DrainProc();
+
+        static Slot                 ring[RING_SIZE];    // The ring buffer
+        static std::atomic<unsigned long>   in_pos;     // The next slot to write
+        static unsigned long        out_pos;            // The next slot to read (protected by drain_mutex)
+        static std::mutex           drain_mutex;        // Serializes the readers (they aren't real time)
+        static std::atomic<int>     level;              // The minimum level
+        static std::atomic<unsigned long>   dropped;    // The number of discarded messages
+        static std::atomic<bool>    running;            // True if the drain thread is running
+        static std::thread          drain_thread;       // The drain thread
+        static std::ostream*        out_stream;         // The output stream
+        /// \endcond
+};
+
+
+#endif // _NICMIDI_LOG_H
@@ -0,0 +1,159 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/// \file
+/// Contains the definition of the classes MIDILoopbackOutDriver and MIDILoopbackInDriver, a pair of
+/// virtual ports which connect an out port to an in port inside the program.
+
+
+#ifndef _NICMIDI_LOOPBACK_H
+#define _NICMIDI_LOOPBACK_H
+
+#include "driver.h"
+
+#include <deque>
+#include <random>
+
+
+///
+/// The in side of a loopback port. It receives the messages sent to its MIDILoopbackOutDriver, stamped with
+/// their arrival time, as if they came from an hardware port. It doesn't use RtMidi, so it works also on
+/// systems without MIDI hardware or drivers. You usually get it with MIDIManager::AddLoopbackPort().
+///
+class MIDILoopbackInDriver : public MIDIInDriver {
+    public:
+        /// The constructor.
+        /// \param id the number of the port (its index in the MIDIManager in ports)
+        /// \param name the name of the port
+        /// \param queue_size the size of the in queue
+                                MIDILoopbackInDriver(int id, const std::string& name,
+                                                     unsigned int queue_size = DEFAULT_QUEUE_SIZE);
+        /// Returns the name of the port.
+        virtual std::string     GetPortName()                   { return name; }
+        /// Returns **true** is the port is open.
+        virtual bool            IsPortOpen() const              { return num_open > 0; }
+        /// Opens the port (only counting the open calls).
+        virtual void            OpenPort();
+        /// Closes the port (see MIDIInDriver::ClosePort()).
+        virtual void            ClosePort();
+        /// Resets the driver to default conditions (see MIDIInDriver::Reset()).
+        virtual void            Reset();
+        /// Puts the message into the in queue, stamped with the given time (in the MIDITimer::GetSysTimeUs()
+        /// scale). It is called by the MIDILoopbackOutDriver and does nothing if the port is closed.
+        void                    Deliver(const MIDIMessage& msg, tUsecs t);
+
+    protected:
+        /// \cond EXCLUDED
+        const std::string       name;           // The name of the port
+        /// \endcond
+};
+
+
+///
+/// The out side of a loopback port. Every message sent to it is delivered to the connected
+/// MIDILoopbackInDriver after a given latency, plus an optional random jitter (for example for testing
+/// the behaviour of the recorder with a real hardware interface). Delivery times are never decreasing, so
+/// the jitter doesn't change the order of messages, as on a MIDI cable. With no latency and no jitter messages
+/// are delivered immediately by the sending thread; otherwise a background thread delivers them at their time.
+/// The in driver stamps them with their exact arrival time, so you can use the pair for measuring the timing
+/// of sequencer, thru and recorder without MIDI hardware. You usually get it with MIDIManager::AddLoopbackPort().
+///
+class MIDILoopbackOutDriver : public MIDIOutDriver {
+    public:
+        /// The constructor.
+        /// \param id the number of the port (its index in the MIDIManager out ports)
+        /// \param name the name of the port
+        /// \param in the in driver which receives the messages (it is not owned by the out driver)
+                                MIDILoopbackOutDriver(int id, const std::string& name, MIDILoopbackInDriver* in);
+        /// The destructor discards the messages not yet delivered.
+        virtual                 ~MIDILoopbackOutDriver();
+        /// Returns the name of the port.
+        virtual std::string     GetPortName()                   { return name; }
+        /// Returns **true** is the port is open.
+        virtual bool            IsPortOpen() const              { return num_open > 0; }
+        /// Returns a pointer to the connected in driver.
+        MIDILoopbackInDriver*   GetInDriver() const             { return in_driver; }
+        /// Returns the latency in usecs.
+        unsigned int            GetLatency() const              { return latency; }
+        /// Returns the maximum jitter in usecs.
+        unsigned int            GetJitter() const               { return jitter; }
+        /// Returns the number of messages sent to the port.
+        unsigned long           GetNumSent() const              { return num_sent; }
+        /// Returns the maximum delay (in usecs) with which the delivery thread delivered a message after its
+        /// arrival time. This is the accuracy of the loopback itself (it is not included in the timestamps).
+        tUsecs                  GetMaxLateness() const          { return max_lateness; }
+
+        /// Opens the port (only counting the open calls).
+        virtual void            OpenPort();
+        /// Closes the port (see MIDIOutDriver::ClosePort()). When the port is effectively closed the messages
+        /// not yet delivered are delivered immediately, with their arrival time.
+        virtual void            ClosePort();
+        /// Resets the driver to default conditions (see MIDIOutDriver::Reset()).
+        virtual void            Reset();
+        /// Sets the latency and the jitter of the port.
+        /// \param lat the time in usecs between the sending and the arrival of a message
+        /// \param jit the maximum random time in usecs added to the latency
+        /// \param seed the seed of the random generator, so that a test can be repeated exactly
+        void                    SetLatency(unsigned int lat, unsigned int jit = 0, unsigned int seed = 1);
+        /// Resets the counters returned by GetNumSent() and GetMaxLateness().
+        void                    ResetStats()                    { num_sent = 0; max_lateness = 0; }
+
+    protected:
+        /// Delivers the message to the in driver, directly or through the delivery thread.
+        virtual void            HardwareMsgOut(const MIDIMessage &msg);
+        /// Delivers all the messages of the batch.
+        virtual void            HardwareBatchOut(const std::vector<unsigned char>& bytes,
+                                                 const std::vector<unsigned int>& ends);
+
+        /// \cond EXCLUDED
+        // A message waiting for its arrival time
+        struct Delivery {
+            Delivery(const MIDIMessage& m, tUsecs t) : msg(m), time(t) {}
+            MIDIMessage     msg;
+            tUsecs          time;
+        };
+
+        void                    DeliveryProc();
+        void                    StopDelivery(bool deliver = false);
+
+        const std::string       name;           // The name of the port
+        MIDILoopbackInDriver*   in_driver;      // The connected in driver
+        unsigned int            latency;        // The latency in usecs
+        unsigned int            jitter;         // The maximum jitter in usecs
+        std::minstd_rand        rand_gen;       // The generator of the jitter
+        tUsecs                  last_time;      // The arrival time of the last message
+        std::atomic<unsigned long>  num_sent;   // The number of sent messages
+        std::atomic<tUsecs>     max_lateness;   // The maximum lateness of the delivery thread
+
+        std::deque<Delivery>    deliveries;     // The messages waiting for delivery (in time order)
+        std::mutex              delivery_mutex; // Protects deliveries
+        std::condition_variable delivery_cond;  // Wakes up the delivery thread
+        std::thread             delivery_thread;// The delivery thread
+        bool                    delivery_exit;  // Tells the delivery thread to exit
+        /// \endcond
+};
+
+
+#endif // _NICMIDI_LOOPBACK_H
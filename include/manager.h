@@ -40,6 +40,7 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <atomic>
 
 
 ///
@@ -65,7 +66,7 @@ public:
     /// Returns the number of MIDI in ports in the system.
     static unsigned int         GetNumMIDIIns();
     /// Returns the system name of the given MIDI in port.
-    static const std::string&   GetMIDIInName(unsigned int n);
+    static std::string          GetMIDIInName(unsigned int n);
     /// Returns a pointer to the MIDIInDriver with given port id.
     static MIDIInDriver*        GetInDriver(unsigned int n);
     /// Returns **true** if n is a valid MIDI in port number. If you call this with 0 as argument
@@ -74,7 +75,7 @@ public:
     /// Returns the number of MIDI out ports in the system.
     static unsigned int         GetNumMIDIOuts();
     /// Returns the system name of the given MIDI out port.
-    static const std::string&   GetMIDIOutName(unsigned int n);
+    static std::string          GetMIDIOutName(unsigned int n);
     /// Returns a pointer to the MIDIOutDriver with given port id.
     static MIDIOutDriver*       GetOutDriver(unsigned int n);
     /// Returns **true** if n is a valid MIDI out port number. If you call this with 0 as argument
@@ -83,6 +84,40 @@ public:
     /// Returns the pointer to the (unique) MIDITickComponent in the queue with tPriority PR_SEQ
     /// (0 if not found).
     static MIDISequencer*       GetSequencer();
+    /// Adds a loopback port, i.e.\ a MIDILoopbackOutDriver connected to a MIDILoopbackInDriver, to the out
+    /// and in ports. They get the last numbers (GetNumMIDIOuts() - 1 and GetNumMIDIIns() - 1). The loopback
+    /// port doesn't need MIDI hardware, so it can be used for testing and benchmarking the library on any
+    /// system. If the environment variable NICMIDI_LOOPBACK is set when the MIDIManager is initialized a
+    /// loopback port named "NiCMidi Loopback" is added automatically (and a system with no MIDI support
+    /// is not considered an error).
+    /// \param name the name of the port
+    /// \return the number of the out port (you can get its driver with GetOutDriver()), or \ref MAX_PORTS
+    /// (which is not a valid port number) if there are already MAX_PORTS in or out ports
+    static unsigned int         AddLoopbackPort(const std::string& name = "NiCMidi Loopback");
+    /// Updates the port list with the ports currently in the system, without stopping the timer. Existing
+    /// drivers are never deleted, so port numbers and pointers remain valid, and ports are matched by name:
+    /// - a new port gets a new driver, appended at the end of the in or out ports (with the last numbers);
+    /// - a removed port keeps its driver (and its open state), but MIDIInDriver::IsPortPresent() or
+    /// MIDIOutDriver::IsPortPresent() return **false**;
+    /// - when a removed port comes back its driver, if open, is reconnected to it (for example when a
+    /// cable is replugged during a performance).
+    ///
+    /// Loopback ports are not affected. New ports beyond \ref MAX_PORTS are ignored.
+    /// \return the number of added ports (in + out)
+    /// \see StartPortWatcher()
+    static unsigned int         RescanPorts();
+    /// Starts a background thread which calls RescanPorts() when the system announces that a MIDI port was
+    /// added or removed. Now this is only implemented for the Linux ALSA sequencer; on other systems you
+    /// must call RescanPorts() by yourself.
+    /// \return **true** if the thread was started (or was already running)
+    static bool                 StartPortWatcher();
+    /// Stops the thread started by StartPortWatcher(). This is called automatically at exit.
+    static void                 StopPortWatcher();
+
+    /// The maximum number of in ports and of out ports. The port lists are allocated with this size when
+    /// the MIDIManager is initialized and never moved, so RescanPorts() and AddLoopbackPort() can add ports
+    /// while other threads (the timer, the sequencer worker, the driver threads) are using them.
+    static const unsigned int   MAX_PORTS = 128;
 
 /* TODO: are these useful?
     /// Starts the MIDITimer thread procedure.
@@ -107,6 +142,11 @@ public:
     static void                 CloseOutPorts();
     /// Sends a MIDI AllNotesOff message to all open out ports.
     static void                 AllNotesOff();
+    /// Sends the messages queued with MIDIOutDriver::QueueMessage() on all out ports.
+    static void                 FlushOutQueues();
+    /// Sets the threaded mode for all out ports, so every port is driven by its own thread and a slow port
+    /// doesn't delay the others (see MIDIOutDriver::SetThreadedOutput()).
+    static void                 SetThreadedOutput(bool on);
     /// Inserts a MIDITickComponent object into the queue. The objects are queued according to their
     /// \ref tPriority parameter; you can add only one of them with \ref PR_SEQ priority (i.e.\ a
     /// sequencer). Advanced classes (as AdvancedSequencer) auto add themselves to the manager queue
@@ -134,6 +174,7 @@ protected:
 
     /// \cond EXCLUDED
     static void                         Exit();         // called at exit
+    static void                         WatcherProc();  // the port watcher thread procedure
 
     // WARNING! We MUST use pointers to avoid the "static inizialization order fiasco"
     static std::vector<MIDIOutDriver*>* MIDI_outs;      // A vector of MIDIOutDriver objects (one for each
@@ -142,12 +183,17 @@ protected:
     static std::vector<MIDIInDriver*>*  MIDI_ins;       // A vector of MIDIInDriver objects (one for each
                                                         // hardware port)
     static std::vector<std::string>*    MIDI_in_names;  // The system names of hardware in ports
+    static std::atomic<unsigned int>    num_outs;       // The number of out ports (the vectors have
+    static std::atomic<unsigned int>    num_ins;        // MAX_PORTS capacity and are read up to these)
 
     static std::vector<MIDITickComponent*>*
                                         MIDITicks;      // The array of MIDITickCompnent objects, everyone
                                                         // of them has his StaticTickProc() callback
 
     static std::mutex*                  proc_lock;      // A mutex for thread safe processing
+    static std::mutex*                  rescan_lock;    // Serializes RescanPorts() calls
+    static std::thread*                 watcher_thread; // The port watcher thread
+    static std::atomic<bool>            watcher_running;// True if the port watcher is running
     static bool                         init;
     /// \endcond
 };
@@ -34,6 +34,7 @@
 #include "track.h"
 
 #include <vector>
+#include <atomic>
 
 
 class MIDIEditMultiTrack;       // forward declaration
@@ -68,12 +69,21 @@ class MIDIMultiTrack {
         /// Deletes all the tracks in the Multitrack, resizes it to the given number of tracks and resets
         /// _clks_per_beat_.
         void                        Reset(unsigned int num_tracks = 0);
+        /// Exchanges the tracks and the clocks per beat with the given MIDIMultiTrack, without copying
+        /// the events.
+        /// \warning if you are using the multitrack into a MIDISequencer class you must then call
+        /// MIDISequencer::Reset(), as the tracks are changed.
+        void                        Swap(MIDIMultiTrack& mlt);
         /// Clears tracks events but mantains the tracks and their parameters. If _mantain_end_ is **true**
         /// doesn't change the time of EOT events, otherwise sets them to 0.
         void                        ClearTracks(bool mantain_end = false);
 
         /// Returns the MIDI clocks per beat of all tracks (i.e.\ the number of MIDI ticks in a quarter note).
         unsigned int                GetClksPerBeat() const          { return clks_per_beat; }
+        /// Returns a number which changes every time the tracks are replaced by operator=(), Reset() or Swap()
+        /// (it is unique among all the multitracks), so you can check if data kept about the tracks (for instance
+        /// by a MIDIRecorder) still refer to them. Editing the tracks doesn't change it (see MIDITrack::GetEditId()).
+        unsigned long               GetLoadId() const               { return load_id; }
         /// Returns the pointer to the track
         /// \param trk_num The track number
         MIDITrack*                  GetTrack(unsigned int trk_num)  { return tracks[trk_num]; }
@@ -179,6 +189,9 @@ class MIDIMultiTrack {
                                                         ///< (this is the number of MIDI ticks for a quarter note).
         /// \cond EXCLUDED
         std::vector<MIDITrack*>     tracks;             // The array of pointers to the MIDITrack objects
+        unsigned long               load_id;            // See GetLoadId()
+
+        static std::atomic<unsigned long> load_count;   // Gives the load ids
         /// \endcond
 };
 
@@ -193,6 +206,7 @@ class MIDIMultiTrackIteratorState {
 /// \cond EXCLUDED
     // This is used only by the MIDIMultiTrackIterator, so all is protected
     friend class MIDIMultiTrackIterator;
+    friend class MIDIFileCache;         // for saving and loading warp positions
 
     public:
         // The constructor.
@@ -34,7 +34,7 @@
 #include <atomic>
 #include <vector>
 #include <set>
-#include <stack>
+#include <deque>
 
 /*
 class MIDIMultiTrackCopier {
@@ -176,7 +176,9 @@ class RecNotifier: public MIDISequencerGUINotifier {
 /// + Can select the time interval which will be affected by recording
 /// + Can choose between merging old and new content on the tracks or overwriting.
 /// + It plays a metronome click while recording (with a lead in measure before starting)
-/// + A multilevel undo is provided
+/// + A multilevel undo and redo is provided. Every take stores only the events it removed and inserted in the
+/// tracks, so the memory used is proportional to what was recorded; the oldest takes are forgotten when the
+/// memory exceeds a given size (see SetUndoMaxSize())
 ///
 /// The recorder is bounded to a MIDISequencer component (given in the constructor) which plays the tracks
 /// content while recording and sets the current time. Recorder and sequencer manage separate MIDIMultiTrack
@@ -189,8 +191,8 @@ class MIDIRecorder : public MIDITickComponent {
                                         MIDIRecorder(MIDISequencer* const s);
         /// The destructor.
         virtual                         ~MIDIRecorder();
-        /// It sets all tracks to recording disabled, empties the internal multitrack and
-        /// sets the start and end recording times to 0 ... TIME_INFINITE.
+        /// It sets all tracks to recording disabled, empties the internal multitrack, clears the undo and redo
+        /// history and sets the start and end recording times to 0 ... TIME_INFINITE.
         virtual void                    Reset();
         /// Returns a pointer to the internal MIDIMultiTrack.
         MIDIMultiTrack*                 GetMultiTrack() const           { return tracks; }
@@ -201,6 +203,18 @@ class MIDIRecorder : public MIDITickComponent {
         MIDIClockTime                   GetStartRecTime() const         { return rec_start_time; }
         /// Returns the recording end time in MIDI ticks.
         MIDIClockTime                   GetEndRecTime() const           { return rec_end_time; }
+        /// Returns the number of takes which can be undone (0 if the sequencer tracks were replaced, for
+        /// instance by loading a file, after the takes).
+        unsigned int                    GetNumUndo() const
+                                { return seq_tracks->GetLoadId() == undo_load_id ? undo_list.size() : 0; }
+        /// Returns the number of undone takes which can be redone (0 if the sequencer tracks were replaced
+        /// after the takes).
+        unsigned int                    GetNumRedo() const
+                                { return seq_tracks->GetLoadId() == undo_load_id ? redo_list.size() : 0; }
+        /// Returns the memory (in bytes) used by the undo and redo history.
+        unsigned long                   GetUndoSize() const             { return undo_size; }
+        /// Returns the maximum memory (in bytes) used by the undo and redo history (see SetUndoMaxSize()).
+        unsigned long                   GetUndoMaxSize() const          { return undo_max_size; }
         /// Returns the pointer to a track of the internal multitrack.
         /// \param trk_num The track number
         MIDITrack*                      GetTrack(unsigned int trk_num)  { return tracks->GetTrack(trk_num); }
@@ -279,9 +293,18 @@ class MIDIRecorder : public MIDITickComponent {
         /// \param trk_num the track number
         /// \return **true** if _trk_num_ is valid (and the track has been disabled), **false** otherwise.
         bool                            DisableTrack(unsigned int trk_num);
-        /// Deletes the changes made in the last recording. You have multiple levels of undo.
+        /// Deletes the changes made in the last recording. You have multiple levels of undo. This cannot be called
+        /// during recording. If a recorded track was edited after the take, or the sequencer tracks were replaced
+        /// (for instance by loading a file), the undo is not possible, and all the history is cleared.
         /// \return **true** if undo has been done, **false** otherwise.
         bool                            UndoRec();
+        /// Restores the changes deleted by the last UndoRec(). A new recording clears the redo history. This
+        /// cannot be called during recording.
+        /// \return **true** if redo has been done, **false** otherwise.
+        bool                            RedoRec();
+        /// Sets the maximum memory (in bytes) used by the undo and redo history. When it is exceeded the oldest
+        /// takes are forgotten (the last one is always kept). The default is \ref DEFAULT_UNDO_MAX_SIZE.
+        void                            SetUndoMaxSize(unsigned long bytes);
 
         /// Starts the recording from the enabled ports and channels. It starts the attached MIDISequencer
         /// from its current position, after a lead in measure.
@@ -295,6 +318,9 @@ class MIDIRecorder : public MIDITickComponent {
             REC_OVER                        ///<    Overwrite the old content
         };
 
+        /// The default maximum memory of the undo and redo history (16 MB)
+        static const unsigned long      DEFAULT_UNDO_MAX_SIZE = 16 * 1024 * 1024;
+
     protected:
         /// Internal function. It is used to resize the internal multitrack according to the
         /// number of enabled tracks.
@@ -314,6 +340,40 @@ class MIDIRecorder : public MIDITickComponent {
         virtual void                    TickProc(tMsecs sys_time);
 
         /// \cond EXCLUDED
+        // A range of events changed by a take: the events before the take and the events which replaced them,
+        // with their positions in the track before and after the take
+        struct UndoHunk {
+            unsigned int                    pos_before;
+            unsigned int                    pos_after;
+            std::vector<MIDITimedMessage>   removed;
+            std::vector<MIDITimedMessage>   inserted;
+        };
+        // The changes of a take to a track (a take can change a track more times, which are applied in order)
+        struct UndoTrack {
+            unsigned int                    trk_num;
+            unsigned int                    num_before; // The number of events before the take
+            unsigned int                    num_after;  // The number of events after the take
+            std::vector<UndoHunk>           hunks;
+        };
+        // The changes of a take
+        struct UndoTake {
+            std::vector<UndoTrack>          tracks;
+            unsigned long                   size;       // The memory used
+        };
+
+        // Internal use: adds to take_cur the changes of the track trk_num from before to after
+        void                            AddUndoTrack(unsigned int trk_num, const MIDITrack* before,
+                                                     const MIDITrack* after);
+        // Internal use: applies the changes of a take to the sequencer tracks (backwards if undo is true);
+        // returns false if the tracks don't match the take
+        bool                            ApplyUndoTake(const UndoTake& take, bool undo);
+        // Internal use: clears the undo and redo history
+        void                            ClearUndo();
+        // Internal use: clears the undo and redo history if the sequencer tracks were replaced
+        void                            CheckUndoTracks();
+        // Internal use: forgets the oldest takes until the history fits in undo_max_size
+        void                            TrimUndo();
+
         MIDISequencer* const            seq;                // The attached sequencer
         MIDIMultiTrack*                 tracks;             // The internal MIDIMultiTrack
         MIDIMultiTrack*                 seq_tracks;         // The sequencer multitrack
@@ -328,7 +388,12 @@ class MIDIRecorder : public MIDITickComponent {
         RecNotifier                     notifier;           // A notifier used as a metronome
         int                             old_seq_mode;       // Internal use
         std::atomic<bool>               rec_on;             // Internal use
-        std::stack<MIDIMultiTrack*>     undo_stack;         // Stack of multitracks for undo
+        UndoTake                        take_cur;           // The changes of the take being recorded
+        unsigned long                   undo_load_id;       // The load id of seq_tracks when the history began
+        std::deque<UndoTake>            undo_list;          // The takes which can be undone (the last at back)
+        std::deque<UndoTake>            redo_list;          // The takes which can be redone (the last at back)
+        unsigned long                   undo_size;          // The memory used by undo_list and redo_list
+        unsigned long                   undo_max_size;      // The maximum memory of undo_list and redo_list
 
         /// \endcond
 };
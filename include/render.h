@@ -0,0 +1,128 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/// \file
+/// Contains the definition of the struct MIDIRenderedEvent and of the sinks used by MIDISequencer::Render().
+
+
+#ifndef _NICMIDI_RENDER_H
+#define _NICMIDI_RENDER_H
+
+#include "msg.h"
+#include "timer.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+
+
+///
+/// A message rendered by MIDISequencer::Render(), with its track, its out port and its time.
+///
+struct MIDIRenderedEvent {
+                            MIDIRenderedEvent() : time_us(0), track(0), port(0) {}
+    tUsecs                  time_us;    ///< The time in usecs from the start of the song (with the tempo scale)
+    int                     track;      ///< The track of the message
+    unsigned int            port;       ///< The out port of the track
+    MIDITimedMessage        msg;        ///< The message, processed by the track processor
+};
+
+
+///
+/// The pure virtual base class of the objects which receive the messages rendered by MIDISequencer::Render().
+/// Put() is called once for every message, in time order and always from the thread which called Render(),
+/// so you don't need to synchronize it. You can subclass it for your own processing, or use one of the
+/// MIDIRenderVectorSink, MIDIRenderFileSink and MIDIRenderCallbackSink classes.
+///
+class MIDIRenderSink {
+    public:
+        /// The destructor does nothing.
+        virtual                 ~MIDIRenderSink() {}
+        /// Receives a rendered message.
+        virtual void            Put(const MIDIRenderedEvent& ev) = 0;
+};
+
+
+///
+/// A MIDIRenderSink which collects the rendered messages in a std::vector.
+///
+class MIDIRenderVectorSink : public MIDIRenderSink {
+    public:
+        /// Appends the message to the vector.
+        virtual void            Put(const MIDIRenderedEvent& ev)    { events.push_back(ev); }
+        /// Empties the vector.
+        void                    Clear()                             { events.clear(); }
+
+        std::vector<MIDIRenderedEvent> events;  ///< The rendered messages
+};
+
+
+///
+/// A MIDIRenderSink which writes the rendered messages to a text file, one message for line. Every line
+/// contains the time in usecs, the out port, the track and the bytes of the message in hexadecimal, separated
+/// by spaces (sysex messages are written with all their bytes).
+///
+class MIDIRenderFileSink : public MIDIRenderSink {
+    public:
+        /// The constructor opens (and truncates) the file.
+        /// \param fname the file name
+                                MIDIRenderFileSink(const char* fname);
+        /// Returns **true** if the file was opened and no write error happened.
+        bool                    IsOK() const                        { return out.good(); }
+        /// Writes the message to the file.
+        virtual void            Put(const MIDIRenderedEvent& ev);
+
+    protected:
+        /// \cond EXCLUDED
+        std::ofstream           out;            // The output file
+        /// \endcond
+};
+
+
+///
+/// A MIDIRenderSink which calls a user function for every rendered message.
+///
+class MIDIRenderCallbackSink : public MIDIRenderSink {
+    public:
+        /// The type of the callback function. It receives the message and the parameter given in the constructor.
+        typedef void (RenderCallback)(const MIDIRenderedEvent& ev, void* param);
+
+        /// The constructor.
+        /// \param cb the callback function
+        /// \param p a parameter passed to the callback (for example a pointer to an object)
+                                MIDIRenderCallbackSink(RenderCallback* cb, void* p = 0) :
+                                    callback(cb), param(p) {}
+        /// Calls the callback function.
+        virtual void            Put(const MIDIRenderedEvent& ev)    { callback(ev, param); }
+
+    protected:
+        /// \cond EXCLUDED
+        RenderCallback*         callback;       // The callback
+        void*                   param;          // The callback parameter
+        /// \endcond
+};
+
+
+#endif // _NICMIDI_RENDER_H
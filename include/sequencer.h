@@ -34,10 +34,13 @@
 #include "processor.h"
 #include "notifier.h"
 #include "tick.h"
+#include "render.h"
 
 #include <string>
 #include <mutex>
 #include <atomic>
+#include <thread>
+#include <condition_variable>
 
 
 class MIDISequencer;        // forward declaration
@@ -215,6 +218,10 @@ class MIDISequencer : public MIDITickComponent {
         MIDIClockTime                   GetCurrentMIDIClockTime() const;
         /// Returns current time in milliseconds; it is effective even during playback
         float                           GetCurrentTimeMs() const;
+        /// Converts a system time (in the MIDITimer::GetSysTimeUs() scale) into the song time in MIDI ticks,
+        /// taking into account the tempo changes. This is used by the MIDIRecorder for timing the incoming
+        /// messages with their arrival time. If the sequencer is not playing it returns the current clock.
+        MIDIClockTime                   SysTimeToMIDI(tUsecs sys_time);
         /// Returns current measure (1st measure is 0).
         unsigned int                    GetCurrentMeasure() const
                                                                 { return state.cur_measure; }
@@ -254,6 +261,16 @@ class MIDISequencer : public MIDITickComponent {
         /// Returns the repeat play (loop) end measure.
         unsigned int                    GetRepeatPlayEnd() const
                                                                 { return repeat_end_meas; }
+        /// Returns the look ahead time in milliseconds (see SetLookAhead()).
+        unsigned int                    GetLookAhead() const    { return look_ahead; }
+        /// Returns **true** if the pre-render mode is on (see SetPreRender()).
+        bool                            GetPreRender() const    { return pre_render; }
+        /// Returns the maximum number of events sent in a timer tick (see SetMaxEventsPerTick()).
+        unsigned int                    GetMaxEventsPerTick() const
+                                                                { return max_events; }
+        /// Returns the number of timer ticks in which the sequencer reached the maximum number of events and
+        /// left some due event to the next tick (see SetMaxEventsPerTick()). It is reset by Reset().
+        unsigned long                   GetNumThrottled() const { return num_throttled; }
         /// Returns **true** if the count in is enabled.
         bool                            GetCountInEnable() const    { return state.playing_status & COUNT_IN_ENABLED; }
         /// Returns **true** if the count in is pending (the sequencer is counting in).
@@ -300,6 +317,9 @@ class MIDISequencer : public MIDITickComponent {
         /// \param trk_num the track number
         int                             GetTrackTimeShift(unsigned int trk_num) const
                                                                 { return state.multitrack->GetTrack(trk_num)->GetTimeShift(); }
+        /// Returns the latency compensation in msecs of the given track (see SetTrackLatency()).
+        unsigned int                    GetTrackLatency(unsigned int trk_num) const
+                                                                { return state.multitrack->GetTrack(trk_num)->GetLatency(); }
         /// Sets the repeat play (loop) parameters: you can set the repeat play status on/off, the start and the
         /// end measure.
         /// When the repeat play mode is on, the sequencer will start playing from its current position if it is
@@ -316,6 +336,28 @@ class MIDISequencer : public MIDITickComponent {
         virtual bool                    SetRepeatPlay(int on_off, int start_meas = -1, int end_meas = -1);
         /// Sets the count in enable or disable.
         virtual void                    SetCountIn(bool on_off);
+        /// Sets the look ahead time. If it is not 0, at every timer tick the sequencer takes all the events which
+        /// fall within the next _msecs_ milliseconds and schedules them in the MIDIOutDriver at their exact time
+        /// (see MIDIOutDriver::ScheduleMessage()), so their timing doesn't depend on the timer resolution. If it is
+        /// 0 (the default) the events are sent when the tick which follows them fires. The look ahead never goes
+        /// beyond the end of the loop in repeat play mode. A value greater than the timer resolution is needed
+        /// (for example 20 msecs with the default resolution); the GUI notifications are anticipated by the same
+        /// amount.
+        virtual void                    SetLookAhead(unsigned int msecs);
+        /// Sets the pre-render mode, which is effective only with the look ahead on (see SetLookAhead()). In this
+        /// mode the sequencer doesn't work in the MIDITimer thread: a worker thread of its own takes the events of
+        /// the look ahead window, runs the track processors, updates the state and schedules the messages in the
+        /// MIDIOutDriver, whose sender thread only sends them at their time. So a slow tick of other components
+        /// doesn't delay the sequencer, and with a large look ahead (for example 100 msecs) a busy CPU delaying
+        /// the worker doesn't change the timing of the messages. The worker fills the window at every timer
+        /// resolution period; the GUI notifications are sent by it. The mode takes effect at the next Start().
+        void                            SetPreRender(bool on_off);
+        /// Sets the maximum number of events the sequencer sends in a timer tick. If it is 0 (the default)
+        /// all the due events are sent, so a dense passage never falls behind; otherwise the remaining events
+        /// are delayed to the next tick, the counter returned by GetNumThrottled() is incremented and a warning
+        /// is written to the MIDILog when the throttling begins.
+        void                            SetMaxEventsPerTick(unsigned int n)
+                                                                { max_events = n; }
         /// Sets the global tempo scale.
         /// \param scale the percentage: 100 = no scaling, 200 = twice faster, 50 = twice slower, etc.
         /// \return **true** if _scale_ is a valid number, **false** otherwise (actually only if it is 0).
@@ -363,6 +405,14 @@ class MIDISequencer : public MIDITickComponent {
         /// \param offset the offset in MIDI ticks
         /// \return **true** if _trk_num_ is valid (and the offset has been changed), **false** otherwise.
         virtual bool                    SetTrackTimeShift(unsigned int trk_num, int offset);
+        /// Sets the latency compensation (in msecs) for a track, for example for a sound with a slow attack.
+        /// In look ahead mode the messages of the track are scheduled earlier by this amount plus the device
+        /// latency of its out port (see MIDIOutDriver::SetDeviceLatency()), so that they sound in time in wall
+        /// clock time at any tempo (while the time shift is in MIDI ticks and scales with the tempo). The look
+        /// ahead window is widened by the greatest compensation of the tracks. The compensation has no effect if
+        /// the look ahead is 0 (see SetLookAhead()). This method is thread-safe and can be called during playback.
+        /// \return **true** if _trk_num_ is valid (and the latency has been changed), **false** otherwise.
+        bool                            SetTrackLatency(unsigned int trk_num, unsigned int msecs);
 
         /// Inserts into the internal MIDIMultiTrack a new empty track with default track parameters (transpose,
         /// time offset, etc.). This method is thread-safe and can be called during playback. Notifies the GUI a
@@ -435,9 +485,34 @@ class MIDISequencer : public MIDITickComponent {
         /// Same of GetNextEventTime(), but time is returned in milliseconds from the beginning.
         virtual bool                    GetNextEventTimeMs (float *time_ms);
         /// Converts a time from MIDI ticks into milliseconds, taking into account all tempo changes from the
-        /// beginning of the song to the given time.
+        /// beginning of the song to the given time. The sequencer keeps a map of the tempo changes, which is
+        /// rebuilt only when a track is edited (see MIDITrack::GetEditId()), so the conversion takes a binary
+        /// search and doesn't depend on the song position.
         /// \param time_clk the time to convert
         float                           MIDItoMs(MIDIClockTime time_clk);  // new : added by me
+        /// Converts a time from milliseconds into MIDI ticks (the inverse of MIDItoMs()), rounding it to the
+        /// nearest tick.
+        /// \param time_ms the time to convert
+        MIDIClockTime                   MsToMIDI(float time_ms);
+        /// Renders the song faster than real time, sending to a sink all the messages which would be sent to the
+        /// ports during playback, processed by the track processors and with their time in usecs (computed from
+        /// the tempo changes and the current tempo scale). The sequencer state is not changed, so you can call
+        /// this also during playback; meta events and beat markers are not rendered. The time shift of the tracks
+        /// is applied only if enabled with SetTimeShiftMode().
+        /// \param sink the MIDIRenderSink which receives the messages (in time order)
+        /// \param start, end the range of the rendered messages, in MIDI ticks (_end_ is excluded; 0 means the
+        /// end of the song)
+        /// \param n_threads the number of threads. It is ignored by the MIDISequencer, which always renders
+        /// in the calling thread, and used by the AdvancedSequencer, which can render disjoint ranges of the song
+        /// in parallel (0 means std::thread::hardware_concurrency())
+        /// \return **false** if the parameters are not valid, **true** otherwise.
+        /// \note The sequencer is locked only while the data needed for the rendering are copied, so the playback
+        /// goes on while the messages are rendered. You must not edit the multitrack, nor change or delete the
+        /// track processors of a MIDISequencer (the AdvancedSequencer uses copies of them), until the method
+        /// returns. If you set an extra processor for a track (see MIDISequencerTrackProcessor) it could be called
+        /// by more threads at the same time.
+        virtual bool                    Render(MIDIRenderSink* sink, MIDIClockTime start = 0, MIDIClockTime end = 0,
+                                               unsigned int n_threads = 1);
         /// TODO
         MIDIClockTime                   MeasToMIDI(unsigned int meas, unsigned int beat = 0, unsigned int offset = 0);
         /// This is equivalent of GoToTime(state.cur_clock) and should be used to update the sequencer
@@ -497,11 +572,148 @@ class MIDISequencer : public MIDITickComponent {
 
         /// \cond EXCLUDED
         // Internal use: scans events at 'now' time upgrading the sequencer state
-        void                            ScanEventsAtThisTime();
+        void                            ScanEventsAtThisTime()  { StateScanEventsAtThisTime(&state); }
+        // Internal use: the start of TickProc() (auto stop and count in); returns false if the tick must
+        // not send events. The caller must hold proc_lock
+        bool                            BeginTick(tMsecs sys_time);
+        // Internal use: the same of GetNextEvent() and GetNextEventTime(), without locking (the caller
+        // must hold proc_lock)
+        bool                            NextEvent(int *trk_num, MIDITimedMessage *msg)
+                                                { return StateNextEvent(&state, trk_num, msg, play_mode); }
+        bool                            NextEventTime(MIDIClockTime *time_clk)
+                                                { return StateNextEventTime(&state, time_clk, play_mode); }
+        // Internal use: the same of NextEvent() and NextEventTime() on a given state with the given play mode
+        // (used by Render(), which doesn't touch the sequencer state)
+        // If procs is not 0 its processors are used instead of the track processors
+        bool                            StateNextEvent(MIDISequencerState* st, int *trk_num, MIDITimedMessage *msg,
+                                                       int mode, const std::vector<MIDIProcessor*>* procs = 0) const;
+        bool                            StateNextEventTime(MIDISequencerState* st, MIDIClockTime *time_clk,
+                                                           int mode) const;
+        // Internal use: the same of ScanEventsAtThisTime() and of the time moving of GoToMeasure() on a given
+        // state (they don't notify and don't touch the time offsets). If ctx is not 0 its play mode and
+        // processors are used instead of the sequencer ones, so they can run without proc_lock
+        struct RenderContext;
+        void                            StateScanEventsAtThisTime(MIDISequencerState* st,
+                                                                  const RenderContext* ctx = 0) const;
+        bool                            StateGoToMeasure(MIDISequencerState* st, unsigned int measure,
+                                                         unsigned int beat, const RenderContext* ctx = 0) const;
+        // Internal use: rebuilds the tempo map if the multitrack was edited
+        void                            UpdateTempoMap();
+
+        // A segment of the tempo map: the time in msecs and the msecs per clock are without tempo scale
+        struct TempoSegment {
+            MIDIClockTime   clock;
+            double          ms;
+            double          ms_per_clock;
+        };
+        // Internal use: the segment of the tempo map tmap which contains the given MIDI time, and the time in
+        // msecs (without tempo scale) of the time
+        static const TempoSegment&      TempoMapSegment(const std::vector<TempoSegment>& tmap, MIDIClockTime t);
+        static double                   TempoMapMs(const std::vector<TempoSegment>& tmap, MIDIClockTime t);
+
+        // Internal use: what RenderRange() and PrepareLoop() take from the sequencer. They copy it under
+        // proc_lock and then work without the lock, so the playback is never stopped by them
+        struct RenderContext {
+                                        RenderContext() : us_per_ms(0.0), play_mode(0) {}
+                                        ~RenderContext();
+            std::vector<TempoSegment>   tempo_map;      // a copy of the tempo map
+            std::vector<unsigned int>   out_ports;      // the out port of every track
+            std::vector<MIDIProcessor*> processors;     // the processor of every track
+            std::vector<MIDIProcessor*> copies;         // the processors given by CopyTrackProcessor() (deleted)
+            double                      us_per_ms;      // msecs without tempo scale -> usecs with tempo scale
+            int                         play_mode;      // the play mode
+        };
+        // Internal use: fills ctx. The caller must hold proc_lock and have updated the tempo map
+        void                            MakeRenderContext(RenderContext* ctx) const;
+        // Internal use: returns a copy of the processor of a track, owned by the caller, or 0 if Render() must
+        // call the processor itself (the MIDISequencer doesn't know the type of the processors, so it returns 0)
+        virtual MIDIProcessor*          CopyTrackProcessor(unsigned int trk_num) const  { return 0; }
+        // Internal use: sends to the sink the messages from the state st to the time end (0 is the end of the
+        // song) skipping those before start. It only uses st and ctx, so it doesn't need proc_lock
+        void                            RenderRange(MIDISequencerState* st, MIDIClockTime start, MIDIClockTime end,
+                                                    const RenderContext& ctx, MIDIRenderSink* sink) const;
 
         // Internal use: prepares the count in
         void                            CountInPrepare();
 
+        // A message with its track
+        struct TrackMessage {
+            unsigned int        track;
+            MIDITimedMessage    msg;
+        };
+        // The data computed by PrepareLoop(), so that the loop wrap in the timer tick only has to copy the state
+        struct LoopData {
+                                        LoopData(MIDIMultiTrack* m) : state(m, 0), end_state(m, 0), gen(0),
+                                                                      meas(0), end_meas(0) {}
+            MIDISequencerState          state;      // the state at the loop start
+            MIDISequencerState          end_state;  // the state at the loop end
+            unsigned long               gen;        // the value of loop_gen when it was computed
+            unsigned int                meas;       // the loop start measure
+            unsigned int                end_meas;   // the loop end measure
+            std::vector<unsigned long>  ids;        // the track edit ids when it was computed
+            std::vector<TrackMessage>   offs;       // the note offs for the notes sounding at the loop end
+            std::vector<TrackMessage>   chase;      // the messages to send at the loop start (AdvancedSequencer)
+        };
+
+        // Internal use: computes a new LoopData and swaps it with loop. The data are copied under proc_lock, then
+        // the events are replayed without the lock. It is called by Start() and by the worker when the loop or the
+        // tracks change during playback. Returns false if the loop was changed meanwhile (the worker does it again)
+        bool                            PrepareLoop();
+        // Internal use: called by PrepareLoop() under proc_lock, sets the state from which the loop start is
+        // searched (the MIDISequencer uses the state at time 0)
+        virtual void                    GetLoopStartState(MIDISequencerState* st);
+        // Internal use: called by PrepareLoop() without proc_lock, computes the loop data moving ld->state to the
+        // loop start. It only uses ld, ctx and the data saved by GetLoopStartState(). Returns false if the loop
+        // start is after the end of the song
+        virtual bool                    ComputeLoop(LoopData* ld, const RenderContext& ctx);
+        // Internal use: returns true if loop is computed for the current loop and tracks
+        bool                            IsLoopPrepared() const;
+        // Internal use: called when something changes the loop start state; if the sequencer is playing it
+        // asks the worker to compute it again
+        void                            InvalidateLoop();
+        // The jobs which the worker does out of the tick (see RequestJob()); subclasses can add their own bits
+        enum { JOB_PREPARE_LOOP = 1 };
+        // Internal use: wakes up the worker, telling it to do the given jobs (a combination of JOB_xxx bits)
+        void                            RequestJob(unsigned int jobs);
+        // Internal use: called by the worker (without proc_lock) to do the requested jobs
+        virtual void                    DoJobs(unsigned int jobs);
+        // Internal use: called by the tick when it reaches the loop end, whose time is end_ms (it can be in the
+        // look ahead window). It moves the sequencer to the loop start and sets the time offsets so that the loop
+        // start is played at end_ms
+        void                            WrapLoop(float end_ms);
+        // Internal use: copies the loop start state into the sequencer state, keeping the tempo scale. sys_ms is
+        // the system time of the loop start, for the messages which must be sent with it
+        virtual void                    LoadLoopState(double sys_ms);
+        // Internal use: the loop wrap when the worker has not yet prepared the loop. It moves the iterator to the
+        // loop start without replaying the events before it, so the programs and controllers are not changed
+        virtual void                    SkipToLoopStart(double sys_ms);
+        // Internal use: sends a message at the loop wrap, scheduling it at the system time sys_ms if the look
+        // ahead is on
+        void                            SendLoopMessage(const TrackMessage& ev, double sys_ms);
+
+        // Internal use: returns true if the out drivers have scheduled messages not yet sent
+        bool                            HasScheduledMessages() const;
+        // Internal use: returns the latency compensation in msecs of a track (the track latency plus the device
+        // latency of its port) and the greatest compensation of the tracks
+        unsigned int                    GetCompensation(unsigned int trk_num) const;
+        unsigned int                    GetMaxCompensation() const;
+        // Internal use: returns the system time in usecs at which a message of the track which must sound at the
+        // system time sys_ms (in msecs) is scheduled
+        tUsecs                          SchedTime(double sys_ms, unsigned int trk_num) const;
+        // Internal use: start and stop the worker, which runs during playback. It does the jobs which must not be
+        // done in the tick (see DoJobs()) and, if the pre-render is on and the look ahead is not 0, it calls
+        // TickProc() instead of the timer
+        void                            StartWorker();
+        void                            StopWorker();
+        // Internal use: if called by the worker (for example by a notifier), makes another thread stop the
+        // sequencer, as the worker can't wait for itself. Returns true if the stop was deferred
+        bool                            DeferStop();
+        // Internal use: the worker thread procedure
+        void                            WorkerProc();
+        // Internal use: locks proc_lock from the worker, which must not block on it (Stop() can hold it while
+        // it waits for the worker). Returns false if the worker must exit
+        bool                            WorkerLock();
+
         MIDITimedMessage                beat_marker_msg;    // Used by the sequencer to send beat marker messages
 
         bool                            repeat_play_mode;   // Enables the repeat play mode
@@ -509,9 +721,28 @@ class MIDISequencer : public MIDITickComponent {
         unsigned int                    repeat_end_meas;    // The loop end measure
         bool                            time_shift_mode;    // The time shift on/off (during playback time shift is always on)
         int                             play_mode;          // PLAY_BOUNDED or PLAY_UNBOUNDED
+        unsigned int                    look_ahead;         // The look ahead time in msecs
+        bool                            pre_render;         // The pre-render mode
+        std::atomic<bool>               worker_on;          // True if the worker calls TickProc() instead of the timer
+        bool                            worker_exit;        // Tells the worker to exit
+        std::thread                     worker;             // The worker thread
+        std::mutex                      worker_mutex;       // Protects worker_exit
+        std::condition_variable         worker_cond;        // Wakes up the worker
+        std::atomic<unsigned int>       max_events;         // The maximum number of events in a tick (0 = no limit)
+        std::atomic<unsigned long>      num_throttled;      // The number of ticks which reached max_events
+        bool                            throttling;         // True if the last tick reached max_events
+        MIDIClockTime                   repeat_start_clock; // The time of the loop start, updated by Start()
+        MIDIClockTime                   repeat_end_clock;   // The time of the loop end, updated by Start()
+        std::atomic<unsigned int>       worker_jobs;        // The jobs requested to the worker
 
         std::vector<MIDIProcessor*>     track_processors;   // A MIDIProcessor for every track
+        std::vector<TempoSegment>       tempo_map;          // The tempo segments, in time order
+        std::vector<unsigned long>      tempo_map_ids;      // The edit ids of the tracks when the map was built
+        MIDIClockTime                   tempo_map_clks;     // The clocks per beat when the map was built
         MIDISequencerState              state;              // The sequencer state
+
+        LoopData*                       loop;               // The prepared loop (see PrepareLoop()), or 0
+        unsigned long                   loop_gen;           // Incremented when the loop must be prepared again
         /// \endcond
 };
 
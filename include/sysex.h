@@ -83,6 +83,9 @@ class  MIDISystemExclusive {
         bool                        IsXGReset() const;
         /// Appends a byte to the buffer, without adding it to checksum.
         void	                    PutSysByte(unsigned char b) { buffer.push_back(b); }
+        /// Appends _len_ bytes to the buffer in a single copy, without adding them to checksum.
+        void	                    PutSysBytes(const unsigned char* buf, unsigned int len)
+                                                                { buffer.insert(buffer.end(), buf, buf + len); }
         /// Appends a byte to the buffer, adding it to checksum.
         void	                    PutByte(unsigned char b)    { PutSysByte(b); chk_sum += b; }
         /// Appends a System exclusive Start byte (0xF0) to the buffer, without affecting the checksum.
@@ -42,6 +42,8 @@
 
 /// The type of a variable which can hold the elapsed time in milliseconds.
 typedef unsigned long long tMsecs;
+/// The type of a variable which can hold the elapsed time in microseconds.
+typedef unsigned long long tUsecs;
 /// This is the typedef of the callback functions which are called at every timer tick. See the MIDITickComponent
 /// class. .
 typedef  void (MIDITick)(tMsecs, void*);
@@ -100,6 +102,11 @@ class MIDITimer {
         static tMsecs               GetSysTimeMs()
                                         { return std::chrono::duration_cast<std::chrono::milliseconds>
                                                  (std::chrono::steady_clock::now() - sys_clock_base).count(); }
+        /// Returns the elapsed time in microseconds since the start of application (the same 0 time of
+        /// GetSysTimeMs()).
+        static tUsecs               GetSysTimeUs()
+                                        { return std::chrono::duration_cast<std::chrono::microseconds>
+                                                 (std::chrono::steady_clock::now() - sys_clock_base).count(); }
         /// Stops the calling thread for the given number of milliseconds. Other threads continue their
         /// execution.
         static void                 Wait(unsigned int msecs)
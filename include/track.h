@@ -38,6 +38,7 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
 
 /// \addtogroup GLOBALS
 ///@{
@@ -96,12 +97,15 @@ class  MIDITrack {
         /// The assignment operator.
         MIDITrack&                  operator=(const MIDITrack &trk);
         /// Deletes all events leaving the track empty (i.e.\ with only the EOT event) and
-        /// resets time_shift, in_port, out_port to 0.
+        /// resets time_shift, latency, in_port, out_port to 0.
         void                        Reset();
         /// Deletes all events leaving the track empty (i.e.\ with only the EOT event).
         /// \param mantain_end If it is **true** the method doesn't change the time of the EOT,
         /// otherwise sets it to 0.
         void	                    Clear(bool mantain_end = false);
+        /// Allocates memory for _n_ events (plus the EOT), so that adding them doesn't reallocate the buffer
+        /// (which copies all the events). It doesn't change the track content.
+        void                        Reserve(unsigned int n)             { events.reserve(n + 1); }
 
         /// Returns the number of events in the track (if the track is empty this returns
         /// 1, for the EOT event).
@@ -129,11 +133,18 @@ class  MIDITrack {
         /// \ref TYPE_MIXED_CHAN, \ref TYPE_UNKNOWN, \ref TYPE_SYSEX, \ref TYPE_RESET_SYSEX, \ref TYPE_BOTH_SYSEX).
         /// \note This is **not** const, because it may call Analyze(), causing an update of the track status.
         unsigned char               GetType();
+        /// Returns a number which changes every time the track is edited by its methods (it is unique among all
+        /// the tracks), so you can check if a track was changed since a previous call. Changing the time shift or
+        /// the latency changes it too, as they change the playing times. Editing an event through the pointer
+        /// returned by GetEventAddress() or the reference returned by GetEvent() is not detected.
+        unsigned long               GetEditId() const                       { return edit_id; }
         /// Returns the channel for recording (-1 for all channels).
         /// See \ref NUMBERING
         int                         GetRecChannel()                         { return (int)rec_chan; }
         /// Returns the track time shift in MIDI ticks.
         int                         GetTimeShift() const                    { return time_shift; }
+        /// Returns the track latency compensation in msecs.
+        unsigned int                GetLatency() const                      { return latency; }
         /// Returns non zero if the track contains MIDI SysEx messages. In this case it can return one of
         /// \ref TYPE_SYSEX, \ref TYPE_RESET_SYSEX or \ref TYPE_BOTH_SYSEX.
         /// \note This is **not** const, because it may call Analyze(), causing an update of the track status.
@@ -168,7 +179,9 @@ class  MIDITrack {
         /// \return **true** if _port_ is a valid port number, **false** otherwise.
         bool                        SetOutPort(unsigned int port);
         /// Sets the track time shift in MIDI ticks.
-        void                        SetTimeShift(int t)                 { time_shift = t; }
+        void                        SetTimeShift(int t)                 { time_shift = t; edit_id = ++edit_count; }
+        /// Sets the track latency compensation in msecs (see MIDISequencer::SetTrackLatency()).
+        void                        SetLatency(unsigned int ms)         { latency = ms; edit_id = ++edit_count; }
         /// Sets the time of the EOT event equal to the time of the last (non data end) event
         /// of the track.
         void                        ShrinkEndTime();
@@ -314,15 +327,21 @@ class  MIDITrack {
         void                        Analyze();
 
         /// \cond EXCLUDED
+        // Marks the track as edited: the status must be updated and the edit id changes
+        void                        SetDirty()                  { status |= STATUS_DIRTY; edit_id = ++edit_count; }
+
         std::vector<MIDITimedMessage>
                                     events;     // The buffer of events
         int                         status;     // A bitfield used to determine the track type
         signed char                 rec_chan;   // The channel for recordng, or -1 for all channels
         int                         time_shift; // The time shift in MIDI ticks
+        unsigned int                latency;    // The latency compensation in msecs
         unsigned int                in_port;    // The in port id for recording midi events
         unsigned int                out_port;   // The out port id for playing midi events
+        unsigned long               edit_id;    // See GetEditId()
 
         static tInsMode             ins_mode;   // See SetInsertMode()
+        static std::atomic<unsigned long> edit_count;   // Gives the edit ids
         /// \endcond
 };
 
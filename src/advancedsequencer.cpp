@@ -25,8 +25,13 @@
 
 #include "../include/advancedsequencer.h"
 #include "../include/manager.h"
+#include "../include/filecache.h"
+#include "../include/log.h"
 
 #include <iostream>
+#include <thread>
+#include <algorithm>
+#include <functional>
 
 
 
@@ -111,8 +116,18 @@ AdvancedSequencer::AdvancedSequencer(MIDISequencerGUINotifier *n) :
     MIDISequencer (new MIDIMultiTrack(17) , n),
     num_measures(0),
     file_loaded (false),
+    render_mode (false),
+    render_valid (false),
+    render_gen (0),
+    render_pos (0),
+    render_state_stale (false),
+    chase_trk (-2),
+    cmd_in_pos (0),
+    cmd_out_pos (0),
     owns_tracks (true)                          // remembers that the multitrack is owned
 {
+    for (unsigned int i = 0; i < CMD_RING_SIZE; i++)
+        cmd_ring[i].seq = i;
     // sets warp_positions and num_measures (needed even if multitrack is empty, otherwise warp_position would be empty)
     ExtractWarpPositions();
     // sets the embedded MIDIThru only if the system has almost an in port
@@ -129,8 +144,18 @@ AdvancedSequencer::AdvancedSequencer(MIDISequencerGUINotifier *n) :
 
 AdvancedSequencer::AdvancedSequencer(MIDIMultiTrack* mlt, MIDISequencerGUINotifier *n) :
     MIDISequencer (mlt, n),
+    render_mode (false),
+    render_valid (false),
+    render_gen (0),
+    render_pos (0),
+    render_state_stale (false),
+    chase_trk (-2),
+    cmd_in_pos (0),
+    cmd_out_pos (0),
     owns_tracks (false)                         // remembers that the multitrack is not owned
 {
+    for (unsigned int i = 0; i < CMD_RING_SIZE; i++)
+        cmd_ring[i].seq = i;
     MIDIManager::AddMIDITick(this);
     file_loaded = !state.multitrack->IsEmpty();
     ExtractWarpPositions();                     // sets warp_positions and num_measures
@@ -166,6 +191,12 @@ AdvancedSequencer::~AdvancedSequencer() {
 void AdvancedSequencer::Reset() {
     Stop();
     MIDITimer::Wait(500);       // pauses for 0.5 sec (TROUBLE WITHOUT THIS!!!! I DON'T KNOW WHY) TODO: eliminate this?
+    ResetTracks();
+    ExtractWarpPositions();
+}
+
+
+void AdvancedSequencer::ResetTracks() {
     MIDISequencer::Reset();     // syncronize the num of tracks and reset track processors (now calls GoToZero())
     for (unsigned  int i = 0; i < GetNumTracks(); ++i) {    // MIDISequencer::Reset() deletes the processors
         track_processors[i] = new MIDISequencerTrackProcessor;
@@ -173,19 +204,18 @@ void AdvancedSequencer::Reset() {
         GetTrack(i)->GetStatus();
     }
     file_loaded = !state.multitrack->IsEmpty();     // the multitrack is not cleared by this
-    ExtractWarpPositions();
+    render_valid = false;
+    render_gen++;
 }
 
 
 bool AdvancedSequencer::Load (const char *fname) {
     Stop();
-    // copy the old multitrack in case we need to rstore it
-    MIDIMultiTrack undo_multi = *state.multitrack;
-    //state.multitrack->Reset();    this is done by LoadMIDIFile
-
-    bool load = LoadMIDIFile(fname, state.multitrack, &header);
-    if(!load)
-        *state.multitrack = undo_multi;
+    // load into a new multitrack, so that a failed load leaves the old one untouched without copying it
+    MIDIMultiTrack new_multi;
+    bool load = LoadMIDIFile(fname, &new_multi, &header);
+    if (load)
+        state.multitrack->Swap(new_multi);   // new_multi deletes the old tracks
     Reset();                    // synchronizes the sequencer with the multitrack, goes to 0, calls
                                 // ExtractWarpPositions() and sets file_loaded
     // UpdateStatus();
@@ -203,6 +233,52 @@ bool AdvancedSequencer::Load (const MIDIMultiTrack* tracks) {
 }
 
 
+bool AdvancedSequencer::LoadCached(const char* fname, const char* cache_name) {
+    std::string c_name = cache_name ? cache_name : std::string(fname) + ".nmc";
+    MIDIFileCache cache;
+    if (!cache.Load(c_name.c_str(), fname)) {
+        // no cache or stale cache: load the file and write the cache
+        if (!Load(fname))
+            return false;
+        SaveCache(c_name.c_str());
+        return true;
+    }
+
+    Stop();
+    cache.GetMultiTrack(state.multitrack);
+    header = cache.GetHeader();
+    // this is the same of Reset(), but the tempo map and the warp positions are read from the cache
+    ResetTracks();
+    const std::vector<MIDICacheTempo>& tmap = cache.GetTempoMap();
+    tempo_map.resize(tmap.size());
+    for (unsigned int i = 0; i < tmap.size(); i++) {
+        tempo_map[i].clock = tmap[i].clock;
+        tempo_map[i].ms = tmap[i].time_ms;
+        tempo_map[i].ms_per_clock = tmap[i].ms_per_clock;
+    }
+    tempo_map_clks = GetClksPerBeat();          // UpdateTempoMap() now finds the map valid
+    tempo_map_ids.resize(GetNumTracks());
+    for (unsigned int i = 0; i < GetNumTracks(); i++)
+        tempo_map_ids[i] = GetTrack(i)->GetEditId();
+    if (cache.GetWarpPositions(&warp_positions, state)) {
+        num_measures = cache.GetNumMeasures();
+        for (unsigned int i = 0; i < GetNumTracks(); i++)
+            GetChaseIndex(i);
+    }
+    else
+        ExtractWarpPositions();
+    return true;
+}
+
+
+bool AdvancedSequencer::SaveCache(const char* cache_name) {
+    if (!file_loaded || header.filename.empty())
+        return false;
+    std::string c_name = cache_name ? cache_name : header.filename + ".nmc";
+    return MIDIFileCache::Save(c_name.c_str(), state.multitrack, header, &warp_positions, num_measures);
+}
+
+
 void AdvancedSequencer::UnLoad() {
     Stop();
     state.multitrack->Reset();
@@ -337,7 +413,7 @@ int AdvancedSequencer::GetTrackTranspose (unsigned int trk_num) const {
 int AdvancedSequencer::GetTrackTimeShift (unsigned int trk_num) const {
     if (!file_loaded)
         return 0;
-    return GetTrackTimeShift(trk_num);
+    return MIDISequencer::GetTrackTimeShift(trk_num);
 }
 
 
@@ -376,23 +452,7 @@ bool AdvancedSequencer::SetMIDIThruTranspose (int amt) {
 bool AdvancedSequencer::SetTrackSolo (unsigned int trk_num) {   // unsoloing done by UnSoloTrack()
     if (!file_loaded || !state.multitrack->IsValidTrackNumber(trk_num))
         return false;
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    for (unsigned int i = 0; i < GetNumTracks(); ++i ) {
-        if(i == trk_num) {
-            ((MIDISequencerTrackProcessor *)track_processors[i])->solo = MIDISequencerTrackProcessor::SOLOED;
-            if (IsPlaying())
-                // track could be muted before soloing: this sets appropriate CC, PC, etc
-                // not previously sent
-                CatchEventsBefore(trk_num);     // MUST be here! We must previously unmute the track!
-        }
-        else {
-            ((MIDISequencerTrackProcessor *)track_processors[i])->solo = MIDISequencerTrackProcessor::NOT_SOLOED;
-            if (IsPlaying() && GetTrackChannel(i) != -1) {
-                MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->AllNotesOff(GetTrackChannel(i));
-                GetTrackState(i)->note_matrix.Reset();
-            }
-        }
-    }
+    PostCommand(CMD_SOLO, trk_num, 0);
     return true;
 }
 
@@ -400,32 +460,14 @@ bool AdvancedSequencer::SetTrackSolo (unsigned int trk_num) {   // unsoloing don
 void AdvancedSequencer::UnSoloTrack()  {
     if (!file_loaded)
         return;
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    for(unsigned int i = 0; i < GetNumTracks(); ++i ) {
-        bool old_solo = ((MIDISequencerTrackProcessor *)track_processors[i])->solo;
-        ((MIDISequencerTrackProcessor *)track_processors[i])->solo = MIDISequencerTrackProcessor::NO_SOLO;
-        if (IsPlaying() && !old_solo)
-            // this sets appropriate CC, PC, etc for previously muted tracks
-            CatchEventsBefore();
-    }
+    PostCommand(CMD_UNSOLO, 0, 0);
 }
 
 
 bool AdvancedSequencer::SetTrackMute (unsigned int trk_num, bool f) {
     if (!file_loaded || !state.multitrack->IsValidTrackNumber(trk_num))
         return false;
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    GetTrackProcessor(trk_num)->mute = f;
-    int channel = GetTrackChannel(trk_num);
-    if (IsPlaying() && channel != -1) {
-        if(f) {
-            MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->AllNotesOff(channel);
-            GetTrackState(trk_num)->note_matrix.Reset();
-        }
-        else
-            // track was muted: this set appropriate CC, PC, etc not previously sent
-            CatchEventsBefore(trk_num);
-    }
+    PostCommand(CMD_MUTE, trk_num, f);
     return true;
 }
 
@@ -433,20 +475,14 @@ bool AdvancedSequencer::SetTrackMute (unsigned int trk_num, bool f) {
 void AdvancedSequencer::UnmuteAllTracks() {
     if (!file_loaded)
         return;
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    for (unsigned int i = 0; i < GetNumTracks(); ++i)
-        GetTrackProcessor(i)->mute = false;
-    if (IsPlaying())
-        // this set appropriate CC, PC, etc for previously muted tracks
-        CatchEventsBefore();
+    PostCommand(CMD_UNMUTE_ALL, 0, 0);
 }
 
 
 bool AdvancedSequencer::SetTrackVelocityScale (unsigned int trk_num, unsigned int scale) {
     if (!file_loaded || !state.multitrack->IsValidTrackNumber(trk_num))
         return false;
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    ((MIDISequencerTrackProcessor *)track_processors[trk_num])->velocity_scale = scale;
+    PostCommand(CMD_VELOCITY_SCALE, trk_num, scale);
     return true;
 }
 
@@ -454,12 +490,7 @@ bool AdvancedSequencer::SetTrackVelocityScale (unsigned int trk_num, unsigned in
 bool AdvancedSequencer::SetTrackRechannelize (unsigned int trk_num, int chan) {
     if (!file_loaded || !state.multitrack->IsValidTrackNumber(trk_num))
         return false;
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    if (IsPlaying() && GetTrackChannel(trk_num) != chan && !(GetTrackChannel(trk_num) == -1)) {
-        MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->AllNotesOff(GetTrackChannel(trk_num));
-        GetTrackState(trk_num)->note_matrix.Reset();
-    }
-    GetTrackProcessor(trk_num)->rechannel = chan;
+    PostCommand(CMD_RECHANNELIZE, trk_num, chan);
     return true;
 }
 
@@ -467,12 +498,87 @@ bool AdvancedSequencer::SetTrackRechannelize (unsigned int trk_num, int chan) {
 bool AdvancedSequencer::SetTrackTranspose (unsigned int trk_num, int amt) {
     if (!file_loaded || !state.multitrack->IsValidTrackNumber(trk_num))
         return false;
+    PostCommand(CMD_TRANSPOSE, trk_num, amt);
+    return true;
+}
+
+
+bool AdvancedSequencer::SetRenderMode(bool on) {
     std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    if (IsPlaying() && GetTrackTranspose(trk_num) != amt && !(GetTrackChannel(trk_num) == -1)) {
-        MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->AllNotesOff(GetTrackChannel(trk_num));
-        GetTrackState(trk_num)->note_matrix.Reset();
+    if (IsPlaying())
+        return false;
+    render_mode = on;
+    if (!on) {                                  // free the memory
+        std::vector<RenderEvent>().swap(render_list);
+        std::vector<MIDITimedMessage>().swap(render_sysex);
+        render_valid = false;
     }
-    GetTrackProcessor(trk_num)->transpose = amt;
+    return true;
+}
+
+
+bool AdvancedSequencer::SetTempoScale(unsigned int scale) {
+    if (scale == 0)
+        return false;
+    PostCommand(CMD_TEMPO_SCALE, 0, scale);
+    return true;
+}
+
+
+bool AdvancedSequencer::Render(MIDIRenderSink* sink, MIDIClockTime start, MIDIClockTime end, unsigned int n_threads) {
+    if (sink == 0 || (end != 0 && end <= start))
+        return false;
+    if (n_threads == 0)
+        n_threads = std::thread::hardware_concurrency();
+    RenderContext ctx;
+    std::vector<MIDISequencerState> warps;      // copies of the warp positions in the rendered range
+
+    proc_lock.lock();
+    // the warp positions were saved with the time shift mode of that moment
+    if (warp_positions.empty() || warp_positions[0].iterator.GetTimeShiftMode() != time_shift_mode) {
+        proc_lock.unlock();
+        return MIDISequencer::Render(sink, start, end);
+    }
+    UpdateTempoMap();
+    MakeRenderContext(&ctx);
+    // the first warp position is the last one at or before start, the last is the last one before end
+    unsigned int first = 0;
+    while (first + 1 < warp_positions.size() && warp_positions[first + 1].cur_clock <= start)
+        first++;
+    unsigned int last = first + 1;
+    while (last < warp_positions.size() && (end == 0 || warp_positions[last].cur_clock < end))
+        last++;
+    if (n_threads > last - first)
+        n_threads = last - first;
+    // with one thread only the first position is needed
+    warps.assign(warp_positions.begin() + first, warp_positions.begin() + (n_threads <= 1 ? first + 1 : last));
+    proc_lock.unlock();
+
+    for (unsigned int i = 0; i < warps.size(); i++)
+        warps[i].notifier = 0;
+    if (n_threads <= 1) {
+        // no need of threads, but we can start from the warp position
+        RenderRange(&warps[0], start, end, ctx, sink);
+        return true;
+    }
+
+    // deal the warp intervals to the threads: every thread renders its messages into a vector
+    unsigned int num = warps.size();
+    std::vector<MIDIRenderVectorSink> buffers(n_threads);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < n_threads; i++) {
+        unsigned int w_start = num * i / n_threads;
+        unsigned int w_end = num * (i + 1) / n_threads;
+        MIDIClockTime r_start = i == 0 ? start : warps[w_start].cur_clock;
+        MIDIClockTime r_end = w_end < num ? warps[w_end].cur_clock : end;
+        workers.push_back(std::thread(&AdvancedSequencer::RenderRange, this, &warps[w_start], r_start, r_end,
+                                      std::cref(ctx), &buffers[i]));
+    }
+    for (unsigned int i = 0; i < n_threads; i++)
+        workers[i].join();
+    for (unsigned int i = 0; i < n_threads; i++)
+        for (unsigned int j = 0; j < buffers[i].events.size(); j++)
+            sink->Put(buffers[i].events[j]);
     return true;
 }
 
@@ -489,11 +595,14 @@ bool AdvancedSequencer::GoToTime (MIDIClockTime time_clk) {
         if (warp_positions[warp_to_item + 1].cur_clock > time_clk)
             break;
     }
-    SetState (&warp_positions[warp_to_item]);
+    SetWarpState(warp_to_item);
     ret = MIDISequencer::GoToTime (time_clk);
     if (ret) {              // we have effectively moved time
-        if (IsPlaying())
+        if (IsPlaying()) {
+            if (render_mode)
+                SyncRenderPos(state.cur_clock);
             CatchEventsBefore();
+        }
     else
         for (unsigned int i = 0; i < GetNumTracks(); ++i)
             GetTrackState(i)->note_matrix.Reset();
@@ -511,14 +620,19 @@ bool AdvancedSequencer::GoToTimeMs(float time_ms) {
     // requested time
     unsigned int warp_to_item = 0;
     for (; warp_to_item < warp_positions.size() - 1; warp_to_item++) {
-        if (warp_positions[warp_to_item + 1].cur_time_ms > time_ms)
+        // the warp times are computed with the tempo scale of the warp positions
+        if (warp_positions[warp_to_item + 1].cur_time_ms * warp_positions[warp_to_item + 1].tempo_scale /
+            state.tempo_scale > time_ms)
             break;
     }
-    SetState (&warp_positions[warp_to_item]);
+    SetWarpState(warp_to_item);
     ret = MIDISequencer::GoToTimeMs (time_ms);
     if (ret) {              // we have effectively moved time
-        if (IsPlaying())
+        if (IsPlaying()) {
+            if (render_mode)
+                SyncRenderPos(state.cur_clock);
             CatchEventsBefore();
+        }
         else
             for (unsigned int i = 0; i < GetNumTracks(); ++i)
                 GetTrackState(i)->note_matrix.Reset();
@@ -540,11 +654,14 @@ bool AdvancedSequencer::GoToMeasure (int measure, int beat) {
     if (warp_to_item >= warp_positions.size())
         warp_to_item = warp_positions.size() - 1;
 
-    SetState (&warp_positions[warp_to_item]);
+    SetWarpState(warp_to_item);
     ret = MIDISequencer::GoToMeasure (measure, beat);
     if (ret) {                  // we have effectively moved time
-        if (IsPlaying())
+        if (IsPlaying()) {
+            if (render_mode)
+                SyncRenderPos(state.cur_clock);
             CatchEventsBefore();
+        }
         else
             for (unsigned int i = 0; i < GetNumTracks(); ++i)
                 GetTrackState (i)->note_matrix.Reset();
@@ -562,6 +679,7 @@ void AdvancedSequencer::Start () {
     std::lock_guard<std::recursive_mutex> lock(proc_lock);
     std::cout << "\t\tEntered in AdvancedSequencer::Start() ...\n";
     MIDISequencer::Stop();
+    ExecCommands();                             // the changes posted before the restart
     if (repeat_play_mode)
         GoToMeasure (repeat_start_meas);
 
@@ -571,7 +689,18 @@ void AdvancedSequencer::Start () {
     // sequencer state, but it would track even CC (not difficult) and SYSEX messages
     CatchEventsBefore();
 
+    if (render_mode) {
+        if (!IsRenderListValid())
+            BuildRenderList();
+        SyncRenderPos(state.cur_clock);
+    }
+    chase_trk = -2;
+    chase_ready.clear();
+
     state.iterator.SetTimeShiftMode(true);
+    repeat_start_clock = MeasToMIDI(repeat_start_meas);
+    repeat_end_clock = MeasToMIDI(repeat_end_meas);
+    PrepareLoop();
     if (GetCountInEnable())
             CountInPrepare();
         else
@@ -580,6 +709,7 @@ void AdvancedSequencer::Start () {
 
     SetDevOffset((tMsecs)GetCurrentTimeMs());
     MIDITickComponent::Start();
+    StartWorker();
     std::cout << "\t\t ... Exiting from AdvancedSequencer::Start()" << std::endl;
     //std::cout << "sys_time_offset = " << sys_time_offset << " sys_time = " << MIDITimer::GetSysTimeMs() << std::endl;
 }
@@ -587,10 +717,16 @@ void AdvancedSequencer::Start () {
 
 void AdvancedSequencer::Stop() {
     if (IsPlaying()) {
-        std::lock_guard<std::recursive_mutex> lock(proc_lock);
+        if (DeferStop())                        // called by the worker, which can't wait for itself
+            return;
         std::cout << "\t\tEntered in AdvancedSequencer::Stop() ...\n";
-        // waits until the timer thread has stopped
+        // waits until the worker and the timer thread have stopped; this must be done without proc_lock,
+        // because their tick could be waiting for it
+        StopWorker();
         MIDITickComponent::Stop();
+        std::lock_guard<std::recursive_mutex> lock(proc_lock);
+        // executes the changes posted but not executed by the tick
+        ExecCommands();
         // resets the autostop flag
         state.playing_status &= ~AUTO_STOP_PENDING;
         state.iterator.SetTimeShiftMode(time_shift_mode);
@@ -722,6 +858,9 @@ void AdvancedSequencer::ExtractWarpPositions() {
     GoToTime(cur_time);
 
     play_mode = old_play_mode;
+    // build the chase index, so it's not built while playing
+    for (unsigned int i = 0; i < GetNumTracks(); i++)
+        GetChaseIndex(i);
     // re-enable the gui notifier if it was enabled previously
     //if (notifier) {
     //    notifier->SetEnable (notifier_mode);
@@ -732,152 +871,719 @@ void AdvancedSequencer::ExtractWarpPositions() {
 
 
 void AdvancedSequencer::CatchEventsBefore() {
-    MIDITimedMessage msg;
-    MIDITrack* trk;
-    unsigned int port;
-    int events_sent = 0;
+    CatchEventsBefore(-1);
+}
+
 
+void AdvancedSequencer::CatchEventsBefore(int trk_num) {
+    if (render_state_stale)
+        SyncRenderState();
     if (GetCurrentMIDIClockTime() == 0)         // nothing to do
         return;
-    std::cout << "Catch events before started ..." << std::endl;
 
-    MIDIManager::OpenOutPorts();
+    CollectEventsBefore(&state, GetCurrentMIDIClockTime(), chase_events, trk_num);
+    OutputChase(chase_events);
+    NICMIDI_LOG_DEBUG("CatchEventsBefore finished: events sent: %u", (unsigned int)chase_events.size());
+}
 
-    //first send sysex (but not reset ones)
-    for (unsigned int i = 0; i < GetNumTracks(); i++) {
+
+void AdvancedSequencer::CollectEventsBefore(const MIDISequencerState* st, MIDIClockTime t,
+                                            std::vector<TrackMessage>& events, int trk_num,
+                                            const MIDISequencerState* from,
+                                            const std::vector<MIDIProcessor*>* procs,
+                                            const std::vector<ChaseIndex>* indexes) {
+    TrackMessage ev;
+    MIDITrack* trk;
+    unsigned int first = (trk_num == -1 ? 0 : trk_num);
+    unsigned int last = (trk_num == -1 ? GetNumTracks() : trk_num + 1);
+    // the events played between these times could have changed the values sent with from
+    MIDIClockTime changed_from = 0, changed_to = 0;
+    if (from) {
+        changed_from = std::min(t, from->cur_clock);
+        changed_to = std::max(t, from->cur_clock);
+    }
+
+    events.clear();
+    // first send sysex (but not reset ones) and all program, controls and pitch bend of non compliant tracks
+    for (unsigned int i = first; i < last; i++) {
         trk = GetTrack(i);
-        if (!(trk->HasSysex())) continue;
-        msg.SetTime(0);
-        port = GetTrackOutPort(i);
-        for (unsigned int j = 0; j < trk->GetNumEvents() && msg.GetTime() <= GetCurrentMIDIClockTime(); j++) {
-            msg = trk->GetEvent(j);
-            if (msg.IsSysEx() &&
-                !(msg.GetSysEx()->IsGMReset() || msg.GetSysEx()->IsGSReset() || msg.GetSysEx()->IsXGReset())) {
-
-                OutputMessage(msg, port);
-                events_sent++;
+        const std::vector<unsigned int>& index = (indexes ? (*indexes)[i].events : GetChaseIndex(i));
+        if (index.empty())
+            continue;
+        if (from) {                             // send them only if some of them was played meanwhile
+            unsigned int j = 0;
+            while (j < index.size() && trk->GetEvent(index[j]).GetTime() < changed_from)
+                j++;
+            if (j == index.size() || trk->GetEvent(index[j]).GetTime() > changed_to)
+                continue;
+        }
+        const MIDISequencerTrackProcessor* proc =
+            (const MIDISequencerTrackProcessor*)(procs ? (*procs)[i] : track_processors[i]);
+        bool muted = proc->mute;
+        ev.track = i;
+        for (unsigned int j = 0; j < index.size(); j++) {
+            const MIDITimedMessage& msg = trk->GetEvent(index[j]);
+            if (msg.GetTime() > t)
+                break;
+            if (msg.IsSysEx() || !muted) {
+                ev.msg = msg;
+                events.push_back(ev);
             }
         }
     }
 
     // then set program, pitch bend and controls of ordinary channel tracks, according to the
     // sequencer state
-    for (unsigned int i = 0; i < GetNumTracks(); i++) {
+    for (unsigned int i = first; i < last; i++) {
         trk = GetTrack(i);
-        if (!GetTrackMute(i) &&
+        const MIDISequencerTrackProcessor* proc =
+            (const MIDISequencerTrackProcessor*)(procs ? (*procs)[i] : track_processors[i]);
+        if (!proc->mute &&
             (trk->GetType() == MIDITrack::TYPE_CHAN || trk->GetType() == MIDITrack::TYPE_IRREG_CHAN)) {
-            int channel = GetTrackChannel(i);
-            port = GetTrackOutPort(i);
-            const MIDISequencerTrackState* tr_state = GetTrackState(i);
+            int channel = (proc->rechannel == -1 ? trk->GetChannel() : proc->rechannel);
+            const MIDISequencerTrackState* tr_state = st->track_states[i];
+            const MIDISequencerTrackState* old_state = (from ? from->track_states[i] : 0);
+            ev.track = i;
             // set the current program
-            if (tr_state->program != -1) {
-                msg.SetProgramChange(channel, tr_state->program);
-                OutputMessage(msg, port);
-                events_sent++;
+            if (tr_state->program != -1 && !(old_state && old_state->program == tr_state->program)) {
+                ev.msg.SetProgramChange(channel, tr_state->program);
+                events.push_back(ev);
             }
             // set the current pitch bend value
-            msg.SetPitchBend(channel, tr_state->bender_value);
-            OutputMessage(msg, port);
-            events_sent ++;
+            if (!(old_state && old_state->bender_value == tr_state->bender_value)) {
+                ev.msg.SetPitchBend(channel, tr_state->bender_value);
+                events.push_back(ev);
+            }
             // set the controllers
             for (unsigned int j = 0; j < C_ALL_NOTES_OFF; j++) {
-                if (tr_state->control_values[j] != -1) {
-                    msg.SetControlChange(channel, j, tr_state->control_values[j]);
-                    OutputMessage(msg, port);
-                    events_sent++;
+                if (tr_state->control_values[j] != -1 &&
+                    !(old_state && old_state->control_values[j] == tr_state->control_values[j])) {
+                    ev.msg.SetControlChange(channel, j, tr_state->control_values[j]);
+                    events.push_back(ev);
                 }   // TODO: RPN and NRPN
             }
         }
     }
+}
 
-    // and now send program, controls and pitch bend of non compliant tracks
-    for (unsigned int i = 0; i < GetMultiTrack()->GetNumTracks(); i++) {
-        trk = GetTrack(i);
-        if (trk->GetType() == MIDITrack::TYPE_MIXED_CHAN) {
-            port = GetTrackOutPort(i);
-            msg.SetTime(0);
-            for (unsigned int j = 0; j < trk->GetNumEvents() && msg.GetTime() <= GetCurrentMIDIClockTime(); j++) {
-                msg = trk->GetEvent(j);
-                if (msg.IsProgramChange() || msg.IsControlChange() || msg.IsPitchBend()) {
-                    OutputMessage(msg, port);
-                    events_sent++;
-                }
-            }
-        }
-    }
 
+void AdvancedSequencer::OutputChase(const std::vector<TrackMessage>& events) {
+    if (events.empty())
+        return;
+    MIDIManager::OpenOutPorts();
+    QueueChase(events);
+    NICMIDI_LOG_DEBUG("Chase: %u messages sent, %u already set on the ports",
+                      (unsigned int)chase_sent.size(), (unsigned int)(events.size() - chase_sent.size()));
+    MIDIManager::FlushOutQueues();
     MIDIManager::CloseOutPorts();
-    std::cout << "CatchEventsBefore finished: events sent: " << events_sent << std::endl;
 }
 
 
-void AdvancedSequencer::CatchEventsBefore(int trk_num) {
+void AdvancedSequencer::QueueChase(const std::vector<TrackMessage>& events) {
+    FilterChase(events);
+    for (unsigned int i = 0; i < chase_sent.size(); i++) {
+        const TrackMessage& ev = events[chase_sent[i]];
+        MIDIOutDriver* driver = MIDIManager::GetOutDriver(GetTrackOutPort(ev.track));
+        // sysex are sent directly, as the driver defers them to its sender thread anyway (the messages
+        // queued after them wait for them, so the order is kept)
+        if (ev.msg.IsSysEx())
+            driver->OutputMessage(ev.msg);
+        else
+            driver->QueueMessage(ev.msg);
+    }
+}
+
+
+void AdvancedSequencer::RequestChase(int trk_num) {
+    if (chase_trk == -2)
+        chase_trk = trk_num;
+    else if (chase_trk != trk_num)
+        chase_trk = -1;
+    RequestJob(JOB_CHASE);
+}
+
+
+void AdvancedSequencer::ComputeChase() {
+    RenderContext ctx;
+    MIDISequencerState st(state.multitrack, 0);
+    // take what we need under the lock
+    if (!WorkerLock())
+        return;
+    int trk_num = chase_trk;
+    chase_trk = -2;
+    MIDIClockTime clk = GetCurrentMIDIClockTime();
+    if (trk_num == -2 || !IsPlaying() || clk == 0) {
+        proc_lock.unlock();
+        return;
+    }
+    unsigned int warp_to_item = 0;
+    while (warp_to_item + 1 < warp_positions.size() && warp_positions[warp_to_item + 1].cur_clock <= clk)
+        warp_to_item++;
+    GetWarpState(&st, warp_to_item);
+    for (unsigned int i = 0; i < GetNumTracks(); i++) {
+        GetTrack(i)->GetStatus();
+        GetChaseIndex(i);
+    }
+    worker_index = chase_index;
+    MakeRenderContext(&ctx);
+    unsigned long gen = render_gen;
+    proc_lock.unlock();
+
+    // bring the state to the current time and collect the messages without the lock
+    std::vector<TrackMessage> events;
+    MIDIClockTime t;
+    int trk;
     MIDITimedMessage msg;
-    MIDITrack* trk = GetTrack(trk_num);
-    unsigned int port = GetTrackOutPort(trk_num);
-    int events_sent = 0;
+    while (StateNextEventTime(&st, &t, ctx.play_mode) && t <= clk &&
+           StateNextEvent(&st, &trk, &msg, ctx.play_mode, &ctx.processors))
+        ;
+    CollectEventsBefore(&st, clk, events, trk_num, 0, &ctx.processors, &worker_index);
 
-    if (GetCurrentMIDIClockTime() == 0)         // nothing to do
+    // the tick sends them, if the processors were not changed meanwhile (the new command asked for a new chase)
+    if (!WorkerLock())
         return;
-    std::cout << "Catch events before started for track " << trk_num << " ..." << std::endl;
+    if (gen == render_gen && IsPlaying())
+        chase_ready.insert(chase_ready.end(), events.begin(), events.end());
+    else if (IsPlaying())
+        RequestChase(trk_num);                  // do it again with the new processors
+    proc_lock.unlock();
+}
 
-    MIDIManager::OpenOutPorts();
 
-    //first send sysex (but not reset ones)
-    if (trk->HasSysex()) {
-        msg.SetTime(0);
-        for (unsigned int i = 0; i < trk->GetNumEvents() && msg.GetTime() <= GetCurrentMIDIClockTime(); i++) {
-            msg = trk->GetEvent(i);
-            if (msg.IsSysEx() &&
-                !(msg.GetSysEx()->IsGMReset() || msg.GetSysEx()->IsGSReset() || msg.GetSysEx()->IsXGReset())) {
+void AdvancedSequencer::DoJobs(unsigned int jobs) {
+    if (jobs & JOB_RENDER_LIST)
+        BuildRenderList();
+    if (jobs & JOB_CHASE)
+        ComputeChase();
+    MIDISequencer::DoJobs(jobs);
+}
 
-                OutputMessage(msg, port);
-                events_sent++;
+
+void AdvancedSequencer::FilterChase(const std::vector<TrackMessage>& events) {
+    // the driver state is checked before anything is queued, so the messages are compared with the values
+    // the ports had before the chase
+    chase_sent.clear();
+    std::vector<unsigned int> sysex_ports;
+    for (unsigned int i = 0; i < events.size(); i++) {
+        const MIDITimedMessage& msg = events[i].msg;
+        unsigned int port = GetTrackOutPort(events[i].track);
+        if (msg.IsSysEx()) {
+            // after a sysex the values on the port are unknown
+            if (std::find(sysex_ports.begin(), sysex_ports.end(), port) == sysex_ports.end())
+                sysex_ports.push_back(port);
+        }
+        else if (std::find(sysex_ports.begin(), sysex_ports.end(), port) == sysex_ports.end() &&
+                 MIDIManager::GetOutDriver(port)->IsRedundant(msg)) {
+            // the message is redundant only if no previous chase message changed the same value
+            bool changed = false;
+            for (unsigned int j = 0; j < chase_sent.size() && !changed; j++) {
+                const TrackMessage& prev = events[chase_sent[j]];
+                changed = (prev.msg.GetStatus() == msg.GetStatus() && GetTrackOutPort(prev.track) == port &&
+                           (!msg.IsControlChange() || prev.msg.GetController() == msg.GetController()));
             }
+            if (!changed)
+                continue;
         }
+        chase_sent.push_back(i);
     }
+}
 
 
-    // restore program, pitch bend and controllers as registered in the sequencer state
-    if (!GetTrackMute(trk_num)) {
-        // if this is an ordinary channel track ...
-        if (trk->GetType() == MIDITrack::TYPE_CHAN || trk->GetType() == MIDITrack::TYPE_IRREG_CHAN) {
-            int channel = GetTrackChannel(trk_num);     // takes into account rechannelize
-            const MIDISequencerTrackState* trk_state = GetTrackState(trk_num);
-            // set the current program
-            if (trk_state->program != -1) {
-                msg.SetProgramChange(channel, trk_state->program);
-                OutputMessage(msg, port);
-                events_sent++;
-            }
-            // set the current pitch bend value
-            msg.SetPitchBend(channel, trk_state->bender_value);
-            OutputMessage(msg, port);
-            events_sent ++;
-            // set the controllers
-            for (unsigned int j = 0; j < C_ALL_NOTES_OFF; j++) {
-                if (trk_state->control_values[j] != -1) {
-                    msg.SetControlChange(channel, j, trk_state->control_values[j]);
-                    OutputMessage(msg, port);
-                    events_sent++;
-                }   // TODO: RPN and NRPN
+const std::vector<unsigned int>& AdvancedSequencer::GetChaseIndex(unsigned int trk_num) {
+    if (chase_index.size() != GetNumTracks())
+        chase_index.resize(GetNumTracks());
+    ChaseIndex& index = chase_index[trk_num];
+    MIDITrack* trk = GetTrack(trk_num);
+    bool mixed = (trk->GetType() == MIDITrack::TYPE_MIXED_CHAN);     // this could analyze the track
+    if (index.edit_id != trk->GetEditId()) {
+        index.events.clear();
+        for (unsigned int i = 0; i < trk->GetNumEvents(); i++) {
+            const MIDITimedMessage& msg = trk->GetEvent(i);
+            if (msg.IsSysEx()) {
+                if (!(msg.GetSysEx()->IsGMReset() || msg.GetSysEx()->IsGSReset() || msg.GetSysEx()->IsXGReset()))
+                    index.events.push_back(i);
             }
+            else if (mixed && (msg.IsProgramChange() || msg.IsControlChange() || msg.IsPitchBend()))
+                index.events.push_back(i);
+        }
+        index.edit_id = trk->GetEditId();
+    }
+    return index.events;
+}
+
+
+// The commands are posted into a bounded ring with a sequence number in every slot, with the same algorithm
+// of the MIDILog ring (see log.cpp): many threads can post without locks, while the reader is the tick (or
+// a method called when the sequencer is stopped) and is protected by proc_lock.
+
+void AdvancedSequencer::PostCommand(int type, unsigned int trk_num, int value) {
+    if (IsPlaying() && PushCommand(type, trk_num, value)) {
+        if (IsPlaying())
+            return;                             // the tick (or Stop()) will execute it
+        // the sequencer was stopped meanwhile, maybe after Stop() executed the posted commands
+        std::lock_guard<std::recursive_mutex> lock(proc_lock);
+        ExecCommands();
+        return;
+    }
+    // the sequencer is stopped (or the ring is full): execute the command now, after the posted ones
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    ExecCommands();
+    if (ExecCommand(type, trk_num, value)) {
+        InvalidateRenderList(CommandTrack(type, trk_num));
+        InvalidateLoop();
+    }
+}
+
+
+bool AdvancedSequencer::PushCommand(int type, unsigned int trk_num, int value) {
+    unsigned long pos = cmd_in_pos.load(std::memory_order_relaxed);
+    CommandSlot* slot;
+    for (;;) {
+        slot = &cmd_ring[pos % CMD_RING_SIZE];
+        long diff = (long)(slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (cmd_in_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
         }
-        // if the track has mixed channels send all previous messages
-        else if (trk->GetType() == MIDITrack::TYPE_MIXED_CHAN) {
-            msg.SetTime(0);
-            for (unsigned int i = 0; i < trk->GetNumEvents() && msg.GetTime() <= GetCurrentMIDIClockTime(); i++) {
-                msg = trk->GetEvent(i);
-                if (msg.IsProgramChange() || msg.IsControlChange() || msg.IsPitchBend()) {
-                    OutputMessage(msg, port);
-                    events_sent++;
+        else if (diff < 0)                      // the ring is full
+            return false;
+        else
+            pos = cmd_in_pos.load(std::memory_order_relaxed);
+    }
+    slot->type = type;
+    slot->track = trk_num;
+    slot->value = value;
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+
+void AdvancedSequencer::ExecCommands() {
+    bool changed = false;
+    for (;;) {
+        CommandSlot& slot = cmd_ring[cmd_out_pos % CMD_RING_SIZE];
+        if (slot.seq.load(std::memory_order_acquire) != cmd_out_pos + 1)
+            break;                              // no more commands
+        int type = slot.type;
+        unsigned int trk_num = slot.track;
+        int value = slot.value;
+        slot.seq.store(cmd_out_pos + CMD_RING_SIZE, std::memory_order_release);    // free the slot
+        cmd_out_pos++;
+        if (ExecCommand(type, trk_num, value)) {
+            InvalidateRenderList(CommandTrack(type, trk_num));
+            changed = true;
+        }
+    }
+    // the loop state is rebuilt only once for all the commands (the worker rebuilds the render list once too)
+    if (changed)
+        InvalidateLoop();
+}
+
+
+bool AdvancedSequencer::ExecCommand(int type, unsigned int trk_num, int value) {
+    // the tracks could have been changed after the command was posted
+    if (type != CMD_UNSOLO && type != CMD_UNMUTE_ALL && type != CMD_TEMPO_SCALE &&
+        !state.multitrack->IsValidTrackNumber(trk_num))
+        return false;
+
+    switch (type) {
+        case CMD_SOLO:
+            for (unsigned int i = 0; i < GetNumTracks(); ++i ) {
+                if(i == trk_num) {
+                    GetTrackProcessor(i)->solo = MIDISequencerTrackProcessor::SOLOED;
+                    if (IsPlaying())
+                        // track could be muted before soloing: this sets appropriate CC, PC, etc
+                        // not previously sent
+                        RequestChase(trk_num);          // MUST be here! We must previously unmute the track!
                 }
+                else {
+                    GetTrackProcessor(i)->solo = MIDISequencerTrackProcessor::NOT_SOLOED;
+                    if (IsPlaying() && GetTrackChannel(i) != -1) {
+                        MIDIManager::GetOutDriver(GetTrackOutPort(i))->AllNotesOff(GetTrackChannel(i));
+                        GetTrackState(i)->note_matrix.Reset();
+                    }
+                }
+            }
+            break;
+        case CMD_UNSOLO:
+            for(unsigned int i = 0; i < GetNumTracks(); ++i ) {
+                int old_solo = GetTrackProcessor(i)->solo;
+                GetTrackProcessor(i)->solo = MIDISequencerTrackProcessor::NO_SOLO;
+                if (IsPlaying() && old_solo == MIDISequencerTrackProcessor::NOT_SOLOED)
+                    // this sets appropriate CC, PC, etc for previously muted tracks
+                    RequestChase(i);
+            }
+            break;
+        case CMD_MUTE: {
+            GetTrackProcessor(trk_num)->mute = (value != 0);
+            int channel = GetTrackChannel(trk_num);
+            if (IsPlaying() && channel != -1) {
+                if(value) {
+                    MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->AllNotesOff(channel);
+                    GetTrackState(trk_num)->note_matrix.Reset();
+                }
+                else
+                    // track was muted: this set appropriate CC, PC, etc not previously sent
+                    RequestChase(trk_num);
+            }
+            break;
+        }
+        case CMD_UNMUTE_ALL:
+            for (unsigned int i = 0; i < GetNumTracks(); ++i)
+                GetTrackProcessor(i)->mute = false;
+            if (IsPlaying())
+                // this set appropriate CC, PC, etc for previously muted tracks
+                RequestChase(-1);
+            break;
+        case CMD_VELOCITY_SCALE:
+            GetTrackProcessor(trk_num)->velocity_scale = value;
+            break;
+        case CMD_RECHANNELIZE:
+            if (IsPlaying() && GetTrackChannel(trk_num) != value && !(GetTrackChannel(trk_num) == -1)) {
+                MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->AllNotesOff(GetTrackChannel(trk_num));
+                GetTrackState(trk_num)->note_matrix.Reset();
+            }
+            GetTrackProcessor(trk_num)->rechannel = value;
+            break;
+        case CMD_TRANSPOSE:
+            if (IsPlaying() && GetTrackTranspose(trk_num) != value && !(GetTrackChannel(trk_num) == -1)) {
+                MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->AllNotesOff(GetTrackChannel(trk_num));
+                GetTrackState(trk_num)->note_matrix.Reset();
             }
+            GetTrackProcessor(trk_num)->transpose = value;
+            break;
+        case CMD_TEMPO_SCALE:
+            if (!render_mode || !IsPlaying())
+                MIDISequencer::SetTempoScale(value);
+            else {
+                // in render mode state.cur_clock is only updated at beats, so we compute the new time from the
+                // current one
+                float now_ms = GetCurrentTimeMs() * state.tempo_scale / value;
+                state.ms_per_clock *= (double)state.tempo_scale / value;
+                state.tempo_scale = value;
+                state.cur_time_ms = MIDItoMs(state.cur_clock);
+                dev_time_offset = (tMsecs)now_ms;
+                sys_time_offset = MIDITimer::GetSysTimeMs();
+            }
+            return false;                       // the processors are unchanged
+    }
+    return true;
+}
+
+
+void AdvancedSequencer::TickProc(tMsecs sys_time) {
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    ExecCommands();
+    if (!chase_ready.empty()) {                 // computed by the worker
+        QueueChase(chase_ready);
+        MIDIManager::FlushOutQueues();
+        chase_ready.clear();
+    }
+    if (!render_mode) {
+        MIDISequencer::TickProc(sys_time);
+        return;
+    }
+
+    if (!BeginTick(sys_time))
+        return;
+    // the times in the render list are in usecs without tempo scale, while cur_time is scaled
+    double us_per_ms = state.tempo_scale * 10.0;
+    // this is negative for a while after a loop wrap anticipated by the look ahead
+    double cur_time = (double)sys_time - sys_time_offset + dev_time_offset;
+    tUsecs cur_us = cur_time > 0.0 ? (tUsecs)(cur_time * us_per_ms) : 0;
+    // the messages of the compensated tracks are scheduled earlier, so we need a wider window
+    unsigned int max_comp = look_ahead ? GetMaxCompensation() : 0;
+    tUsecs window_end_us = (tUsecs)((cur_time + look_ahead + max_comp) * us_per_ms);
+    MIDITimedMessage msg;
+    while (render_pos < render_list.size() && render_list[render_pos].time_us <= window_end_us) {
+        const RenderEvent& ev = render_list[render_pos];
+        if (repeat_play_mode && ev.clock >= repeat_end_clock) {
+            // the loop end moves the time, so it can be anticipated only if the loop start is ready
+            if (ev.time_us > cur_us && !IsLoopPrepared()) {
+                RequestJob(JOB_PREPARE_LOOP);
+                break;
+            }
+            // we hit the end of our repeat block: jump to the loop start (this resyncs render_pos) and go on
+            // with the events of the loop start within the window
+            WrapLoop(MIDItoMs(repeat_end_clock));
+            cur_time = (double)sys_time - sys_time_offset + dev_time_offset;
+            cur_us = cur_time > 0.0 ? (tUsecs)(cur_time * us_per_ms) : 0;
+            window_end_us = (tUsecs)((cur_time + look_ahead + max_comp) * us_per_ms);
+            continue;
+        }
+        render_pos++;
+        render_state_stale = true;
+        if (ev.port == RENDER_BEAT) {
+            // keep the state updated with the current measure and beat
+            state.cur_clock = state.last_beat_time = state.last_tempo_change = ev.clock;
+            state.cur_time_ms = state.last_time_ms = ev.time_us / us_per_ms;
+            state.cur_beat = ev.bytes[0];
+            if (state.cur_measure != ev.data) {
+                state.cur_measure = ev.data;
+                state.Notify(MIDISequencerGUIEvent::GROUP_TRANSPORT, MIDISequencerGUIEvent::GROUP_TRANSPORT_MEASURE);
+            }
+            state.Notify(MIDISequencerGUIEvent::GROUP_TRANSPORT, MIDISequencerGUIEvent::GROUP_TRANSPORT_BEAT);
+            continue;
         }
+        // the list is being rebuilt for the changed tracks: their notes would have the old parameters
+        if (!render_changed.empty() && render_changed[ev.track] && ev.len == 3 &&
+            (ev.bytes[0] & 0xf0) == NOTE_ON && ev.bytes[2] != 0)
+            continue;
+        if (ev.len == 0)
+            msg = render_sysex[ev.data];
+        else {
+            msg.SetStatus(ev.bytes[0]);
+            msg.SetByte1(ev.bytes[1]);
+            msg.SetByte2(ev.bytes[2]);
+        }
+        MIDIOutDriver* driver = MIDIManager::GetOutDriver(ev.port);
+        if (look_ahead)
+            driver->ScheduleMessage(msg, SchedTime((double)sys_time_offset - dev_time_offset +
+                                                   ev.time_us * 0.1 / state.tempo_scale, ev.track));
+        else
+            driver->QueueMessage(msg);
+    }
+    MIDIManager::FlushOutQueues();
+    // auto stop at end of sequence
+    if (render_pos == render_list.size() && !repeat_play_mode && !HasScheduledMessages()) {
+        NICMIDI_LOG_INFO("Auto stopping the sequencer: StaticStopProc called at time %lu",
+                         (unsigned long)GetCurrentMIDIClockTime());
+        state.playing_status |= AUTO_STOP_PENDING;
+        std::thread(StaticStopProc, this).detach();
     }
+}
 
-    MIDIManager::CloseOutPorts();
-    std::cout << "CatchEventsBefore finished: events sent: " << events_sent << std::endl;
+
+MIDIProcessor* AdvancedSequencer::CopyTrackProcessor(unsigned int trk_num) const {
+    return new MIDISequencerTrackProcessor(*(const MIDISequencerTrackProcessor*)track_processors[trk_num]);
 }
 
 
+bool AdvancedSequencer::BuildRenderList() {
+    RenderContext ctx;
+    MIDISequencerState st(state.multitrack, 0);
+    std::vector<RenderEvent> list;
+    std::vector<MIDITimedMessage> sysex;
+    std::vector<RenderTrackId> ids;
+    // take what we need under the lock (Start() calls this holding it, so it is not released)
+    if (!WorkerLock())
+        return false;
+    unsigned long gen = render_gen;
+    MakeRenderContext(&ctx);
+    st = state;
+    st.notifier = 0;
+    ids.resize(GetNumTracks());
+    for (unsigned int i = 0; i < GetNumTracks(); i++) {
+        ids[i].edit_id = GetTrack(i)->GetEditId();
+        ids[i].port = GetTrackOutPort(i);
+    }
+    proc_lock.unlock();
+
+    CompileRenderList(&st, ctx, list, sysex);
+
+    // swap the new list in, if no processor was changed meanwhile
+    if (!WorkerLock())
+        return false;
+    bool ret = (gen == render_gen);
+    if (ret) {
+        bool playing = render_mode && IsPlaying();
+        // go on from the first event not yet sent
+        MIDIClockTime next_clk = render_pos < render_list.size() ? render_list[render_pos].clock : 0;
+        bool at_end = render_pos == render_list.size();
+        render_list.swap(list);
+        render_sysex.swap(sysex);
+        render_ids.swap(ids);
+        render_valid = true;
+        render_changed.clear();
+        if (playing) {
+            if (at_end)
+                render_pos = render_list.size();
+            else
+                SyncRenderPos(next_clk);
+        }
+        NICMIDI_LOG_INFO("Render list built: %u events, %u sysex", (unsigned int)render_list.size(),
+                         (unsigned int)render_sysex.size());
+    }
+    proc_lock.unlock();
+    return ret;                                 // the old list is freed here, without the lock
+}
+
+
+void AdvancedSequencer::CompileRenderList(MIDISequencerState* st, const RenderContext& ctx,
+                                          std::vector<RenderEvent>& events,
+                                          std::vector<MIDITimedMessage>& sysex) const {
+    st->iterator.SetTimeShiftMode(true);        // must be set before resetting the iterator
+    st->Reset();                                // this sets the tempo scale to 100
+    int trk_num;
+    MIDITimedMessage msg;
+    RenderEvent ev;
+    // the processors are applied: muted messages become NoOp
+    while (StateNextEvent(st, &trk_num, &msg, PLAY_BOUNDED, &ctx.processors)) {
+        ev.time_us = (tUsecs)(st->cur_time_ms * 1000.0 + 0.5);
+        ev.clock = st->cur_clock;
+        ev.track = (unsigned short)trk_num;
+        ev.len = 0;
+        if (msg.IsBeatMarker()) {
+            ev.port = RENDER_BEAT;
+            ev.bytes[0] = (unsigned char)st->cur_beat;
+            ev.data = st->cur_measure;
+        }
+        else if (msg.IsChannelMsg()) {
+            ev.port = (unsigned short)ctx.out_ports[trk_num];
+            ev.len = (unsigned char)msg.GetLength();
+            ev.bytes[0] = msg.GetStatus();
+            ev.bytes[1] = msg.GetByte1();
+            ev.bytes[2] = msg.GetByte2();
+        }
+        else if (msg.IsSysEx()) {
+            ev.port = (unsigned short)ctx.out_ports[trk_num];
+            ev.data = sysex.size();
+            sysex.push_back(msg);
+        }
+        else                                    // meta events and NoOps
+            continue;
+        events.push_back(ev);
+    }
+}
+
+
+bool AdvancedSequencer::IsRenderListValid() const {
+    if (!render_valid || render_ids.size() != GetNumTracks())
+        return false;
+    for (unsigned int i = 0; i < GetNumTracks(); i++)
+        if (render_ids[i].edit_id != state.multitrack->GetTrack(i)->GetEditId() ||
+            render_ids[i].port != GetTrackOutPort(i))
+            return false;
+    return true;
+}
+
+
+void AdvancedSequencer::InvalidateRenderList(int trk_num) {
+    render_valid = false;
+    render_gen++;
+    if (render_mode && IsPlaying()) {
+        // until the worker rebuilds the list the tick doesn't send the note ons of the changed tracks
+        if (render_changed.size() != GetNumTracks())
+            render_changed.assign(GetNumTracks(), 0);
+        if (trk_num == -1)
+            render_changed.assign(GetNumTracks(), 1);
+        else
+            render_changed[trk_num] = 1;
+        RequestJob(JOB_RENDER_LIST);
+    }
+}
+
+
+void AdvancedSequencer::SyncRenderPos(MIDIClockTime clk) {
+    unsigned int lo = 0, hi = render_list.size();
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (render_list[mid].clock < clk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    render_pos = lo;
+    render_state_stale = false;
+}
+
+
+void AdvancedSequencer::SyncRenderState() {
+    // the render TickProc doesn't process the events, so the track states (programs, controllers, etc.) are
+    // those of the start time. This brings the state to the current time, without changing the time offsets
+    MIDIClockTime clk = MsToMIDI(GetCurrentTimeMs());
+    unsigned int scale = state.tempo_scale;
+    unsigned int warp_to_item = 0;
+    for (; warp_to_item < warp_positions.size() - 1; warp_to_item++)
+        if (warp_positions[warp_to_item + 1].cur_clock > clk)
+            break;
+    state = warp_positions[warp_to_item];
+    RescaleState(scale);
+    state.iterator.SetTimeShiftMode(true);
+    MIDIClockTime t;
+    int trk_num;
+    MIDITimedMessage msg;
+    while (NextEventTime(&t) && t <= clk)
+        NextEvent(&trk_num, &msg);
+    render_state_stale = false;
+}
+
+
+void AdvancedSequencer::SetWarpState(unsigned int warp_to_item) {
+    // the warp positions could have a different tempo scale: we keep the current one
+    unsigned int scale = state.tempo_scale;
+    SetState(&warp_positions[warp_to_item]);
+    RescaleState(scale);
+}
+
+
+void AdvancedSequencer::RescaleState(unsigned int scale) {
+    double f = (double)state.tempo_scale / scale;
+    state.cur_time_ms *= f;
+    state.last_time_ms *= f;
+    state.ms_per_clock *= f;
+    state.tempo_scale = scale;
+}
+
+
+void AdvancedSequencer::GetWarpState(MIDISequencerState* st, unsigned int warp_to_item) {
+    if (warp_to_item >= warp_positions.size())
+        warp_to_item = warp_positions.size() - 1;
+    // the warp positions are usable only if they were saved with the time shift on, or if no track is shifted
+    bool shifted = false;
+    for (unsigned int i = 0; i < GetNumTracks() && !shifted; i++)
+        shifted = (GetTrackTimeShift(i) != 0);
+    if (warp_positions.empty() || (shifted && !warp_positions[warp_to_item].iterator.GetTimeShiftMode()))
+        MIDISequencer::GetLoopStartState(st);   // the state at time 0
+    else {
+        *st = warp_positions[warp_to_item];
+        st->notifier = 0;
+        st->iterator.SetTimeShiftMode(true);
+    }
+}
+
+
+void AdvancedSequencer::GetLoopStartState(MIDISequencerState* st) {
+    GetWarpState(st, repeat_start_meas / MEASURES_PER_WARP);
+    // ComputeLoop() can't update the track status and the chase indexes, so we do it here
+    for (unsigned int i = 0; i < GetNumTracks(); i++) {
+        GetTrack(i)->GetStatus();
+        GetChaseIndex(i);
+    }
+    loop_index = chase_index;
+}
+
+
+bool AdvancedSequencer::ComputeLoop(LoopData* ld, const RenderContext& ctx) {
+    if (!MIDISequencer::ComputeLoop(ld, ctx))
+        return false;
+    // at the loop end the ports have the values of end_state, so we send only the ones which differ
+    if (ld->state.cur_clock > 0)
+        CollectEventsBefore(&ld->state, ld->state.cur_clock, ld->chase, -1, &ld->end_state, &ctx.processors,
+                            &loop_index);
+    return true;
+}
+
+
+void AdvancedSequencer::LoadLoopState(double sys_ms) {
+    MIDISequencer::LoadLoopState(sys_ms);
+    if (render_mode)
+        SyncRenderPos(state.cur_clock);
+    // the chase messages go before the events of the loop start; if they are sent now we can skip the
+    // values the ports already have (scheduled ones are compared with the loop end state only)
+    if (look_ahead)
+        for (unsigned int i = 0; i < loop->chase.size(); i++)
+            SendLoopMessage(loop->chase[i], sys_ms);
+    else {
+        FilterChase(loop->chase);
+        for (unsigned int i = 0; i < chase_sent.size(); i++)
+            SendLoopMessage(loop->chase[chase_sent[i]], sys_ms);
+    }
+}
+
+
+void AdvancedSequencer::SkipToLoopStart(double sys_ms) {
+    MIDISequencer::SkipToLoopStart(sys_ms);
+    if (render_mode)
+        SyncRenderPos(state.cur_clock);
+}
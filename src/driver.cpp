@@ -25,6 +25,27 @@
 
 #include "../include/driver.h"
 #include "../include/timer.h"
+#include "../include/log.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+// Tries to give the thread a real time priority. This is only a hint: if the OS doesn't allow it
+// (for example if the user hasn't the needed privileges) the thread runs with normal priority.
+static void SetHighPriority(std::thread& th) {
+#if defined(_WIN32)
+    SetThreadPriority((HANDLE)th.native_handle(), THREAD_PRIORITY_TIME_CRITICAL);
+#elif defined(__unix__) || defined(__APPLE__)
+    sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    pthread_setschedparam(th.native_handle(), SCHED_FIFO, &param);
+#endif
+}
 
 
 /////////////////////////////////////////////////
@@ -68,13 +89,34 @@ MIDIRawMessage& MIDIRawMessageQueue::ReadMessage(unsigned int n) {
 }
 
 
+// Returns the index of the port with the given name in the RtMidi port list (-1 if it is not present).
+// The hint is checked first, so ports with the same name keep their index
+static int FindPort(RtMidi* port, const std::string& name, int hint) {
+    try {
+        int n = port->getPortCount();
+        if (hint >= 0 && hint < n && port->getPortName(hint) == name)
+            return hint;
+        for (int i = 0; i < n; i++)
+            if (port->getPortName(i) == name)
+                return i;
+    }
+    catch (RtMidiError& error) {
+        error.printMessage();
+    }
+    return -1;
+}
+
+
 /////////////////////////////////////////////////
 //           class MIDIOutDriver               //
 /////////////////////////////////////////////////
 
 
 MIDIOutDriver::MIDIOutDriver(int id) :
-    processor(0), port_id(id), num_open(0) {
+    processor(0), port_id(id), rtmidi_index(id), present(true), num_open(0), sched_count(0), sender_exit(false),
+    num_deferred(0), sysex_rate(DEFAULT_SYSEX_RATE), device_latency(0), sysex_next_time(0),
+    threaded(false), ring(0), ring_size(0), ring_in(0), ring_out(0), ring_peak(0), ring_dropped(0),
+    max_send_time(0), sender_waiting(false) {
     try {
         port = new RtMidiOut();
     }
@@ -82,29 +124,74 @@ MIDIOutDriver::MIDIOutDriver(int id) :
         error.printMessage();
         port = new RtMidiOut(RtMidi::RTMIDI_DUMMY);// A non functional MIDI out, which won't throw further exceptions
     }
+    port_name = port->getPortName(id);
+    ResetNoteState();
+}
+
+
+MIDIOutDriver::MIDIOutDriver(int id, RtMidiOut* p) :
+    processor(0), port(p), port_id(id), rtmidi_index(-1), present(true), num_open(0), sched_count(0), sender_exit(false),
+    num_deferred(0), sysex_rate(DEFAULT_SYSEX_RATE), device_latency(0), sysex_next_time(0),
+    threaded(false), ring(0), ring_size(0), ring_in(0), ring_out(0), ring_peak(0), ring_dropped(0),
+    max_send_time(0), sender_waiting(false) {
+    ResetNoteState();
 }
 
 
 MIDIOutDriver::~MIDIOutDriver() {
-    port->closePort();
-    delete port;
+    StopSender();
+    delete[] ring;
+    if (port) {
+        port->closePort();
+        delete port;
+    }
 }
 
 
 void MIDIOutDriver::Reset() {
-    port->closePort();
+    {
+        std::lock_guard<std::mutex> lock(sched_mutex);
+        sched_queue = std::priority_queue<SchedMessage>();
+        sysex_queue.clear();
+        num_deferred = 0;
+    }
+    threaded = false;
+    MIDIMessage msg;
+    while (RingPop(msg))                        // discard the messages of the threaded mode
+        ;
+    if (port)
+        port->closePort();
     processor = 0;
     num_open = 0;
+    std::lock_guard<std::recursive_mutex> lock(out_mutex);
+    ResetNoteState();
+}
+
+
+unsigned int MIDIOutDriver::GetNumNotesOn(int chan) const {
+    unsigned int count = 0;
+    int first = (chan == -1 ? 0 : chan);
+    int last = (chan == -1 ? 15 : chan);
+    for (chan = first; chan <= last; chan++)
+        for (int i = 0; i < 4; i++)
+            for (uint32_t bits = note_bits[chan][i]; bits; bits &= bits - 1)
+                count++;
+    return count;
 }
 
 
 void MIDIOutDriver::OpenPort() {
     if (num_open == 0) {
+        int id = FindPort(port, port_name, rtmidi_index);
+        if (id < 0) {
+            NICMIDI_LOG_WARNING("OUT Port %s is not present", port_name.c_str());
+            return;
+        }
         try {
-            port->openPort(port_id);
-#if DRIVER_USES_MIDIMATRIX
-            out_matrix.Reset();
-#endif
+            std::lock_guard<std::recursive_mutex> lock(out_mutex);
+            rtmidi_index = id;
+            port->openPort(rtmidi_index);
+            ResetNoteState();
         }
         catch (RtMidiError& error) {
             error.printMessage();
@@ -113,10 +200,10 @@ void MIDIOutDriver::OpenPort() {
     }
     num_open++;
 
-    std::cout << "OUT Port " << port->getPortName(port_id) << " open";
     if (num_open > 1)
-        std::cout << " (" << num_open << " times)";
-    std::cout<< std::endl;
+        NICMIDI_LOG_INFO("OUT Port %s open (%d times)", port_name.c_str(), num_open);
+    else
+        NICMIDI_LOG_INFO("OUT Port %s open", port_name.c_str());
 }
 
 
@@ -125,113 +212,669 @@ void MIDIOutDriver::ClosePort() {
         port->closePort();
     if (num_open > 0) {
         num_open--;
-        std::cout << "OUT Port " << port->getPortName(port_id) << " closed";
         if (num_open > 0)
-            std::cout << " (open " << num_open << " times)";
-        std::cout << std::endl;
+            NICMIDI_LOG_INFO("OUT Port %s closed (open %d times)", port_name.c_str(), num_open);
+        else
+            NICMIDI_LOG_INFO("OUT Port %s closed", port_name.c_str());
     }
     else
-        std::cout << "OUT Port " << port->getPortName()
-        << "Attempt to close an already closed port!" << std::endl;
+        NICMIDI_LOG_WARNING("OUT Port %s: attempt to close an already closed port!", port_name.c_str());
 }
 
 
-void MIDIOutDriver::AllNotesOff(int chan) {
-    MIDIMessage msg;
+bool MIDIOutDriver::Reconnect() {
+    std::lock_guard<std::recursive_mutex> lock(out_mutex);
+    if (num_open == 0 || port == 0)             // port is 0 for virtual ports
+        return true;
+    int id = FindPort(port, port_name, rtmidi_index);
+    if (id < 0)
+        return false;
+    try {
+        port->closePort();
+        rtmidi_index = id;
+        port->openPort(rtmidi_index);
+        ResetNoteState();                       // the device was probably reset
+    }
+    catch (RtMidiError& error) {
+        error.printMessage();
+        return false;
+    }
+    NICMIDI_LOG_INFO("OUT Port %s reconnected", port_name.c_str());
+    return true;
+}
 
-    if (!port->isPortOpen())
-        return;
 
-    if (chan == -1) {
-        for (int i = 0; i < 16; i++)
-            AllNotesOff(i);
+void MIDIOutDriver::AllNotesOff(int chan) {
+    ClearSchedule();                            // future messages are discarded
+    if (!IsPortOpen())
         return;
-    }
-    out_mutex.lock();
 
-#if DRIVER_USES_MIDIMATRIX                      // send a note off for every note on in the out_matrix
-    if(out_matrix.GetChannelCount(chan) > 0)  {
-        for(int note = 0; note < 128; ++note) {
-            while(out_matrix.GetNoteCount(chan,note) > 0) {
-                msg.SetNoteOff((unsigned char)chan, (unsigned char)note, 0);
-                HardwareMsgOut(msg);
-            }
+    FlushQueue();                               // pending messages must be sent before
+    out_mutex.lock();
+    SendRing();
+    // build a batch with a note off for every sounding note and a pedal off for every pedal down; an All Notes
+    // Off is added only for the channels whose state is unknown (the port was open or reconnected and no
+    // All Notes Off was sent since)
+    panic_bytes.clear();
+    panic_ends.clear();
+    int first = (chan == -1 ? 0 : chan);
+    int last = (chan == -1 ? 15 : chan);
+    for (chan = first; chan <= last; chan++) {
+        for (int i = 0; i < 4; i++) {
+            if (note_bits[chan][i] == 0)
+                continue;
+            for (int n = 0; n < 32; n++)
+                if ((note_bits[chan][i] >> n) & 1) {
+                    panic_bytes.push_back(NOTE_OFF | chan);
+                    panic_bytes.push_back(i * 32 + n);
+                    panic_bytes.push_back(0);
+                    panic_ends.push_back(panic_bytes.size());
+                }
+        }
+        if ((damper_bits >> chan) & 1) {
+            panic_bytes.push_back(CONTROL_CHANGE | chan);
+            panic_bytes.push_back(C_DAMPER);
+            panic_bytes.push_back(0);
+            panic_ends.push_back(panic_bytes.size());
+        }
+        if ((sostenuto_bits >> chan) & 1) {
+            panic_bytes.push_back(CONTROL_CHANGE | chan);
+            panic_bytes.push_back(C_SOSTENUTO);
+            panic_bytes.push_back(0);
+            panic_ends.push_back(panic_bytes.size());
+        }
+        if ((unknown_bits >> chan) & 1) {
+            panic_bytes.push_back(CONTROL_CHANGE | chan);
+            panic_bytes.push_back(C_ALL_NOTES_OFF);
+            panic_bytes.push_back(0);
+            panic_ends.push_back(panic_bytes.size());
         }
     }
-    msg.SetControlChange(chan,C_DAMPER,0 );     // send a pedal off for every channel
-    HardwareMsgOut(msg);
-#endif // DRIVER_USES_MIDIMATRIX
-
-    msg.SetAllNotesOff( (unsigned char)chan );
-    HardwareMsgOut(msg);
-
+    HardwareBatchOut(panic_bytes, panic_ends);  // this clears the state
     out_mutex.unlock();
 }
 
 
 void MIDIOutDriver::OutputMessage(const MIDITimedMessage& msg) {    // MIDITimedMessage is good also for MIDIMessage
-    MIDITimedMessage msg_copy(msg);
+    // the message is copied only if it must be processed
+    const MIDITimedMessage* out_msg = &msg;
+    MIDITimedMessage msg_copy;
 
-    if (processor)
+    if (processor) {
+        msg_copy = msg;
         processor->Process(&msg_copy);
+        out_msg = &msg_copy;
+    }
+
+    if (threaded) {                             // the sender thread will send it
+        if (RingPush(*out_msg))
+            WakeSender();
+        return;
+    }
 
     int i = 0;
     for( ; i < DRIVER_MAX_RETRIES; i++) {
         if (out_mutex.try_lock()) {
-            HardwareMsgOut(msg_copy);
+            if (!DeferMessage(*out_msg))
+                HardwareMsgOut(*out_msg);
             out_mutex.unlock();
             break;
         }
-        std::cerr << "busy driver (" << (i + 1) << ") ... " << std::endl;
+        NICMIDI_LOG_WARNING("busy driver (%d) ...", i + 1);
         MIDITimer::Wait(1);
     }
     if (i == DRIVER_MAX_RETRIES)
-        std::cerr << "MIDIOutDriver::OutputMessage() failed!" << std::endl;
+        NICMIDI_LOG_ERROR("MIDIOutDriver::OutputMessage() failed!");
+}
+
+
+void MIDIOutDriver::QueueMessage(const MIDITimedMessage& msg) {
+    const MIDITimedMessage* out_msg = &msg;
+    MIDITimedMessage msg_copy;
+
+    if (processor) {
+        msg_copy = msg;
+        processor->Process(&msg_copy);
+        out_msg = &msg_copy;
+    }
+
+    if (threaded) {                             // FlushQueue() will wake the sender thread
+        RingPush(*out_msg);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(batch_mutex);
+    PutMsgBytes(*out_msg, batch_bytes);
+    if (batch_ends.empty() || batch_bytes.size() > batch_ends.back())
+        batch_ends.push_back(batch_bytes.size());
+}
+
+
+void MIDIOutDriver::FlushQueue() {
+    if (threaded && ring_in != ring_out)
+        WakeSender();
+    // take the batch, so other threads can queue messages while we are sending
+    std::vector<unsigned char> bytes;
+    std::vector<unsigned int> ends;
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        if (batch_ends.empty())
+            return;
+        bytes.swap(batch_bytes);
+        ends.swap(batch_ends);
+    }
+
+    int i = 0;
+    for( ; i < DRIVER_MAX_RETRIES; i++) {
+        if (out_mutex.try_lock()) {
+            HardwareBatchOut(bytes, ends);
+            out_mutex.unlock();
+            break;
+        }
+        NICMIDI_LOG_WARNING("busy driver (%d) ...", i + 1);
+        MIDITimer::Wait(1);
+    }
+    if (i == DRIVER_MAX_RETRIES)
+        NICMIDI_LOG_ERROR("MIDIOutDriver::FlushQueue() failed!");
+
+    // give back the buffers, so their memory is reused
+    std::lock_guard<std::mutex> lock(batch_mutex);
+    if (batch_ends.empty()) {
+        bytes.clear();
+        ends.clear();
+        batch_bytes.swap(bytes);
+        batch_ends.swap(ends);
+    }
+}
+
+
+void MIDIOutDriver::ScheduleMessage(const MIDITimedMessage& msg, tUsecs t) {
+    const MIDITimedMessage* out_msg = &msg;
+    MIDITimedMessage msg_copy;
+
+    if (processor) {
+        msg_copy = msg;
+        processor->Process(&msg_copy);
+        out_msg = &msg_copy;
+    }
+
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(sched_mutex);
+        StartSender();
+        // the sender must be woken only if this is the new first message
+        wake = sched_queue.empty() || t < sched_queue.top().time;
+        sched_queue.push(SchedMessage(*out_msg, t, sched_count++));
+    }
+    if (wake)
+        sched_cond.notify_one();
+}
+
+
+void MIDIOutDriver::ClearSchedule() {
+    std::vector<MIDIMessage> due;
+    {
+        std::lock_guard<std::mutex> lock(sched_mutex);
+        if (sched_queue.empty())
+            return;
+        tUsecs now = MIDITimer::GetSysTimeUs();
+        while (!sched_queue.empty() && sched_queue.top().time <= now) {
+            due.push_back(sched_queue.top().msg);
+            sched_queue.pop();
+        }
+        sched_queue = std::priority_queue<SchedMessage>();
+    }
+    std::lock_guard<std::recursive_mutex> out_lock(out_mutex);
+    for (unsigned int i = 0; i < due.size(); i++)
+        if (!DeferMessage(due[i]))
+            HardwareMsgOut(due[i]);
+}
+
+
+unsigned int MIDIOutDriver::GetNumScheduled() {
+    std::lock_guard<std::mutex> lock(sched_mutex);
+    return sched_queue.size();
+}
+
+
+void MIDIOutDriver::SetSysExRate(unsigned int bytes_per_sec) {
+    std::lock_guard<std::mutex> lock(sched_mutex);
+    sysex_rate = bytes_per_sec;
+}
+
+
+void MIDIOutDriver::StartSender() {
+    if (!sender_thread.joinable()) {
+        sender_exit = false;
+        sender_thread = std::thread(&MIDIOutDriver::SenderProc, this);
+        SetHighPriority(sender_thread);
+    }
+}
+
+
+void MIDIOutDriver::StopSender() {
+    if (sender_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(sched_mutex);
+            sender_exit = true;
+        }
+        sched_cond.notify_one();
+        sender_thread.join();
+    }
+}
+
+
+void MIDIOutDriver::SetThreadedOutput(bool on, unsigned int queue_size) {
+    std::lock_guard<std::recursive_mutex> out_lock(out_mutex);
+    if (on) {
+        if (queue_size == 0)
+            queue_size = DEFAULT_OUT_QUEUE_SIZE;
+        else if (queue_size < MIN_OUT_QUEUE_SIZE)   // with 1 slot a written and a free slot look the same
+            queue_size = MIN_OUT_QUEUE_SIZE;
+        if (queue_size != ring_size) {
+            SendRing();
+            delete[] ring;
+            ring = new RingSlot[queue_size]();      // all the seq are 0 (see RingPush())
+            ring_size = queue_size;
+            ring_in = ring_out = 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sched_mutex);
+            StartSender();
+        }
+        threaded = true;
+    }
+    else {
+        threaded = false;
+        SendRing();
+    }
+}
+
+
+void MIDIOutDriver::ResetOutStats() {
+    ring_peak = 0;
+    ring_dropped = 0;
+    max_send_time = 0;
+}
+
+
+// The queue works as the MIDILog ring buffer: the seq field of the slot i, which is used by the positions
+// i, i + ring_size, i + 2 * ring_size ..., holds (pos - i) when the slot is free for the writer at position
+// pos, and (pos - i + 1) when it holds the message written at pos.
+bool MIDIOutDriver::RingPush(const MIDIMessage& msg) {
+    unsigned long pos = ring_in.load(std::memory_order_relaxed);
+    RingSlot* slot;
+    for (;;) {
+        slot = &ring[pos % ring_size];
+        unsigned long base = pos - pos % ring_size;
+        long diff = (long)(slot->seq.load(std::memory_order_acquire) - base);
+        if (diff == 0) {
+            if (ring_in.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {                        // the queue is full
+            ring_dropped++;
+            return false;
+        }
+        else
+            pos = ring_in.load(std::memory_order_relaxed);
+    }
+    slot->msg = msg;
+    slot->seq.store(pos - pos % ring_size + 1, std::memory_order_release);
+    unsigned int len = pos + 1 - ring_out.load(std::memory_order_relaxed);
+    if (len > ring_peak)
+        ring_peak = len;
+    return true;
+}
+
+
+bool MIDIOutDriver::RingPop(MIDIMessage& msg) {
+    if (ring == 0)
+        return false;
+    unsigned long pos = ring_out.load(std::memory_order_relaxed);
+    RingSlot* slot;
+    for (;;) {
+        slot = &ring[pos % ring_size];
+        unsigned long base = pos - pos % ring_size;
+        long diff = (long)(slot->seq.load(std::memory_order_acquire) - (base + 1));
+        if (diff == 0) {
+            if (ring_out.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)                          // the queue is empty
+            return false;
+        else
+            pos = ring_out.load(std::memory_order_relaxed);
+    }
+    msg = slot->msg;
+    slot->seq.store(pos - pos % ring_size + ring_size, std::memory_order_release);
+    return true;
+}
+
+
+void MIDIOutDriver::SendRing() {
+    MIDIMessage msg;
+    while (RingPop(msg)) {
+        tUsecs start = MIDITimer::GetSysTimeUs();
+        if (!DeferMessage(msg))
+            HardwareMsgOut(msg);
+        tUsecs elapsed = MIDITimer::GetSysTimeUs() - start;
+        if (elapsed > max_send_time)
+            max_send_time = elapsed;
+    }
+}
+
+
+void MIDIOutDriver::WakeSender() {
+    // this fence and the one in SenderProc() ensure that either the sender sees the new message or we see
+    // it waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sender_waiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(sched_mutex);
+        sched_cond.notify_one();
+    }
+}
+
+
+bool MIDIOutDriver::IsTimingCritical(unsigned char status, unsigned char byte1) {
+    switch (status & 0xf0) {
+        case NOTE_OFF:
+        case NOTE_ON:
+        case POLY_PRESSURE:
+        case CHANNEL_PRESSURE:
+        case PITCH_BEND:
+            return true;
+        case CONTROL_CHANGE:                        // pedals and channel mode messages
+            return byte1 == C_DAMPER || byte1 == C_SOSTENUTO || byte1 == C_SOFT_PEDAL ||
+                   byte1 >= C_ALL_SOUND_OFF;
+        default:
+            return status >= RT_TIMING_CLOCK;       // real time messages
+    }
+}
+
+
+bool MIDIOutDriver::DeferMessage(const MIDIMessage& msg) {
+    bool is_sysex = msg.IsSysEx();
+    // fast path: no lock if nothing is deferred
+    if (!is_sysex && num_deferred == 0)
+        return false;
+    if (!is_sysex && (msg.GetStatus() < NOTE_OFF || IsTimingCritical(msg.GetStatus(), msg.GetByte1())))
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(sched_mutex);
+        if (!is_sysex && sysex_queue.empty())
+            return false;
+        StartSender();
+        sysex_queue.push_back(msg);
+        num_deferred = sysex_queue.size();
+    }
+    sched_cond.notify_one();
+    return true;
+}
+
+
+void MIDIOutDriver::SenderProc() {
+    std::unique_lock<std::mutex> lock(sched_mutex);
+    while (!sender_exit) {
+        tUsecs now = MIDITimer::GetSysTimeUs();
+        tUsecs wake = 0;                        // 0 means no wake up time
+        // take all the due scheduled messages
+        while (!sched_queue.empty() && sched_queue.top().time <= now) {
+            sender_due.push_back(sched_queue.top().msg);
+            sched_queue.pop();
+        }
+        if (!sched_queue.empty())
+            wake = sched_queue.top().time;
+        // take the deferred messages, pacing the sysex
+        while (!sysex_queue.empty()) {
+            const MIDIMessage& msg = sysex_queue.front();
+            if (msg.IsSysEx()) {
+                if (now < sysex_next_time) {
+                    if (wake == 0 || sysex_next_time < wake)
+                        wake = sysex_next_time;
+                    break;
+                }
+                // the time needed for transmitting the sysex at the given rate
+                tUsecs len = msg.GetSysEx()->GetLength();
+                sysex_next_time = now + (sysex_rate ? len * 1000000 / sysex_rate :
+                                                      DRIVER_WAIT_AFTER_SYSEX * 1000);
+            }
+            sender_deferred.push_back(msg);
+            sysex_queue.pop_front();
+        }
+        num_deferred = sysex_queue.size();
+
+        if (sender_due.empty() && sender_deferred.empty()) {
+            sender_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring_in.load(std::memory_order_relaxed) == ring_out.load(std::memory_order_relaxed)) {
+                // wait until something is due (or a new message arrives)
+                if (wake)
+                    sched_cond.wait_for(lock, std::chrono::microseconds(wake - now));
+                else
+                    sched_cond.wait(lock);
+                sender_waiting = false;
+                continue;
+            }
+            sender_waiting = false;
+        }
+        // send the messages with the schedule unlocked; the messages of the threaded mode (sent before
+        // by the user) go first, then the timing critical messages
+        lock.unlock();
+        out_mutex.lock();
+        SendRing();
+        for (unsigned int i = 0; i < sender_due.size(); i++)
+            if (!DeferMessage(sender_due[i]))
+                HardwareMsgOut(sender_due[i]);
+        for (unsigned int i = 0; i < sender_deferred.size(); i++)
+            HardwareMsgOut(sender_deferred[i]);
+        out_mutex.unlock();
+        sender_due.clear();
+        sender_deferred.clear();
+        lock.lock();
+    }
 }
 
 
 void MIDIOutDriver::HardwareMsgOut(const MIDIMessage &msg) {
     if (!port->isPortOpen())
         return;
-    msg_bytes.clear();
-#if DRIVER_USES_MIDIMATRIX
-    if (msg.IsChannelMsg()) {
-        MIDITimedMessage tmsg(msg);
-        out_matrix.Process (&tmsg);
-    }
-#endif
+    if (msg.IsChannelMsg())
+        TrackMessage(msg.GetStatus(), msg.GetByte1(), msg.GetByte2());
 
+    // channel messages are sent from a local buffer, sysex directly from their own buffer
+    unsigned char msg_bytes[3];
+    const unsigned char* bytes = msg_bytes;
+    unsigned int len = 0;
     if (msg.IsSysEx()) {
-        for (int i = 0; i < msg.GetSysEx()->GetLength(); i++)
-            msg_bytes.push_back(msg.GetSysEx()->GetData(i));
-        //std::cout << "Driver sent sysex of " << msg.GetSysEx()->GetLength() << " bytes ... ";
+        bytes = msg.GetSysEx()->GetBuffer();
+        len = msg.GetSysEx()->GetLength();
+        ResetLastValues();          // the sysex could change them
     }
 
     //else if (msg.IsReset())         // a reset message, with the same status of meta events
     //    msg_bytes.push_back(msg.GetStatus()) TODO: for now don't send reset messages
 
-    else if (msg.IsMetaEvent())
-        return;                     // don't send meta events
+    else if (msg.IsMetaEvent() || msg.GetStatus() < NOTE_OFF)
+        return;                     // don't send meta events and service messages
 
     else {                          // other messages
-        msg_bytes.push_back(msg.GetStatus());
-        if (msg.GetLength() > 1)
-            msg_bytes.push_back(msg.GetByte1());
-        if (msg.GetLength() > 2)
-            msg_bytes.push_back(msg.GetByte2());
+        msg_bytes[0] = msg.GetStatus();
+        msg_bytes[1] = msg.GetByte1();
+        msg_bytes[2] = msg.GetByte2();
+        len = msg.GetLength();
+    }
+
+    if (len > 0) {
+        try {
+            port->sendMessage(bytes, len);
+        }
+        catch (RtMidiError& error) {
+            error.printMessage();
+        }
     }
+}
 
-    if (msg_bytes.size() > 0) {
+
+void MIDIOutDriver::HardwareBatchOut(const std::vector<unsigned char>& bytes,
+                                     const std::vector<unsigned int>& ends) {
+    if (!port->isPortOpen())
+        return;
+    unsigned int start = 0;
+    for (unsigned int i = 0; i < ends.size(); i++) {
+        const unsigned char* p = bytes.data() + start;
+        unsigned int len = ends[i] - start;
+        start = ends[i];
+        // SysEx (and the messages which must follow them) are sent by the sender thread
+        if (p[0] == SYSEX_START || (num_deferred > 0 && !IsTimingCritical(p[0], len > 1 ? p[1] : 0))) {
+            MIDIMessage msg;
+            if (p[0] == SYSEX_START) {
+                MIDISystemExclusive sysex(p, len);
+                msg.SetSysEx(&sysex);
+            }
+            else {
+                msg.SetStatus(p[0]);
+                msg.SetByte1(len > 1 ? p[1] : 0);
+                msg.SetByte2(len > 2 ? p[2] : 0);
+            }
+            if (DeferMessage(msg))
+                continue;
+        }
+        if (p[0] >= NOTE_OFF && p[0] < SYSEX_START)
+            TrackMessage(p[0], len > 1 ? p[1] : 0, len > 2 ? p[2] : 0);
+        // every message must be sent with its own call (RtMidi doesn't accept running status)
         try {
-            port->sendMessage(&msg_bytes);
+            port->sendMessage(p, len);
         }
         catch (RtMidiError& error) {
             error.printMessage();
         }
-        //std::cout << "Driver sent nonSysex message" << std::endl;
     }
-    if (msg.IsSysEx()) // || msg.IsReset())
-        MIDITimer::Wait(DRIVER_WAIT_AFTER_SYSEX);
+}
+
+
+void MIDIOutDriver::TrackMessage(unsigned char status, unsigned char byte1, unsigned char byte2) {
+    int chan = status & 0x0f;
+    uint32_t bit = (uint32_t)1 << (byte1 & 31);
+    switch (status & 0xf0) {
+        case NOTE_ON:
+            if (byte2 > 0) {
+                note_bits[chan][(byte1 & 0x7f) >> 5] |= bit;
+                break;
+            }
+            // a note on with velocity 0 is a note off
+            // falls through
+        case NOTE_OFF:
+            note_bits[chan][(byte1 & 0x7f) >> 5] &= ~bit;
+            break;
+        case PROGRAM_CHANGE:
+            last_program[chan] = byte1 & 0x7f;
+            break;
+        case PITCH_BEND:
+            last_bender[chan] = (byte1 & 0x7f) | ((byte2 & 0x7f) << 7);
+            break;
+        case CONTROL_CHANGE:
+            // the data entry value refers to the selected (N)RPN: a new selection or an increment makes it unknown
+            if ((byte1 >= C_NRPN_LSB && byte1 <= C_RPN_MSB && last_control[chan][byte1] != (byte2 & 0x7f)) ||
+                byte1 == C_DATA_INC || byte1 == C_DATA_DEC)
+                last_control[chan][C_DATA_ENTRY] = last_control[chan][C_DATA_ENTRY + C_LSB] = -1;
+            last_control[chan][byte1 & 0x7f] = byte2 & 0x7f;
+            if (byte1 == C_RESET)
+                for (int i = 0; i < 128; i++)
+                    last_control[chan][i] = -1;
+            else if (byte1 == C_DAMPER) {
+                if (byte2 >= 64)
+                    damper_bits |= (1 << chan);
+                else
+                    damper_bits &= ~(1 << chan);
+            }
+            else if (byte1 == C_SOSTENUTO) {
+                if (byte2 >= 64)
+                    sostenuto_bits |= (1 << chan);
+                else
+                    sostenuto_bits &= ~(1 << chan);
+            }
+            else if (byte1 == C_ALL_NOTES_OFF || byte1 == C_ALL_SOUND_OFF) {
+                for (int i = 0; i < 4; i++)
+                    note_bits[chan][i] = 0;
+                unknown_bits &= ~(1 << chan);
+            }
+            break;
+    }
+}
+
+
+void MIDIOutDriver::ResetNoteState() {
+    for (int chan = 0; chan < 16; chan++)
+        for (int i = 0; i < 4; i++)
+            note_bits[chan][i] = 0;
+    damper_bits = 0;
+    sostenuto_bits = 0;
+    unknown_bits = 0xffff;                      // the device could have sounding notes we didn't send
+    ResetLastValues();
+}
+
+
+void MIDIOutDriver::ResetLastValues() {
+    for (int chan = 0; chan < 16; chan++) {
+        for (int i = 0; i < 128; i++)
+            last_control[chan][i] = -1;
+        last_program[chan] = -1;
+        last_bender[chan] = -1;
+    }
+}
+
+
+bool MIDIOutDriver::IsRedundant(const MIDIMessage& msg) {
+    if (processor || num_deferred > 0 || ring_in != ring_out)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        if (!batch_ends.empty())
+            return false;
+    }
+    // the values are written by the thread which sends: if it is sending we don't wait, and the message
+    // is sent anyway
+    if (!out_mutex.try_lock())
+        return false;
+    bool ret = false;
+    int chan = msg.GetChannel();
+    if (msg.IsControlChange()) {
+        int ctrl = msg.GetController();
+        // the data entry acts on the selected (N)RPN and the increment and decrement are not idempotent
+        ret = ctrl != C_RESET && ctrl != C_DATA_ENTRY && ctrl != C_DATA_ENTRY + C_LSB && ctrl != C_DATA_INC &&
+              ctrl != C_DATA_DEC && last_control[chan][ctrl] == msg.GetControllerValue();
+    }
+    else if (msg.IsProgramChange())
+        ret = last_program[chan] == msg.GetProgramValue();
+    else if (msg.IsPitchBend())
+        ret = last_bender[chan] == msg.GetBenderValue() + 8192;
+    out_mutex.unlock();
+    return ret;
+}
+
+
+void MIDIOutDriver::PutMsgBytes(const MIDIMessage& msg, std::vector<unsigned char>& bytes) {
+    if (msg.IsSysEx()) {
+        const unsigned char* buf = msg.GetSysEx()->GetBuffer();
+        bytes.insert(bytes.end(), buf, buf + msg.GetSysEx()->GetLength());
+        //std::cout << "Driver sent sysex of " << msg.GetSysEx()->GetLength() << " bytes ... ";
+    }
+
+    //else if (msg.IsReset())         // a reset message, with the same status of meta events
+    //    msg_bytes.push_back(msg.GetStatus()) TODO: for now don't send reset messages
+
+    else if (msg.IsMetaEvent() || msg.GetStatus() < NOTE_OFF)
+        return;                     // don't send meta events and service messages
+
+    else {                          // other messages
+        bytes.push_back(msg.GetStatus());
+        if (msg.GetLength() > 1)
+            bytes.push_back(msg.GetByte1());
+        if (msg.GetLength() > 2)
+            bytes.push_back(msg.GetByte2());
+    }
 }
 
 
@@ -241,7 +884,8 @@ void MIDIOutDriver::HardwareMsgOut(const MIDIMessage &msg) {
 
 
 MIDIInDriver::MIDIInDriver(int id, unsigned int queue_size) :
-    processor(0), port_id(id), num_open(0), in_queue(queue_size) {
+    processor(0), port_id(id), rtmidi_index(id), present(true), num_open(0), in_queue(queue_size), in_last_time(0),
+    in_time_valid(false) {
     try {
         port = new RtMidiIn();
         port->setCallback(HardwareMsgIn, this);
@@ -251,17 +895,27 @@ MIDIInDriver::MIDIInDriver(int id, unsigned int queue_size) :
         error.printMessage();
         port = new RtMidiIn(RtMidi::RTMIDI_DUMMY);// A non functional MIDI out, which won't throw further exceptions
     }
+    port_name = port->getPortName(id);
+}
+
+
+MIDIInDriver::MIDIInDriver(int id, RtMidiIn* p, unsigned int queue_size) :
+    processor(0), port(p), port_id(id), rtmidi_index(-1), present(true), num_open(0), in_queue(queue_size),
+    in_last_time(0), in_time_valid(false) {
 }
 
 
 MIDIInDriver::~MIDIInDriver() {
-    port->closePort();
-    delete port;
+    if (port) {
+        port->closePort();
+        delete port;
+    }
 }
 
 
 void MIDIInDriver::Reset() {
-    port->closePort();
+    if (port)
+        port->closePort();
     num_open = 0;
     in_queue.Reset();
 
@@ -271,8 +925,17 @@ void MIDIInDriver::Reset() {
 
 void MIDIInDriver::OpenPort() {
     if (num_open == 0) {
+        in_mutex.lock();
+        in_time_valid = false;                  // the first delta time given by RtMidi is 0
+        in_mutex.unlock();
+        int id = FindPort(port, port_name, rtmidi_index);
+        if (id < 0) {
+            NICMIDI_LOG_WARNING("IN Port %s is not present", port_name.c_str());
+            return;
+        }
         try {
-            port->openPort(port_id);
+            rtmidi_index = id;
+            port->openPort(rtmidi_index);
         }
         catch (RtMidiError& error) {
             error.printMessage();
@@ -281,10 +944,10 @@ void MIDIInDriver::OpenPort() {
     }
     num_open++;
 
-    std::cout << "IN Port " << port->getPortName() << " open";
     if (num_open > 1)
-        std::cout << " (" << num_open << " times)";
-    std::cout<< std::endl;
+        NICMIDI_LOG_INFO("IN Port %s open (%d times)", port_name.c_str(), num_open);
+    else
+        NICMIDI_LOG_INFO("IN Port %s open", port_name.c_str());
 }
 
 
@@ -293,15 +956,35 @@ void MIDIInDriver::ClosePort() {
             port->closePort();
     if (num_open > 0) {
         num_open--;
-
-        std::cout << "IN Port " << port->getPortName() << " closed";
         if (num_open > 0)
-            std::cout << " (" << num_open << " times)";
-        std::cout << std::endl;
+            NICMIDI_LOG_INFO("IN Port %s closed (open %d times)", port_name.c_str(), num_open);
+        else
+            NICMIDI_LOG_INFO("IN Port %s closed", port_name.c_str());
     }
     else
-        std::cout << "IN Port " << port->getPortName()
-        << "Attempt to close an already closed port!" << std::endl;
+        NICMIDI_LOG_WARNING("IN Port %s: attempt to close an already closed port!", port_name.c_str());
+}
+
+
+bool MIDIInDriver::Reconnect() {
+    std::lock_guard<std::recursive_mutex> lock(in_mutex);
+    if (num_open == 0 || port == 0)             // port is 0 for virtual ports
+        return true;
+    int id = FindPort(port, port_name, rtmidi_index);
+    if (id < 0)
+        return false;
+    try {
+        port->closePort();
+        rtmidi_index = id;
+        in_time_valid = false;
+        port->openPort(rtmidi_index);
+    }
+    catch (RtMidiError& error) {
+        error.printMessage();
+        return false;
+    }
+    NICMIDI_LOG_INFO("IN Port %s reconnected", port_name.c_str());
+    return true;
 }
 
 
@@ -342,12 +1025,18 @@ void MIDIInDriver::HardwareMsgIn(double time,
 
     MIDIInDriver* drv = static_cast<MIDIInDriver*>(p);
 
-    std::cout << drv->GetPortName() << " callback executed   ";
-
     if (!drv->port->isPortOpen() || msg_bytes->size() == 0)
         return;
 
+    tUsecs now = MIDITimer::GetSysTimeUs();
     drv->in_mutex.lock();
+    // rebuild the arrival time adding the RtMidi delta time (in seconds) to the previous one
+    tUsecs msg_time = drv->in_last_time + (tUsecs)(time * 1000000.0 + 0.5);
+    if (!drv->in_time_valid || msg_time > now || now - msg_time > DRIVER_MAX_IN_DRIFT)
+        msg_time = now;                             // anchor to the system time
+    drv->in_last_time = msg_time;
+    drv->in_time_valid = true;
+
     MIDITimedMessage msg;
     msg.SetStatus(msg_bytes->operator[](0));        // in msg_bytes[0] there is the status byte
     if (msg.IsSysEx()) {
@@ -364,17 +1053,19 @@ void MIDIInDriver::HardwareMsgIn(double time,
             msg.SetByte2(msg_bytes->operator[](2)); // byte3 surely 0 in non-meta messages
     }
 
-    if (!msg.IsNoOp()) {                            // now we have a valid message
+    drv->PutInQueue(msg, msg_time);
+    drv->in_mutex.unlock();
+}
 
-        if (drv->processor)
-            drv->processor->Process(&msg);          // process it with the in processor
+
+void MIDIInDriver::PutInQueue(MIDITimedMessage& msg, tUsecs t) {
+    if (!msg.IsNoOp()) {                            // now we have a valid message
+        if (processor)
+            processor->Process(&msg);               // process it with the in processor
                                                     // adds the message to the queue
-        drv->in_queue.PutMessage(MIDIRawMessage(msg,
-                                                MIDITimer::GetSysTimeMs(),
-                                                drv->port_id));
-        std::cout << "Got message, queue size: " << drv->in_queue.GetLength() << std::endl;
+        in_queue.PutMessage(MIDIRawMessage(msg, t / 1000, port_id, t));
+        NICMIDI_LOG_DEBUG("IN Port %d got message, queue size: %u", port_id, in_queue.GetLength());
     }
     else
-        std::cout << "No message, queue size: " << drv->in_queue.GetLength() << std::endl;
-    drv->in_mutex.unlock();
+        NICMIDI_LOG_DEBUG("IN Port %d no message, queue size: %u", port_id, in_queue.GetLength());
 }
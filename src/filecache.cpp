@@ -0,0 +1,663 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "../include/filecache.h"
+
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define CACHE_USES_MMAP
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////
+//                     cache file records and helpers                     //
+////////////////////////////////////////////////////////////////////////////
+
+// All the records have fixed size and natural alignment, and every section of the file starts at
+// a multiple of 8 bytes, so the records can be read directly from the mapped file.
+
+static const char CACHE_MAGIC[8] = { 'N', 'i', 'C', 'M', 'i', 'd', 'i', 'C' };
+static const uint32_t CACHE_BYTE_ORDER = 0x01020304;
+
+
+struct MIDIFileCache::FileHeader {
+    char        magic[8];               // CACHE_MAGIC
+    uint32_t    version;                // CACHE_VERSION
+    uint32_t    byte_order;             // CACHE_BYTE_ORDER, written in the machine order
+    uint64_t    file_size;              // the size of the cache file
+    uint64_t    src_size;               // the size of the original MIDI file
+    int64_t     src_mtime;              // the modification time of the original MIDI file, in nsecs
+    int32_t     format;                 // the MIDIFileHeader fields
+    int32_t     ntrks;
+    int32_t     division;
+    uint32_t    clks_per_beat;          // the clocks per beat of the multitrack
+    uint32_t    num_tracks;             // the number of records in every section
+    uint32_t    num_events;
+    uint32_t    payload_size;
+    uint32_t    num_tempos;
+    uint32_t    num_measures;           // the number of measures given to Save()
+    uint32_t    num_warps;
+    uint32_t    warps_size;
+    uint32_t    name_len;
+    uint32_t    layout;                 // GetLayoutHash()
+    uint32_t    reserved;
+    uint64_t    tracks_off;             // the offset of every section from the start of the file
+    uint64_t    events_off;
+    uint64_t    payload_off;
+    uint64_t    tempos_off;
+    uint64_t    warps_off;
+    uint64_t    name_off;
+};
+
+
+struct MIDIFileCache::TrackRecord {
+    uint32_t    first_event;            // the index of the first event of the track in the event section
+    uint32_t    num_events;             // the number of events (excluding the data end)
+    uint32_t    end_time;               // the time of the data end
+    uint32_t    reserved;
+};
+
+
+struct MIDIFileCache::EventRecord {
+    uint32_t    time;
+    uint8_t     status;
+    uint8_t     byte1;
+    uint8_t     byte2;
+    uint8_t     byte3;
+    uint32_t    payload_off;            // the offset of the SysEx data in the payload pool
+    uint32_t    payload_len;            // the length of the SysEx data (0 if the event has none)
+};
+
+
+struct MIDIFileCache::TempoRecord {
+    uint32_t    clock;
+    uint32_t    reserved;
+    double      time_ms;
+    double      ms_per_clock;
+};
+
+
+// Appends the raw bytes of a value to a buffer.
+template<class T>
+static void Put(std::vector<unsigned char>& buf, const T& v) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(&v);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+
+// Appends a string (as its length and its characters) to a buffer.
+static void PutString(std::vector<unsigned char>& buf, const std::string& s) {
+    Put(buf, (uint32_t)s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+}
+
+
+// Reads a value from a buffer, checking it doesn't go beyond the end.
+template<class T>
+static bool Get(const unsigned char*& p, const unsigned char* end, T& v) {
+    if (end - p < (long)sizeof(T))
+        return false;
+    std::memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+
+// Reads a string from a buffer, checking it doesn't go beyond the end.
+static bool GetString(const unsigned char*& p, const unsigned char* end, std::string& s) {
+    uint32_t len;
+    if (!Get(p, end, len) || (unsigned long)(end - p) < len)
+        return false;
+    s.assign(reinterpret_cast<const char*>(p), len);
+    p += len;
+    return true;
+}
+
+
+// Pads a buffer with zeroes to a multiple of 8 bytes.
+static void Align(std::vector<unsigned char>& buf) {
+    while (buf.size() % 8)
+        buf.push_back(0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                          class MIDIFileCache                           //
+////////////////////////////////////////////////////////////////////////////
+
+
+MIDIFileCache::MIDIFileCache() : data(0), data_size(0), mapped(false), num_measures(0) {}
+
+
+MIDIFileCache::~MIDIFileCache() {
+    Clear();
+}
+
+
+void MIDIFileCache::Clear() {
+#ifdef CACHE_USES_MMAP
+    if (mapped)
+        munmap(const_cast<unsigned char*>(data), data_size);
+#endif // CACHE_USES_MMAP
+    data = 0;
+    data_size = 0;
+    mapped = false;
+    std::vector<unsigned char>().swap(buffer);
+    header = MIDIFileHeader();
+    num_measures = 0;
+    tempo_map.clear();
+}
+
+
+bool MIDIFileCache::Load(const char* cache_name, const char* src_name) {
+    Clear();
+    uint64_t size;
+    int64_t mtime;
+    if (!GetFileStat(cache_name, &size, &mtime) || size < sizeof(FileHeader))
+        return false;
+
+#ifdef CACHE_USES_MMAP
+    int fd = open(cache_name, O_RDONLY);
+    if (fd < 0)
+        return false;
+    void* addr = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                                      // the mapping stays valid
+    if (addr == MAP_FAILED)
+        return false;
+    data = static_cast<const unsigned char*>(addr);
+    mapped = true;
+#else
+    std::ifstream in_stream(cache_name, std::ios::in | std::ios::binary);
+    if (in_stream.fail())
+        return false;
+    buffer.resize(size);
+    if (!in_stream.read(reinterpret_cast<char*>(buffer.data()), size)) {
+        Clear();
+        return false;
+    }
+    data = buffer.data();
+#endif // CACHE_USES_MMAP
+    data_size = size;
+
+    if (!Validate()) {
+        Clear();
+        return false;
+    }
+    const FileHeader* fh = reinterpret_cast<const FileHeader*>(data);
+    // check that the MIDI file was not changed after writing the cache
+    if (src_name) {
+        uint64_t src_size;
+        int64_t src_mtime;
+        if (!GetFileStat(src_name, &src_size, &src_mtime) ||
+            src_size != fh->src_size || src_mtime != fh->src_mtime) {
+            Clear();
+            return false;
+        }
+    }
+
+    header.format = fh->format;
+    header.ntrks = fh->ntrks;
+    header.division = fh->division;
+    if (src_name)
+        header.filename = src_name;
+    else
+        header.filename.assign(reinterpret_cast<const char*>(data + fh->name_off), fh->name_len);
+    num_measures = fh->num_measures;
+    const TempoRecord* tr = reinterpret_cast<const TempoRecord*>(data + fh->tempos_off);
+    tempo_map.resize(fh->num_tempos);
+    for (unsigned int i = 0; i < fh->num_tempos; i++) {
+        tempo_map[i].clock = tr[i].clock;
+        tempo_map[i].time_ms = tr[i].time_ms;
+        tempo_map[i].ms_per_clock = tr[i].ms_per_clock;
+    }
+    return true;
+}
+
+
+bool MIDIFileCache::GetMultiTrack(MIDIMultiTrack* tracks) const {
+    if (!IsLoaded())
+        return false;
+    const FileHeader* fh = reinterpret_cast<const FileHeader*>(data);
+    const TrackRecord* trk_rec = reinterpret_cast<const TrackRecord*>(data + fh->tracks_off);
+    const EventRecord* ev_rec = reinterpret_cast<const EventRecord*>(data + fh->events_off);
+    const unsigned char* payload = data + fh->payload_off;
+
+    tracks->Reset(fh->num_tracks);
+    tracks->SetClksPerBeat(fh->clks_per_beat);      // the multitrack is empty, so no event is rescaled
+    MIDITimedMessage msg;
+    for (unsigned int i = 0; i < fh->num_tracks; i++) {
+        MIDITrack* trk = tracks->GetTrack(i);
+        trk->Reserve(trk_rec[i].num_events);        // the events are never reallocated (and so copied again)
+        const EventRecord* ev = ev_rec + trk_rec[i].first_event;
+        for (unsigned int j = 0; j < trk_rec[i].num_events; j++, ev++) {
+            msg.SetTime(ev->time);
+            msg.SetStatus(ev->status);
+            msg.SetByte1(ev->byte1);
+            msg.SetByte2(ev->byte2);
+            msg.SetByte3(ev->byte3);
+            trk->PushEvent(msg);
+            if (ev->payload_len) {
+                // copy the data directly into the event in the track, as a single block
+                MIDITimedMessage& new_msg = trk->GetEvent(trk->GetNumEvents() - 2);
+                new_msg.AllocateSysEx(ev->payload_len);
+                new_msg.GetSysEx()->PutSysBytes(payload + ev->payload_off, ev->payload_len);
+            }
+        }
+        trk->SetEndTime(trk_rec[i].end_time);
+    }
+    return true;
+}
+
+
+bool MIDIFileCache::GetWarpPositions(std::vector<MIDISequencerState>* warps,
+                                     const MIDISequencerState& model) const {
+    warps->clear();
+    if (!IsLoaded())
+        return false;
+    const FileHeader* fh = reinterpret_cast<const FileHeader*>(data);
+    if (fh->num_warps == 0 || model.multitrack->GetNumTracks() != fh->num_tracks)
+        return false;
+    const unsigned char* p = data + fh->warps_off;
+    const unsigned char* end = p + fh->warps_size;
+    warps->reserve(fh->num_warps);
+    for (unsigned int i = 0; i < fh->num_warps; i++) {
+        warps->push_back(model);
+        if (!GetState(p, end, warps->back())) {
+            warps->clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool MIDIFileCache::Save(const char* cache_name, const MIDIMultiTrack* tracks, const MIDIFileHeader& head,
+                         const std::vector<MIDISequencerState>* warps, unsigned int num_meas) {
+    FileHeader fh;
+    std::memset(&fh, 0, sizeof(fh));
+    std::memcpy(fh.magic, CACHE_MAGIC, sizeof(fh.magic));
+    fh.version = CACHE_VERSION;
+    fh.byte_order = CACHE_BYTE_ORDER;
+    fh.layout = GetLayoutHash();
+    uint64_t src_size = 0;
+    int64_t src_mtime = 0;
+    if (!GetFileStat(head.filename.c_str(), &src_size, &src_mtime))
+        return false;
+    fh.src_size = src_size;
+    fh.src_mtime = src_mtime;
+    fh.format = head.format;
+    fh.ntrks = head.ntrks;
+    fh.division = head.division;
+    fh.clks_per_beat = tracks->GetClksPerBeat();
+    fh.num_tracks = tracks->GetNumTracks();
+
+    // build the track, event and payload sections
+    std::vector<TrackRecord> trk_recs(fh.num_tracks);
+    std::vector<EventRecord> ev_recs;
+    std::vector<unsigned char> payload;
+    for (unsigned int i = 0; i < fh.num_tracks; i++) {
+        const MIDITrack* trk = tracks->GetTrack(i);
+        trk_recs[i].first_event = ev_recs.size();
+        trk_recs[i].end_time = trk->GetEndTime();
+        trk_recs[i].reserved = 0;
+        for (unsigned int j = 0; j < trk->GetNumEvents(); j++) {
+            const MIDITimedMessage& msg = trk->GetEvent(j);
+            if (msg.IsDataEnd())
+                continue;
+            EventRecord ev;
+            ev.time = msg.GetTime();
+            ev.status = msg.GetStatus();
+            ev.byte1 = msg.GetByte1();
+            ev.byte2 = msg.GetByte2();
+            ev.byte3 = msg.GetByte3();
+            ev.payload_off = payload.size();
+            ev.payload_len = 0;
+            const MIDISystemExclusive* sysex = msg.GetSysEx();
+            if (sysex && sysex->GetLength() > 0) {
+                ev.payload_len = sysex->GetLength();
+                payload.insert(payload.end(), sysex->GetBuffer(), sysex->GetBuffer() + sysex->GetLength());
+            }
+            ev_recs.push_back(ev);
+        }
+        trk_recs[i].num_events = ev_recs.size() - trk_recs[i].first_event;
+    }
+    fh.num_events = ev_recs.size();
+    fh.payload_size = payload.size();
+
+    // build the tempo map
+    std::vector<MIDICacheTempo> tmap;
+    MakeTempoMap(tracks, &tmap);
+    fh.num_tempos = tmap.size();
+    fh.num_measures = num_meas;
+
+    // build the warp snapshots
+    std::vector<unsigned char> warp_blob;
+    if (warps) {
+        for (unsigned int i = 0; i < warps->size(); i++)
+            PutState(warp_blob, (*warps)[i]);
+        fh.num_warps = warps->size();
+    }
+    fh.warps_size = warp_blob.size();
+    fh.name_len = head.filename.size();
+
+    // put all together
+    std::vector<unsigned char> buf(sizeof(FileHeader));
+    Align(buf);
+    fh.tracks_off = buf.size();
+    for (unsigned int i = 0; i < trk_recs.size(); i++)
+        Put(buf, trk_recs[i]);
+    Align(buf);
+    fh.events_off = buf.size();
+    for (unsigned int i = 0; i < ev_recs.size(); i++)
+        Put(buf, ev_recs[i]);
+    Align(buf);
+    fh.payload_off = buf.size();
+    buf.insert(buf.end(), payload.begin(), payload.end());
+    Align(buf);
+    fh.tempos_off = buf.size();
+    for (unsigned int i = 0; i < tmap.size(); i++) {
+        TempoRecord tr;
+        tr.clock = tmap[i].clock;
+        tr.reserved = 0;
+        tr.time_ms = tmap[i].time_ms;
+        tr.ms_per_clock = tmap[i].ms_per_clock;
+        Put(buf, tr);
+    }
+    Align(buf);
+    fh.warps_off = buf.size();
+    buf.insert(buf.end(), warp_blob.begin(), warp_blob.end());
+    Align(buf);
+    fh.name_off = buf.size();
+    buf.insert(buf.end(), head.filename.begin(), head.filename.end());
+    Align(buf);
+    fh.file_size = buf.size();
+    std::memcpy(buf.data(), &fh, sizeof(fh));
+
+    std::ofstream out_stream(cache_name, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (out_stream.fail())
+        return false;
+    out_stream.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+    return !out_stream.fail();
+}
+
+
+bool MIDIFileCache::GetFileStat(const char* fname, uint64_t* size, int64_t* mtime) {
+    struct stat st;
+    if (stat(fname, &st) != 0)
+        return false;
+    *size = st.st_size;
+    // use the nsecs where available, so a file rewritten in the same second is detected
+#if defined(__APPLE__)
+    *mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+    *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    *mtime = (int64_t)st.st_mtime * 1000000000;
+#endif
+    return true;
+}
+
+
+uint32_t MIDIFileCache::GetLayoutHash() {
+    // PutState() and GetState() must be updated when the classes they save change, and then CACHE_VERSION
+    // must be bumped. As a safety net the sizes of these classes go into the header, so a cache written by a
+    // build where they are different (forgotten bump, different compiler or options) is considered stale.
+    const uint32_t sizes[] = {
+        sizeof(MIDISequencerState), sizeof(MIDISequencerTrackState), sizeof(MIDIMultiTrackIteratorState),
+        sizeof(MIDIMatrix), C_ALL_NOTES_OFF, sizeof(FileHeader), sizeof(TrackRecord), sizeof(EventRecord),
+        sizeof(TempoRecord)
+    };
+    uint32_t hash = 2166136261u;                    // FNV-1a
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        hash ^= sizes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+void MIDIFileCache::MakeTempoMap(const MIDIMultiTrack* tracks, std::vector<MIDICacheTempo>* tmap) {
+    // the iterator doesn't modify the multitrack, but it wants a non const pointer
+    MIDIMultiTrack* mt = const_cast<MIDIMultiTrack*>(tracks);
+    MIDIMultiTrackIterator iter(mt);
+    int trk_num;
+    MIDITimedMessage* msg;
+    MIDIClockTime clks = mt->GetClksPerBeat();
+
+    // this must give the same values of MIDISequencer::UpdateTempoMap(): the default tempo until the first
+    // tempo change, then a segment for every tempo change (the last wins if more are at the same time)
+    tmap->clear();
+    MIDICacheTempo seg = { 0, 0.0, 60000.0 / (MIDI_DEFAULT_TEMPO * clks) };
+    tmap->push_back(seg);
+    // enable only tracks with meta events in the iterator, as the MIDISequencer does
+    for (unsigned int i = 0; i < mt->GetNumTracks(); i++)
+        if (!(mt->GetTrack(i)->GetStatus() & MIDITrack::HAS_MAIN_META))
+            iter.SetEnable(i, false);
+    while (iter.GetNextEvent(&trk_num, &msg)) {
+        if (!msg->IsTempo())
+            continue;
+        MIDICacheTempo& last = tmap->back();
+        seg.clock = msg->GetTime();
+        seg.time_ms = last.time_ms + (seg.clock - last.clock) * last.ms_per_clock;
+        seg.ms_per_clock = 60000.0 / (msg->GetTempo() * clks);
+        if (seg.clock == last.clock)
+            last = seg;
+        else
+            tmap->push_back(seg);
+    }
+}
+
+
+void MIDIFileCache::PutState(std::vector<unsigned char>& buf, const MIDISequencerState& s) {
+    Put(buf, (uint32_t)s.cur_clock);
+    Put(buf, s.cur_time_ms);
+    Put(buf, (uint32_t)s.cur_beat);
+    Put(buf, (uint32_t)s.cur_measure);
+    Put(buf, (uint32_t)s.beat_length);
+    Put(buf, (uint32_t)s.number_of_beats);
+    Put(buf, (uint32_t)s.next_beat_time);
+    Put(buf, s.tempobpm);
+    Put(buf, (uint32_t)s.tempo_scale);
+    Put(buf, s.timesig_numerator);
+    Put(buf, s.timesig_denominator);
+    Put(buf, s.keysig_sharpflat);
+    Put(buf, s.keysig_mode);
+    PutString(buf, s.marker_text);
+    Put(buf, (int32_t)s.last_event_track);
+    Put(buf, (uint32_t)s.last_beat_time);
+    Put(buf, s.ms_per_clock);
+    Put(buf, s.last_time_ms);
+    Put(buf, (uint32_t)s.last_tempo_change);
+    Put(buf, (uint32_t)s.count_in_time);
+    Put(buf, s.playing_status);
+
+    const MIDIMultiTrackIteratorState& it = s.iterator.GetState();
+    Put(buf, (uint32_t)it.num_tracks);
+    Put(buf, (uint32_t)it.cur_time);
+    Put(buf, (int32_t)it.cur_event_track);
+    Put(buf, (uint8_t)it.time_shift_mode);
+    for (unsigned int i = 0; i < it.num_tracks; i++) {
+        Put(buf, (int32_t)it.next_event_number[i]);
+        Put(buf, (uint32_t)it.next_event_time[i]);
+        Put(buf, (uint8_t)it.enabled[i]);
+    }
+
+    Put(buf, (uint32_t)s.track_states.size());
+    for (unsigned int i = 0; i < s.track_states.size(); i++) {
+        const MIDISequencerTrackState* ts = s.track_states[i];
+        Put(buf, ts->program);
+        Put(buf, ts->bender_value);
+        PutString(buf, ts->track_name);
+        Put(buf, (uint8_t)ts->notes_are_on);
+        Put(buf, (uint8_t)ts->got_good_track_name);
+        for (unsigned int j = 0; j < C_ALL_NOTES_OFF; j++)
+            Put(buf, ts->control_values[j]);
+        // the note matrix is stored as a pedal bitmask and a list of the sounding notes
+        uint16_t pedals = 0;
+        std::vector<unsigned char> notes;
+        for (unsigned int ch = 0; ch < 16; ch++) {
+            if (ts->note_matrix.GetHoldPedal(ch))
+                pedals |= (1 << ch);
+            if (ts->note_matrix.GetChannelCount(ch) == 0)
+                continue;
+            for (unsigned int n = 0; n < 128; n++) {
+                int count = ts->note_matrix.GetNoteCount(ch, n);
+                if (count > 0) {
+                    notes.push_back(ch);
+                    notes.push_back(n);
+                    notes.push_back(count > 255 ? 255 : count);
+                }
+            }
+        }
+        Put(buf, pedals);
+        Put(buf, (uint32_t)(notes.size() / 3));
+        buf.insert(buf.end(), notes.begin(), notes.end());
+    }
+}
+
+
+bool MIDIFileCache::GetState(const unsigned char*& p, const unsigned char* end, MIDISequencerState& s) {
+    uint32_t u32;
+    int32_t i32;
+    uint8_t u8;
+
+    if (!Get(p, end, u32)) return false;
+    s.cur_clock = u32;
+    if (!Get(p, end, s.cur_time_ms)) return false;
+    if (!Get(p, end, u32)) return false;
+    s.cur_beat = u32;
+    if (!Get(p, end, u32)) return false;
+    s.cur_measure = u32;
+    if (!Get(p, end, u32)) return false;
+    s.beat_length = u32;
+    if (!Get(p, end, u32)) return false;
+    s.number_of_beats = u32;
+    if (!Get(p, end, u32)) return false;
+    s.next_beat_time = u32;
+    if (!Get(p, end, s.tempobpm)) return false;
+    // the times in msecs depend on the tempo scale, so it must be the same of the model
+    if (!Get(p, end, u32) || u32 != s.tempo_scale) return false;
+    if (!Get(p, end, s.timesig_numerator) || !Get(p, end, s.timesig_denominator) ||
+        !Get(p, end, s.keysig_sharpflat) || !Get(p, end, s.keysig_mode) ||
+        !GetString(p, end, s.marker_text))
+        return false;
+    if (!Get(p, end, i32)) return false;
+    s.last_event_track = i32;
+    if (!Get(p, end, u32)) return false;
+    s.last_beat_time = u32;
+    if (!Get(p, end, s.ms_per_clock) || !Get(p, end, s.last_time_ms)) return false;
+    if (!Get(p, end, u32)) return false;
+    s.last_tempo_change = u32;
+    if (!Get(p, end, u32)) return false;
+    s.count_in_time = u32;
+    if (!Get(p, end, s.playing_status)) return false;
+
+    MIDIMultiTrackIteratorState& it = s.iterator.GetState();
+    if (!Get(p, end, u32) || u32 != it.num_tracks) return false;
+    if (!Get(p, end, u32)) return false;
+    it.cur_time = u32;
+    if (!Get(p, end, i32)) return false;
+    it.cur_event_track = i32;
+    if (!Get(p, end, u8)) return false;
+    it.time_shift_mode = (u8 != 0);
+    for (unsigned int i = 0; i < it.num_tracks; i++) {
+        if (!Get(p, end, i32)) return false;
+        it.next_event_number[i] = i32;
+        if (!Get(p, end, u32)) return false;
+        it.next_event_time[i] = u32;
+        if (!Get(p, end, u8)) return false;
+        it.enabled[i] = (u8 != 0);
+    }
+
+    if (!Get(p, end, u32) || u32 != s.track_states.size()) return false;
+    for (unsigned int i = 0; i < s.track_states.size(); i++) {
+        MIDISequencerTrackState* ts = s.track_states[i];
+        if (!Get(p, end, ts->program) || !Get(p, end, ts->bender_value) || !GetString(p, end, ts->track_name))
+            return false;
+        if (!Get(p, end, u8)) return false;
+        ts->notes_are_on = (u8 != 0);
+        if (!Get(p, end, u8)) return false;
+        ts->got_good_track_name = (u8 != 0);
+        for (unsigned int j = 0; j < C_ALL_NOTES_OFF; j++)
+            if (!Get(p, end, ts->control_values[j]))
+                return false;
+        // rebuild the note matrix feeding it with pedal and note on messages
+        uint16_t pedals;
+        uint32_t num_notes;
+        if (!Get(p, end, pedals) || !Get(p, end, num_notes) || (unsigned long)(end - p) < num_notes * 3UL)
+            return false;
+        ts->note_matrix.Reset();
+        MIDITimedMessage msg;
+        for (unsigned int ch = 0; ch < 16; ch++) {
+            if (pedals & (1 << ch)) {
+                msg.SetControlChange(ch, C_DAMPER, 127);
+                ts->note_matrix.Process(&msg);
+            }
+        }
+        for (unsigned int j = 0; j < num_notes; j++, p += 3) {
+            msg.SetNoteOn(p[0] & 0x0f, p[1] & 0x7f, 64);
+            for (unsigned int k = 0; k < p[2]; k++)
+                ts->note_matrix.Process(&msg);
+        }
+    }
+    return true;
+}
+
+
+bool MIDIFileCache::Validate() {
+    const FileHeader* fh = reinterpret_cast<const FileHeader*>(data);
+    if (std::memcmp(fh->magic, CACHE_MAGIC, sizeof(fh->magic)) != 0 ||
+        fh->version != CACHE_VERSION || fh->byte_order != CACHE_BYTE_ORDER ||
+        fh->layout != GetLayoutHash() || fh->file_size != data_size || fh->num_tempos == 0)
+        return false;
+    // check that every section is inside the file and aligned
+    struct { uint64_t off; uint64_t len; } sections[] = {
+        { fh->tracks_off, (uint64_t)fh->num_tracks * sizeof(TrackRecord) },
+        { fh->events_off, (uint64_t)fh->num_events * sizeof(EventRecord) },
+        { fh->payload_off, fh->payload_size },
+        { fh->tempos_off, (uint64_t)fh->num_tempos * sizeof(TempoRecord) },
+        { fh->warps_off, fh->warps_size },
+        { fh->name_off, fh->name_len }
+    };
+    for (unsigned int i = 0; i < sizeof(sections) / sizeof(sections[0]); i++)
+        if (sections[i].off % 8 || sections[i].off < sizeof(FileHeader) ||
+            sections[i].off > data_size || sections[i].len > data_size - sections[i].off)
+            return false;
+    // check the track and event records
+    const TrackRecord* trk_rec = reinterpret_cast<const TrackRecord*>(data + fh->tracks_off);
+    for (unsigned int i = 0; i < fh->num_tracks; i++)
+        if ((uint64_t)trk_rec[i].first_event + trk_rec[i].num_events > fh->num_events)
+            return false;
+    const EventRecord* ev_rec = reinterpret_cast<const EventRecord*>(data + fh->events_off);
+    for (unsigned int i = 0; i < fh->num_events; i++)
+        if ((uint64_t)ev_rec[i].payload_off + ev_rec[i].payload_len > fh->payload_size)
+            return false;
+    return true;
+}
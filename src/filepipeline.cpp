@@ -0,0 +1,275 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "../include/filepipeline.h"
+
+#include <thread>
+#include <chrono>
+
+
+// A MIDI event takes 3 or 4 bytes in a file, while a MIDITimedMessage takes about 24 bytes; a file is held
+// in memory twice (the loaded and the processed multitrack) plus a third copy made by WriteMIDIFile()
+// when merging tracks for format 0.
+static const unsigned long MEM_FACTOR = 24;
+static const unsigned long MEM_MIN = 4096;
+
+
+////////////////////////////////////////////////////////////////////////////
+//                       struct MIDIPipelineStats                         //
+////////////////////////////////////////////////////////////////////////////
+
+
+double MIDIPipelineStats::GetFilesPerSec() const {
+    return elapsed_ms ? (files_ok + files_failed) * 1000.0 / elapsed_ms : 0.0;
+}
+
+
+double MIDIPipelineStats::GetBytesPerSec() const {
+    return elapsed_ms ? bytes_read * 1000.0 / elapsed_ms : 0.0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                        class MIDIFilePipeline                          //
+////////////////////////////////////////////////////////////////////////////
+
+
+MIDIFilePipeline::MIDIFilePipeline(unsigned int n, unsigned long budget) :
+    mem_budget(budget), format(1), strip(true), optimize(false), quantize(0), processor(0), mem_used(0) {
+    SetNumThreads(n);
+}
+
+
+void MIDIFilePipeline::Reset() {
+    jobs.clear();
+    stats = MIDIPipelineStats();
+}
+
+
+void MIDIFilePipeline::AddFile(const std::string& in_name, const std::string& out_name) {
+    jobs.push_back(Job(in_name, out_name));
+}
+
+
+void MIDIFilePipeline::SetNumThreads(unsigned int n) {
+    if (n == 0)
+        n = std::thread::hardware_concurrency();
+    num_threads = (n == 0 ? 1 : n);                 // hardware_concurrency() can return 0
+}
+
+
+bool MIDIFilePipeline::SetFormat(int f) {
+    if (f != 0 && f != 1)
+        return false;
+    format = f;
+    return true;
+}
+
+
+bool MIDIFilePipeline::Run() {
+    stats = MIDIPipelineStats();
+    mem_used = 0;
+    for (unsigned int i = 0; i < jobs.size(); i++)
+        jobs[i].ok = false;
+
+    unsigned int n_threads = num_threads < jobs.size() ? num_threads : jobs.size();
+    if (n_threads == 0)
+        return true;                                // nothing to do
+
+    // deal the files to the threads
+    for (unsigned int i = 0; i < n_threads; i++)
+        worker_queues.push_back(new WorkerQueue);
+    for (unsigned int i = 0; i < jobs.size(); i++)
+        worker_queues[i % n_threads]->queue.push_back(i);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < n_threads; i++)
+        workers.push_back(std::thread(&MIDIFilePipeline::WorkerProc, this, i));
+    for (unsigned int i = 0; i < n_threads; i++)
+        workers[i].join();
+    stats.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>
+                       (std::chrono::steady_clock::now() - start).count();
+
+    for (unsigned int i = 0; i < worker_queues.size(); i++)
+        delete worker_queues[i];
+    worker_queues.clear();
+    return stats.files_failed == 0;
+}
+
+
+void MIDIFilePipeline::PrintStats(std::ostream& os) const {
+    os << "Converted " << stats.files_ok << " files (" << stats.files_failed << " failed) in "
+       << stats.elapsed_ms << " msecs" << std::endl;
+    os << "Read " << stats.bytes_read << " bytes, written " << stats.bytes_written << " bytes, "
+       << stats.events << " events" << std::endl;
+    if (optimize)
+        os << "Size optimizing mode saved " << stats.bytes_saved << " bytes" << std::endl;
+    os << "Throughput: " << stats.GetFilesPerSec() << " files/sec, " << stats.GetBytesPerSec() / 1024.0
+       << " KB/sec (" << stats.steals << " steals, " << stats.budget_waits << " budget waits)" << std::endl;
+}
+
+
+void MIDIFilePipeline::WorkerProc(unsigned int n) {
+    unsigned int job;
+    while (GetNextJob(n, &job)) {
+        jobs[job].ok = ConvertFile(jobs[job]);
+        std::lock_guard<std::mutex> lock(stats_lock);
+        if (jobs[job].ok)
+            stats.files_ok++;
+        else
+            stats.files_failed++;
+    }
+}
+
+
+bool MIDIFilePipeline::GetNextJob(unsigned int n, unsigned int* job) {
+    {
+        // first look in the own queue
+        std::lock_guard<std::mutex> lock(worker_queues[n]->lock);
+        if (!worker_queues[n]->queue.empty()) {
+            *job = worker_queues[n]->queue.front();
+            worker_queues[n]->queue.pop_front();
+            return true;
+        }
+    }
+    // the queue is empty: steal from the back of another queue
+    for (unsigned int i = 1; i < worker_queues.size(); i++) {
+        WorkerQueue* q = worker_queues[(n + i) % worker_queues.size()];
+        std::lock_guard<std::mutex> lock(q->lock);
+        if (!q->queue.empty()) {
+            *job = q->queue.back();
+            q->queue.pop_back();
+            std::lock_guard<std::mutex> s_lock(stats_lock);
+            stats.steals++;
+            return true;
+        }
+    }
+    return false;                                   // all queues are empty
+}
+
+
+bool MIDIFilePipeline::ConvertFile(Job& job) {
+    // get the file size for estimating the needed memory
+    std::ifstream in_stream(job.in_name.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    if (in_stream.fail())
+        return false;
+    unsigned long in_size = (unsigned long)in_stream.tellg();
+    in_stream.close();
+    unsigned long reserved = in_size * MEM_FACTOR + MEM_MIN;
+
+    ReserveMem(reserved);
+    bool ret = false;
+    unsigned long long ev_count = 0;
+    unsigned long out_size = 0;
+    long saved = 0;
+    {
+        // read stage
+        MIDIMultiTrack src_tracks;
+        if (LoadMIDIFile(job.in_name, &src_tracks)) {
+            // process stage
+            MIDIMultiTrack dest_tracks(src_tracks.GetNumTracks(), src_tracks.GetClksPerBeat());
+            MIDIClockTime grid = quantize ? src_tracks.GetClksPerBeat() / quantize : 0;
+            for (unsigned int i = 0; i < src_tracks.GetNumTracks(); i++)
+                ProcessTrack(src_tracks.GetTrack(i), dest_tracks.GetTrack(i), grid, &ev_count);
+            src_tracks.Reset();                     // free memory as soon as possible
+            // write stage
+            if (WriteMIDIFile(job.out_name, format, &dest_tracks, strip, optimize, &saved)) {
+                std::ifstream out_stream(job.out_name.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+                if (!out_stream.fail()) {
+                    out_size = (unsigned long)out_stream.tellg();
+                    ret = true;
+                }
+            }
+        }
+    }
+    ReleaseMem(reserved);
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+    stats.bytes_read += in_size;
+    if (ret) {
+        stats.bytes_written += out_size;
+        stats.bytes_saved += saved;
+        stats.events += ev_count;
+    }
+    return ret;
+}
+
+
+void MIDIFilePipeline::ProcessTrack(const MIDITrack* src, MIDITrack* dest,
+                                    MIDIClockTime grid, unsigned long long* ev_count) {
+    // the amount every sounding note was moved by the quantizer, for moving its note off too
+    long note_shift[16][128] = { { 0 } };
+
+    dest->SetEndTime(src->GetEndTime());
+    for (unsigned int i = 0; i < src->GetNumEvents(); i++) {
+        MIDITimedMessage msg(src->GetEvent(i));
+        if (msg.IsNoOp() || msg.IsDataEnd())
+            continue;
+        if (msg.IsChannelMsg()) {
+            if (processor && !processor->Process(&msg))
+                continue;
+            if (grid > 1 && msg.IsNote()) {
+                int chan = msg.GetChannel();
+                int note = msg.GetNote();
+                if (msg.IsNoteOn()) {
+                    MIDIClockTime q = (msg.GetTime() + grid / 2) / grid * grid;
+                    note_shift[chan][note] = (long)q - (long)msg.GetTime();
+                    msg.SetTime(q);
+                }
+                else {
+                    long t = (long)msg.GetTime() + note_shift[chan][note];
+                    msg.SetTime(t < 0 ? 0 : t);
+                }
+            }
+        }
+        dest->InsertEvent(msg, INSMODE_INSERT);
+        (*ev_count)++;
+    }
+}
+
+
+void MIDIFilePipeline::ReserveMem(unsigned long bytes) {
+    std::unique_lock<std::mutex> lock(mem_lock);
+    if (mem_used > 0 && mem_used + bytes > mem_budget) {
+        {
+            std::lock_guard<std::mutex> s_lock(stats_lock);
+            stats.budget_waits++;
+        }
+        // a file bigger than the budget is admitted when no other file is in memory
+        while (mem_used > 0 && mem_used + bytes > mem_budget)
+            mem_released.wait(lock);
+    }
+    mem_used += bytes;
+}
+
+
+void MIDIFilePipeline::ReleaseMem(unsigned long bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mem_lock);
+        mem_used -= bytes;
+    }
+    mem_released.notify_all();
+}
@@ -28,7 +28,8 @@
 
 
 MIDIFileWriter::MIDIFileWriter(std::ostream *out_stream_) : error(0), within_track(0), file_length(0), track_length(0),
-    track_time(0), track_position(0), running_status(0),  out_stream(out_stream_)
+    track_time(0), track_position(0), running_status(0), plain_status(0), optimize(false), keep_off_vel(true),
+    bytes_saved(0), out_stream(out_stream_)
 {}
 
 
@@ -42,6 +43,7 @@ void MIDIFileWriter::WriteFileHeader(int format, int ntrks, int division) {
     WriteShort((short)ntrks);
     WriteShort((short)division);
     file_length = 4 + 4 + 6;
+    bytes_saved = 0;                        // a new file begins
 }
 
 
@@ -49,7 +51,7 @@ void MIDIFileWriter::WriteTrackHeader(unsigned long length) {
     track_position = file_length;
     track_length = 0;
     track_time = 0;
-    running_status = 0;
+    running_status = plain_status = 0;
 
     WriteCharacter((unsigned char) 'M');
     WriteCharacter((unsigned char) 'T');
@@ -115,11 +117,35 @@ void MIDIFileWriter::WriteEvent(const MIDITimedMessage &msg) {
 
 void MIDIFileWriter::WriteChannelEvent(const MIDITimedMessage &msg) {
     short len = msg.GetLength();
+    unsigned char status = msg.GetStatus();
+    unsigned char byte2 = msg.GetByte2();
 
     if(len > 0) {
+        if(optimize) {
+            if(msg.IsNoteOff()) {
+                // a note on with velocity 0 is the same of a note off with velocity 64
+                unsigned char chan = msg.GetChannel();
+                if(running_status == (NOTE_OFF | chan)) {
+                    if(status == (NOTE_ON | chan))
+                        byte2 = 64;
+                    status = NOTE_OFF | chan;
+                }
+                else if(status == (NOTE_ON | chan) || !keep_off_vel || byte2 == 64) {
+                    status = NOTE_ON | chan;
+                    byte2 = 0;
+                }
+            }
+            // count the bytes a plain running status would have written
+            if(msg.GetStatus() != plain_status) {
+                plain_status = msg.GetStatus();
+                bytes_saved++;
+            }
+            if(status != running_status)
+                bytes_saved--;
+        }
         WriteDeltaTime(msg.GetTime());
-        if(msg.GetStatus() != running_status) {
-            running_status = msg.GetStatus();
+        if(status != running_status) {
+            running_status = status;
             WriteCharacter((unsigned char)running_status);
             IncrementCounters(1);
         }
@@ -128,7 +154,7 @@ void MIDIFileWriter::WriteChannelEvent(const MIDITimedMessage &msg) {
             IncrementCounters(1);
         }
         if(len > 2) {
-            WriteCharacter((unsigned char) msg.GetByte2());
+            WriteCharacter(byte2);
             IncrementCounters(1);
         }
     }
@@ -145,7 +171,7 @@ void MIDIFileWriter::WriteSysExEvent(const MIDITimedMessage &msg) {
     for(int i = 1; i < len; i++) 	// skip the initial 0xF0
         WriteCharacter((unsigned char)(msg.GetSysEx()->GetData(i)));
     IncrementCounters(len);
-    running_status = 0;
+    running_status = plain_status = 0;
 }
 
 
@@ -161,7 +187,7 @@ void MIDIFileWriter::WriteMetaEvent(unsigned long time, unsigned char type, cons
     for(int i = 0; i < length; i++)
         WriteCharacter((unsigned char) data[i]);
     IncrementCounters(length);
-    running_status = 0;
+    running_status = plain_status = 0;
 }
 
 
@@ -175,7 +201,7 @@ void MIDIFileWriter::WriteEndOfTrack(unsigned long time)  {
         WriteCharacter((unsigned char) 0x00);		// length of event
         IncrementCounters(3);
         within_track = false;
-        running_status = 0;
+        running_status = plain_status = 0;
     }
 }
 
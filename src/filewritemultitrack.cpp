@@ -84,7 +84,8 @@ bool MIDIFileWriteMultiTrack::PostWrite() {
 
 
 
-bool WriteMIDIFile(const char* filename, int format, const MIDIMultiTrack* tracks, bool strip) {
+bool WriteMIDIFile(const char* filename, int format, const MIDIMultiTrack* tracks, bool strip, bool optimize,
+                   long* bytes_saved) {
     MIDIMultiTrack tmp_tracks(1, tracks->GetClksPerBeat());
     switch (format) {
         case 0: {
@@ -118,10 +119,15 @@ bool WriteMIDIFile(const char* filename, int format, const MIDIMultiTrack* track
     if (write_stream.fail())
         return false;
     MIDIFileWriteMultiTrack writer (&tmp_tracks, &write_stream);
-    return writer.Write(tmp_tracks.GetNumTracks(), tmp_tracks.GetClksPerBeat());
+    writer.SetOptimizeSize(optimize);
+    bool ret = writer.Write(tmp_tracks.GetNumTracks(), tmp_tracks.GetClksPerBeat());
+    if (bytes_saved)
+        *bytes_saved = writer.GetBytesSaved();
+    return ret;
 }
 
 
-bool WriteMIDIFile(const std::string& filename, int format, const MIDIMultiTrack* tracks, bool strip) {
-    return WriteMIDIFile(filename.c_str(), format, tracks, strip);
+bool WriteMIDIFile(const std::string& filename, int format, const MIDIMultiTrack* tracks, bool strip,
+                   bool optimize, long* bytes_saved) {
+    return WriteMIDIFile(filename.c_str(), format, tracks, strip, optimize, bytes_saved);
 }
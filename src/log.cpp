@@ -0,0 +1,123 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "../include/log.h"
+
+#include <cstdio>
+#include <cstdarg>
+
+
+// The ring buffer is a bounded queue with a sequence number in every slot. For the slot i, which is used
+// by the positions i, i + RING_SIZE, i + 2 * RING_SIZE ..., the seq field holds (pos - i) when the slot is
+// free for the writer at position pos, and (pos - i + 1) when it holds the message written at pos. As it
+// starts from 0 the buffer doesn't need any initialization. Writers reserve a position with a CAS on
+// in_pos; the reader is protected by a mutex, as it never runs in a real time thread.
+
+MIDILog::Slot MIDILog::ring[MIDILog::RING_SIZE];
+std::atomic<unsigned long> MIDILog::in_pos(0);
+unsigned long MIDILog::out_pos = 0;
+std::mutex MIDILog::drain_mutex;
+std::atomic<int> MIDILog::level(MIDILog::LOG_INFO);
+std::atomic<unsigned long> MIDILog::dropped(0);
+std::atomic<bool> MIDILog::running(false);
+std::thread MIDILog::drain_thread;
+std::ostream* MIDILog::out_stream = &std::cout;
+
+static const char* level_names[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+
+void MIDILog::Write(int lev, const char* fmt, ...) {
+    if (lev < level.load(std::memory_order_relaxed) || lev >= LOG_NONE)
+        return;
+    // reserve a slot
+    unsigned long pos = in_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &ring[pos % RING_SIZE];
+        unsigned long base = pos - pos % RING_SIZE;
+        long diff = (long)(slot->seq.load(std::memory_order_acquire) - base);
+        if (diff == 0) {
+            if (in_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {                        // the buffer is full
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+            pos = in_pos.load(std::memory_order_relaxed);
+    }
+    // fill it and publish it
+    slot->lev = lev;
+    slot->time = MIDITimer::GetSysTimeUs();
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    va_end(args);
+    slot->seq.store(pos - pos % RING_SIZE + 1, std::memory_order_release);
+}
+
+
+void MIDILog::Flush() {
+    std::lock_guard<std::mutex> lock(drain_mutex);
+    bool written = false;
+    for (;;) {
+        Slot& slot = ring[out_pos % RING_SIZE];
+        unsigned long base = out_pos - out_pos % RING_SIZE;
+        if (slot.seq.load(std::memory_order_acquire) != base + 1)
+            break;                                  // no more messages
+        *out_stream << slot.time / 1000 << '.';
+        out_stream->width(3);
+        out_stream->fill('0');
+        *out_stream << slot.time % 1000 << " [" << level_names[slot.lev] << "] " << slot.text << '\n';
+        out_stream->fill(' ');
+        slot.seq.store(base + RING_SIZE, std::memory_order_release);    // free the slot
+        out_pos++;
+        written = true;
+    }
+    if (written)
+        out_stream->flush();
+}
+
+
+void MIDILog::Start() {
+    if (!running.exchange(true))
+        drain_thread = std::thread(DrainProc);
+}
+
+
+void MIDILog::Stop() {
+    if (running.exchange(false))
+        drain_thread.join();
+    Flush();
+}
+
+
+void MIDILog::DrainProc() {
+    while (running.load()) {
+        Flush();
+        MIDITimer::Wait(DRAIN_INTERVAL);
+    }
+}
@@ -0,0 +1,242 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "../include/loopback.h"
+#include "../include/log.h"
+
+
+////////////////////////////////////////////////////////////////////////////
+//                      class MIDILoopbackInDriver                        //
+////////////////////////////////////////////////////////////////////////////
+
+
+MIDILoopbackInDriver::MIDILoopbackInDriver(int id, const std::string& nm, unsigned int queue_size) :
+    MIDIInDriver(id, 0, queue_size), name(nm) {
+}
+
+
+void MIDILoopbackInDriver::OpenPort() {
+    in_mutex.lock();
+    int n = ++num_open;
+    in_mutex.unlock();
+    if (n > 1)
+        NICMIDI_LOG_INFO("IN Port %s open (%d times)", name.c_str(), n);
+    else
+        NICMIDI_LOG_INFO("IN Port %s open", name.c_str());
+}
+
+
+void MIDILoopbackInDriver::ClosePort() {
+    in_mutex.lock();
+    bool was_open = (num_open > 0);
+    if (was_open)
+        num_open--;
+    int n = num_open;
+    in_mutex.unlock();
+    if (!was_open)
+        NICMIDI_LOG_WARNING("IN Port %s: attempt to close an already closed port!", name.c_str());
+    else if (n > 0)
+        NICMIDI_LOG_INFO("IN Port %s closed (open %d times)", name.c_str(), n);
+    else
+        NICMIDI_LOG_INFO("IN Port %s closed", name.c_str());
+}
+
+
+void MIDILoopbackInDriver::Reset() {
+    in_mutex.lock();
+    MIDIInDriver::Reset();
+    in_mutex.unlock();
+}
+
+
+void MIDILoopbackInDriver::Deliver(const MIDIMessage& msg, tUsecs t) {
+    std::lock_guard<std::recursive_mutex> lock(in_mutex);
+    if (num_open == 0)
+        return;
+    MIDITimedMessage tmsg(msg);
+    PutInQueue(tmsg, t);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                      class MIDILoopbackOutDriver                       //
+////////////////////////////////////////////////////////////////////////////
+
+
+MIDILoopbackOutDriver::MIDILoopbackOutDriver(int id, const std::string& nm, MIDILoopbackInDriver* in) :
+    MIDIOutDriver(id, 0), name(nm), in_driver(in), latency(0), jitter(0), last_time(0),
+    num_sent(0), max_lateness(0), delivery_exit(false) {
+}
+
+
+MIDILoopbackOutDriver::~MIDILoopbackOutDriver() {
+    StopSender();                               // it could call HardwareMsgOut()
+    StopDelivery();
+}
+
+
+void MIDILoopbackOutDriver::OpenPort() {
+    out_mutex.lock();
+    if (num_open == 0)
+        ResetNoteState();
+    int n = ++num_open;
+    out_mutex.unlock();
+    if (n > 1)
+        NICMIDI_LOG_INFO("OUT Port %s open (%d times)", name.c_str(), n);
+    else
+        NICMIDI_LOG_INFO("OUT Port %s open", name.c_str());
+}
+
+
+void MIDILoopbackOutDriver::ClosePort() {
+    out_mutex.lock();
+    bool was_open = (num_open > 0);
+    if (was_open)
+        num_open--;
+    int n = num_open;
+    out_mutex.unlock();
+    if (!was_open)
+        NICMIDI_LOG_WARNING("OUT Port %s: attempt to close an already closed port!", name.c_str());
+    else if (n > 0)
+        NICMIDI_LOG_INFO("OUT Port %s closed (open %d times)", name.c_str(), n);
+    else {
+        StopDelivery(true);
+        NICMIDI_LOG_INFO("OUT Port %s closed", name.c_str());
+    }
+}
+
+
+void MIDILoopbackOutDriver::Reset() {
+    MIDIOutDriver::Reset();
+    StopDelivery();
+}
+
+
+void MIDILoopbackOutDriver::SetLatency(unsigned int lat, unsigned int jit, unsigned int seed) {
+    std::lock_guard<std::mutex> lock(delivery_mutex);
+    latency = lat;
+    jitter = jit;
+    rand_gen.seed(seed);
+}
+
+
+void MIDILoopbackOutDriver::HardwareMsgOut(const MIDIMessage &msg) {
+    if (!IsPortOpen() || msg.GetStatus() < NOTE_OFF)    // meta and service messages are not sent
+        return;
+    if (msg.IsChannelMsg())
+        TrackMessage(msg.GetStatus(), msg.GetByte1(), msg.GetByte2());
+    else if (msg.IsSysEx())
+        ResetLastValues();                      // the sysex could change them
+    num_sent++;
+    tUsecs now = MIDITimer::GetSysTimeUs();
+    {
+        std::lock_guard<std::mutex> lock(delivery_mutex);
+        if (latency > 0 || jitter > 0 || !deliveries.empty()) {
+            tUsecs t = now + latency;
+            if (jitter > 0)
+                t += rand_gen() % (jitter + 1);
+            if (t < last_time)
+                t = last_time;                  // keep the order of the messages
+            last_time = t;
+            if (!delivery_thread.joinable()) {
+                delivery_exit = false;
+                delivery_thread = std::thread(&MIDILoopbackOutDriver::DeliveryProc, this);
+            }
+            deliveries.push_back(Delivery(msg, t));
+            if (deliveries.size() == 1)
+                delivery_cond.notify_one();
+            return;
+        }
+        last_time = now;
+    }
+    in_driver->Deliver(msg, now);
+}
+
+
+void MIDILoopbackOutDriver::HardwareBatchOut(const std::vector<unsigned char>& bytes,
+                                             const std::vector<unsigned int>& ends) {
+    unsigned int start = 0;
+    MIDIMessage msg;
+    for (unsigned int i = 0; i < ends.size(); i++) {
+        const unsigned char* p = bytes.data() + start;
+        unsigned int len = ends[i] - start;
+        start = ends[i];
+        if (p[0] == SYSEX_START) {
+            MIDISystemExclusive sysex(p, len);
+            msg.SetSysEx(&sysex);
+        }
+        else {
+            msg.SetStatus(p[0]);
+            msg.SetByte1(len > 1 ? p[1] : 0);
+            msg.SetByte2(len > 2 ? p[2] : 0);
+        }
+        if (!DeferMessage(msg))
+            HardwareMsgOut(msg);
+    }
+}
+
+
+void MIDILoopbackOutDriver::DeliveryProc() {
+    std::unique_lock<std::mutex> lock(delivery_mutex);
+    while (!delivery_exit) {
+        if (deliveries.empty()) {
+            delivery_cond.wait(lock);
+            continue;
+        }
+        tUsecs now = MIDITimer::GetSysTimeUs();
+        if (deliveries.front().time > now) {
+            delivery_cond.wait_for(lock, std::chrono::microseconds(deliveries.front().time - now));
+            continue;
+        }
+        Delivery d = deliveries.front();
+        deliveries.pop_front();
+        lock.unlock();
+        if (now - d.time > max_lateness)
+            max_lateness = now - d.time;
+        in_driver->Deliver(d.msg, d.time);      // the timestamp is the exact arrival time
+        lock.lock();
+    }
+}
+
+
+void MIDILoopbackOutDriver::StopDelivery(bool deliver) {
+    if (delivery_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(delivery_mutex);
+            delivery_exit = true;
+        }
+        delivery_cond.notify_one();
+        delivery_thread.join();
+    }
+    // take the messages, so the in driver is not called with the lock held
+    std::deque<Delivery> pending;
+    {
+        std::lock_guard<std::mutex> lock(delivery_mutex);
+        pending.swap(deliveries);
+    }
+    if (deliver)                                // the messages already sent (usually note offs) arrive now
+        for (unsigned int i = 0; i < pending.size(); i++)
+            in_driver->Deliver(pending[i].msg, pending[i].time);
+}
@@ -24,16 +24,37 @@
 
 
 #include "../include/manager.h"
+#include "../include/loopback.h"
+#include "../include/log.h"
+
+#include <cstdlib>              // for getenv()
+#include <map>
+
+#ifdef __LINUX_ALSA__
+#include <alsa/asoundlib.h>     // for the port watcher
+#include <poll.h>
+#include <cerrno>
+#endif // __LINUX_ALSA__
 
 
 std::vector<MIDIOutDriver*>* MIDIManager::MIDI_outs;
 std::vector<std::string>* MIDIManager::MIDI_out_names;
 std::vector<MIDIInDriver*>* MIDIManager::MIDI_ins;
 std::vector<std::string>* MIDIManager::MIDI_in_names;
+std::atomic<unsigned int> MIDIManager::num_outs(0);
+std::atomic<unsigned int> MIDIManager::num_ins(0);
 std::vector<MIDITickComponent*>* MIDIManager::MIDITicks;
 std::mutex* MIDIManager::proc_lock;
+std::mutex* MIDIManager::rescan_lock;
+std::thread* MIDIManager::watcher_thread;
+std::atomic<bool> MIDIManager::watcher_running(false);
 bool MIDIManager::init;
 
+// The port watcher waits for new announces at most for WATCHER_POLL_TIME msecs (so it can exit), and
+// rescans the ports WATCHER_DEBOUNCE msecs after the last one (a device often announces many ports)
+static const int WATCHER_POLL_TIME = 100;
+static const tMsecs WATCHER_DEBOUNCE = 200;
+
 /*
 MIDIManager::MIDIManager() {
 #ifdef WIN32
@@ -63,9 +84,9 @@ MIDIManager::~MIDIManager() {
 void MIDIManager::Reset() {
     MIDITimer::HardStop();
     MIDITicks->clear();
-    for(unsigned int i = 0; i < MIDI_outs->size(); i++)
+    for(unsigned int i = 0; i < num_outs; i++)
         (*MIDI_outs)[i]->Reset();
-    for(unsigned int i = 0; i < MIDI_ins->size(); i++)
+    for(unsigned int i = 0; i < num_ins; i++)
         (*MIDI_ins)[i]->Reset();
 }
 
@@ -73,11 +94,11 @@ void MIDIManager::Reset() {
 unsigned int MIDIManager::GetNumMIDIIns() {
     if (!init)
         Init();
-    return MIDI_ins->size();
+    return num_ins;
 }
 
 
-const std::string& MIDIManager::GetMIDIInName(unsigned int n) {
+std::string MIDIManager::GetMIDIInName(unsigned int n) {
     if (!init)
         Init();
     return (*MIDI_in_names)[n];
@@ -94,18 +115,18 @@ MIDIInDriver* MIDIManager::GetInDriver(unsigned int n) {
 bool MIDIManager::IsValidInPortNumber(unsigned int n) {
     if (!init)
         Init();
-    return MIDI_ins->size() > n;
+    return num_ins > n;
 }
 
 
 unsigned int MIDIManager::GetNumMIDIOuts() {
     if (!init)
         Init();
-    return MIDI_outs->size();
+    return num_outs;
 }
 
 
-const std::string& MIDIManager::GetMIDIOutName(unsigned int n) {
+std::string MIDIManager::GetMIDIOutName(unsigned int n) {
     if (!init)
         Init();
     return (*MIDI_out_names)[n];
@@ -122,7 +143,146 @@ MIDIOutDriver* MIDIManager::GetOutDriver(unsigned int n) {
 bool MIDIManager::IsValidOutPortNumber(unsigned int n) {
     if (!init)
         Init();
-    return MIDI_outs->size() > n;
+    return num_outs > n;
+}
+
+
+unsigned int MIDIManager::AddLoopbackPort(const std::string& name) {
+    if (!init)
+        Init();
+    std::lock_guard<std::mutex> r_lock(*rescan_lock);
+    if (num_outs == MAX_PORTS || num_ins == MAX_PORTS) {
+        NICMIDI_LOG_ERROR("MIDIManager::AddLoopbackPort(): too many ports");
+        return MAX_PORTS;
+    }
+    // the vectors have MAX_PORTS capacity, so they aren't moved and the readers can go on; they see the
+    // new ports when the counts are updated
+    MIDILoopbackInDriver* in = new MIDILoopbackInDriver(num_ins, name);
+    MIDI_ins->push_back(in);
+    MIDI_in_names->push_back(name);
+    MIDI_outs->push_back(new MIDILoopbackOutDriver(num_outs, name, in));
+    MIDI_out_names->push_back(name);
+    num_ins++;
+    return num_outs++;
+}
+
+
+unsigned int MIDIManager::RescanPorts() {
+    if (!init)
+        Init();
+    std::lock_guard<std::mutex> r_lock(*rescan_lock);
+    // get the system port names; every name counts the ports with that name
+    std::map<std::string, int> out_names, in_names;
+    std::vector<std::string> out_order, in_order;
+    try {
+        RtMidiOut temp_MIDI_out;
+        for (unsigned int i = 0; i < temp_MIDI_out.getPortCount(); i++) {
+            std::string name = temp_MIDI_out.getPortName(i);
+            if (out_names[name]++ == 0)
+                out_order.push_back(name);
+        }
+        RtMidiIn temp_MIDI_in;
+        for (unsigned int i = 0; i < temp_MIDI_in.getPortCount(); i++) {
+            std::string name = temp_MIDI_in.getPortName(i);
+            if (in_names[name]++ == 0)
+                in_order.push_back(name);
+        }
+    }
+    catch (RtMidiError &error) {
+        error.printMessage();
+        return 0;
+    }
+
+    // update the existing drivers (skipping virtual ports, which have no RtMidi port)
+    for (unsigned int i = 0; i < num_outs; i++) {
+        MIDIOutDriver* drv = (*MIDI_outs)[i];
+        if (drv->port == 0)
+            continue;
+        bool found = out_names[drv->port_name] > 0;
+        if (found)
+            out_names[drv->port_name]--;
+        if (found && !drv->present) {
+            drv->present = true;
+            drv->Reconnect();
+        }
+        else if (!found && drv->present) {
+            drv->present = false;
+            NICMIDI_LOG_WARNING("OUT Port %s removed", drv->port_name.c_str());
+        }
+    }
+    for (unsigned int i = 0; i < num_ins; i++) {
+        MIDIInDriver* drv = (*MIDI_ins)[i];
+        if (drv->port == 0)
+            continue;
+        bool found = in_names[drv->port_name] > 0;
+        if (found)
+            in_names[drv->port_name]--;
+        if (found && !drv->present) {
+            drv->present = true;
+            drv->Reconnect();
+        }
+        else if (!found && drv->present) {
+            drv->present = false;
+            NICMIDI_LOG_WARNING("IN Port %s removed", drv->port_name.c_str());
+        }
+    }
+
+    // the remaining names are new ports: add their drivers. The vectors have MAX_PORTS capacity, so they
+    // aren't moved and the readers can go on; they see the new ports when the counts are updated
+    unsigned int added = 0;
+    for (unsigned int i = 0; i < out_order.size(); i++)
+        for (int j = 0; j < out_names[out_order[i]]; j++) {
+            if (num_outs == MAX_PORTS) {
+                NICMIDI_LOG_ERROR("OUT Port %s ignored: too many ports", out_order[i].c_str());
+                continue;
+            }
+            MIDIOutDriver* drv = new MIDIOutDriver(num_outs);
+            drv->port_name = out_order[i];      // OpenPort() will look for it by name
+            drv->rtmidi_index = -1;
+            MIDI_outs->push_back(drv);
+            MIDI_out_names->push_back(drv->port_name);
+            num_outs++;
+            added++;
+            NICMIDI_LOG_INFO("OUT Port %s added", drv->port_name.c_str());
+        }
+    for (unsigned int i = 0; i < in_order.size(); i++)
+        for (int j = 0; j < in_names[in_order[i]]; j++) {
+            if (num_ins == MAX_PORTS) {
+                NICMIDI_LOG_ERROR("IN Port %s ignored: too many ports", in_order[i].c_str());
+                continue;
+            }
+            MIDIInDriver* drv = new MIDIInDriver(num_ins);
+            drv->port_name = in_order[i];
+            drv->rtmidi_index = -1;
+            MIDI_ins->push_back(drv);
+            MIDI_in_names->push_back(drv->port_name);
+            num_ins++;
+            added++;
+            NICMIDI_LOG_INFO("IN Port %s added", drv->port_name.c_str());
+        }
+    return added;
+}
+
+
+bool MIDIManager::StartPortWatcher() {
+    if (!init)
+        Init();
+#ifdef __LINUX_ALSA__
+    if (!watcher_running.exchange(true))
+        watcher_thread = new std::thread(WatcherProc);
+    return true;
+#else
+    return false;
+#endif // __LINUX_ALSA__
+}
+
+
+void MIDIManager::StopPortWatcher() {
+    if (watcher_running.exchange(false)) {
+        watcher_thread->join();
+        delete watcher_thread;
+        watcher_thread = 0;
+    }
 }
 
 
@@ -154,7 +314,7 @@ void MIDIManager::StopTimer() {
 void MIDIManager::OpenInPorts() {
     if (!init)
         Init();
-    for (unsigned int i = 0; i < MIDI_ins->size(); i++)
+    for (unsigned int i = 0; i < num_ins; i++)
         (*MIDI_ins)[i]->OpenPort();
 }
 
@@ -162,7 +322,7 @@ void MIDIManager::OpenInPorts() {
 void MIDIManager::CloseInPorts() {
     if (!init)
         Init();
-    for (unsigned int i = 0; i < MIDI_ins->size(); i++)
+    for (unsigned int i = 0; i < num_ins; i++)
         (*MIDI_ins)[i]->ClosePort();
 }
 
@@ -170,7 +330,7 @@ void MIDIManager::CloseInPorts() {
 void MIDIManager::OpenOutPorts() {
     if (!init)
         Init();
-    for (unsigned int i = 0; i < MIDI_outs->size(); i++)
+    for (unsigned int i = 0; i < num_outs; i++)
         (*MIDI_outs)[i]->OpenPort();
 }
 
@@ -178,7 +338,7 @@ void MIDIManager::OpenOutPorts() {
 void MIDIManager::CloseOutPorts() {
     if (!init)
         Init();
-    for (unsigned int i = 0; i < MIDI_outs->size(); i++)
+    for (unsigned int i = 0; i < num_outs; i++)
         (*MIDI_outs)[i]->ClosePort();
 }
 
@@ -186,11 +346,27 @@ void MIDIManager::CloseOutPorts() {
 void MIDIManager::AllNotesOff() {
     if (!init)
         Init();
-    for (unsigned int i = 0; i < MIDI_outs->size(); i++)
+    for (unsigned int i = 0; i < num_outs; i++)
         (*MIDI_outs)[i]->AllNotesOff();
 }
 
 
+void MIDIManager::FlushOutQueues() {
+    if (!init)
+        Init();
+    for (unsigned int i = 0; i < num_outs; i++)
+        (*MIDI_outs)[i]->FlushQueue();
+}
+
+
+void MIDIManager::SetThreadedOutput(bool on) {
+    if (!init)
+        Init();
+    for (unsigned int i = 0; i < num_outs; i++)
+        (*MIDI_outs)[i]->SetThreadedOutput(on);
+}
+
+
 void MIDIManager::AddMIDITick(MIDITickComponent* tick) {
     if (!init)
         Init();
@@ -252,7 +428,7 @@ void MIDIManager::TickProc(tMsecs sys_time, void* p) {
             tp->GetFunc()(sys_time, tp);
     }
 
-    for (unsigned int i = 0; i < MIDI_ins->size(); i++)
+    for (unsigned int i = 0; i < num_ins; i++)
         if ((*MIDI_ins)[i]->IsPortOpen())
             (*MIDI_ins)[i]->FlushQueue();
     proc_lock->unlock();
@@ -261,6 +437,55 @@ void MIDIManager::TickProc(tMsecs sys_time, void* p) {
 }
 
 
+void MIDIManager::WatcherProc() {
+#ifdef __LINUX_ALSA__
+    // open an ALSA sequencer client and subscribe to the system announce port
+    snd_seq_t* seq;
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0) {
+        NICMIDI_LOG_ERROR("Port watcher: cannot open the ALSA sequencer");
+        return;
+    }
+    snd_seq_set_client_name(seq, "NiCMidi Port Watcher");
+    int port = snd_seq_create_simple_port(seq, "Announce", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+                                          SND_SEQ_PORT_TYPE_APPLICATION);
+    if (port < 0 || snd_seq_connect_from(seq, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE) < 0) {
+        NICMIDI_LOG_ERROR("Port watcher: cannot connect to the ALSA announce port");
+        snd_seq_close(seq);
+        return;
+    }
+    int num_fds = snd_seq_poll_descriptors_count(seq, POLLIN);
+    std::vector<struct pollfd> fds(num_fds);
+    snd_seq_poll_descriptors(seq, fds.data(), num_fds, POLLIN);
+    NICMIDI_LOG_INFO("Port watcher started");
+
+    bool changed = false;
+    tMsecs change_time = 0;
+    while (watcher_running.load()) {
+        poll(fds.data(), num_fds, WATCHER_POLL_TIME);
+        snd_seq_event_t* ev;
+        int ret;
+        while ((ret = snd_seq_event_input(seq, &ev)) >= 0) {
+            if (ev->type == SND_SEQ_EVENT_PORT_START || ev->type == SND_SEQ_EVENT_PORT_EXIT ||
+                ev->type == SND_SEQ_EVENT_PORT_CHANGE) {
+                changed = true;
+                change_time = MIDITimer::GetSysTimeMs();
+            }
+        }
+        if (ret == -ENOSPC) {                   // the input buffer overflowed: some announce could be lost
+            changed = true;
+            change_time = MIDITimer::GetSysTimeMs();
+        }
+        if (changed && MIDITimer::GetSysTimeMs() - change_time >= WATCHER_DEBOUNCE) {
+            changed = false;
+            RescanPorts();
+        }
+    }
+    snd_seq_close(seq);
+    NICMIDI_LOG_INFO("Port watcher stopped");
+#endif // __LINUX_ALSA__
+}
+
+
 void MIDIManager::Init() {
 #ifdef WIN32    //TODO: this is temporary, needed by WINDOWS10
      CoInitializeEx(NULL, COINIT_MULTITHREADED);
@@ -271,35 +496,48 @@ void MIDIManager::Init() {
     MIDI_out_names = new std::vector<std::string>;
     MIDI_ins = new std::vector<MIDIInDriver*>;
     MIDI_in_names = new std::vector<std::string>;
+    MIDI_outs->reserve(MAX_PORTS);              // the vectors must never be moved (see RescanPorts())
+    MIDI_out_names->reserve(MAX_PORTS);
+    MIDI_ins->reserve(MAX_PORTS);
+    MIDI_in_names->reserve(MAX_PORTS);
     MIDITicks = new std::vector<MIDITickComponent*>;
     proc_lock = new std::mutex;
+    rescan_lock = new std::mutex;
     try {
         RtMidiOut temp_MIDI_out;
-        for (unsigned int i = 0; i < temp_MIDI_out.getPortCount(); i++) {
+        for (unsigned int i = 0; i < temp_MIDI_out.getPortCount() && i < MAX_PORTS; i++) {
             MIDI_outs->push_back(new MIDIOutDriver(i));
             MIDI_out_names->push_back(temp_MIDI_out.getPortName(i));
+            num_outs++;
         }
         RtMidiIn temp_MIDI_in;
-        for (unsigned int i = 0; i < temp_MIDI_in.getPortCount(); i++) {
+        for (unsigned int i = 0; i < temp_MIDI_in.getPortCount() && i < MAX_PORTS; i++) {
             MIDI_ins->push_back(new MIDIInDriver(i));
             MIDI_in_names->push_back(temp_MIDI_in.getPortName(i));
+            num_ins++;
         }
     }
     catch (RtMidiError &error) {
         error.printMessage();
-        exit(EXIT_FAILURE);
+        if (!getenv("NICMIDI_LOOPBACK"))
+            exit(EXIT_FAILURE);
     }
     MIDITimer::SetMIDITick(TickProc);
+    MIDILog::Start();
     atexit(Exit);
     init = true;
-    std::cout << "Exiting MIDIManager::Init() Found " << MIDI_outs->size() << " midi out and "
-              << MIDI_ins->size() << " midi in" << std::endl;
+    if (getenv("NICMIDI_LOOPBACK"))
+        AddLoopbackPort();
+    std::cout << "Exiting MIDIManager::Init() Found " << num_outs << " midi out and "
+              << num_ins << " midi in" << std::endl;
 }
 
 
 void MIDIManager::Exit() {
     std::cout << "MIDIManager Exit()" << std::endl;
+    StopPortWatcher();
     MIDITimer::HardStop();
+    MIDILog::Stop();
 
 
 #ifdef WIN32
@@ -681,6 +681,6 @@ bool IsSameKind (const MIDITimedMessage &m1, const MIDITimedMessage &m2) {
 bool operator== (const MIDITimedMessage &m1, const MIDITimedMessage &m2) {
     if (m1.GetTime() != m2.GetTime())
         return false;
-    return ((MIDIMessage)m1 == (MIDIMessage)m2);
+    return ((const MIDIMessage&)m1 == (const MIDIMessage&)m2);
 }
 
@@ -26,6 +26,7 @@
 #include "../include/multitrack.h"
 #include "../include/dump_tracks.h"    // DEBUG:
 #include <iostream>
+#include <utility>
 
 
 ////////////////////////////////////////////////////////////////
@@ -33,8 +34,11 @@
 ////////////////////////////////////////////////////////////////
 
 
+std::atomic<unsigned long> MIDIMultiTrack::load_count(0);
+
+
 MIDIMultiTrack::MIDIMultiTrack(unsigned int num_tracks, unsigned int cl_p_b) :
-          clks_per_beat(cl_p_b) {
+          clks_per_beat(cl_p_b), load_id(++load_count) {
     tracks.resize(num_tracks);
     for (unsigned int i = 0; i < num_tracks; i++)
         tracks[i] = new MIDITrack;
@@ -42,7 +46,7 @@ MIDIMultiTrack::MIDIMultiTrack(unsigned int num_tracks, unsigned int cl_p_b) :
 
 
 MIDIMultiTrack::MIDIMultiTrack(const MIDIMultiTrack& mlt) :
-          clks_per_beat(mlt.clks_per_beat) {
+          clks_per_beat(mlt.clks_per_beat), load_id(++load_count) {
     tracks.resize(mlt.GetNumTracks());
     for (unsigned int i = 0; i < mlt.GetNumTracks(); i++)
         tracks[i] = new MIDITrack(*mlt.GetTrack(i));
@@ -66,6 +70,14 @@ MIDIMultiTrack& MIDIMultiTrack::operator=(const MIDIMultiTrack& mlt) {
 }
 
 
+void MIDIMultiTrack::Swap(MIDIMultiTrack& mlt) {
+    std::swap(clks_per_beat, mlt.clks_per_beat);
+    tracks.swap(mlt.tracks);
+    load_id = ++load_count;
+    mlt.load_id = ++load_count;
+}
+
+
 void MIDIMultiTrack::Reset(unsigned int num_tracks) {
     clks_per_beat = DEFAULT_CLKS_PER_BEAT;
     for(unsigned int i = 0; i < tracks.size(); i++)
@@ -73,6 +85,7 @@ void MIDIMultiTrack::Reset(unsigned int num_tracks) {
     tracks.resize(0);
     for (unsigned int i = 0; i < num_tracks; i++)
         InsertTrack();
+    load_id = ++load_count;
 }
 
 
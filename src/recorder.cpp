@@ -23,6 +23,9 @@
 
 #include "../include/recorder.h"
 #include "../include/manager.h"
+#include "../include/log.h"
+
+#include <algorithm>
 
 
 ////////////////////////////////////////////////////////////////////////////
@@ -79,23 +82,19 @@ MIDIRecorder::MIDIRecorder(MIDISequencer* const s) :
     seq(s), rec_start_time(0), rec_end_time(TIME_INFINITE),
     rec_mode(REC_OVER), notifier(s),
     old_seq_mode(MIDISequencer::PLAY_BOUNDED),
-    rec_on(false)
+    rec_on(false), undo_size(0), undo_max_size(DEFAULT_UNDO_MAX_SIZE)
 {
     //check if an in port exists
     //if (!MIDIManager::IsValidInPortNumber(0))
         //throw RtMidiError("MIDIRecorder needs almost a MIDI in port in the system\n", RtMidiError::INVALID_DEVICE);
     tracks = new MIDIMultiTrack();
     seq_tracks = s->GetState()->multitrack;
+    undo_load_id = seq_tracks->GetLoadId();
 }
 
 
 MIDIRecorder::~MIDIRecorder() {
     Stop();
-    while (!undo_stack.empty()) {
-        MIDIMultiTrack* t = undo_stack.top();
-        undo_stack.pop();
-        delete t;
-    }
     delete tracks;
 }
 
@@ -106,6 +105,7 @@ void MIDIRecorder::Reset() {
     rec_start_time = 0;
     rec_end_time = TIME_INFINITE;
     en_tracks.resize(0);
+    ClearUndo();
     if (seq->GetState()->notifier)
         seq->GetState()->Notify(MIDISequencerGUIEvent::GROUP_RECORDER,
                                 MIDISequencerGUIEvent::GROUP_RECORDER_RESET);
@@ -242,18 +242,52 @@ bool MIDIRecorder::DisableTrack(unsigned int trk_num) {
 
 
 bool MIDIRecorder::UndoRec() {
-    if (!undo_stack.empty()) {
-        const MIDIMultiTrack* undo_tracks = undo_stack.top();
-        for (unsigned int i = 0; i < undo_tracks->GetNumTracks(); i++)
-            if (!undo_tracks->GetTrack(i)->IsEmpty())
-                seq_tracks->SetTrack(undo_tracks->GetTrack(i) , i);
-        undo_stack.pop();
-        if (seq->GetState()->notifier)
-            seq->GetState()->Notify(MIDISequencerGUIEvent::GROUP_ALL);
-        delete undo_tracks;
-        return true;
+    if (IsPlaying())
+        return false;
+    CheckUndoTracks();
+    if (undo_list.empty())
+        return false;
+    if (!ApplyUndoTake(undo_list.back(), true)) {
+        NICMIDI_LOG_WARNING("MIDIRecorder::UndoRec(): the tracks were edited after the take, undo history cleared");
+        ClearUndo();
+        return false;
     }
-    return false;
+    redo_list.push_back(UndoTake());
+    redo_list.back().tracks.swap(undo_list.back().tracks);
+    redo_list.back().size = undo_list.back().size;
+    undo_list.pop_back();
+    seq->UpdateStatus();
+    if (seq->GetState()->notifier)
+        seq->GetState()->Notify(MIDISequencerGUIEvent::GROUP_ALL);
+    return true;
+}
+
+
+bool MIDIRecorder::RedoRec() {
+    if (IsPlaying())
+        return false;
+    CheckUndoTracks();
+    if (redo_list.empty())
+        return false;
+    if (!ApplyUndoTake(redo_list.back(), false)) {
+        NICMIDI_LOG_WARNING("MIDIRecorder::RedoRec(): the tracks were edited after the undo, undo history cleared");
+        ClearUndo();
+        return false;
+    }
+    undo_list.push_back(UndoTake());
+    undo_list.back().tracks.swap(redo_list.back().tracks);
+    undo_list.back().size = redo_list.back().size;
+    redo_list.pop_back();
+    seq->UpdateStatus();
+    if (seq->GetState()->notifier)
+        seq->GetState()->Notify(MIDISequencerGUIEvent::GROUP_ALL);
+    return true;
+}
+
+
+void MIDIRecorder::SetUndoMaxSize(unsigned long bytes) {
+    undo_max_size = bytes;
+    TrimUndo();
 }
 
 
@@ -267,16 +301,19 @@ void MIDIRecorder::Start() {
     if (!IsPlaying()) {
         std::cout << "\t\tEntered in MIDIRecorder::Start() ..." << std::endl;
         MIDIManager::OpenInPorts();
-        MIDIMultiTrack* undo_multi = new MIDIMultiTrack(en_tracks.size(), seq_tracks->GetClksPerBeat());
+        // the changes of the take are stored while recording, so we don't need a copy of the tracks
+        take_cur.tracks.clear();
+        take_cur.size = 0;
         for (unsigned int i = 0; i < en_tracks.size(); i++) {
             if (en_tracks[i]) {
-                undo_multi->SetTrack(seq_tracks->GetTrack(i), i);
                 PrepareTrack(i);
-                if (rec_mode == REC_OVER)
+                if (rec_mode == REC_OVER) {
+                    // the events deleted in the recording area
+                    AddUndoTrack(i, seq_tracks->GetTrack(i), tracks->GetTrack(i));
                     seq_tracks->SetTrack(tracks->GetTrack(i), i);
+                }
             }
         }
-        undo_stack.push(undo_multi);
         rec_on.store(false);            // will be set to true by the static StaticProc()
         SetSeqNotifier();
         old_seq_mode = seq->GetPlayMode();
@@ -308,9 +345,23 @@ void MIDIRecorder::Stop() {
         for (unsigned int i = 0; i < en_tracks.size(); i++) {
             if (en_tracks[i]) {
                 tracks->GetTrack(i)->CloseOpenEvents(rec_start_time, rec_end_time);
+                // the recorded events
+                AddUndoTrack(i, seq_tracks->GetTrack(i), tracks->GetTrack(i));
                 seq_tracks->SetTrack(tracks->GetTrack(i), i);
             }
         }
+        CheckUndoTracks();
+        if (!take_cur.tracks.empty()) {
+            // a new take can't be redone over the undone ones
+            for (unsigned int i = 0; i < redo_list.size(); i++)
+                undo_size -= redo_list[i].size;
+            redo_list.clear();
+            undo_size += take_cur.size;
+            undo_list.push_back(UndoTake());
+            std::swap(undo_list.back(), take_cur);
+            TrimUndo();
+        }
+        take_cur.tracks.clear();
         seq->UpdateStatus();
         seq->SetPlayMode(old_seq_mode);
         //stops the sequencer on a beat
@@ -320,6 +371,140 @@ void MIDIRecorder::Stop() {
 }
 
 
+void MIDIRecorder::AddUndoTrack(unsigned int trk_num, const MIDITrack* before, const MIDITrack* after) {
+    UndoTrack ut;
+    unsigned int i = 0, j = 0;
+    unsigned int n_bef = before->GetNumEvents(), n_aft = after->GetNumEvents();
+    ut.trk_num = trk_num;
+    ut.num_before = n_bef;
+    ut.num_after = n_aft;
+    // the tracks are in time order, so we can compare them a time at a time: when two events differ the
+    // events of both tracks at the first of their times go into a hunk, until the tracks match again
+    while (i < n_bef || j < n_aft) {
+        if (i < n_bef && j < n_aft && before->GetEvent(i) == after->GetEvent(j)) {
+            i++;
+            j++;
+            continue;
+        }
+        ut.hunks.push_back(UndoHunk());
+        UndoHunk& h = ut.hunks.back();
+        h.pos_before = i;
+        h.pos_after = j;
+        do {
+            MIDIClockTime t;
+            if (i == n_bef)
+                t = after->GetEvent(j).GetTime();
+            else if (j == n_aft)
+                t = before->GetEvent(i).GetTime();
+            else
+                t = std::min(before->GetEvent(i).GetTime(), after->GetEvent(j).GetTime());
+            for ( ; i < n_bef && before->GetEvent(i).GetTime() == t; i++)
+                h.removed.push_back(before->GetEvent(i));
+            for ( ; j < n_aft && after->GetEvent(j).GetTime() == t; j++)
+                h.inserted.push_back(after->GetEvent(j));
+        } while ((i < n_bef || j < n_aft) && !(i < n_bef && j < n_aft && before->GetEvent(i) == after->GetEvent(j)));
+    }
+    if (ut.hunks.empty())
+        return;
+    for (unsigned int k = 0; k < ut.hunks.size(); k++) {
+        const UndoHunk& h = ut.hunks[k];
+        take_cur.size += sizeof(UndoHunk) + (h.removed.size() + h.inserted.size()) * sizeof(MIDITimedMessage);
+        for (unsigned int l = 0; l < h.removed.size(); l++)
+            if (h.removed[l].IsSysEx())
+                take_cur.size += h.removed[l].GetSysEx()->GetLength();
+        for (unsigned int l = 0; l < h.inserted.size(); l++)
+            if (h.inserted[l].IsSysEx())
+                take_cur.size += h.inserted[l].GetSysEx()->GetLength();
+    }
+    take_cur.tracks.push_back(UndoTrack());
+    std::swap(take_cur.tracks.back(), ut);
+}
+
+
+bool MIDIRecorder::ApplyUndoTake(const UndoTake& take, bool undo) {
+    // apply the changes to copies of the track events, so we check all the tracks before changing anything
+    // (a track can be changed more times by a take, and the changes are undone in reverse order)
+    std::vector<unsigned int> trk_nums;
+    std::vector<std::vector<MIDITimedMessage> > trk_events;
+    std::vector<MIDITimedMessage> events;
+    for (unsigned int i = 0; i < take.tracks.size(); i++) {
+        const UndoTrack& ut = take.tracks[undo ? take.tracks.size() - 1 - i : i];
+        unsigned int n = std::find(trk_nums.begin(), trk_nums.end(), ut.trk_num) - trk_nums.begin();
+        if (n == trk_nums.size()) {
+            if (!seq_tracks->IsValidTrackNumber(ut.trk_num))
+                return false;
+            const MIDITrack* trk = seq_tracks->GetTrack(ut.trk_num);
+            trk_nums.push_back(ut.trk_num);
+            trk_events.push_back(std::vector<MIDITimedMessage>());
+            trk_events.back().reserve(trk->GetNumEvents());
+            for (unsigned int j = 0; j < trk->GetNumEvents(); j++)
+                trk_events.back().push_back(trk->GetEvent(j));
+        }
+        const std::vector<MIDITimedMessage>& cur = trk_events[n];
+        if (cur.size() != (undo ? ut.num_after : ut.num_before))
+            return false;
+        // rebuild the events of the track, replacing the hunks
+        events.clear();
+        events.reserve(undo ? ut.num_before : ut.num_after);
+        unsigned int from = 0;
+        for (unsigned int j = 0; j < ut.hunks.size(); j++) {
+            const UndoHunk& h = ut.hunks[j];
+            unsigned int pos = undo ? h.pos_after : h.pos_before;
+            const std::vector<MIDITimedMessage>& old = undo ? h.inserted : h.removed;
+            if (pos < from || pos + old.size() > cur.size())
+                return false;
+            for (unsigned int k = 0; k < old.size(); k++)
+                if (!(cur[pos + k] == old[k]))
+                    return false;
+            events.insert(events.end(), cur.begin() + from, cur.begin() + pos);
+            const std::vector<MIDITimedMessage>& rep = undo ? h.removed : h.inserted;
+            events.insert(events.end(), rep.begin(), rep.end());
+            from = pos + old.size();
+        }
+        events.insert(events.end(), cur.begin() + from, cur.end());
+        trk_events[n].swap(events);
+    }
+    for (unsigned int i = 0; i < trk_nums.size(); i++) {
+        MIDITrack* trk = seq_tracks->GetTrack(trk_nums[i]);
+        const std::vector<MIDITimedMessage>& evs = trk_events[i];
+        // the last event is the data end
+        trk->Clear();
+        for (unsigned int j = 0; j < evs.size() - 1; j++)
+            trk->PushEvent(evs[j]);
+        trk->SetEndTime(evs.back().GetTime());
+    }
+    return true;
+}
+
+
+void MIDIRecorder::ClearUndo() {
+    undo_list.clear();
+    redo_list.clear();
+    undo_size = 0;
+    undo_load_id = seq_tracks->GetLoadId();
+}
+
+
+void MIDIRecorder::CheckUndoTracks() {
+    // the history refers to the tracks which were replaced (for instance by loading a file)
+    if (seq_tracks->GetLoadId() != undo_load_id)
+        ClearUndo();
+}
+
+
+void MIDIRecorder::TrimUndo() {
+    // the redo history goes first, as it is the farthest from the current tracks
+    while (undo_size > undo_max_size && !redo_list.empty()) {
+        undo_size -= redo_list.front().size;
+        redo_list.pop_front();
+    }
+    while (undo_size > undo_max_size && undo_list.size() > 1) {
+        undo_size -= undo_list.front().size;
+        undo_list.pop_front();
+    }
+}
+
+
 void MIDIRecorder::ResizeTracks(unsigned int new_size) {
     if (new_size <= en_tracks.size()) {
         int max_enabled = -1;
@@ -441,7 +626,13 @@ void MIDIRecorder::TickProc(tMsecs sys_time) {
             for (unsigned int j = 0, out_count = 0; j < port->GetQueueSize() && out_count < 100; j++, out_count++) {
                 port->ReadMessage(rmsg, j);
                 MIDITimedMessage msg(rmsg.msg);
-                msg.SetTime(cur_time);
+                // time the message with its arrival time, not with the tick which got it
+                MIDIClockTime msg_time = seq->SysTimeToMIDI(rmsg.timestamp_us);
+                if (msg_time < rec_start_time)
+                    msg_time = rec_start_time;
+                else if (msg_time > cur_time)
+                    msg_time = cur_time;
+                msg.SetTime(msg_time);
                 if (msg.IsChannelMsg()) {
                     // search among the tracks which can accept the message
                     signed char ch1 = msg.GetChannel();
@@ -0,0 +1,61 @@
+/*
+ *   NiCMidi - A C++ Class Library for MIDI
+ *
+ *   Copyright (C) 2004  J.D. Koftinoff Software, Ltd.
+ *   www.jdkoftinoff.com jeffk@jdkoftinoff.com
+ *   Copyright (C) 2021, 2022  Nicola Cassetta
+ *   https://github.com/ncassetta/NiCMidi
+ *
+ *   This file is part of NiCMidi.
+ *
+ *   NiCMidi is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation, either version 3 of
+ *   the License, or (at your option) any later version.
+ *
+ *   NiCMidi is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with NiCMidi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "../include/render.h"
+#include "../include/sysex.h"
+
+#include <cstdio>
+
+
+////////////////////////////////////////////////////////////////////////////
+//                      class MIDIRenderFileSink                          //
+////////////////////////////////////////////////////////////////////////////
+
+
+MIDIRenderFileSink::MIDIRenderFileSink(const char* fname) :
+    out(fname, std::ios::out | std::ios::trunc) {
+}
+
+
+void MIDIRenderFileSink::Put(const MIDIRenderedEvent& ev) {
+    char buf[8];
+    out << ev.time_us << ' ' << ev.port << ' ' << ev.track;
+    if (ev.msg.IsSysEx()) {
+        const MIDISystemExclusive* sysex = ev.msg.GetSysEx();
+        for (int i = 0; i < sysex->GetLength(); i++) {
+            snprintf(buf, sizeof(buf), " %02X", sysex->GetBuffer()[i]);
+            out << buf;
+        }
+    }
+    else {
+        int len = ev.msg.GetLength();
+        unsigned char bytes[3] = { ev.msg.GetStatus(), ev.msg.GetByte1(), ev.msg.GetByte2() };
+        for (int i = 0; i < len && i < 3; i++) {
+            snprintf(buf, sizeof(buf), " %02X", bytes[i]);
+            out << buf;
+        }
+    }
+    out << '\n';
+}
@@ -25,6 +25,9 @@
 
 #include "../include/sequencer.h"
 #include "../include/manager.h"     // goes here, for SetPort()
+#include "../include/log.h"
+
+#include <algorithm>
 
 
 
@@ -88,7 +91,7 @@ MIDISequencerState::MIDISequencerState(const MIDISequencerState& s) :
     notifier(s.notifier), multitrack(s.multitrack), iterator(s.iterator),
     cur_clock(s.cur_clock), cur_time_ms(s.cur_time_ms), cur_beat(s.cur_beat),
     cur_measure(s.cur_measure), beat_length(s.beat_length), number_of_beats(s.number_of_beats),
-    next_beat_time(s.next_beat_time), tempobpm(s.tempobpm), tempo_scale(100), timesig_numerator(s.timesig_numerator),
+    next_beat_time(s.next_beat_time), tempobpm(s.tempobpm), tempo_scale(s.tempo_scale), timesig_numerator(s.timesig_numerator),
     timesig_denominator(s.timesig_denominator), keysig_sharpflat(s.keysig_sharpflat),
     keysig_mode(s. keysig_mode), marker_text(s.marker_text), last_event_track(s.last_event_track),
     last_beat_time(s.last_beat_time), ms_per_clock(s.ms_per_clock), last_time_ms(s.last_time_ms),
@@ -122,14 +125,20 @@ const MIDISequencerState& MIDISequencerState::operator= (const MIDISequencerStat
     keysig_mode = s.keysig_mode;
     marker_text = s.marker_text;
 
-    for (unsigned int i = 0; i < track_states.size(); i++)
-        delete track_states[i];
-    track_states.resize(multitrack->GetNumTracks());
-    // TODO: see above
-    if (track_states.size() != s.track_states.size())
-        std::cout << "MIDISequencerState operator= - Warning: the two vectors have different sizes" << std::endl;
-    for (unsigned int i = 0; i < track_states.size(); i++)
-        track_states[i] = new MIDISequencerTrackState(*s.track_states[i]);
+    if (track_states.size() == s.track_states.size() && track_states.size() == multitrack->GetNumTracks())
+        // copy the track states without reallocating them (this is done in the timer tick at the loop wrap)
+        for (unsigned int i = 0; i < track_states.size(); i++)
+            *track_states[i] = *s.track_states[i];
+    else {
+        for (unsigned int i = 0; i < track_states.size(); i++)
+            delete track_states[i];
+        track_states.resize(multitrack->GetNumTracks());
+        // TODO: see above
+        if (track_states.size() != s.track_states.size())
+            std::cout << "MIDISequencerState operator= - Warning: the two vectors have different sizes" << std::endl;
+        for (unsigned int i = 0; i < track_states.size(); i++)
+            track_states[i] = new MIDISequencerTrackState(*s.track_states[i]);
+    }
     last_event_track = s.last_event_track;
     last_beat_time = s.last_beat_time;
     ms_per_clock = s.ms_per_clock;
@@ -371,8 +380,21 @@ MIDISequencer::MIDISequencer (MIDIMultiTrack *m, MIDISequencerGUINotifier *n) :
     repeat_start_meas(0), repeat_end_meas(0),
     time_shift_mode(false),
     play_mode(PLAY_BOUNDED),
+    look_ahead(0),
+    pre_render(false),
+    worker_on(false),
+    worker_exit(false),
+    max_events(0),
+    num_throttled(0),
+    throttling(false),
+    repeat_start_clock(0),
+    repeat_end_clock(0),
+    worker_jobs(0),
     track_processors(m->GetNumTracks(), 0),
-    state (m, n) {
+    tempo_map_clks(0),
+    state (m, n),
+    loop(0),
+    loop_gen(0) {
     // checks if the system has almost a MIDI out
     if (!MIDIManager::IsValidOutPortNumber(0))
         throw RtMidiError("MIDISequencer needs almost a MIDI out port in the system\n", RtMidiError::INVALID_DEVICE);
@@ -387,6 +409,7 @@ MIDISequencer::~MIDISequencer() {
     for (unsigned int i = 0; i < track_processors.size(); ++i)
         if (track_processors[i])
             delete track_processors[i];
+    delete loop;
 }
 
 
@@ -405,6 +428,8 @@ void MIDISequencer::Reset() {
         state.multitrack->GetTrack(i)->SetTimeShift(0);
     }
     play_mode = PLAY_BOUNDED;
+    num_throttled = 0;
+    throttling = false;
     bool notifier_mode = false;
     if(state.notifier) {
         notifier_mode = state.notifier->GetEnable();
@@ -436,9 +461,25 @@ MIDIClockTime MIDISequencer::GetCurrentMIDIClockTime() const {
 
 
 float MIDISequencer::GetCurrentTimeMs() const {
-    return IsPlaying() ?
-        MIDITimer::GetSysTimeMs() - sys_time_offset + dev_time_offset :
-        state.cur_time_ms;
+    if (!IsPlaying())
+        return state.cur_time_ms;
+    // this is negative for a while after a loop wrap anticipated by the look ahead
+    double time_ms = (double)MIDITimer::GetSysTimeMs() - sys_time_offset + dev_time_offset;
+    return time_ms > 0.0 ? time_ms : 0.0;
+}
+
+
+MIDIClockTime MIDISequencer::SysTimeToMIDI(tUsecs sys_time) {
+    if (!IsPlaying())
+        return state.cur_clock;
+    float time_ms = sys_time * 0.001 - sys_time_offset + dev_time_offset;
+    if (time_ms < 0.0)
+        time_ms = 0.0;
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    // a time after the last processed event has the current tempo
+    if (time_ms >= state.cur_time_ms)
+        return state.cur_clock + (MIDIClockTime)((time_ms - state.cur_time_ms) / state.ms_per_clock + 0.5);
+    return MsToMIDI(time_ms);
 }
 
 
@@ -456,6 +497,11 @@ bool MIDISequencer::SetRepeatPlay(int on_off, int start_meas, int end_meas) {
     }
     else if (on_off != -1)
         repeat_play_mode = (bool)on_off;
+    if (repeat_play_mode && IsPlaying()) {
+        repeat_start_clock = MeasToMIDI(repeat_start_meas);
+        repeat_end_clock = MeasToMIDI(repeat_end_meas);
+    }
+    InvalidateLoop();
     return ret;
 }
 
@@ -466,6 +512,18 @@ void MIDISequencer::SetCountIn(bool on_off) {
 }
 
 
+void MIDISequencer::SetLookAhead(unsigned int msecs) {
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    look_ahead = msecs;
+}
+
+
+void MIDISequencer::SetPreRender(bool on_off) {
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    pre_render = on_off;
+}
+
+
 bool MIDISequencer::SetTempoScale(unsigned int scale) {
     if (scale == 0)
         return false;
@@ -533,6 +591,15 @@ bool MIDISequencer::SetTrackProcessor(unsigned int trk_num, MIDIProcessor* p) {
 }
 
 
+bool MIDISequencer::SetTrackLatency(unsigned int trk_num, unsigned int msecs) {
+    if (!state.multitrack->IsValidTrackNumber(trk_num))
+        return false;
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    state.multitrack->GetTrack(trk_num)->SetLatency(msecs);
+    return true;
+}
+
+
 bool MIDISequencer::SetTrackTimeShift(unsigned int trk_num, int offset) {
     if (!state.multitrack->IsValidTrackNumber(trk_num))
         return false;
@@ -775,7 +842,6 @@ bool MIDISequencer::GoToTimeMs(float time_ms) {
 }
 
 
-// This is simpler because every measure has as first event a beat event!
 bool MIDISequencer::GoToMeasure (unsigned int measure, unsigned int beat) {
     bool ret = true;
 
@@ -789,37 +855,12 @@ bool MIDISequencer::GoToMeasure (unsigned int measure, unsigned int beat) {
         state.notifier->SetEnable (false);
     }
 
-//    OLD VERSION if (measure < state.cur_measure ||
-//         // ADDED FOLLOWING LINE:  this failed in this case!!!
-//        (measure == state.cur_measure && beat < state.cur_beat) ||
-//        (measure == 0 && beat == 0))
-    if (measure < state.cur_measure ||
-        (measure == state.cur_measure && beat <= state.cur_beat))
-        state.Reset();
-
-    int trk;
-    MIDITimedMessage msg;
-
-        // iterate thru all the events until cur-measure and cur_beat are
-        // where we want them.
-    if (measure > 0 || beat > 0) {          // if meas == 0 && beat == 0 nothing to do
-        while(1) {
-            if (!GetNextEvent(&trk, &msg)) {// no other events and PLAY_BOUNDED: we can't reach our time and return false
-                state = old_state;          // refresh initial state
-                ret = false;
-                break;
-            }
-            if (msg.IsBeatMarker()) {       // there must be a beat marker at right time
-                if(state.cur_measure == measure && state.cur_beat >= beat)
-                    break;
-            }
-        }
+    if (!StateGoToMeasure(&state, measure, beat)) {
+        state = old_state;              // refresh initial state
+        ret = false;
     }
 
     if (ret) {                          // we have effectively moved time
-        // examine all the events at this specific time
-        // and update the track states to reflect this time
-        ScanEventsAtThisTime();
         if (IsPlaying()) {
             // update real time parameters
             dev_time_offset = state.cur_time_ms;
@@ -839,43 +880,47 @@ bool MIDISequencer::GoToMeasure (unsigned int measure, unsigned int beat) {
 
 
 bool MIDISequencer::GetNextEvent(int *trk_num, MIDITimedMessage *msg) {
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    return NextEvent(trk_num, msg);
+}
+
+
+bool MIDISequencer::GetNextEventTime(MIDIClockTime *time_clk) {
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    return NextEventTime(time_clk);
+}
+
+
+bool MIDISequencer::StateNextEvent(MIDISequencerState* st, int *trk_num, MIDITimedMessage *msg, int mode,
+                                   const std::vector<MIDIProcessor*>* procs) const {
+    const std::vector<MIDIProcessor*>& processors = procs ? *procs : track_processors;
     MIDIClockTime t;
     bool ret = false;
 
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
     // ask the iterator for the current event time
-    if (state.iterator.GetNextEventTime(&t)) {
-        // now auto set by state
-        // move current time forward one event
-        //MIDIClockTime new_clock;
-        //GetNextEventTime(&new_clock);
-        //if (new_clock != state.cur_clock) {
-        //    state.cur_time_ms = MIDItoMs(new_clock);
-        //    state.cur_clock = new_clock;
-        //}
-
+    if (st->iterator.GetNextEventTime(&t)) {
         // is the next beat marker before this event?
-        if(state.next_beat_time <= t) {
+        if(st->next_beat_time <= t) {
             // yes, this is a beat event now.
             // say this event came on track 0, the conductor track
-            state.last_event_track = *trk_num = 0;
+            st->last_event_track = *trk_num = 0;
 
             // put current info into beat marker message
-            beat_marker_msg.SetTime(state.next_beat_time);
-            *msg = beat_marker_msg;
-            state.Process(msg);
+            msg->SetBeatMarker();
+            msg->SetTime(st->next_beat_time);
+            st->Process(msg);
         }
         else    {   // this event comes before the next beat
             MIDITimedMessage *msg_ptr;
 
-            if(state.iterator.GetNextEvent(trk_num, &msg_ptr)) {
-                state.last_event_track = *trk_num;
+            if(st->iterator.GetNextEvent(trk_num, &msg_ptr)) {
+                st->last_event_track = *trk_num;
 
                 // copy the event so Process can modify it
                 *msg = *msg_ptr;
 
-                if ((track_processors[*trk_num] && !track_processors[*trk_num]->Process(msg)) ||
-                     !state.Process(msg))
+                if ((processors[*trk_num] && !processors[*trk_num]->Process(msg)) ||
+                     !st->Process(msg))
                     msg->Clear();
             }
         }
@@ -883,46 +928,35 @@ bool MIDISequencer::GetNextEvent(int *trk_num, MIDITimedMessage *msg) {
     }
     // we are after the last event, but must continue to play sending
     // only beat markers
-    else if (play_mode == PLAY_UNBOUNDED) {
-        // move current time forward one event
-        //MIDIClockTime new_clock;
-        //GetNextEventTime(&new_clock);
-        //double new_time_ms = MIDItoMs(new_clock);
-
-        // must set cur_clock AFTER GetNextEventTimeMs() is called
-        // since GetNextEventTimeMs() uses cur_clock to calculate
-        //state.cur_clock = new_clock;
-        //state.cur_time_ms = new_time_ms;
-
+    else if (mode == PLAY_UNBOUNDED) {
         // the event is surely a beat marker
         // say this event came on track 0, the conductor track
-        state.last_event_track = *trk_num = 0;
+        st->last_event_track = *trk_num = 0;
 
         // put current info into beat marker message
-        beat_marker_msg.SetTime(state.next_beat_time);
-        *msg = beat_marker_msg;
+        msg->SetBeatMarker();
+        msg->SetTime(st->next_beat_time);
 
-        state.Process(msg);
+        st->Process(msg);
         ret = true;
     }
     return ret;
 }
 
 
-bool MIDISequencer::GetNextEventTime(MIDIClockTime *time_clk) {
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+bool MIDISequencer::StateNextEventTime(MIDISequencerState* st, MIDIClockTime *time_clk, int mode) const {
     // ask the iterator for the current event time
-    bool ret = state.iterator.GetNextEventTime(time_clk);
+    bool ret = st->iterator.GetNextEventTime(time_clk);
 
     if(ret) {
         // if we have an event in the future, check to see if it is
         // further in time than the next beat marker
-        if((*time_clk) >= state.next_beat_time)
+        if((*time_clk) >= st->next_beat_time)
             // ok, the next event is a beat - return the next beat time
-            *time_clk = state.next_beat_time;
+            *time_clk = st->next_beat_time;
     }
-    else if (play_mode == PLAY_UNBOUNDED)
-        *time_clk = state.next_beat_time;
+    else if (mode == PLAY_UNBOUNDED)
+        *time_clk = st->next_beat_time;
     return ret;
 }
 
@@ -930,7 +964,7 @@ bool MIDISequencer::GetNextEventTime(MIDIClockTime *time_clk) {
 bool MIDISequencer::GetNextEventTimeMs(float *time_ms) {
     MIDIClockTime t;
     std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    bool ret = GetNextEventTime(&t);
+    bool ret = NextEventTime(&t);
 
     if(ret || play_mode == PLAY_UNBOUNDED) {
         MIDIClockTime offset = t - state.cur_clock;
@@ -1000,52 +1034,94 @@ float MIDISequencer::MIDItoMs(MIDIClockTime t) {
 float MIDISequencer::MIDItoMs(MIDIClockTime t) {
     if (t == 0)
         return 0.0;
-    MIDIMultiTrackIterator iter(state.multitrack);
-    MIDIClockTime last_tempo_t = 0, delta_t = 0, now_t = 0;
-    float ms_time = 0.0;
-    int trk_num;
-    MIDITimedMessage* msg;
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    UpdateTempoMap();
+    return TempoMapMs(tempo_map, t) * 100.0 / state.tempo_scale;
+}
+
 
+MIDIClockTime MIDISequencer::MsToMIDI(float time_ms) {
+    if (time_ms <= 0.0)
+        return 0;
     std::lock_guard<std::recursive_mutex> lock(proc_lock);
-    // enable only tracks with meta events in the iterator
-    for (unsigned int i = 0; i < GetNumTracks(); i++) {
-        int trk_status = GetTrack(i)->GetStatus();
-        if (!(trk_status & MIDITrack::HAS_MAIN_META))
-            iter.SetEnable(i, false);
+    UpdateTempoMap();
+    double ms = time_ms * state.tempo_scale * 0.01;   // the time without tempo scale
+    // find the last segment which begins before ms
+    unsigned int lo = 0, hi = tempo_map.size();
+    while (hi - lo > 1) {
+        unsigned int mid = (lo + hi) / 2;
+        if (tempo_map[mid].ms < ms)
+            lo = mid;
+        else
+            hi = mid;
     }
+    const TempoSegment& seg = tempo_map[lo];
+    return seg.clock + (MIDIClockTime)((ms - seg.ms) / seg.ms_per_clock + 0.5);
+}
 
-    // we initialize this variable in the case of no tempo signature at the beginning
-    // it wil be changed (see below) at first tempo change message
-    float ms_per_clock = 6000000.0 / (MIDI_DEFAULT_TEMPO * (float)state.tempo_scale *
-                                       GetClksPerBeat());
 
-    // look for tempo events
-    while (iter.GetNextEvent(&trk_num, &msg)) {
-        now_t = msg->GetTime();
-        // calculate delta_time in MIDI clocks
-        delta_t = now_t - last_tempo_t;
-        float delta_ms = delta_t * ms_per_clock;
-        if (ms_time + delta_ms >= t)
-            break;
+const MIDISequencer::TempoSegment& MIDISequencer::TempoMapSegment(const std::vector<TempoSegment>& tmap,
+                                                                  MIDIClockTime t) {
+    // find the last segment which begins at or before t
+    unsigned int lo = 0, hi = tmap.size();
+    while (hi - lo > 1) {
+        unsigned int mid = (lo + hi) / 2;
+        if (tmap[mid].clock <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return tmap[lo];
+}
 
-        // if we have a tempo change must calculate the time
-        // in msecs between the last tempo change and now
-        if (msg->IsTempo()) {
-            // and add it in msecs to ms_time
-            ms_time += delta_ms;
-            last_tempo_t = now_t;
-
-            // calculate new milliseconds per clock: this comes from
-            //  -true_bpm = old_tempo * tempo_scale / 100
-            //  -clocks_per_sec = true_bpm * clks_per_beat / 60
-            //  -clocks_per_ms = clocks_per_sec / 1000
-            //  -ms_per_clock = 1 / clocks_per_ms
-            ms_per_clock = 6000000.0 / (msg->GetTempo() *
-                           (float)state.tempo_scale * GetClksPerBeat());
-        }
+
+double MIDISequencer::TempoMapMs(const std::vector<TempoSegment>& tmap, MIDIClockTime t) {
+    const TempoSegment& seg = TempoMapSegment(tmap, t);
+    return seg.ms + (t - seg.clock) * seg.ms_per_clock;
+}
+
+
+void MIDISequencer::UpdateTempoMap() {
+    // check if the map is still valid
+    bool valid = (tempo_map_clks == GetClksPerBeat() && tempo_map_ids.size() == GetNumTracks());
+    for (unsigned int i = 0; valid && i < GetNumTracks(); i++)
+        valid = (tempo_map_ids[i] == GetTrack(i)->GetEditId());
+    if (valid)
+        return;
+
+    tempo_map_clks = GetClksPerBeat();
+    tempo_map_ids.resize(GetNumTracks());
+    for (unsigned int i = 0; i < GetNumTracks(); i++)
+        tempo_map_ids[i] = GetTrack(i)->GetEditId();
+
+    // the default tempo, until the first tempo change message
+    tempo_map.clear();
+    TempoSegment seg = { 0, 0.0, 60000.0 / (MIDI_DEFAULT_TEMPO * tempo_map_clks) };
+    tempo_map.push_back(seg);
+    // look for tempo events only in the tracks with meta events
+    MIDIMultiTrackIterator iter(state.multitrack);
+    for (unsigned int i = 0; i < GetNumTracks(); i++)
+        if (!(GetTrack(i)->GetStatus() & MIDITrack::HAS_MAIN_META))
+            iter.SetEnable(i, false);
+    int trk_num;
+    MIDITimedMessage* msg;
+    while (iter.GetNextEvent(&trk_num, &msg)) {
+        if (!msg->IsTempo())
+            continue;
+        TempoSegment& last = tempo_map.back();
+        seg.clock = msg->GetTime();
+        seg.ms = last.ms + (seg.clock - last.clock) * last.ms_per_clock;
+        // calculate new milliseconds per clock: this comes from
+        //  -true_bpm = tempo * tempo_scale / 100   (with tempo_scale = 100)
+        //  -clocks_per_sec = true_bpm * clks_per_beat / 60
+        //  -clocks_per_ms = clocks_per_sec / 1000
+        //  -ms_per_clock = 1 / clocks_per_ms
+        seg.ms_per_clock = 60000.0 / (msg->GetTempo() * tempo_map_clks);
+        if (seg.clock == last.clock)
+            last = seg;                         // more tempo changes at the same time: the last wins
+        else
+            tempo_map.push_back(seg);
     }
-    ms_time += (t - last_tempo_t) * ms_per_clock;
-    return ms_time;
 }
 
 
@@ -1108,6 +1184,65 @@ MIDIClockTime MIDISequencer::MeasToMIDI(unsigned int meas, unsigned int beat, un
 
 
 
+// n_threads is ignored: see the AdvancedSequencer for a parallel render
+bool MIDISequencer::Render(MIDIRenderSink* sink, MIDIClockTime start, MIDIClockTime end, unsigned int n_threads) {
+    if (sink == 0 || (end != 0 && end <= start))
+        return false;
+    RenderContext ctx;
+    MIDISequencerState st(state.multitrack);
+    proc_lock.lock();
+    UpdateTempoMap();
+    MakeRenderContext(&ctx);
+    // render from a copy of the state, moved to the beginning
+    st = state;
+    st.notifier = 0;
+    st.iterator.SetTimeShiftMode(time_shift_mode);
+    st.Reset();
+    proc_lock.unlock();
+    RenderRange(&st, start, end, ctx, sink);
+    return true;
+}
+
+
+MIDISequencer::RenderContext::~RenderContext() {
+    for (unsigned int i = 0; i < copies.size(); i++)
+        delete copies[i];
+}
+
+
+void MIDISequencer::MakeRenderContext(RenderContext* ctx) const {
+    ctx->tempo_map = tempo_map;
+    ctx->us_per_ms = 100000.0 / state.tempo_scale;
+    ctx->play_mode = play_mode;
+    ctx->out_ports.resize(GetNumTracks());
+    ctx->processors.resize(GetNumTracks());
+    for (unsigned int i = 0; i < GetNumTracks(); i++) {
+        ctx->out_ports[i] = GetTrackOutPort(i);
+        MIDIProcessor* proc = track_processors[i] ? CopyTrackProcessor(i) : 0;
+        if (proc)
+            ctx->copies.push_back(proc);
+        else
+            proc = track_processors[i];
+        ctx->processors[i] = proc;
+    }
+}
+
+
+void MIDISequencer::RenderRange(MIDISequencerState* st, MIDIClockTime start, MIDIClockTime end,
+                                const RenderContext& ctx, MIDIRenderSink* sink) const {
+    MIDIRenderedEvent ev;
+    MIDIClockTime t;
+    while (StateNextEventTime(st, &t, PLAY_BOUNDED) && (end == 0 || t < end)) {
+        StateNextEvent(st, &ev.track, &ev.msg, PLAY_BOUNDED, &ctx.processors);
+        if (t < start || ev.msg.IsMetaEvent() || ev.msg.IsBeatMarker() || ev.msg.IsNoOp())
+            continue;
+        ev.time_us = (tUsecs)(TempoMapMs(ctx.tempo_map, t) * ctx.us_per_ms + 0.5);
+        ev.port = ctx.out_ports[ev.track];
+        sink->Put(ev);
+    }
+}
+
+
 MIDIClockTime MIDISequencer::MeasToMIDI(unsigned int meas, unsigned int beat, unsigned int offset) {
 
     if (meas == 0 && beat == 0 && offset == 0)
@@ -1197,7 +1332,11 @@ void MIDISequencer::Start() {
             state.Notify (MIDISequencerGUIEvent::GROUP_TRANSPORT,
                           MIDISequencerGUIEvent::GROUP_TRANSPORT_START);
         SetDevOffset((tMsecs)GetCurrentTimeMs());
+        repeat_start_clock = MeasToMIDI(repeat_start_meas);
+        repeat_end_clock = MeasToMIDI(repeat_end_meas);
+        PrepareLoop();
         MIDITickComponent::Start();
+        StartWorker();
         std::cout << "\t\t ... Exiting from MIDISequencer::Start()" << std::endl;
     }
 }
@@ -1205,10 +1344,14 @@ void MIDISequencer::Start() {
 
 void MIDISequencer::Stop() {
     if (IsPlaying()) {
-        std::lock_guard<std::recursive_mutex> lock(proc_lock);
+        if (DeferStop())                        // called by the worker, which can't wait for itself
+            return;
         std::cout << "\t\tEntered in MIDISequencer::Stop() ..." << std::endl;
-        // waits until the timer thread has stopped
+        // waits until the worker and the timer thread have stopped; this must be done without proc_lock,
+        // because their tick could be waiting for it
+        StopWorker();
         MIDITickComponent::Stop();
+        std::lock_guard<std::recursive_mutex> lock(proc_lock);
         // resets the autostop flag
         state.playing_status &= ~AUTO_STOP_PENDING;
         state.iterator.SetTimeShiftMode(time_shift_mode);
@@ -1223,7 +1366,81 @@ void MIDISequencer::Stop() {
 
 void MIDISequencer::StaticTickProc(tMsecs sys_time, void* pt) {
     MIDISequencer* seq_pt = static_cast<MIDISequencer *>(pt);
-    seq_pt->TickProc(sys_time);
+    if (!seq_pt->worker_on.load())              // otherwise the worker calls TickProc()
+        seq_pt->TickProc(sys_time);
+}
+
+
+void MIDISequencer::StartWorker() {
+    if (worker.joinable())
+        return;
+    worker_exit = false;
+    worker_on.store(pre_render && look_ahead > 0);
+    worker = std::thread(&MIDISequencer::WorkerProc, this);
+}
+
+
+void MIDISequencer::StopWorker() {
+    if (!worker.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        worker_exit = true;
+    }
+    worker_cond.notify_one();
+    worker.join();
+    worker_on.store(false);
+}
+
+
+bool MIDISequencer::DeferStop() {
+    if (worker.get_id() != std::this_thread::get_id())
+        return false;
+    // Stop() was called by a notifier in the worker: as for the auto stop, another thread stops the sequencer
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    state.playing_status |= AUTO_STOP_PENDING;  // the tick doesn't send events until the sequencer stops
+    std::thread(StaticStopProc, this).detach();
+    return true;
+}
+
+
+void MIDISequencer::WorkerProc() {
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    while (!worker_exit) {
+        lock.unlock();
+        bool done = true;
+        if (worker_on.load()) {
+            // Stop() can be called with proc_lock held while it waits for the worker, so we must not block on it
+            done = proc_lock.try_lock();
+            if (done) {
+                TickProc(MIDITimer::GetSysTimeMs());
+                proc_lock.unlock();
+            }
+        }
+        // the heavy work which must not be done in the tick
+        unsigned int jobs = worker_jobs.exchange(0);
+        if (jobs)
+            DoJobs(jobs);
+        lock.lock();
+        if (worker_on.load()) {
+            if (!worker_exit && worker_jobs.load() == 0)
+                worker_cond.wait_for(lock, std::chrono::milliseconds(done ? MIDITimer::GetResolution() : 1));
+        }
+        else                                    // nothing to do until a job is requested
+            while (!worker_exit && worker_jobs.load() == 0)
+                worker_cond.wait(lock);
+    }
+}
+
+
+bool MIDISequencer::WorkerLock() {
+    while (!proc_lock.try_lock()) {
+        std::unique_lock<std::mutex> lock(worker_mutex);
+        if (worker_exit)
+            return false;
+        worker_cond.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    return true;
 }
 
 /* OLD VERSION (trouble with repeatde play)
@@ -1283,25 +1500,24 @@ void MIDISequencer::TickProc(tMsecs sys_time) {
 }
 */
 
-// NEW VERSION
-void MIDISequencer::TickProc(tMsecs sys_time) {
-    float next_event_time = 0.0;
-    int msg_track;
-    MIDITimedMessage msg;
 
-    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+// Common start of every tick (also used by derived classes which override TickProc()): returns false if
+// the tick must not send events (auto stop pending or count in running)
+bool MIDISequencer::BeginTick(tMsecs sys_time) {
     //std::cout << "MIDISequencer::TickProc; sys_time_offset " << sys_time_offset << " sys_time " << sys_time
     //     << " dev_time_offset " << dev_time_offset << std::endl;
 
     // check if already autostopped
     if (state.playing_status & AUTO_STOP_PENDING) {
-        std::cout << "MIDISequencer::TickProc called after Auto Stop" << std::endl;
-        return;
+        NICMIDI_LOG_DEBUG("MIDISequencer::TickProc called after Auto Stop");
+        return false;
     }
 
-    if (sys_time < sys_time_offset) {
-        std::cout << "WARNING! sys_time = " << sys_time << " sys_time_offset = " << sys_time_offset << std::endl;
-        std::cout << "This causes an error when starting from the beginning" << std::endl;
+    // after an anticipated loop wrap sys_time can be lesser than sys_time_offset, but not lesser than the
+    // loop start (i.e. dev_time_offset) in the sys_time scale
+    if (sys_time + dev_time_offset < sys_time_offset) {
+        NICMIDI_LOG_WARNING("sys_time = %llu sys_time_offset = %llu: this causes an error when starting from "
+                            "the beginning", sys_time, sys_time_offset);
         sys_time_offset = sys_time;
     }
 
@@ -1319,7 +1535,7 @@ void MIDISequencer::TickProc(tMsecs sys_time) {
         if (clocks >= state.count_in_time) {
             if (state.count_in_time != state.beat_length * state.number_of_beats) {
                 state.Process(&beat_marker_msg);    // increments state.count_in_time
-                return;
+                return false;
             }
             else {
                 // ends count in
@@ -1331,44 +1547,89 @@ void MIDISequencer::TickProc(tMsecs sys_time) {
             }
         }
         else
-            return;
+            return false;
     }
-    // find current time
-    tMsecs cur_time = sys_time - sys_time_offset + dev_time_offset;
-    // find all events that exist before or at this time,
-    // limit ourselves to 100 midi events max.
-    int output_count = 100;
-    while(
-        (GetNextEventTimeMs(&next_event_time) || play_mode == PLAY_UNBOUNDED)
-        && (next_event_time <= cur_time
-        && (--output_count) > 0 )) {
+    return true;
+}
+
+
+// NEW VERSION
+void MIDISequencer::TickProc(tMsecs sys_time) {
+    float next_event_time = 0.0;
+    int msg_track;
+    MIDITimedMessage msg;
+
+    std::lock_guard<std::recursive_mutex> lock(proc_lock);
+    if (!BeginTick(sys_time))
+        return;
+    // find current time (this is negative for a while after a loop wrap anticipated by the look ahead)
+    double cur_time = (double)sys_time - sys_time_offset + dev_time_offset;
+    // find all events that exist before or at this time (or within the look ahead). We already hold the
+    // lock, so we call the non locking methods; the time of the next event is found from the current
+    // tempo, as there are no tempo changes between the current time and it
+    // the messages of the compensated tracks are scheduled earlier, so we need a wider window
+    unsigned int max_comp = look_ahead ? GetMaxCompensation() : 0;
+    double window_end = cur_time + look_ahead + max_comp;
+    MIDIClockTime next_clock;
+    unsigned int output_count = 0;
+    unsigned int max_count = max_events;
+    bool throttled = false;
+    for (;;) {
+        if (!NextEventTime(&next_clock) && play_mode != PLAY_UNBOUNDED)
+            break;
+        next_event_time = state.cur_time_ms + (next_clock - state.cur_clock) * state.ms_per_clock;
+        if (next_event_time > window_end)
+            break;
+        if (max_count > 0 && output_count == max_count) {
+            throttled = true;                   // the remaining events go to the next tick
+            break;
+        }
+        // the loop end moves the time, so it can be anticipated only if the loop start is ready
+        if (next_event_time > cur_time && repeat_play_mode && next_clock >= repeat_end_clock && !IsLoopPrepared()) {
+            RequestJob(JOB_PREPARE_LOOP);
+            break;
+        }
         // found an event! get it!
-        if(GetNextEvent(&msg_track, &msg)) {
+        output_count++;
+        if(NextEvent(&msg_track, &msg)) {
             // as the beat marker is the 1st event of a measure, we must check here if we have
             // reached the loop end
             if (msg.IsBeatMarker() && repeat_play_mode && GetCurrentMeasure() == repeat_end_meas) {
-                // yes we hit the end of our repeat block: shut off all notes on
-                MIDIManager::AllNotesOff();
-                // now move the sequencer to our start position
-                GoToMeasure(repeat_start_meas);
-                // our current raw system time is now the new system time offset
-                sys_time_offset = sys_time;
-                // the sequencer time offset now must be reset to the
-                // time in milliseconds of the sequence start point
-                dev_time_offset = (tMsecs)GetCurrentTimeMs();
-                break;
+                // yes we hit the end of our repeat block: jump to the loop start (this doesn't replay the
+                // events) and go on with the events of the loop start within the window
+                WrapLoop(state.cur_time_ms);
+                cur_time = (double)sys_time - sys_time_offset + dev_time_offset;
+                window_end = cur_time + look_ahead + max_comp;
+                continue;
+            }
+            else if (!msg.IsMetaEvent() && !msg.IsBeatMarker() && !msg.IsNoOp()) {
+                MIDIOutDriver* driver = MIDIManager::GetOutDriver(GetTrackOutPort(msg_track));
+                if (look_ahead)
+                    // schedule the message at the system time corresponding to its time (minus the latency
+                    // compensation)
+                    driver->ScheduleMessage(msg, SchedTime(sys_time_offset + (double)state.cur_time_ms -
+                                                           dev_time_offset, msg_track));
+                else
+                    // otherwise queue the message in the driver: all the messages of this tick
+                    // are sent together below
+                    driver->QueueMessage(msg);
             }
-            else if (!msg.IsMetaEvent() && !msg.IsBeatMarker())
-                // otherwise tell the driver to send this message now
-                MIDIManager::GetOutDriver(GetTrackOutPort(msg_track))->OutputMessage(msg);
         }
     }
+    MIDIManager::FlushOutQueues();
+    if (throttled) {
+        num_throttled++;
+        if (!throttling)
+            NICMIDI_LOG_WARNING("Sequencer reached %u events in a tick: throttling", max_count);
+    }
+    throttling = throttled;
     // auto stop at end of sequence
     MIDIClockTime tmp;
     if (!(repeat_play_mode && state.cur_measure >= repeat_end_meas) &&
-        !GetNextEventTime(&tmp) && (play_mode == PLAY_BOUNDED)) {
+        !GetNextEventTime(&tmp) && (play_mode == PLAY_BOUNDED) && !HasScheduledMessages()) {
         // no events left
-        std::cout << "Auto stopping the sequencer: StaticStopProc called at time " << GetCurrentMIDIClockTime() << std::endl;
+        NICMIDI_LOG_INFO("Auto stopping the sequencer: StaticStopProc called at time %lu",
+                         (unsigned long)GetCurrentMIDIClockTime());
         //<< "GetNextEventTime() returned " << retval << std::endl;
         state.playing_status |= AUTO_STOP_PENDING;      // must be here, not in StaticStopProc
         //times = 0;      // only for log, comment if you don't need
@@ -1377,30 +1638,96 @@ void MIDISequencer::TickProc(tMsecs sys_time) {
 }
 
 
-void MIDISequencer::ScanEventsAtThisTime() {
+unsigned int MIDISequencer::GetCompensation(unsigned int trk_num) const {
+    return state.multitrack->GetTrack(trk_num)->GetLatency() +
+           MIDIManager::GetOutDriver(GetTrackOutPort(trk_num))->GetDeviceLatency();
+}
+
+
+unsigned int MIDISequencer::GetMaxCompensation() const {
+    unsigned int max_comp = 0;
+    for (unsigned int i = 0; i < GetNumTracks(); i++)
+        max_comp = std::max(max_comp, GetCompensation(i));
+    return max_comp;
+}
+
+
+tUsecs MIDISequencer::SchedTime(double sys_ms, unsigned int trk_num) const {
+    double t = sys_ms - GetCompensation(trk_num);
+    return t > 0.0 ? (tUsecs)(t * 1000.0) : 0;
+}
+
+
+bool MIDISequencer::HasScheduledMessages() const {
+    if (look_ahead)
+        for (unsigned int i = 0; i < MIDIManager::GetNumMIDIOuts(); i++)
+            if (MIDIManager::GetOutDriver(i)->GetNumScheduled() > 0)
+                return true;
+    return false;
+}
+
+
+void MIDISequencer::StateScanEventsAtThisTime(MIDISequencerState* st, const RenderContext* ctx) const {
     // save the current iterator state
-    MIDIMultiTrackIteratorState istate( state.iterator.GetState() );
-    int prev_measure = state.cur_measure;
-    int prev_beat = state.cur_beat;
-    MIDIClockTime orig_clock = state.cur_clock;
-    float orig_time_ms = state.cur_time_ms;
+    MIDIMultiTrackIteratorState istate( st->iterator.GetState() );
+    int prev_measure = st->cur_measure;
+    int prev_beat = st->cur_beat;
+    MIDIClockTime orig_clock = st->cur_clock;
+    float orig_time_ms = st->cur_time_ms;
 
     // process all messages up to and including this time only
     MIDIClockTime t = 0;
     int trk;
     MIDITimedMessage msg;
-    while( GetNextEventTime(&t) && t == orig_clock && GetNextEvent(&trk, &msg)) {
+    int mode = ctx ? ctx->play_mode : play_mode;
+    const std::vector<MIDIProcessor*>* procs = ctx ? &ctx->processors : 0;
+    while( StateNextEventTime(st, &t, mode) && t == orig_clock && StateNextEvent(st, &trk, &msg, mode, procs)) {
         ;  // cycle through all events at this time
     }
 
     // restore the iterator state
-    state.iterator.SetState(istate);
-    state.cur_measure = prev_measure;
-    state.cur_beat = prev_beat;
-    state.cur_clock = orig_clock;
-    state.cur_time_ms = orig_time_ms;
-    if (state.cur_clock == state.last_beat_time)
-        state.next_beat_time = state.cur_clock;
+    st->iterator.SetState(istate);
+    st->cur_measure = prev_measure;
+    st->cur_beat = prev_beat;
+    st->cur_clock = orig_clock;
+    st->cur_time_ms = orig_time_ms;
+    if (st->cur_clock == st->last_beat_time)
+        st->next_beat_time = st->cur_clock;
+}
+
+
+// This is simpler because every measure has as first event a beat event!
+bool MIDISequencer::StateGoToMeasure(MIDISequencerState* st, unsigned int measure, unsigned int beat,
+                                     const RenderContext* ctx) const {
+//    OLD VERSION if (measure < state.cur_measure ||
+//         // ADDED FOLLOWING LINE:  this failed in this case!!!
+//        (measure == state.cur_measure && beat < state.cur_beat) ||
+//        (measure == 0 && beat == 0))
+    if (measure < st->cur_measure ||
+        (measure == st->cur_measure && beat <= st->cur_beat))
+        st->Reset();
+
+    int trk;
+    MIDITimedMessage msg;
+    int mode = ctx ? ctx->play_mode : play_mode;
+    const std::vector<MIDIProcessor*>* procs = ctx ? &ctx->processors : 0;
+
+        // iterate thru all the events until cur-measure and cur_beat are
+        // where we want them.
+    if (measure > 0 || beat > 0) {          // if meas == 0 && beat == 0 nothing to do
+        while(1) {
+            if (!StateNextEvent(st, &trk, &msg, mode, procs))
+                return false;               // no other events and PLAY_BOUNDED: we can't reach our time
+            if (msg.IsBeatMarker()) {       // there must be a beat marker at right time
+                if(st->cur_measure == measure && st->cur_beat >= beat)
+                    break;
+            }
+        }
+    }
+    // examine all the events at this specific time
+    // and update the track states to reflect this time
+    StateScanEventsAtThisTime(st, ctx);
+    return true;
 }
 
 
@@ -1412,3 +1739,203 @@ void MIDISequencer::CountInPrepare() {
         beat_marker_msg.SetTime(0);
     }
 }
+
+
+bool MIDISequencer::PrepareLoop() {
+    RenderContext ctx;
+    LoopData* ld = 0;
+    // take what we need under the lock
+    if (!WorkerLock())
+        return false;
+    unsigned long gen = loop_gen;
+    if (repeat_play_mode) {
+        ld = new LoopData(state.multitrack);
+        ld->gen = gen;
+        ld->meas = repeat_start_meas;
+        ld->end_meas = repeat_end_meas;
+        ld->ids.resize(GetNumTracks());
+        for (unsigned int i = 0; i < GetNumTracks(); i++)
+            ld->ids[i] = state.multitrack->GetTrack(i)->GetEditId();
+        MakeRenderContext(&ctx);
+        GetLoopStartState(&ld->state);
+    }
+    proc_lock.unlock();
+
+    // replay the events without the lock
+    if (ld && !ComputeLoop(ld, ctx)) {
+        delete ld;
+        ld = 0;
+    }
+
+    // swap the new data in, if the loop was not changed meanwhile
+    if (!WorkerLock()) {
+        delete ld;
+        return false;
+    }
+    bool ret = (gen == loop_gen);
+    if (ret)
+        std::swap(loop, ld);
+    proc_lock.unlock();
+    delete ld;                                  // the old data (or the new ones, if they are already old)
+    return ret;
+}
+
+
+void MIDISequencer::GetLoopStartState(MIDISequencerState* st) {
+    // during playback the time shift is always on
+    *st = state;
+    st->notifier = 0;
+    st->iterator.SetTimeShiftMode(true);
+    st->Reset();
+}
+
+
+bool MIDISequencer::ComputeLoop(LoopData* ld, const RenderContext& ctx) {
+    if (!StateGoToMeasure(&ld->state, ld->meas, 0, &ctx))
+        return false;
+
+    // play the loop on a copy of the loop start state, for finding the notes which are sounding at the loop end
+    ld->end_state = ld->state;
+    int trk;
+    MIDITimedMessage msg;
+    while (StateNextEvent(&ld->end_state, &trk, &msg, ctx.play_mode, &ctx.processors))
+        if (msg.IsBeatMarker() && (unsigned int)ld->end_state.cur_measure >= ld->end_meas)
+            break;
+    TrackMessage ev;
+    for (unsigned int i = 0; i < ld->end_state.track_states.size(); i++) {
+        const MIDIMatrix& matrix = ld->end_state.track_states[i]->note_matrix;
+        ev.track = i;
+        for (int chan = 0; chan < 16; chan++) {
+            if (matrix.GetChannelCount(chan) > 0)
+                for (int note = matrix.GetMinNoteOn(chan); note <= matrix.GetMaxNoteOn(chan); note++)
+                    if (matrix.GetNoteCount(chan, note) > 0) {
+                        ev.msg.SetNoteOff(chan, note, 0);
+                        ld->offs.push_back(ev);
+                    }
+            if (matrix.GetHoldPedal(chan)) {
+                ev.msg.SetControlChange(chan, C_DAMPER, 0);
+                ld->offs.push_back(ev);
+            }
+        }
+    }
+    return true;
+}
+
+
+bool MIDISequencer::IsLoopPrepared() const {
+    if (!loop || loop->gen != loop_gen || loop->meas != repeat_start_meas || loop->ids.size() != GetNumTracks())
+        return false;
+    for (unsigned int i = 0; i < GetNumTracks(); i++)
+        if (loop->ids[i] != state.multitrack->GetTrack(i)->GetEditId())
+            return false;
+    return true;
+}
+
+
+void MIDISequencer::InvalidateLoop() {
+    loop_gen++;
+    if (IsPlaying())
+        RequestJob(JOB_PREPARE_LOOP);                       // the worker does it, out of the tick
+}
+
+
+void MIDISequencer::RequestJob(unsigned int jobs) {
+    if ((worker_jobs.fetch_or(jobs) & jobs) != jobs) {
+        // the lock ensures the worker is not between its check of the jobs and its wait
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        worker_cond.notify_one();
+    }
+}
+
+
+void MIDISequencer::DoJobs(unsigned int jobs) {
+    if (jobs & JOB_PREPARE_LOOP)
+        PrepareLoop();
+}
+
+
+void MIDISequencer::WrapLoop(float end_ms) {
+    // the loop start must be played at the system time of the loop end, not at the time of this tick
+    double sys_end = (double)sys_time_offset - dev_time_offset + end_ms;
+    if (IsLoopPrepared()) {
+        if (look_ahead)
+            // the loop end could be in the future: we can't shut off all the notes now
+            for (unsigned int i = 0; i < loop->offs.size(); i++)
+                SendLoopMessage(loop->offs[i], sys_end);
+        else
+            MIDIManager::AllNotesOff();
+        LoadLoopState(sys_end);
+    }
+    else {
+        // the tracks were edited (or the loop changed) and the worker is still preparing the loop: we
+        // don't replay the events here
+        SkipToLoopStart(sys_end);
+        RequestJob(JOB_PREPARE_LOOP);
+    }
+    dev_time_offset = (tMsecs)state.cur_time_ms;
+    sys_time_offset = (tMsecs)(sys_end - state.cur_time_ms + dev_time_offset + 0.5);
+}
+
+
+void MIDISequencer::LoadLoopState(double sys_ms) {
+    MIDISequencerGUINotifier* notifier = state.notifier;
+    unsigned int scale = state.tempo_scale;
+    unsigned char status = state.playing_status;
+    state = loop->state;
+    state.notifier = notifier;
+    state.playing_status = status;
+    // the tempo scale could be changed after the loop state was computed
+    state.tempo_scale = scale;
+    state.ms_per_clock = 6000000.0 / (state.tempobpm * scale * GetClksPerBeat());
+    state.last_time_ms = MIDItoMs(state.last_tempo_change);
+    state.cur_time_ms = MIDItoMs(state.cur_clock);
+    if (state.notifier)
+        state.notifier->Notify(MIDISequencerGUIEvent::GROUP_ALL);
+}
+
+
+void MIDISequencer::SendLoopMessage(const TrackMessage& ev, double sys_ms) {
+    MIDIOutDriver* driver = MIDIManager::GetOutDriver(GetTrackOutPort(ev.track));
+    if (look_ahead)
+        driver->ScheduleMessage(ev.msg, SchedTime(sys_ms, ev.track));
+    else
+        driver->QueueMessage(ev.msg);
+}
+
+
+void MIDISequencer::SkipToLoopStart(double sys_ms) {
+    // shut off the notes which are sounding now (they are the same at the loop end, as the tick is there)
+    TrackMessage ev;
+    for (unsigned int i = 0; i < state.track_states.size(); i++) {
+        MIDISequencerTrackState* ts = state.track_states[i];
+        ev.track = i;
+        for (int chan = 0; chan < 16; chan++) {
+            if (ts->note_matrix.GetChannelCount(chan) > 0)
+                for (int note = ts->note_matrix.GetMinNoteOn(chan); note <= ts->note_matrix.GetMaxNoteOn(chan);
+                     note++)
+                    if (ts->note_matrix.GetNoteCount(chan, note) > 0) {
+                        ev.msg.SetNoteOff(chan, note, 0);
+                        SendLoopMessage(ev, sys_ms);
+                    }
+            if (ts->note_matrix.GetHoldPedal(chan)) {
+                ev.msg.SetControlChange(chan, C_DAMPER, 0);
+                SendLoopMessage(ev, sys_ms);
+            }
+        }
+        ts->note_matrix.Reset();
+        ts->notes_are_on = false;
+    }
+    // move the iterator and the times (the tempo is taken from the tempo map, the time signature is unchanged)
+    state.iterator.GoToTime(repeat_start_clock);
+    UpdateTempoMap();
+    const TempoSegment& seg = TempoMapSegment(tempo_map, repeat_start_clock);
+    state.cur_clock = state.last_tempo_change = repeat_start_clock;
+    state.last_beat_time = state.next_beat_time = repeat_start_clock;
+    state.cur_measure = repeat_start_meas;
+    state.cur_beat = 0;
+    state.ms_per_clock = seg.ms_per_clock * 100.0 / state.tempo_scale;
+    state.tempobpm = 60000.0 / (seg.ms_per_clock * GetClksPerBeat());
+    state.last_time_ms = state.cur_time_ms = TempoMapMs(tempo_map, repeat_start_clock) * 100.0 / state.tempo_scale;
+    if (state.notifier)
+        state.notifier->Notify(MIDISequencerGUIEvent::GROUP_ALL);
+}
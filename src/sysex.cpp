@@ -44,9 +44,8 @@ MIDISystemExclusive::MIDISystemExclusive(const MIDISystemExclusive &se) : buffer
 }
 
 
-MIDISystemExclusive::MIDISystemExclusive(const unsigned char *buf, unsigned int len) : chk_sum(0) {
-    for (unsigned int i = 0; i < len; i++)
-        buffer.push_back(buf[i]);
+MIDISystemExclusive::MIDISystemExclusive(const unsigned char *buf, unsigned int len) :
+    buffer(buf, buf + len), chk_sum(0) {
 }
 
 
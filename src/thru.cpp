@@ -25,6 +25,7 @@
 
 #include "../include/thru.h"
 #include "../include/manager.h"
+#include "../include/log.h"
 
 
 MIDIThru::MIDIThru() : MIDITickComponent(PR_PRE_SEQ, StaticTickProc), in_port(0), out_port(0), in_channel(-1),
@@ -182,7 +183,7 @@ void MIDIThru::TickProc(tMsecs sys_time_)
     MIDIOutDriver* out_driver = MIDIManager::GetOutDriver(out_port);
     in_driver->LockQueue();
     for (unsigned int i = 0; i < in_driver->GetQueueSize(); i++) {
-        std::cout << "Message found\n";
+        NICMIDI_LOG_DEBUG("MIDIThru: message found");
         in_driver->ReadMessage(rmsg, i);
         msg = rmsg.msg;
         if (msg.IsChannelMsg()) {
@@ -35,10 +35,11 @@
 
 
 tInsMode MIDITrack::ins_mode = INSMODE_INSERT_OR_REPLACE;
+std::atomic<unsigned long> MIDITrack::edit_count(0);
 
 
 MIDITrack::MIDITrack(MIDIClockTime end_time) : status(INIT_STATUS), rec_chan(-1),
-    time_shift(0), in_port(0), out_port() {
+    time_shift(0), latency(0), in_port(0), out_port(), edit_id(++edit_count) {
 // a track always contains at least the MIDI_END event, so num_events > 0
     MIDITimedMessage msg;
     msg.SetDataEnd();
@@ -48,7 +49,8 @@ MIDITrack::MIDITrack(MIDIClockTime end_time) : status(INIT_STATUS), rec_chan(-1)
 
 
 MIDITrack::MIDITrack(const MIDITrack &trk) : events(trk.events), status(trk.status), rec_chan(trk.rec_chan),
-                     time_shift(trk.time_shift), in_port(trk.in_port), out_port(trk.out_port)
+                     time_shift(trk.time_shift), latency(trk.latency), in_port(trk.in_port), out_port(trk.out_port),
+                     edit_id(++edit_count)
 {}
 
 
@@ -57,8 +59,10 @@ MIDITrack& MIDITrack::operator=(const MIDITrack &trk) {
     rec_chan = trk.rec_chan;
     status = trk.status;
     time_shift = trk.time_shift;
+    latency = trk.latency;
     in_port = trk.in_port;
     out_port = trk.out_port;
+    edit_id = ++edit_count;
     return *this;
 }
 
@@ -67,6 +71,7 @@ void MIDITrack::Reset() {
     Clear();
     rec_chan = 0;
     time_shift = 0;
+    latency = 0;
     in_port = 0;
     out_port = 0;
 }
@@ -79,6 +84,7 @@ void MIDITrack::Clear(bool mantain_end) {
     msg.SetTime(end);
     events.push_back(msg);
     status = INIT_STATUS;
+    edit_id = ++edit_count;
 }
 
 
@@ -137,6 +143,7 @@ bool MIDITrack::SetEndTime(MIDIClockTime end_time) {
         if (events[events.size() - 2].GetTime() > end_time) return false;
             // we tried to insert an MIDI_END before last (musical) event
     events.back().SetTime(end_time);
+    edit_id = ++edit_count;
     return true;
 }
 
@@ -148,7 +155,7 @@ bool MIDITrack::SetChannel(int chan) {
         if (GetEvent(i).IsChannelMsg())
             GetEvent(i).SetChannel(chan);
     }
-    status |= STATUS_DIRTY;
+    SetDirty();
     return true;
 }
 
@@ -208,7 +215,7 @@ bool MIDITrack::InsertEvent(const MIDITimedMessage& msg, tInsMode mode) {
     if (GetEndTime() < msg.GetTime()) {                 // insert as last event
         SetEndTime(msg.GetTime());                      // adjust DATA_END
         events.insert(events.end() - 1, msg);           // insert just before DATA_END
-        status |= STATUS_DIRTY;
+        SetDirty();
         return true;
     }
 
@@ -227,7 +234,7 @@ bool MIDITrack::InsertEvent(const MIDITimedMessage& msg, tInsMode mode) {
             while (CompareEventsForInsert(msg, events[ev_num]) == 1)
                 ev_num++;
             events.insert(events.begin() + ev_num, msg);
-            status |= STATUS_DIRTY;
+            SetDirty();
             return true;
 
         case INSMODE_REPLACE:                           // replace a same kind event, or do nothing
@@ -235,7 +242,7 @@ bool MIDITrack::InsertEvent(const MIDITimedMessage& msg, tInsMode mode) {
             while (IsValidEventNum(ev_num) && events[ev_num].GetTime() == msg.GetTime()) {
                 if (IsSameKind(events[ev_num], msg)) {
                     events[ev_num] = msg;               // replace if found
-                    status |= STATUS_DIRTY;
+                    SetDirty();
                     return true;
                 }
                 ev_num++;
@@ -249,7 +256,7 @@ bool MIDITrack::InsertEvent(const MIDITimedMessage& msg, tInsMode mode) {
                 if (IsSameKind(events[ev_num], msg) &&
                      (mode == INSMODE_INSERT_OR_REPLACE || !msg.IsNote())) {
                     events[ev_num] = msg;               // replace if found
-                    status |= STATUS_DIRTY;
+                    SetDirty();
                     return true;
                 }
                 ev_num++;
@@ -259,7 +266,7 @@ bool MIDITrack::InsertEvent(const MIDITimedMessage& msg, tInsMode mode) {
             while (CompareEventsForInsert(msg, events[ev_num]) == 1)
                 ev_num++;
             events.insert(events.begin() + ev_num, msg);
-            status |= STATUS_DIRTY;
+            SetDirty();
             return true;                                // insert
     }
 
@@ -335,7 +342,7 @@ bool MIDITrack::DeleteEvent( const MIDITimedMessage& msg ) {
     if (!FindEventNumber(msg, &ev_num))
         return false;
     events.erase(events.begin() + ev_num);
-    status |= STATUS_DIRTY;
+    SetDirty();
     return true;
 }
 
@@ -355,6 +362,7 @@ bool MIDITrack::DeleteNote( const MIDITimedMessage& msg ) {
         }
         ev_num++;
     }
+    SetDirty();
     return true;
 }
 
@@ -365,7 +373,7 @@ void MIDITrack::PushEvent(const MIDITimedMessage& msg) {
     if (GetEndTime() < msg.GetTime())
         SetEndTime(msg.GetTime());                      // adjust DATA_END
     events.insert(events.end() - 1, msg);               // insert just before DATA_END
-    status |= STATUS_DIRTY;
+    SetDirty();
 }
 
 
@@ -377,6 +385,7 @@ void MIDITrack::InsertInterval(MIDIClockTime start, MIDIClockTime length, const
     if (FindEventNumber(start, &start_n)) {             // there are events after start time
         for (unsigned int i = start_n; i < events.size(); i++)
             events[i].AddTime(length);                  // moves these events
+        SetDirty();
     }
     if(!src) return;                                    // we want only move events
 
@@ -432,6 +441,7 @@ void MIDITrack::DeleteInterval(MIDIClockTime start, MIDIClockTime end) {
     FindEventNumber(end, &ev_num);                  // an event surely exists
     for (unsigned int i = ev_num; i < events.size(); i++)
         events[i].SubTime(end - start);             // shifts subsequents events
+    SetDirty();
 }
 
 
@@ -462,6 +472,7 @@ void MIDITrack::ClearInterval(MIDIClockTime start, MIDIClockTime end) {
             events.erase(events.begin() + ev_num);  // deletes NOTE OFF,PEDAL OFF and unneded PITCH BEND at end
         else
             ev_num++;
+    SetDirty();
 }
 
 